@@ -1,5 +1,11 @@
-﻿import mmap
-import re
+﻿import os
+import mmap
+import json
+import hashlib
+import threading
+
+from ckit import ckitcore
+from ckit import ckit_threadutil
 
 
 class HugeFile:
@@ -8,7 +14,9 @@ class HugeFile:
         self.mm = mmap.mmap( fileno, 0, access=mmap.ACCESS_READ )
 
     def close(self):
-        self.mm.close()
+        # 空になったファイルは、mm の代わりに空の bytes を持っている
+        if isinstance( self.mm, mmap.mmap ):
+            self.mm.close()
 
 
 class HugeBinaryFile(HugeFile):
@@ -22,50 +30,371 @@ class HugeBinaryFile(HugeFile):
 
 class HugeTextFile(HugeFile):
 
-    def __init__( self, fileno, encoding, offset ):
+    # 一度にスキャンする最大バイト数
+    scan_chunk_size = 16 * 1024 * 1024
+
+    # 行インデックスファイルの拡張子
+    index_file_suffix = ".ckitidx"
+
+    # これより小さいファイルの行インデックスはファイルに保存しない
+    index_file_min_size = 4 * 1024 * 1024
+
+    # ファイルの同一性の確認に使う、先頭と末尾のハッシュの範囲
+    index_hash_size = 64 * 1024
+
+    ## コンストラクタ
+    #
+    #  @param fileno    ファイル番号
+    #  @param encoding  エンコーディング名 ( utf-16-le / utf-16-be の場合は 2バイト単位で改行を探す )
+    #  @param offset    最初の行の開始位置 ( BOM の直後 )
+    #  @param sampling  何行ごとに行頭位置を記録するか ( 大きくするとメモリ使用量が減る代わりに、行の取得が遅くなる )
+    #  @param filename  ファイル名 ( 指定すると行インデックスをファイルに保存し、次回以降に再利用する )
+    #  @param index_dir 行インデックスファイルを保存するディレクトリ ( None の場合はファイルと同じ場所に保存する )
+    #
+    def __init__( self, fileno, encoding, offset, sampling=1, filename=None, index_dir=None ):
 
         HugeFile.__init__( self, fileno )
 
+        self.fileno = fileno
         self.encoding = encoding
+        self.offset = offset
+        self.sampling = sampling
+        self.filename = filename
+        self.index_dir = index_dir
 
-        if self.encoding=="utf-16-le":
-            self.line_end_re_object = re.compile( b"\x0D\x00\x0A\x00|\x0D\x00|\x0A\x00" )
-        elif self.encoding=="utf-16-be":
-            self.line_end_re_object = re.compile( b"\x00\x0D\x00\x0A|\x00\x0D|\x00\x0A" )
-        else:
-            self.line_end_re_object = re.compile( b"\x0D\x0A|\x0D|\x0A" )
+        # ネイティブの行インデックス ( 改行の検索は SIMD で、大きなチャンク単位で行われる )
+        self.line_index = ckitcore.LineIndex( encoding, offset, sampling )
+        self.scan_completed = False
+        self.saved_size = 0
+
+        self.indexing_thread = None
+        self.indexing_canceled = False
+
+        self.follow_cron_item = None
+        self.follow_cron_table = None
+        self.follow_handler = None
+        self.follow_window = None
+
+        # mm / line_index / scan_completed の入れ替えを保護する
+        self.lock = threading.RLock()
+
+        # close() の後は checkGrowth() を行わない
+        # close() は実行中の checkGrowth() が終わるのを待ってから mm を閉じる
+        self.closed = False
+        self.growth_checking = 0
+        self.growth_checked = threading.Condition(self.lock)
+
+        # 追記されただけか ( 切り詰められた後に大きくなったのではないか ) を確認するための、先頭のハッシュ
+        self.head_hash = self._headHash()
 
-        self.line_pos = [ offset ]
+        if self.filename:
+            self._loadIndex()
+
+    def close(self):
+        self.stopFollowing()
+        with self.lock:
+            self.closed = True
+            while self.growth_checking:
+                self.growth_checked.wait()
+        self.stopIndexing()
+        if self.filename and self.line_index.scannedSize() != self.saved_size:
+            self.saveIndex()
+        HugeFile.close(self)
 
     def getLine( self, lineno ):
 
-        while len(self.line_pos) <= lineno:
-            next_lineend_pos, next_lineend = self._findNextLineEnd( self.line_pos[-1] )
-            if next_lineend_pos>=0:
-                self.line_pos.append(next_lineend_pos+len(next_lineend))
+        self._scan(lineno)
+
+        # mm は大きくなる方向にしか入れ替わらないので、スキャンの後に取得すれば行の範囲を含んでいる
+        with self.lock:
+            mm = self.mm
+            line_index = self.line_index
+
+        linestart_pos, lineend_pos = line_index.getLineRange( mm, lineno )
+
+        return mm[ linestart_pos : lineend_pos ]
+
+    ## 行数を取得する ( ファイルの最後までスキャンする )
+    def getNumLines(self):
+        self._scan()
+        return self.line_index.numLines()
+
+    ## 行頭位置がわかっている行の数を取得する ( スキャンは行わない )
+    def getNumIndexedLines(self):
+        return self.line_index.numLines()
+
+    ## バックグラウンドで行インデックスの作成を開始する
+    #
+    #  行インデックスの作成中も、getLine() や getNumIndexedLines() を呼び出すことができます。
+    #  最後まで作成し終わると、filename が指定されている場合は行インデックスをファイルに保存します。
+    #
+    def startIndexing(self):
+
+        if self.scan_completed or self.indexing_thread:
+            return
+
+        self.indexing_canceled = False
+        self.indexing_thread = threading.Thread( target=self._indexingThread, daemon=True )
+        self.indexing_thread.start()
+
+    ## バックグラウンドでの行インデックスの作成を中止する
+    def stopIndexing(self):
+
+        if not self.indexing_thread:
+            return
+
+        self.indexing_canceled = True
+        self.indexing_thread.join()
+        self.indexing_thread = None
+
+    ## バックグラウンドで行インデックスを作成中かを調べる
+    def isIndexing(self):
+        return self.indexing_thread!=None and self.indexing_thread.is_alive()
+
+    ## 行インデックスの作成の進捗を取得する
+    #
+    #  @return 0.0 ～ 1.0
+    #
+    def getProgress(self):
+        if self.scan_completed or len(self.mm)==0:
+            return 1.0
+        return min( self.line_index.scannedSize() / len(self.mm), 1.0 )
+
+    def _indexingThread(self):
+
+        # スキャンは GIL を解放して行われるので、UI スレッドを妨げない
+        while not self.indexing_canceled and not self.scan_completed:
+            self._scanChunk()
+
+        if self.scan_completed and self.filename:
+            self.saveIndex()
+
+    def _scan( self, lineno=None ):
+        while not self.closed and not self.scan_completed and ( lineno==None or self.line_index.numLines() <= lineno ):
+            self._scanChunk()
+
+    def _scanChunk(self):
+
+        # スキャン中はロックを保持しない ( UI スレッドの getLine() を待たせないように )
+        with self.lock:
+            mm = self.mm
+            line_index = self.line_index
+
+        completed = line_index.scan( mm, HugeTextFile.scan_chunk_size )
+
+        with self.lock:
+            # スキャン中に mm / line_index が入れ替わった場合は、結果を反映しない
+            if self.mm is mm and self.line_index is line_index:
+                self.scan_completed = completed
+
+    ## ファイルの追記の追跡を開始する
+    #
+    #  @param handler       行が追加されたときに呼ばれる関数 handler( first_lineno, num_lines )
+    #  @param window        handler を呼び出すウインドウ
+    #  @param interval      ファイルサイズを調べる間隔 (sec)
+    #  @param cron_table    ファイルサイズを調べる CronTable ( None の場合はデフォルトの CronTable )
+    #
+    #  ファイルサイズを定期的に調べ、ファイルが大きくなっていたら、追加された部分だけ行インデックスを作成して
+    #  handler を呼び出します。handler は window.postCall() を使って、ウインドウのスレッドで呼ばれます。
+    #  first_lineno 以降の行が変化した ( または追加された ) ことを意味します。
+    #
+    def startFollowing( self, handler, window, interval=1.0, cron_table=None ):
+
+        self.stopFollowing()
+
+        if cron_table==None:
+            cron_table = ckit_threadutil.CronTable.defaultCronTable()
+
+        def onTimer(cron_item):
+            self.checkGrowth()
+
+        self.follow_handler = handler
+        self.follow_window = window
+        self.follow_cron_table = cron_table
+        self.follow_cron_item = ckit_threadutil.CronItem( onTimer, interval )
+        self.follow_cron_table.add(self.follow_cron_item)
+
+    ## ファイルの追記の追跡を終了する
+    def stopFollowing(self):
+
+        if not self.follow_cron_item:
+            return
+
+        self.follow_cron_item.cancel()
+        self.follow_cron_table.remove(self.follow_cron_item)
+        self.follow_cron_item = None
+        self.follow_cron_table = None
+        self.follow_handler = None
+        self.follow_window = None
+
+    ## ファイルサイズの変化を調べ、行インデックスを更新する
+    #
+    #  @return 変化があった場合は ( first_lineno, num_lines )、変化がなかった場合は None
+    #
+    #  ファイルが大きくなった場合は、ファイルをマップし直して、追加された部分だけスキャンします。
+    #  ファイルが小さくなった場合 ( ログのローテーションなど ) や、先頭が変わっていた場合 ( 切り詰められた後に大きくなった ) は、
+    #  行インデックスを作り直します。
+    #  追跡中は、変化があった場合に handler の呼び出しをウインドウに依頼します。
+    #  close() の後は何もせずに None を返します。
+    #
+    def checkGrowth(self):
+
+        with self.lock:
+            if self.closed:
+                return None
+            self.growth_checking += 1
+
+        try:
+            return self._checkGrowth()
+        finally:
+            with self.lock:
+                self.growth_checking -= 1
+                self.growth_checked.notify_all()
+
+    def _checkGrowth(self):
+
+        with self.lock:
+
+            size = os.fstat(self.fileno).st_size
+
+            old_size = len(self.mm)
+            if size==old_size:
+                return None
+
+            # 古い mm は、参照しているスレッドがなくなった時点で解放される
+            # 空のファイルはマップできないので、空の bytes で代用する
+            if size==0:
+                self.mm = b""
+            else:
+                self.mm = mmap.mmap( self.fileno, 0, access=mmap.ACCESS_READ )
+            self.scan_completed = False
+
+            # 前回と同じ範囲の先頭のハッシュが変わっていなければ、後ろに追記されただけとみなす
+            head_size, head_hash = self.head_hash
+            appended = size > old_size and self._hash( 0, head_size )==head_hash
+            self.head_hash = self._headHash()
+
+            if not appended:
+                # 切り詰められた場合や、先頭が変わった場合 ( ログのローテーションなど ) は最初から数え直す
+                self.line_index = ckitcore.LineIndex( self.encoding, self.offset, self.sampling )
+                self.saved_size = 0
+                first_lineno = 0
             else:
-                raise IndexError
+                # スキャン済みの範囲はそのまま使い、続きからスキャンする
+                # 最後の行は追記によって伸びている可能性がある
+                # また、最後が CR で終わっていた場合は、その前の行が CRLF で終わる行に変わる可能性がある
+                first_lineno = max( self.line_index.numLines()-2, 0 )
 
-        linestart_pos = self.line_pos[lineno]
+        self._scan()
 
-        lineend_pos, next_lineend = self._findNextLineEnd( self.line_pos[lineno] )
+        result = ( first_lineno, self.line_index.numLines() )
 
-        if lineend_pos>=0:
-            return self.mm[ linestart_pos : lineend_pos+len(next_lineend) ]
-        else:
-            return self.mm[ linestart_pos : ]
+        handler = self.follow_handler
+        window = self.follow_window
+        if handler and window:
+
+            def notify():
+                handler( *result )
+
+            try:
+                window.postCall(notify)
+            except ValueError:
+                # ウインドウが破棄された
+                pass
+
+        return result
+
+    ## 行インデックスをファイルに保存する
+    #
+    #  ファイルのサイズ、更新日時、先頭と末尾のハッシュと一緒に保存し、
+    #  次回開いたときに同じファイルか ( または後ろに追記されただけのファイルか ) を確認します。
+    #  保存に失敗しても例外は送出しません。
+    #
+    def saveIndex(self):
 
-    def _findNextLineEnd( self, start ):
+        if not self.filename:
+            return
 
-        re_result = self.line_end_re_object.search( self.mm, start )
+        data = self.line_index.dump()
+        indexed_size = self.line_index.scannedSize()
 
-        if re_result:
-            return re_result.span()[0], re_result.group(0)
+        if indexed_size < HugeTextFile.index_file_min_size:
+            return
+
+        st = os.fstat(self.fileno)
+
+        key = {
+            "version" : 1,
+            "encoding" : self.encoding,
+            "offset" : self.offset,
+            "sampling" : self.sampling,
+            "indexed_size" : indexed_size,
+            "file_size" : st.st_size,
+            "mtime" : st.st_mtime,
+            "head" : self._hash( 0, min( HugeTextFile.index_hash_size, indexed_size ) ),
+            "tail" : self._hash( indexed_size-HugeTextFile.index_hash_size, indexed_size ),
+        }
+
+        index_filename = self._indexFilename()
+        tmp_filename = index_filename + ".tmp"
+
+        try:
+            with open( tmp_filename, "wb" ) as fd:
+                fd.write( json.dumps(key).encode("utf-8") + b"\n" )
+                fd.write(data)
+            os.replace( tmp_filename, index_filename )
+            self.saved_size = indexed_size
+        except OSError:
+            try:
+                os.unlink(tmp_filename)
+            except OSError:
+                pass
+
+    def _loadIndex(self):
+
+        try:
+            with open( self._indexFilename(), "rb" ) as fd:
+                key = json.loads( fd.readline().decode("utf-8") )
+                data = fd.read()
+        except (OSError,ValueError):
+            return
+
+        try:
+            if key["version"]!=1 or key["encoding"]!=self.encoding or key["offset"]!=self.offset or key["sampling"]!=self.sampling:
+                return
+
+            indexed_size = key["indexed_size"]
+            if indexed_size > len(self.mm):
+                return
+
+            # サイズと更新日時が同じなら同じファイルとみなす
+            # そうでなければ、先頭と、インデックス済みの範囲の末尾が一致する場合に、後ろに追記されたファイルとみなす
+            st = os.fstat(self.fileno)
+            if st.st_size!=key["file_size"] or st.st_mtime!=key["mtime"]:
+                if key["head"]!=self._hash( 0, min( HugeTextFile.index_hash_size, indexed_size ) ):
+                    return
+                if key["tail"]!=self._hash( indexed_size-HugeTextFile.index_hash_size, indexed_size ):
+                    return
+        except (KeyError,TypeError):
+            return
+
+        if self.line_index.load(data):
+            self.saved_size = self.line_index.scannedSize()
+
+    def _indexFilename(self):
+        if self.index_dir:
+            path = os.path.normcase( os.path.abspath(self.filename) )
+            return os.path.join( self.index_dir, hashlib.sha1( path.encode("utf-8") ).hexdigest() + HugeTextFile.index_file_suffix )
         else:
-            return -1, None
+            return self.filename + HugeTextFile.index_file_suffix
+
+    def _headHash(self):
+        size = min( HugeTextFile.index_hash_size, len(self.mm) )
+        return ( size, self._hash( 0, size ) )
 
-    # TODO: 1行1行切り出すのではなく、re.finditer で、大き目のチャンクに対して、
-    # 一度に複数行に分割する処理をしたほうが速そう
+    def _hash( self, begin, end ):
+        begin = max( begin, 0 )
+        return hashlib.sha1( self.mm[ begin : end ] ).hexdigest()
 
 
 
@@ -102,6 +431,7 @@ def test_HugeTextFile():
     fd.close()
 
 
-test_HugeTextFile()
+if __name__ == "__main__":
+    test_HugeTextFile()
 
 
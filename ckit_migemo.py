@@ -1,6 +1,96 @@
-import os
+﻿import os
+import re
+import bisect
 import ctypes
+import collections
 
+## Migemo の展開結果とコンパイル済みのパターンを保持する数
+MIGEMO_CACHE_SIZE = 256
+
+#--------------------------------------------------------------------
+
+## Migemo の展開結果をコンパイルした検索パターン
+#
+#  ckitcore.Regex で検索します。ckitcore.Regex が対応していない構文を含む場合や、
+#  ckitcore を import できない環境では re で検索します。
+#
+class MigemoPattern:
+
+    def __init__( self, pattern, ignore_case=True ):
+
+        self.pattern = pattern
+        self.flags = re.UNICODE
+        if ignore_case:
+            self.flags |= re.IGNORECASE
+
+        # pattern と flags を持っているので、re のパターンオブジェクトの代わりに ckitcore.Regex に渡すことができる
+        # (PortableMigemo を Windows 以外でも使えるように、ckitcore はここで import する)
+        try:
+            from ckit import ckitcore
+            self.native_object = ckitcore.Regex(self)
+            self.re_object = None
+        except ( ImportError, ValueError ):
+            self.native_object = None
+            self.re_object = re.compile( self.pattern, self.flags )
+
+    ## 文字列の pos 以降を検索し、( 開始位置, 終了位置 ) を返す
+    def search( self, s, pos=0 ):
+
+        if self.native_object:
+            return self.native_object.search( s, pos )
+
+        re_result = self.re_object.search( s, pos )
+        if re_result:
+            return ( re_result.start(), re_result.end() )
+        return None
+
+    ## 行のリストを検索し、( 行番号, 開始位置, 終了位置 ) を返す
+    #
+    #  引数は ckit_textwidget.Search.searchLines と同じです。
+    #
+    def searchLines( self, lines, line, index, direction, oneline=False ):
+
+        if self.native_object:
+            return self.native_object.searchLines( lines, line, index, direction, oneline )
+
+        while 0<=line<len(lines):
+
+            s = lines[line] if isinstance( lines[line], str ) else lines[line].s
+
+            if direction>0:
+                result = self.search( s, index )
+            else:
+                result = None
+                pos = 0
+                while pos<=index:
+                    re_result = self.re_object.search( s, pos, index )
+                    if not re_result : break
+                    result = ( re_result.start(), re_result.end() )
+                    pos = re_result.start() + 1
+
+            if result:
+                return ( line, result[0], result[1] )
+
+            if oneline:
+                break
+
+            if direction>0:
+                line += 1
+                index = 0
+            else:
+                line -= 1
+                if line>=0:
+                    index = len( lines[line] if isinstance( lines[line], str ) else lines[line].s )
+
+        return None
+
+#--------------------------------------------------------------------
+
+## migemo.dll を使ってローマ字を日本語の正規表現に展開するクラス
+#
+#  同じ問い合わせの結果とコンパイル済みのパターンはキャッシュされるので、
+#  インクリメンタルサーチでキーを入力したり削除したりするたびに DLL を呼び出すことはありません。
+#
 class Migemo:
 
     DICTID_INVALID    = 0
@@ -11,6 +101,8 @@ class Migemo:
     DICTID_ZEN2HAN    = 5
 
     def __init__( self, dll_dirname, dict_dirname ):
+
+        self._initCache()
         
         self.dll = ctypes.WinDLL( os.path.join( dll_dirname, 'migemo.dll' ) )
         self.dll.migemo_open.restype = ctypes.c_void_p
@@ -36,14 +128,305 @@ class Migemo:
         if not result : return
 
         self.dictionary_ready = True
+
+    def _initCache(self):
+        self.query_cache = collections.OrderedDict()      # 問い合わせ -> 展開した正規表現
+        self.pattern_cache = collections.OrderedDict()    # ( 問い合わせ, ignore_case ) -> MigemoPattern
+
+    def _getCache( self, cache, key ):
+        value = cache.get(key)
+        if value!=None:
+            cache.move_to_end(key)
+        return value
+
+    def _setCache( self, cache, key, value ):
+        cache[key] = value
+        if len(cache)>MIGEMO_CACHE_SIZE:
+            cache.popitem(last=False)
     
     def isDictionaryReady(self):
         return self.dictionary_ready
 
+    ## ローマ字の問い合わせを、日本語の正規表現の文字列に展開する
     def query( self, q ):
 
+        s = self._getCache( self.query_cache, q )
+        if s==None:
+            s = self._query(q)
+            self._setCache( self.query_cache, q, s )
+        return s
+
+    ## ローマ字の問い合わせを展開し、コンパイルした MigemoPattern を返す
+    def compile( self, q, ignore_case=True ):
+
+        key = ( q, ignore_case )
+        pattern = self._getCache( self.pattern_cache, key )
+        if pattern==None:
+            pattern = MigemoPattern( self.query(q), ignore_case )
+            self._setCache( self.pattern_cache, key, pattern )
+        return pattern
+
+    def _query( self, q ):
+
         p = self.dll.migemo_query( ctypes.c_void_p(self.handle), q.encode("utf-8") )
         s = ctypes.c_char_p(p).value.decode("utf-8")
         self.dll.migemo_release( ctypes.c_void_p(self.handle), ctypes.c_void_p(p) )
         return s
 
+#--------------------------------------------------------------------
+
+def _makeRomaTable():
+
+    table = {}
+
+    rows = [
+        ( "",   "あ い う え お" ),
+        ( "k",  "か き く け こ" ),
+        ( "g",  "が ぎ ぐ げ ご" ),
+        ( "s",  "さ し す せ そ" ),
+        ( "z",  "ざ じ ず ぜ ぞ" ),
+        ( "t",  "た ち つ て と" ),
+        ( "d",  "だ ぢ づ で ど" ),
+        ( "n",  "な に ぬ ね の" ),
+        ( "h",  "は ひ ふ へ ほ" ),
+        ( "b",  "ば び ぶ べ ぼ" ),
+        ( "p",  "ぱ ぴ ぷ ぺ ぽ" ),
+        ( "m",  "ま み む め も" ),
+        ( "y",  "や い ゆ いぇ よ" ),
+        ( "r",  "ら り る れ ろ" ),
+        ( "w",  "わ うぃ う うぇ を" ),
+        ( "f",  "ふぁ ふぃ ふ ふぇ ふぉ" ),
+        ( "v",  "ゔぁ ゔぃ ゔ ゔぇ ゔぉ" ),
+        ( "c",  "か し く せ こ" ),
+        ( "q",  "くぁ くぃ く くぇ くぉ" ),
+        ( "j",  "じゃ じ じゅ じぇ じょ" ),
+        ( "sh", "しゃ し しゅ しぇ しょ" ),
+        ( "ch", "ちゃ ち ちゅ ちぇ ちょ" ),
+        ( "ts", "つぁ つぃ つ つぇ つぉ" ),
+        ( "th", "てゃ てぃ てゅ てぇ てょ" ),
+        ( "dh", "でゃ でぃ でゅ でぇ でょ" ),
+        ( "x",  "ぁ ぃ ぅ ぇ ぉ" ),
+        ( "l",  "ぁ ぃ ぅ ぇ ぉ" ),
+        ( "xy", "ゃ ぃ ゅ ぇ ょ" ),
+        ( "ly", "ゃ ぃ ゅ ぇ ょ" ),
+    ]
+
+    # 拗音 ( きゃ など )
+    for c, kana in ( ("k","き"), ("g","ぎ"), ("s","し"), ("z","じ"), ("t","ち"), ("d","ぢ"), ("n","に"), ("h","ひ"), ("b","び"), ("p","ぴ"), ("m","み"), ("r","り"), ("j","じ"), ("c","ち") ):
+        rows.append( ( c+"y", " ".join( [ kana+small for small in ( "ゃ", "ぃ", "ゅ", "ぇ", "ょ" ) ] ) ) )
+
+    for consonant, kana_list in rows:
+        for vowel, kana in zip( "aiueo", kana_list.split() ):
+            table[consonant+vowel] = kana
+
+    table.update( {
+        "nn" : "ん",
+        "n'" : "ん",
+        "xn" : "ん",
+        "xtu" : "っ",
+        "ltu" : "っ",
+        "xtsu" : "っ",
+        "ltsu" : "っ",
+        "xwa" : "ゎ",
+        "lwa" : "ゎ",
+        "xka" : "ゕ",
+        "xke" : "ゖ",
+        "-" : "ー",
+    } )
+
+    return table
+
+#--------------------------------------------------------------------
+
+## Python だけで実装した Migemo
+#
+#  migemo.dll を使わずに、ローマ字をひらがなとカタカナに変換し、
+#  辞書があれば読みがそれで始まる単語も含めた正規表現に展開します。
+#  Windows 以外の環境でも使うことができ、Migemo の代わりに使うことができます。
+#
+#  辞書は migemo-dict ( UTF-8 で、1行に "読み<TAB>単語<TAB>単語..." ) の形式です。
+#
+#  読みで辞書を引いた結果は読みごとにキャッシュし、入力が1文字ずつ増えていく場合は、
+#  キャッシュにある短い読みの結果を絞り込んで求めます。
+#
+class PortableMigemo(Migemo):
+
+    ROMA2HIRA = _makeRomaTable()
+
+    # ROMA2HIRA のキーの、途中までの文字列の集合
+    ROMA_PREFIXES = set( [ key[:i] for key in ROMA2HIRA for i in range( 1, len(key)+1 ) ] )
+
+    def __init__( self, dict_dirname=None ):
+
+        self._initCache()
+
+        self.dict_keys = []
+        self.dict_words = []
+        self.word_cache = collections.OrderedDict()   # 読み -> [ ( 読み, 単語 ), ... ]
+
+        if dict_dirname:
+            self.loadDictionary( os.path.join( dict_dirname, "migemo-dict" ) )
+
+        self.dictionary_ready = True
+
+    ## migemo-dict 形式の辞書を読み込む
+    def loadDictionary( self, filename ):
+
+        entries = []
+
+        fd = open( filename, "r", encoding="utf-8", errors="ignore" )
+        for line in fd:
+            if not line or line.startswith(";") : continue
+            fields = line.rstrip("\r\n").split("\t")
+            if len(fields)<2 : continue
+            for word in fields[1:]:
+                if word:
+                    entries.append( ( fields[0], word ) )
+        fd.close()
+
+        entries.sort()
+        self.dict_keys = [ entry[0] for entry in entries ]
+        self.dict_words = [ entry[1] for entry in entries ]
+        self.word_cache.clear()
+
+    ## ローマ字をひらがなに変換し、( 変換した文字列, 末尾の変換できなかったローマ字 ) を返す
+    def romaToHira( self, q ):
+
+        q = q.lower()
+        hira = []
+        i = 0
+
+        while i<len(q):
+
+            c = q[i]
+
+            # 促音 ( kk -> っk )
+            if i+1<len(q) and q[i+1]==c and c.isalpha() and c not in "aiueon":
+                hira.append("っ")
+                i += 1
+                continue
+
+            # 撥音 ( 子音の前の n -> ん、nn の後ろに母音が続く場合も n -> ん )
+            if c=="n" and i+1<len(q) and ( q[i+1] not in "aiueoyn'" or ( q[i+1]=="n" and i+2<len(q) and q[i+2] in "aiueoy" ) ):
+                hira.append("ん")
+                i += 1
+                continue
+
+            for length in range( 4, 0, -1 ):
+                kana = PortableMigemo.ROMA2HIRA.get( q[i:i+length] )
+                if kana:
+                    hira.append(kana)
+                    i += length
+                    break
+            else:
+                if q[i:] in PortableMigemo.ROMA_PREFIXES:
+                    # 入力の途中
+                    return ( "".join(hira), q[i:] )
+                hira.append(c)
+                i += 1
+
+        return ( "".join(hira), "" )
+
+    @staticmethod
+    def hiraToKata( s ):
+        return "".join( [ chr(ord(c)+0x60) if "ぁ"<=c<="ゖ" else c for c in s ] )
+
+    @staticmethod
+    def hanToZen( s ):
+        return "".join( [ chr(ord(c)+0xFEE0) if "!"<=c<="~" else c for c in s ] )
+
+    ## 読みが yomi で始まる辞書の単語を返す
+    def _lookupWords( self, yomi ):
+
+        words = self._getCache( self.word_cache, yomi )
+        if words!=None:
+            return words
+
+        # 短い読みの結果がキャッシュにあれば、その中から絞り込む
+        for i in range( len(yomi)-1, 0, -1 ):
+            prefix_words = self.word_cache.get( yomi[:i] )
+            if prefix_words!=None:
+                words = [ entry for entry in prefix_words if entry[0].startswith(yomi) ]
+                break
+        else:
+            begin = bisect.bisect_left( self.dict_keys, yomi )
+            end = bisect.bisect_left( self.dict_keys, yomi + "\uffff" )
+            words = list( zip( self.dict_keys[begin:end], self.dict_words[begin:end] ) )
+
+        self._setCache( self.word_cache, yomi, words )
+        return words
+
+    def _query( self, q ):
+
+        if not q:
+            return ""
+
+        words = set( [ q, PortableMigemo.hanToZen(q) ] )
+
+        # ASCII 以外を含む場合は展開しない
+        if all( [ " "<=c<="~" for c in q ] ):
+
+            hira, rest = self.romaToHira(q)
+
+            # 入力の途中のローマ字は、それで始まる全てのかなの候補にする
+            if rest:
+                yomi_list = set( [ hira + kana for key, kana in PortableMigemo.ROMA2HIRA.items() if key.startswith(rest) ] )
+            else:
+                yomi_list = set( [ hira ] )
+
+            for yomi in yomi_list:
+                words.add(yomi)
+                words.add( PortableMigemo.hiraToKata(yomi) )
+                for key, word in self._lookupWords(yomi):
+                    words.add(word)
+
+            for key, word in self._lookupWords(q.lower()):
+                words.add(word)
+
+        return _makeTrieRegex(words)
+
+#--------------------------------------------------------------------
+
+## 単語の集合を、共通の先頭部分をまとめた正規表現にする
+#
+#  同じ位置から始まる候補の中では、長い単語を優先してマッチします。
+#
+def _makeTrieRegex( words ):
+
+    trie = {}
+    for word in words:
+        if not word : continue
+        node = trie
+        for c in word:
+            node = node.setdefault( c, {} )
+        node[""] = None
+
+    def toRegex(node):
+
+        leaf_chars = []
+        alternatives = []
+        for c in sorted(node):
+            if c=="" : continue
+            child = node[c]
+            if len(child)==1 and "" in child:
+                leaf_chars.append(c)
+            else:
+                alternatives.append( re.escape(c) + toRegex(child) )
+
+        if len(leaf_chars)==1:
+            alternatives.append( re.escape(leaf_chars[0]) )
+        elif leaf_chars:
+            alternatives.append( "[" + "".join( [ re.escape(c) for c in leaf_chars ] ) + "]" )
+
+        if len(alternatives)==1 and "" not in node:
+            return alternatives[0]
+
+        s = "(?:" + "|".join(alternatives) + ")"
+        if "" in node:
+            s += "?"
+        return s
+
+    if not trie:
+        return ""
+
+    return toRegex(trie)
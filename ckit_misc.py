@@ -8,6 +8,8 @@ import inspect
 
 import pyauto
 
+from ckit import ckitcore
+
 ## @addtogroup misc
 ## @{
 
@@ -689,12 +691,24 @@ def expandTab( window, src, tab_width=4, offset=0 ):
 #--------------------------------------------------------------------
 
 ## 単語区切り位置を検索するためのクラス
+#
+#  char_types は文字の集合の文字列か UnicodeRange のシーケンスで、先に指定した種類が優先されます。
+#  type_bounds は、左の文字の種類から、単語を区切る右の文字の種類のリストへの辞書です。
+#
+#  文字の種類の表を ckitcore.WordBreak にコンパイルして、1文字ずつ種類を調べずに区切り位置を探します。
+#  ckitcore.WordBreak が扱えない文字の種類を含む場合は、Python で区切り位置を探します。
+#
 class WordBreak:
 
     def __init__( self, char_types, type_bounds ):
 
         self.char_types = char_types
         self.type_bounds = type_bounds
+
+        try:
+            self.native_object = ckitcore.WordBreak( char_types, type_bounds )
+        except ValueError:
+            self.native_object = None
         
     def _charType( self, c ):
 
@@ -703,8 +717,12 @@ class WordBreak:
                 return i
         return -1
 
+    ## s の pos から step の方向に、次の単語区切りの位置を返す
     def __call__( self, s, pos, step, use_type_bounds=True ):
 
+        if self.native_object:
+            return self.native_object.find( s, pos, step, use_type_bounds )
+
         if step>0:
             pos += 1
             if pos>=len(s) : return len(s)
@@ -732,6 +750,21 @@ class WordBreak:
                 right_char_type = left_char_type
                 left_char_type = self._charType(s[pos-1])
 
+    ## s の中の全ての単語区切りの位置 ( 文字列の端を除く ) のリストを返す
+    def findAll( self, s, use_type_bounds=True ):
+
+        if self.native_object:
+            return self.native_object.findAll( s, use_type_bounds )
+
+        result = []
+        for pos in range( 1, len(s) ):
+            left_char_type = self._charType(s[pos-1])
+            right_char_type = self._charType(s[pos])
+            if left_char_type!=right_char_type:
+                if not use_type_bounds or right_char_type in self.type_bounds[left_char_type]:
+                    result.append(pos)
+        return result
+
 ## Unicode の範囲を定義するためのクラス
 class UnicodeRange:
     
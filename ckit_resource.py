@@ -40,6 +40,9 @@ strings.setString( "readonly",
 strings.setString( "search_found", 
     en_US = "[%s] is found.",
     ja_JP = "[%s]が見つかりました." )
+strings.setString( "search_found_count", 
+    en_US = "[%s] is found. (%d/%d)",
+    ja_JP = "[%s]が見つかりました. (%d/%d)" )
 strings.setString( "search_not_found", 
     en_US = "[%s] is not found.",
     ja_JP = "[%s]が見つかりません." )
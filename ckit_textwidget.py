@@ -1,7 +1,10 @@
 ﻿import os
 import re
 import math
+import tempfile
 import bisect
+import threading
+import traceback
 import cProfile
 
 import pyauto
@@ -30,30 +33,29 @@ DEFAULT_LINEEND = "\r\n" # FIXME : カスタマイズ
 #--------------------------------------------------------------------
 
 import re
-import struct
 
 lexer_debug = False
 
+TokenArray = ckitcore.TokenArray
+
+## Line.tokens に設定するトークン配列を扱うクラス
+#
+#  Line.tokens は ckitcore.TokenArray で、(位置,種類) のシーケンスとしてそのまま読むことができます。
+#
 class Token:
 
-    stock_SimpleTextLine = struct.pack("ii",0,0)
+    stock_SimpleTextLine = TokenArray( [ (0,0) ] )
         
     @staticmethod
     def pack( tokens ):
         if tokens == [(0,0)]:
             #print( "simple text line", id(Token.stock_SimpleTextLine) )
             return Token.stock_SimpleTextLine
-        s = b""
-        for token in tokens:
-            s += struct.pack("ii",token[0],token[1])
-        return s
+        return TokenArray(tokens)
 
     @staticmethod
     def unpack( s ):
-        tokens = []
-        for i in range( 0, len(s), 8 ):
-            tokens.append( struct.unpack( "ii", s[i:i+8] ) )
-        return tokens
+        return list(s)
 
 Token_Text = 0
 Token_Keyword = 1
@@ -77,6 +79,35 @@ class Lexer:
     def lex( self, ctx, line, detail ):
         pass
 
+    ## 行のトークンを分析して line.tokens に設定する
+    def lexLine( self, line ):
+        tokens, ctx = self.lex( line.ctx, line.s, True )
+        line.tokens = Token.pack( tokens )
+
+    ## lines[start:stop] の行の開始コンテキストをまとめて更新する
+    #
+    #  Document.updateSyntaxContext から呼ばれ、処理を終えた行番号、その直前の行のコンテキストが変化したかどうか、
+    #  分析した行数、コンテキストが変化した行の範囲 ( 変化しなかった場合は None ) を返す。
+    #  残りの行は Document.updateSyntaxContext が1行ずつ処理する。
+    #
+    def updateContexts( self, lines, start, stop, max_lex ):
+        return start, (lines[start].ctx==None), 0, None
+
+    ## 文字列のリスト texts とコンテキストのリスト ctxs に対して updateContexts と同じ処理を行う
+    #
+    #  バックグラウンドのスレッドが、ドキュメントのスナップショットに対して使います。
+    #  ctxs は更新されます。
+    #
+    def updateContextList( self, texts, ctxs, start, stop ):
+        return start, (ctxs[start]==None), 0, None
+
+    ## texts[start:stop] の行のトークンを分析して、Token.pack した結果のリストを返す
+    #
+    #  ここで分析しなかった行は None になり、呼び出し側が lex() で分析します。
+    #
+    def lexTokenList( self, texts, ctxs, start, stop ):
+        return [ None ] * ( stop - start )
+
 ## テキストファイル用のシンタックス分析クラス
 class TextLexer(Lexer):
     
@@ -102,6 +133,7 @@ class RegexLexer(Lexer):
         self.rule_map_ctx = {}
         self.re_flags = 0
         self.compiled = False
+        self.native_lexer = None
 
     def _compile(self):
     
@@ -125,12 +157,68 @@ class RegexLexer(Lexer):
                         self.rule_map_ctx[k] = []
                     self.rule_map_ctx[k].append(rule)
 
+        # 全てのルールを1つの正規表現にまとめたネイティブの実装
+        # 対応していない構文を含むコンテキストや行は Python の実装で分析する
+        self.native_lexer = ckitcore.RegexLexer( self.rule_map, self.rule_map_ctx )
+
         self.compiled = True
 
     def lex( self, ctx, line, detail ):
     
         if not self.compiled:
             self._compile()
+
+        if not lexer_debug:
+            result = self.native_lexer.lex( ctx, line, detail )
+            if result!=None:
+                return result
+
+        return self._lex( ctx, line, detail )
+
+    def lexLine( self, line ):
+
+        if not self.compiled:
+            self._compile()
+
+        if not lexer_debug:
+            if self.native_lexer.lexLine(line):
+                return
+
+        tokens, ctx = self._lex( line.ctx, line.s, True )
+        line.tokens = Token.pack( tokens )
+
+    def updateContexts( self, lines, start, stop, max_lex ):
+
+        if not self.compiled:
+            self._compile()
+
+        # 行数が多い場合はネイティブの実装で並列に分析する
+        if not lexer_debug:
+            return self.native_lexer.updateContexts( lines, start, stop, rootContext(), max_lex )
+
+        return Lexer.updateContexts( self, lines, start, stop, max_lex )
+
+    def updateContextList( self, texts, ctxs, start, stop ):
+
+        if not self.compiled:
+            self._compile()
+
+        if not lexer_debug:
+            return self.native_lexer.updateContextList( texts, ctxs, start, stop, rootContext() )
+
+        return Lexer.updateContextList( self, texts, ctxs, start, stop )
+
+    def lexTokenList( self, texts, ctxs, start, stop ):
+
+        if not self.compiled:
+            self._compile()
+
+        if not lexer_debug:
+            return self.native_lexer.lexTokenList( texts, ctxs, start, stop )
+
+        return Lexer.lexTokenList( self, texts, ctxs, start, stop )
+
+    def _lex( self, ctx, line, detail ):
     
         if lexer_debug:
             print( "line :", line )
@@ -266,33 +354,11 @@ class WordCompletion(Completion):
         if re.match( "[a-zA-Z0-9_]+", tail ):
             return None
 
+        # 各文書の単語の一覧から、hint で始まる単語を集める
         items = set()
-        
-        re_patern = re.compile( "\\b" + hint + "[a-zA-Z0-9_]+" )
-        
         for edit in window.edit_list:
+            items.update( edit.doc.getWordIndex().find(hint) )
 
-            # 速度のため、行数が大きすぎるファイルは無視
-            if len(edit.doc.lines) > 10000:
-                continue
-
-            for line in edit.doc.lines:
-
-                s = line.s
-
-                # 速度のため、長すぎる行は無視
-                if len(s) > 1000:
-                    continue
-
-                pos = 0
-                while pos<len(s):
-                    re_result = re_patern.search(s,pos)
-                    if re_result:
-                        items.add( re_result.group(0) )
-                        pos += 1
-                    else:
-                        break
-        
         items = list(items)
         items.sort()
         
@@ -392,37 +458,14 @@ class TextMode(Mode):
 
 #--------------------------------------------------------------------
 
-class UndoInfo:
-
-    def __init__(self):
-
-        self.old_text       = None
-        self.old_text_left  = None
-        self.old_text_right = None
-        self.old_anchor     = None
-        self.old_cursor     = None
+## 行を分割する改行文字の正規表現 ( modifyText() と同じく CR / LF / CRLF で分割する )
+_line_break_re = re.compile( "\r\n|\r|\n" )
 
-        self.new_text       = None
-        self.new_text_left  = None
-        self.new_text_right = None
-        self.new_anchor     = None
-        self.new_cursor     = None
-
-    def __str__(self):
-        return "UndoInfo( %s,%s,  %s,%s )" % ( self.old_text_left, self.old_text_right, self.new_text_left, self.new_text_right )
-
-
-class AtomicUndoInfo:
-
-    def __init__(self):
-        self.old_anchor = None
-        self.old_cursor = None
-        self.new_anchor = None
-        self.new_cursor = None
-        self.items      = []
-
-    def __str__(self):
-        return "AtomicUndoInfo( %s,%s,  %s,%s )" % ( self.old_anchor, self.old_cursor, self.new_anchor, self.new_cursor )
+## 1つの文書の Undo 情報が使うメモリの上限
+#
+#  これを超えると、古い Undo 情報の文字列から順に一時ファイルに書き出します。
+#
+UNDO_JOURNAL_MEMORY_LIMIT = 64 * 1024 * 1024
 
 
 ## TextWidget の文書中の位置を示すクラス
@@ -567,86 +610,28 @@ class Point:
         point.index = len(s)-len(s2)
         return point
 
+    ## 対応する括弧の位置を返す
+    #
+    #  キャレットの右の括弧の場合は対応する括弧の右、キャレットの左の括弧の場合は対応する括弧の左の位置を返します。
+    #  対応する括弧は Document.getBracketIndex() のインデックスで探すので、括弧の間の行数に関係なく見つかります。
+    #  対応する括弧が無い場合は、同じ位置を返します。
+    #
     def correspondingBracket( self, bracket_pair_list ):
-    
-        point = self.copy()
 
-        s = self.edit.doc.lines[point.line].s
+        s = self.edit.doc.lines[self.line].s
+        bracket_index = self.edit.doc.getBracketIndex( bracket_pair_list )
 
         for bracket_pair in bracket_pair_list:
-            if point.index<len(s) and bracket_pair[0]==s[point.index]:
-                step = 1
-                depth = 1
-                inside = False
-                point = point.right()
-                break
-            elif point.index<len(s) and bracket_pair[1]==s[point.index]:
-                step = -1
-                depth = 1
-                inside = True
-                break
-            elif point.index>0 and bracket_pair[0]==s[point.index-1]:
-                step = 1
-                depth = 1
-                inside = True
-                break
-            elif point.index>0 and bracket_pair[1]==s[point.index-1]:
-                step = -1
-                depth = 1
-                inside = False
-                point = point.left()
-                break
-        else:
-            return point
-            
-        num_checked_lines = 0
-                    
-        while True:
-
-            s = self.edit.doc.lines[point.line].s
+            for index, offset in ( ( self.index, 1 ), ( self.index-1, 0 ) ):
+                if 0<=index<len(s) and s[index] in bracket_pair:
+                    match = bracket_index.findPair( self.line, index )
+                    if match:
+                        point = self.copy()
+                        point.line = match[0]
+                        point.index = match[1] + offset
+                        return point
 
-            if step>0:
-                pos1 = s.find( bracket_pair[0], point.index )
-                pos2 = s.find( bracket_pair[1], point.index )
-            else:
-                pos1 = s.rfind( bracket_pair[0], 0, point.index )
-                pos2 = s.rfind( bracket_pair[1], 0, point.index )
-                
-            if pos1>=0 and (pos2<0 or int(math.copysign(1,pos2-pos1))==step):
-                depth += step
-                point.index = pos1
-            elif pos2>=0 and (pos1<0 or int(math.copysign(1,pos1-pos2))==step):
-                depth -= step
-                point.index = pos2
-            else:
-                if step>0:
-                    point = point.lineEnd()
-                else:
-                    point = point.lineBegin()
-
-                # 1000行チェックしても見つからなかったら諦める
-                num_checked_lines += 1
-                if num_checked_lines > 1000:
-                    # FIXME : エラーメッセージをステータスバーに表示するべき
-                    return self.copy()
-
-            if depth<=0 : break
-
-            if step>0:
-                new_point = point.right()
-            else:
-                new_point = point.left()
-
-            # 末端まで到達
-            if new_point==point:
-                return self.copy()
-
-            point = new_point
-
-        if (step>0 and not inside) or (step<0 and inside):
-            point = point.right()
-
-        return point
+        return self.copy()
 
 
 ## TextWidget の選択範囲を示すクラス
@@ -711,9 +696,7 @@ class Document:
         self.bg_color_name = None
         self.diff_mode = False
 
-        self.undo_list = []
-        self.redo_list = []
-        self.atomic_undo = None
+        self.undo_journal = ckitcore.UndoJournal( UNDO_JOURNAL_MEMORY_LIMIT, os.path.join( tempfile.gettempdir(), "ckit_undo_%d_%x.tmp" % ( os.getpid(), id(self) ) ) )
         self.modcount = 0
         
         # Documentの変更を所属する全てのTextWidgetに通知するためのハンドラ
@@ -724,6 +707,13 @@ class Document:
         self.lexer = None
         self.lex_ctx_dirty_top = 0
         self.lex_token_dirty_top = 0
+        self.lex_generation = 0         # 行の内容やモードが変わるたびに増える ( バックグラウンドの分析結果の確認用 )
+        self.syntax_job = None          # バックグラウンドで実行中のシンタックス分析
+        self.search_hit_object = None   # search_hit_index の検索条件
+        self.search_hit_index = None    # 検索条件に一致する全ての範囲 ( ckitcore.SearchHitIndex )
+        self.word_index = None          # 単語補完のための単語の一覧 ( ckitcore.WordIndex )
+        self.bracket_pairs = None       # bracket_index の括弧の種類
+        self.bracket_index = None       # 対応する括弧を探すためのインデックス ( ckitcore.BracketIndex )
         self.minor_mode_list = []
 
         if filename and os.path.exists(filename):
@@ -787,6 +777,9 @@ class Document:
             line.tokens = None
         self.lex_ctx_dirty_top = 0
         self.lex_token_dirty_top = 0
+        self.lex_generation += 1
+
+        self.bracket_index = None
 
     def appendMinorMode( self, mode ):
         self.minor_mode_list.append(mode)
@@ -821,8 +814,7 @@ class Document:
 
         self.lines = []
 
-        self.undo_list = []
-        self.redo_list = []
+        self.undo_journal.clear()
         self.modcount = 0
 
         fd.seek( 0, os.SEEK_SET )
@@ -830,29 +822,41 @@ class Document:
         
         detected_encoding = ckit_misc.detectTextEncoding( data, ascii_as="utf-8" )
         
+        bom_len = 0
         if detected_encoding.bom:
-            data = data[ len(detected_encoding.bom) : ]
+            bom_len = len(detected_encoding.bom)
 
         if not encoding:
             encoding = detected_encoding
 
-        if encoding.encoding:
-            data = data.decode( encoding=encoding.encoding, errors='replace' )
+        if not encoding.encoding:
+            raise UnicodeError
+
+        # ネイティブのデコーダで、改行位置で分割したチャンクを並列にデコードする
+        # (cp932 の 波ダッシュ → 全角チルダ の置き換えも同時に行われる)
+        lines = ckitcore.decodeLines( data, encoding.encoding, bom_len )
+
+        # ネイティブで扱えないエンコーディング
+        if lines==None:
+
+            data = data[bom_len:].decode( encoding=encoding.encoding, errors='replace' )
             
             # 波ダッシュ → 全角チルダ
             if encoding.encoding=="cp932":
                 data = data.replace( "\u301c", "\uff5e" )
-            
-            self.encoding = encoding
-        else:
-            raise UnicodeError
 
-        lines = data.splitlines(True)
-        self.lines = [ Line(line) for line in lines ]
+            # ネイティブのデコーダと同じく CR / LF / CRLF だけで分割する
+            # (str.splitlines は \x0c や \u2028 などでも分割する)
+            # 空か、改行で終わっている場合は、最後に空の行が追加される
+            lines = []
+            pos = 0
+            for match in _line_break_re.finditer(data):
+                lines.append( Line( data[pos:match.end()] ) )
+                pos = match.end()
+            lines.append( Line( data[pos:] ) )
 
-        # 空か、改行で終わっている場合は、最後に行を追加する
-        if len(self.lines)==0 or self.lines[-1].end:
-            self.lines.append( Line("") )
+        self.encoding = encoding
+        self.lines = lines
 
         if len(self.lines)>0 and self.lines[0].end:
             self.lineend = self.lines[0].end
@@ -861,12 +865,22 @@ class Document:
 
         self.lex_ctx_dirty_top = 0
         self.lex_token_dirty_top = 0
+        self.lex_generation += 1
+
+        self.clearSearchHitIndex()
+        self.word_index = None
+        self.bracket_index = None
 
     def writeFile( self, fd ):
 
         if self.encoding.bom:
             fd.write( self.encoding.bom )
 
+        # ネイティブのエンコーダで、大きなバッファ単位で書き出す
+        if ckitcore.encodeLines( self.lines, self.encoding.encoding, fd.write ):
+            return
+
+        # ネイティブで扱えないエンコーディング
         for line in self.lines:
             s = line.s
 
@@ -879,6 +893,36 @@ class Document:
             end = line.end.encode( self.encoding.encoding )
             fd.write(end)
 
+    ## ファイルに保存する
+    #
+    #  @param filename 保存先のファイル名 ( None の場合は Document のファイル名 )
+    #
+    #  同じディレクトリの一時ファイルに書き出してから置き換えるため、
+    #  保存の途中で失敗しても元のファイルは壊れません。
+    #
+    def saveFile( self, filename=None ):
+
+        if not filename:
+            filename = self.filename
+
+        if ckitcore.saveLines( filename, self.lines, self.encoding.encoding, self.encoding.bom ):
+            return
+
+        # ネイティブで扱えないエンコーディング
+        fd, tmp_filename = tempfile.mkstemp( dir=os.path.dirname(filename) )
+        try:
+            with os.fdopen( fd, "wb" ) as fd:
+                self.writeFile(fd)
+            os.replace( tmp_filename, filename )
+        except:
+            os.unlink(tmp_filename)
+            raise
+
+    ## 行の開始コンテキストを、lex_ctx_dirty_top から stop まで更新する
+    #
+    #  コンテキストが変化した行のトークンは無効になる。
+    #  コンテキストが変化した行の範囲 ( begin, end ) を返す。変化しなかった場合は None を返す。
+    #
     def updateSyntaxContext( self, stop=None, max_lex=None ):
 
         #print( "updateSyntaxContext", stop, max_lex )
@@ -894,13 +938,14 @@ class Document:
             max_lex = len(self.lines)
 
         if self.lex_ctx_dirty_top==None or self.lex_ctx_dirty_top>=stop:
-            return
+            return None
 
-        line = start
-        num_lex = 0
-        prev_line_dirty = (self.lines[line].ctx==None)
+        # バックグラウンドの分析は中止して、ここで分析する
+        self.cancelSyntaxWorker()
 
-        while True:
+        line, prev_line_dirty, num_lex, changed_range = self.lexer.updateContexts( self.lines, start, stop, max_lex )
+
+        while line<stop and num_lex<max_lex:
     
             if self.lines[line].ctx==None or prev_line_dirty:
 
@@ -914,6 +959,10 @@ class Document:
                     self.lines[line].ctx = ctx
                     self.lines[line].tokens = None
                     prev_line_dirty = True
+                    if changed_range:
+                        changed_range = ( changed_range[0], line+1 )
+                    else:
+                        changed_range = ( line, line+1 )
                 else:
                     prev_line_dirty = False
 
@@ -921,9 +970,6 @@ class Document:
 
             line += 1
 
-            if line>=stop or num_lex>=max_lex:
-                break
-
         if line<len(self.lines):
             if prev_line_dirty:
                 self.lines[line].ctx = None
@@ -931,6 +977,8 @@ class Document:
         else:
             self.lex_ctx_dirty_top = None
 
+        return changed_range
+
 
     def updateSyntaxTokens( self, start=None, stop=None, max_lex=None ):
     
@@ -951,13 +999,15 @@ class Document:
             return
 
         num_lex = 0
+        lexed_top = None
 
         for line in range( start, stop ):
             if self.lines[line].tokens==None:
-                ctx = self.lines[line].ctx
-                assert( ctx != None )
-                tokens, tmp = self.lexer.lex( ctx, self.lines[line].s, True )
-                self.lines[line].tokens = Token.pack( tokens )
+                assert( self.lines[line].ctx != None )
+                self.lexer.lexLine( self.lines[line] )
+
+                if lexed_top==None:
+                    lexed_top = line
 
                 num_lex += 1
                 if num_lex>=max_lex:
@@ -966,6 +1016,10 @@ class Document:
         if start<=self.lex_token_dirty_top and line==len(self.lines)-1:
             self.lex_token_dirty_top = None
 
+        # トークンを分析した行の括弧から、文字列やコメントの中のものを除く
+        if lexed_top!=None:
+            self.updateBracketIndex( lexed_top, line+1-lexed_top, line+1-lexed_top )
+
     def fillSyntaxContextAndTokens( self, start, stop, ctx, tokens ):
 
         if start==None:
@@ -980,26 +1034,427 @@ class Document:
             self.lines[line].ctx = ctx
             self.lines[line].tokens = Token.pack(tokens)
 
+    ## シンタックス情報をバックグラウンドで少しずつ更新する
+    #
+    #  コンテキストが変化して再描画が必要な行の範囲 ( begin, end ) を返す。変化しなかった場合は None を返す。
+    #
     def updateSyntaxTimer(self):
-        if not isinstance( self.lexer, TextLexer ):
-            self.updateSyntaxContext( max_lex=1000 )
+        changed_range = None
+        if not isinstance( self.lexer, TextLexer ) and not self.getSyntaxJob():
+            changed_range = self.updateSyntaxContext( max_lex=1000 )
             self.updateSyntaxTokens( start=self.lex_token_dirty_top, max_lex=100 )
+        return changed_range
 
     def isSyntaxDirty(self):
         return (self.lex_ctx_dirty_top!=None or self.lex_token_dirty_top!=None)
 
+    ## 実行中のバックグラウンドのシンタックス分析を取得する
+    #
+    #  ドキュメントが変更されて結果が使えなくなった分析は中止し、None を返します。
+    #
+    def getSyntaxJob(self):
+        job = self.syntax_job
+        if job and job.generation!=self.lex_generation:
+            self.cancelSyntaxWorker()
+            job = None
+        return job
+
+    ## バックグラウンドのシンタックス分析を中止する
+    def cancelSyntaxWorker(self):
+        if self.syntax_job:
+            self.syntax_job.cancel()
+            self.syntax_job = None
+
+    ## 検索条件に一致する全ての範囲のインデックスを取得する
+    #
+    #  search_object の検索条件で文書全体を検索したインデックスを作り、以降は編集に合わせて更新します。
+    #  インデックスは最後に指定した検索条件のものだけを保持します。
+    #  Python で1行ずつ検索する必要がある大きな文書では、インデックスを作らずに None を返します。
+    #
+    def getSearchHitIndex( self, search_object ):
+
+        if search_object is not self.search_hit_object:
+
+            self.clearSearchHitIndex()
+
+            if search_object==None : return None
+            if search_object.multiline : return None
+            if search_object.native_object==None and len(self.lines)>SEARCH_HIT_INDEX_MAX_PYTHON_LINES : return None
+
+            hit_index = ckitcore.SearchHitIndex()
+            search_object.findLines( hit_index, self.lines, 0, 0, len(self.lines) )
+
+            self.search_hit_object = search_object
+            self.search_hit_index = hit_index
+
+        return self.search_hit_index
+
+    ## 行 [line,line+old_count) が new_count 行に置き換わったことを、検索結果のインデックスに反映する
+    def updateSearchHitIndex( self, line, old_count, new_count ):
+        if self.search_hit_index!=None:
+            self.search_hit_object.findLines( self.search_hit_index, self.lines, line, old_count, new_count )
+
+    def clearSearchHitIndex(self):
+        self.search_hit_object = None
+        self.search_hit_index = None
+
+    ## 単語補完のための単語の一覧を取得する
+    #
+    #  最初に呼び出したときに文書全体から単語の一覧を作り、以降は編集に合わせて更新します。
+    #
+    def getWordIndex(self):
+        if self.word_index==None:
+            self.word_index = ckitcore.WordIndex()
+            self.word_index.addLines( self.lines, 0, len(self.lines) )
+        return self.word_index
+
+    ## 行 [line,line+count) の単語を、単語の一覧から取り除く ( 行を変更する前に呼び出す )
+    def removeWordIndexLines( self, line, count ):
+        if self.word_index!=None:
+            self.word_index.removeLines( self.lines, line, count )
+
+    ## 行 [line,line+count) の単語を、単語の一覧に加える ( 行を変更した後に呼び出す )
+    def addWordIndexLines( self, line, count ):
+        if self.word_index!=None:
+            self.word_index.addLines( self.lines, line, count )
+
+    ## 対応する括弧を探すためのインデックスを取得する
+    #
+    #  最初に呼び出したときに文書全体の括弧のインデックスを作り、以降は編集とシンタックス分析に合わせて更新します。
+    #  トークンを分析済みの行では、文字列とコメントの中の括弧を除外します。
+    #
+    def getBracketIndex( self, bracket_pair_list ):
+        if self.bracket_index==None or self.bracket_pairs!=bracket_pair_list:
+            self.bracket_index = ckitcore.BracketIndex( bracket_pair_list, ( Token_String, Token_Comment ) )
+            self.bracket_index.updateLines( self.lines, 0, 0, len(self.lines) )
+            self.bracket_pairs = bracket_pair_list
+        return self.bracket_index
+
+    ## 行 [line,line+old_count) が new_count 行に置き換わったことを、括弧のインデックスに反映する
+    def updateBracketIndex( self, line, old_count, new_count ):
+        if self.bracket_index!=None:
+            self.bracket_index.updateLines( self.lines, line, old_count, new_count )
+
+    ## 表示範囲のシンタックス分析を、必要に応じてバックグラウンドのスレッドで開始する
+    #
+    #  @param self              -
+    #  @param window            結果を受け取るウインドウ
+    #  @param visible_top       表示範囲の先頭の行
+    #  @param visible_bottom    表示範囲の終端の行
+    #  @param finished_func     分析結果を受け取る関数 ( ウインドウのスレッドで呼ばれる )
+    #  @return                  バックグラウンドで分析中の場合は True
+    #
+    #  表示範囲までの未分析の行数が少ない場合は、バックグラウンドでは分析せずに False を返します。
+    #  その場合は、呼び出し側で updateSyntaxContext() を呼び出します。
+    #
+    def requestSyntaxWorker( self, window, visible_top, visible_bottom, finished_func ):
+
+        if not syntax_worker_enabled : return False
+
+        if self.getSyntaxJob() : return True
+
+        if self.lex_ctx_dirty_top==None : return False
+
+        visible_bottom = min( visible_bottom, len(self.lines) )
+        if visible_bottom - self.lex_ctx_dirty_top < SYNTAX_WORKER_MIN_LINES : return False
+
+        self.syntax_job = SyntaxJob( self, window, visible_top, visible_bottom, finished_func )
+        SyntaxWorker.getInstance().enqueue( self.syntax_job )
+
+        return True
+
+    ## バックグラウンドのシンタックス分析の結果を反映する
+    #
+    #  @return 再描画が必要な行の範囲 ( begin, end )。必要がない場合は None
+    #
+    def applySyntaxResult( self, job, result ):
+
+        if self.getSyntaxJob() is not job : return None
+
+        changed_range = None
+
+        def extendRange( begin, end ):
+            if changed_range:
+                return ( min( changed_range[0], begin ), max( changed_range[1], end ) )
+            else:
+                return ( begin, end )
+
+        # コンテキストが変化した行
+        if result.ctx_begin!=None:
+            begin = job.base + result.ctx_begin
+            for i, ctx in enumerate( result.ctxs, begin ):
+                line = self.lines[i]
+                if line.ctx != ctx:
+                    line.ctx = ctx
+                    line.tokens = None
+            changed_range = extendRange( begin, begin + len(result.ctxs) )
+
+        # 表示範囲のトークン
+        if result.tokens:
+            begin = job.base + result.token_begin
+            for i, tokens in enumerate( result.tokens, begin ):
+                if tokens!=None:
+                    self.lines[i].tokens = tokens
+            changed_range = extendRange( begin, begin + len(result.tokens) )
+            self.updateBracketIndex( begin, len(result.tokens), len(result.tokens) )
+
+        # 処理を終えた行まで進める
+        line = job.base + result.end
+        if line<len(self.lines):
+            if result.prev_line_dirty:
+                self.lines[line].ctx = None
+            self.lex_ctx_dirty_top = line
+        else:
+            self.lex_ctx_dirty_top = None
+            self.syntax_job = None
+
+        return changed_range
+
+#--------------------------------------------------------------------
+
+## バックグラウンドのシンタックス分析を使うかどうか
+syntax_worker_enabled = True
+
+## 表示範囲までの未分析の行数がこれ以上の場合に、バックグラウンドで分析する
+SYNTAX_WORKER_MIN_LINES = 10000
+
+## バックグラウンドの分析で、1回に結果を返す行数
+SYNTAX_WORKER_CHUNK_LINES = 50000
+
+## 正規表現の検索で、検索結果のインデックスを作る最大の行数
+SEARCH_HIT_INDEX_MAX_PYTHON_LINES = 100000
+
+## 行をまたぐ正規表現の検索で、1つのマッチがまたぐ行数の上限
+SEARCH_MULTILINE_MAX_LINES = 1000
+
+## バックグラウンドのシンタックス分析の結果
+class SyntaxResult:
+
+    def __init__( self, end, prev_line_dirty ):
+        self.end = end                          # 処理を終えた行 ( SyntaxJob.base からの相対位置 )
+        self.prev_line_dirty = prev_line_dirty  # end の直前の行のコンテキストが変化したか
+        self.ctx_begin = None                   # コンテキストが変化した行の範囲の先頭
+        self.ctxs = []                          # コンテキストが変化した範囲の新しいコンテキスト
+        self.token_begin = None                 # トークンを分析した行の範囲の先頭
+        self.tokens = []                        # 分析したトークン
+
+## バックグラウンドのシンタックス分析
+#
+#  作成時にドキュメントの行の文字列とコンテキストのスナップショットを取り、
+#  SyntaxWorker のスレッドの中で、表示範囲までを先に、残りをそのあとに分析します。
+#  結果はウインドウのメッセージキューを経由して、ウインドウのスレッドで finished_func に渡されます。
+#
+class SyntaxJob:
+
+    def __init__( self, doc, window, visible_top, visible_bottom, finished_func ):
+
+        self.lexer = doc.lexer
+        self.generation = doc.lex_generation
+        self.window = window
+        self.finished_func = finished_func
+        self.canceled = False
+
+        # 分析を始める行の直前の行からのスナップショット
+        self.base = max( doc.lex_ctx_dirty_top - 1, 0 )
+        self.start = doc.lex_ctx_dirty_top - self.base
+        self.texts = [ line.s for line in doc.lines[self.base:] ]
+        self.ctxs = [ line.ctx for line in doc.lines[self.base:] ]
+
+        self.visible_top = max( visible_top - self.base, self.start )
+        self.visible_bottom = visible_bottom - self.base
+
+    def cancel(self):
+        self.canceled = True
+
+    def isCanceled(self):
+        return self.canceled
+
+    def run(self):
+
+        num_lines = len(self.texts)
+        line = self.start
+
+        # 表示範囲までのコンテキストと、表示範囲のトークン
+        result = self._updateContexts( line, self.visible_bottom )
+        if result==None : return
+        line = result.end
+
+        result.token_begin = self.visible_top
+        result.tokens = self._lexTokens( self.visible_top, line )
+        if not self._post(result) : return
+
+        # 残りの行
+        while line<num_lines:
+            result = self._updateContexts( line, min( line + SYNTAX_WORKER_CHUNK_LINES, num_lines ) )
+            if result==None : return
+            line = result.end
+            if not self._post(result) : return
+
+    def _updateContexts( self, line, stop ):
+
+        texts = self.texts
+        ctxs = self.ctxs
+
+        prev_line_dirty = False
+        changed_begin = None
+        changed_end = None
+
+        # ネイティブで分析できない行が続く場合に、毎回多くの行を渡さないように、
+        # 分析できなかったときは渡す行数を減らし、分析できるたびに増やす
+        num_native_lines = SYNTAX_WORKER_CHUNK_LINES
+
+        while line<stop:
+
+            if self.canceled : return None
+
+            # まとめてネイティブで分析し、分析できなかった行は1行だけ Python で分析する
+            chunk_stop = min( line + num_native_lines, stop )
+            line, prev_line_dirty, num_lex, changed_range = self.lexer.updateContextList( texts, ctxs, line, chunk_stop )
+            if changed_range:
+                if changed_begin==None : changed_begin = changed_range[0]
+                changed_end = changed_range[1]
+
+            if line<chunk_stop:
+
+                if ctxs[line]==None or prev_line_dirty:
+
+                    if line + self.base == 0:
+                        ctx = rootContext()
+                    else:
+                        ctx = self.lexer.lex( ctxs[line-1], texts[line-1], False )
+
+                    if ctxs[line] != ctx:
+                        ctxs[line] = ctx
+                        prev_line_dirty = True
+                        if changed_begin==None : changed_begin = line
+                        changed_end = line+1
+                    else:
+                        prev_line_dirty = False
+
+                line += 1
+
+                num_native_lines = 16
+            else:
+                num_native_lines = min( num_native_lines * 2, SYNTAX_WORKER_CHUNK_LINES )
+
+            # 続きを分析するときに、コンテキストが変化したことがわかるようにする
+            if line<len(texts) and prev_line_dirty:
+                ctxs[line] = None
+
+        result = SyntaxResult( line, prev_line_dirty )
+        if changed_begin!=None:
+            result.ctx_begin = changed_begin
+            result.ctxs = ctxs[changed_begin:changed_end]
+
+        return result
+
+    def _lexTokens( self, start, stop ):
+
+        if start>=stop : return []
+
+        tokens_list = self.lexer.lexTokenList( self.texts, self.ctxs, start, stop )
+
+        for i in range( len(tokens_list) ):
+            if tokens_list[i]==None:
+                tokens, ctx = self.lexer.lex( self.ctxs[start+i], self.texts[start+i], True )
+                tokens_list[i] = Token.pack( tokens )
+
+        return tokens_list
+
+    def _post( self, result ):
+
+        if self.canceled : return False
+
+        def finished():
+            self.finished_func( self, result )
+
+        try:
+            self.window.postCall(finished)
+        except ValueError:
+            # ウインドウが破棄された
+            self.cancel()
+            return False
+
+        return True
+
+## バックグラウンドでシンタックス分析を行うスレッド
+#
+#  SyntaxJob を登録された順に実行します。
+#
+class SyntaxWorker(threading.Thread):
+
+    instance = None
+
+    ## スレッドを取得する ( 最初に呼ばれたときに開始する )
+    @staticmethod
+    def getInstance():
+        if SyntaxWorker.instance==None:
+            SyntaxWorker.instance = SyntaxWorker()
+        return SyntaxWorker.instance
+
+    def __init__(self):
+        threading.Thread.__init__(self)
+        self.daemon = True
+        self.cond = threading.Condition()
+        self.jobs = []
+        self.start()
+
+    ## 分析を登録する
+    def enqueue( self, job ):
+        with self.cond:
+            self.jobs.append(job)
+            self.cond.notify()
+
+    def run(self):
+
+        ckitcore.setBlockDetector()
+
+        while True:
+
+            with self.cond:
+                while not self.jobs:
+                    self.cond.wait()
+                job = self.jobs.pop(0)
+
+            if job.isCanceled() : continue
+
+            try:
+                job.run()
+            except:
+                traceback.print_exc()
+
 #--------------------------------------------------------------------
 
+## 正規表現のマッチの結果 ( re.Match ) を、最初に必要になったときに求めるためのクラス
+#
+#  ネイティブの検索で見つかった位置から re でマッチしなおすと、パターンによっては re が大きく後戻りして時間がかかるので、
+#  グループを使う場合 ( 置換など ) にだけ re でマッチしなおします。
+#
+class LazyReResult:
+
+    def __init__( self, func=None, re_result=None ):
+        self.func = func
+        self.re_result = re_result
+
+    def get(self):
+        if self.func:
+            self.re_result = self.func()
+            self.func = None
+        return self.re_result
+
 ## TextWidget の検索条件を保存し実行するクラス
+#
+#  multiline が True の場合や、検索する文字列が改行を含む場合は、行をまたいで検索します。
+#
 class Search:
 
-    def __init__( self, text, word, case, regex ):
+    def __init__( self, text, word, case, regex, multiline=False ):
 
         self.text = text
         self.word = word
         self.case = case
         self.regex = regex
-        self.text_upper = self.text.upper()
+        self.multiline = multiline or ( "\n" in text )
 
         # 検索するテキストの最初と最後が単語区切りになりえるかチェックして、
         # そうでなかったら単語単位の検索を無効にする
@@ -1008,40 +1463,78 @@ class Search:
         elif re.match( "[a-zA-Z0-9_]", self.text )==None:
             self.word = False
 
-        if self.regex or self.word:
+        if self.regex:
 
-            if self.regex:
-                if self.word:
-                    re_pattern = r"\b" + self.text + r"\b"
-                else:
-                    re_pattern = self.text
+            if self.word:
+                re_pattern = r"\b" + self.text + r"\b"
             else:
-                re_pattern = ""
-                for c in self.text:
-                    if c in "\\[]^":
-                        c = "\\" + c;
-                    re_pattern += "[" + c + "]"
-
-                if self.word:
-                    re_pattern = r"\b" + re_pattern + r"\b"
+                re_pattern = self.text
 
             re_option = re.UNICODE
             if not self.case:
                 re_option |= re.IGNORECASE
 
+            # 行をまたぐ検索では、^ と $ を各行の先頭と末尾にマッチさせる
+            if self.multiline:
+                re_option |= re.MULTILINE
+
             self.re_object = re.compile( re_pattern, re_option )
-            self.re_result = None
+
+            # 後戻りせずに線形時間で検索できる ckitcore.Regex を使う
+            # 対応していない構文 ( 後方参照など ) を含む場合は re で検索する
+            try:
+                self.native_object = ckitcore.Regex( self.re_object )
+            except ValueError:
+                self.native_object = None
 
         else:
+            # 正規表現を使わない検索は、大文字小文字の区別と単語単位の判定も含めて ckitcore.TextSearch で行う
             self.re_object = None
-            self.re_result = None
+            self.native_object = ckitcore.TextSearch( self.text, self.word, self.case )
+
+        self.lazy_re_result = LazyReResult()
 
     def __str__(self):
         return self.text
 
+    ## 最後の検索の正規表現のマッチの結果 ( re.Match )
+    #
+    #  ネイティブの検索で見つけた場合は、最初に参照されたときに re でマッチしなおして求めます。
+    #
+    @property
+    def re_result(self):
+        return self.lazy_re_result.get()
+
+    @re_result.setter
+    def re_result( self, re_result ):
+        self.lazy_re_result = LazyReResult( re_result=re_result )
+
+    # ネイティブの検索で見つかった位置から re でマッチしなおす処理を、re_result が参照されるまで遅らせる
+    def _matchReResult( self, line, result, end=None ):
+        if result and self.re_object:
+            if end==None:
+                end = len(line)
+            re_object = self.re_object
+            start = result[0]
+            self.lazy_re_result = LazyReResult( lambda : re_object.match( line, start, end ) )
+        else:
+            self.re_result = None
+
     def search( self, line, pos=None, end=None ):
 
-        if self.re_object:
+        if self.native_object:
+
+            if pos==None:
+                result = self.native_object.search(line)
+            elif end==None:
+                result = self.native_object.search(line,pos)
+            else:
+                result = self.native_object.search(line,pos,end)
+
+            self._matchReResult( line, result, end )
+            return result
+
+        else:
 
             if pos==None:
                 re_result = self.re_object.search(line)
@@ -1050,35 +1543,181 @@ class Search:
             else:
                 re_result = self.re_object.search(line,pos,end)
         
-            if self.regex:
-                self.re_result = re_result
-            else:
-                self.re_result = None
+            self.re_result = re_result
         
             if re_result:
                 return ( re_result.start(), re_result.end() )
             else:
                 return None
-        
+
+    ## line の end までの範囲で、最も右で始まるマッチを探す
+    #
+    #  正規表現の場合は、マッチの結果を re_result に設定します。
+    #
+    def rsearch( self, line, end=None ):
+
+        if end==None:
+            end = len(line)
+
+        if self.native_object:
+
+            result = self.native_object.rsearch( line, end )
+            self._matchReResult( line, result, end )
+            return result
+
         else:
 
-            if self.case:
-                text = self.text
+            pos = 0
+            last_found = None
+            last_re_result = None
+            while pos<len(line):
+                search_result = self.search( line, pos, end )
+                if not search_result : break
+                if last_found==None or last_found[0] < search_result[0] :
+                    last_found = search_result
+                    last_re_result = self.re_result
+                pos = search_result[0] + 1
+
+            self.re_result = last_re_result
+            return last_found
+
+    ## 行のリストを検索する
+    #
+    #  lines[line] の index から、direction が正の場合は後方に、負の場合は前方に向かって検索し、
+    #  ( 行番号, 開始位置, 終了位置 ) を返します。見つからない場合は None を返します。
+    #  最初の行は、direction が正の場合は index 以降を、負の場合は index までを検索します。
+    #
+    def searchLines( self, lines, line, index, direction, oneline=False ):
+
+        if self.native_object:
+
+            result = self.native_object.searchLines( lines, line, index, direction, oneline )
+
+            if result:
+                # 後方に検索した場合の最初の行は、index までを検索した結果
+                if direction<0 and result[0]==line:
+                    end = index
+                else:
+                    end = None
+                self._matchReResult( lines[result[0]].s, result[1:], end )
             else:
-                text = self.text_upper
-                line = line.upper()
-            
-            if pos==None:
-                pos = line.find(text)
-            elif end==None:
-                pos = line.find(text,pos)
+                self.re_result = None
+
+            return result
+
+        while 0<=line<len(lines):
+
+            s = lines[line].s
+
+            if direction>0:
+                result = self.search( s, index )
             else:
-                pos = line.find(text,pos,end)
-        
-            if pos>=0:
-                return ( pos, pos+len(text) )
+                result = self.rsearch( s, index )
+
+            if result:
+                return ( line, result[0], result[1] )
+
+            if oneline:
+                break
+
+            if direction>0:
+                line += 1
+                index = 0
             else:
-                return None
+                line -= 1
+                if line>=0:
+                    index = len(lines[line].s)
+
+        return None
+
+    ## 行 [line,line+old_count) を new_count 行に置き換え、lines[line:line+new_count] の中の重ならない全てのマッチを hit_index に登録する
+    def findLines( self, hit_index, lines, line, old_count, new_count ):
+
+        if self.native_object:
+            hit_index.findLines( self.native_object, lines, line, old_count, new_count )
+            return
+
+        hits = []
+        for i in range( line, line+new_count ):
+            s = lines[i].s
+            pos = 0
+            while True:
+                result = self.search( s, pos )
+                if result and result[1]!=pos:
+                    hits.append( ( i, result[0], result[1] ) )
+                    pos = result[1]
+                else:
+                    break
+
+        hit_index.replaceLines( line, old_count, new_count, hits )
+
+    ## 行をまたいで検索する
+    #
+    #  lines を改行でつないだ1つのテキストとして ( line, index ) から検索し、
+    #  ( 開始行, 開始位置, 終了行, 終了位置 ) を返します。見つからない場合は None を返します。
+    #  direction が正の場合は ( line, index ) 以降で始まる最初のマッチを、
+    #  負の場合は ( line, index ) までで終わるマッチの中で最も右で始まるものを探します。
+    #
+    #  行末の改行コードの種類に関わらず、改行は '\n' として検索します。
+    #  正規表現の場合、1つのマッチがまたぐ行数は SEARCH_MULTILINE_MAX_LINES までです。
+    #
+    def searchMultiLine( self, lines, line, index, direction ):
+
+        if self.native_object:
+
+            if self.regex:
+                max_lines = SEARCH_MULTILINE_MAX_LINES
+            else:
+                max_lines = self.text.count("\n") + 1
+
+            result = self.native_object.searchMultiLine( lines, line, index, direction, max_lines )
+
+            # マッチした範囲の文字列だけで re でマッチしなおす処理を、re_result が参照されるまで遅らせる
+            # 範囲の外を参照する先読み/後読みを含む場合は None になることがある
+            if result and self.re_object:
+                re_object = self.re_object
+                text = self._getRangeText( lines, *result )
+                self.lazy_re_result = LazyReResult( lambda : re_object.fullmatch(text) )
+            else:
+                self.re_result = None
+
+            return result
+
+        # ckitcore.Regex が対応していないパターンは、全ての行をつないだ文字列を re で検索する
+        offsets = []
+        pos = 0
+        for l in lines:
+            offsets.append(pos)
+            pos += len(l.s) + 1
+
+        text = "\n".join( [ l.s for l in lines ] )
+        pos = offsets[line] + min( index, len(lines[line].s) )
+
+        if direction>0:
+            result = self.search( text, pos )
+        else:
+            result = self.rsearch( text, pos )
+
+        if not result:
+            return None
+
+        def toLineIndex(pos):
+            i = bisect.bisect_right( offsets, pos ) - 1
+            return ( i, pos-offsets[i] )
+
+        return toLineIndex(result[0]) + toLineIndex(result[1])
+
+    def _getRangeText( self, lines, line1, index1, line2, index2 ):
+        if line1==line2:
+            return lines[line1].s[index1:index2]
+        texts = [ lines[line1].s[index1:] ]
+        for i in range( line1+1, line2 ):
+            texts.append( lines[i].s )
+        if line2<len(lines):
+            texts.append( lines[line2].s[:index2] )
+        else:
+            texts.append( "" )
+        return "\n".join(texts)
 
 
 #--------------------------------------------------------------------
@@ -1098,6 +1737,8 @@ class TextWidget(ckit_widget.Widget):
     
     rect_mode_clipboard_number = None # 矩形選択モードで格納したクリップボードのシーケンス番号
 
+    syntax_timer_interval = 10 # 見えていない行のシンタックス情報を更新する間隔 (msec)
+
     def __init__( self, window, x, y, width, height, message_handler=None ):
 
         ckit_widget.Widget.__init__( self, window, x, y, width, height )
@@ -1115,7 +1756,7 @@ class TextWidget(ckit_widget.Widget):
         self.scroll_bottom_adjust = False
         self.show_lineno = True
         self.search_object = None
-        self.search_re_result = None
+        self.lazy_search_re_result = LazyReResult()
         self.mouse_click_info = None
         self.message_handler = message_handler
 
@@ -1123,6 +1764,8 @@ class TextWidget(ckit_widget.Widget):
 
         self.candidate_window = None
 
+        self.syntax_timer_running = False
+
         self.plane_lineno = None
         self.plane_scrollbar0 = None
         self.plane_scrollbar1 = None
@@ -1133,6 +1776,8 @@ class TextWidget(ckit_widget.Widget):
 
     def destroy(self):
 
+        self._stopSyntaxTimer()
+
         if self.candidate_window:
             self.candidate_window.destroy()
 
@@ -1448,41 +2093,10 @@ class TextWidget(ckit_widget.Widget):
         return self.point( line, index )
 
     def getText( self, left, right, block_mode=False ):
+        # 長さを求めてから1つの文字列に書き込み、矩形選択の桁数から位置への変換もネイティブで行う
+        return self.window.getLinesText( self.doc.lines, ( left.line, left.index ), ( right.line, right.index ), block_mode, self.doc.mode.tab_width, TextWidget.BLOCK_SELECTION_COLUMN_OFFSET )
 
-        if left.line==right.line:
-            line = self.doc.lines[ left.line ]
-            text = line.s[ left.index : right.index ]
-        else:
-            lines = []
-            if not block_mode:
-                line = self.doc.lines[ left.line ]
-                lines.append( line.s[ left.index : ] )
-                lines.append( line.end )
-                for i in range( left.line+1, right.line ):
-                    line = self.doc.lines[i]
-                    lines.append( line.s )
-                    lines.append( line.end )
-                line = self.doc.lines[ right.line ]
-                lines.append( line.s[ : right.index ] )
-            else:
-                column1 = self.getColumnFromIndex( left.line, left.index )
-                column2 = self.getColumnFromIndex( right.line, right.index )
-                rect_column_left = min(column1,column2)
-                rect_column_right = max(column1,column2)
-
-                for i in range( left.line, right.line+1 ):
-
-                    sel_left = self.getIndexFromColumn( i, rect_column_left, TextWidget.BLOCK_SELECTION_COLUMN_OFFSET )
-                    sel_right = self.getIndexFromColumn( i, rect_column_right, TextWidget.BLOCK_SELECTION_COLUMN_OFFSET )
-
-                    line = self.doc.lines[i]
-                    lines.append( line.s[ sel_left : sel_right ] )
-                    lines.append( line.end )
-                
-            text = "".join(lines)
-        return text
-
-    def modifyText( self, anchor=None, cursor=None, text="", text_block_mode=False, move_cursor=True, notify_modified=True, paint=True, modstep=1, append_undo=True, undo_select=False, ignore_readonly=False ):
+    def modifyText( self, anchor=None, cursor=None, text="", text_block_mode=False, move_cursor=True, notify_modified=True, paint=True, modstep=1, append_undo=True, undo_select=False, ignore_readonly=False, keep_lineend=False ):
 
         #print( "modifyText", anchor, cursor )
 
@@ -1512,19 +2126,22 @@ class TextWidget(ckit_widget.Widget):
         
         block_mode = self.selection.block_mode or text_block_mode
 
+        old_num_lines = len(self.doc.lines)
+
         if not block_mode:
 
             if append_undo:
-                undo_info = UndoInfo()
-                undo_info.old_text = self.getText(left,right)
-                undo_info.old_text_left = left.copy()
-                undo_info.old_text_right = right.copy()
+                old_text = self.getText(left,right)
                 if undo_select:
-                    undo_info.old_anchor = anchor.copy()
-                    undo_info.old_cursor = cursor.copy()
+                    old_anchor = anchor.copy()
                 else:
-                    undo_info.old_anchor = cursor.copy()
-                    undo_info.old_cursor = cursor.copy()
+                    old_anchor = cursor.copy()
+                old_cursor = cursor.copy()
+                # 選択範囲のない1文字の入力は、続けて入力した文字と1つのUndo単位にまとめる
+                coalesce = ( left==right and len(text)==1 and not undo_select )
+
+            # 変更する行の単語を、単語の一覧から取り除く
+            self.doc.removeWordIndexLines( left.line, right.line-left.line+1 )
 
             # 選択範囲の削除
             if left!=right:
@@ -1565,22 +2182,26 @@ class TextWidget(ckit_widget.Widget):
             # テキストの挿入
             if text:
 
+                # 改行で分割した行は、最後にまとめて行のリストに挿入する
+                line = self.doc.lines[ cursor.line ]
+                first_line = cursor.line
+                new_lines = []
+
                 insert_lines = text.splitlines(True)
                 for insert_line in insert_lines:
 
                     if insert_line.endswith("\r\n"):
-                        insert_return = True
+                        insert_return = "\r\n"
                         insert_line = insert_line[:-2]
                     elif insert_line.endswith("\n"):
-                        insert_return = True
+                        insert_return = "\n"
                         insert_line = insert_line[:-1]
                     elif insert_line.endswith("\r"):
-                        insert_return = True
+                        insert_return = "\r"
                         insert_line = insert_line[:-1]
                     else:
-                        insert_return = False
+                        insert_return = None
 
-                    line = self.doc.lines[ cursor.line ]
                     line.s = line.s[ : cursor.index ] + insert_line + line.s[ cursor.index : ]
                     cursor.index += len(insert_line)
 
@@ -1588,7 +2209,11 @@ class TextWidget(ckit_widget.Widget):
                         s1 = line.s[ : cursor.index ]
                         s2 = line.s[ cursor.index : ]
 
-                        lineend1 = self.doc.lineend
+                        # Undo/Redo では、記録した改行文字をそのまま使う
+                        if keep_lineend:
+                            lineend1 = insert_return
+                        else:
+                            lineend1 = self.doc.lineend
                         lineend2 = line.end
                         if s1.strip():
                             bg1 = line.bg
@@ -1604,12 +2229,17 @@ class TextWidget(ckit_widget.Widget):
                         line2 = Line( s2 + lineend2 )
                         line2.bg = bg2
                         if line.modified or cursor.index : line2.modified = True
-                        self.doc.lines.insert( cursor.line+1, line2 )
+                        new_lines.append(line2)
 
                         cursor.line += 1
                         cursor.index = 0
 
-                    line.modified = True
+                        line.modified = True
+                        line = line2
+                    else:
+                        line.modified = True
+
+                self.doc.lines[ first_line+1 : first_line+1 ] = new_lines
 
                 if anchor.line!=cursor.line and anchor.index==0:
                     self.doc.lines[cursor.line].bookmark = self.doc.lines[anchor.line].bookmark
@@ -1617,16 +2247,14 @@ class TextWidget(ckit_widget.Widget):
 
             # Undo情報の登録
             if append_undo:
-                undo_info.new_text = text
-                undo_info.new_text_left = anchor.copy()
-                undo_info.new_text_right = cursor.copy()
                 if undo_select:
-                    undo_info.new_anchor = anchor.copy()
-                    undo_info.new_cursor = cursor.copy()
+                    new_anchor = anchor
                 else:
-                    undo_info.new_anchor = cursor.copy()
-                    undo_info.new_cursor = cursor.copy()
-                self.appendUndo(undo_info)
+                    new_anchor = cursor
+                # 改行文字は文書の改行文字に変換されているので、挿入後のテキストを記録する
+                if anchor.line!=cursor.line:
+                    text = self.getText( anchor, cursor )
+                self.appendUndo( anchor, old_text, text, old_anchor, old_cursor, new_anchor, cursor, coalesce )
         
         else: # block_mode
         
@@ -1649,12 +2277,9 @@ class TextWidget(ckit_widget.Widget):
                 undo_right.line += num_modify_line
                 undo_right = min( undo_right, self.pointDocumentEnd() )
                 
-                undo_info = UndoInfo()
-                undo_info.old_text = self.getText(undo_left,undo_right)
-                undo_info.old_text_left = undo_left
-                undo_info.old_text_right = undo_right
-                undo_info.old_anchor = cursor.copy()
-                undo_info.old_cursor = cursor.copy()
+                old_text = self.getText(undo_left,undo_right)
+
+            self.doc.removeWordIndexLines( left.line, min( num_modify_line, len(self.doc.lines)-left.line ) )
 
             for i in range(num_modify_line):
                 
@@ -1695,45 +2320,166 @@ class TextWidget(ckit_widget.Widget):
                 undo_right.line += num_modify_line
                 undo_right = min( undo_right, self.pointDocumentEnd() )
 
-                undo_info.new_text = self.getText(undo_left,undo_right)
-                undo_info.new_text_left = undo_left
-                undo_info.new_text_right = undo_right
-                undo_info.new_anchor = cursor.copy()
-                undo_info.new_cursor = cursor.copy()
+                new_text = self.getText(undo_left,undo_right)
                 
-                self.appendUndo(undo_info)
+                self.appendUndo( undo_left, old_text, new_text, cursor, cursor, cursor, cursor )
+
 
+        if block_mode:
+            new_count = num_modify_line
+        else:
+            new_count = cursor.line - left.line + 1
+        old_count = new_count - ( len(self.doc.lines) - old_num_lines )
+        self._updateModifiedLines( left.line, old_count, new_count, modstep )
+
+        if move_cursor:
+            self.setCursor( cursor, paint=False )
+
+        if notify_modified:
+            self._notifyTextModified(left, right, cursor)
+
+        if paint:
+            self.paint()
+
+    ## 行の変更後に、変更カウント、検索結果のインデックス、シンタックスハイライトの状態を更新する
+    def _updateModifiedLines( self, line, old_count, new_count, modstep ):
 
         # 変更カウント
         if self.doc.modcount!=None:
             self.doc.modcount += modstep
             if self.doc.modcount==0:
-                for line in self.doc.lines:
-                    line.modified=False
+                for l in self.doc.lines:
+                    l.modified=False
 
-        if move_cursor:
-            self.setCursor( cursor, paint=False )
+        # 検索結果、単語、括弧のインデックスを更新
+        self.doc.updateSearchHitIndex( line, old_count, new_count )
+        self.doc.addWordIndexLines( line, new_count )
+        self.doc.updateBracketIndex( line, old_count, new_count )
 
         # シンタックスハイライトの再計算が必要
-        if left.line+1<len(self.doc.lines):
-            self.doc.lines[left.line+1].ctx = None
+        self.doc.lex_generation += 1
+        if line+1<len(self.doc.lines):
+            self.doc.lines[line+1].ctx = None
             if self.doc.lex_ctx_dirty_top==None:
-                self.doc.lex_ctx_dirty_top = left.line+1
+                self.doc.lex_ctx_dirty_top = line+1
             else:
-                self.doc.lex_ctx_dirty_top = min( self.doc.lex_ctx_dirty_top, left.line+1 )
+                self.doc.lex_ctx_dirty_top = min( self.doc.lex_ctx_dirty_top, line+1 )
 
-        self.doc.lines[left.line].tokens = None
+        if line<len(self.doc.lines):
+            self.doc.lines[line].tokens = None
         if self.doc.lex_token_dirty_top==None:
-            self.doc.lex_token_dirty_top = left.line
+            self.doc.lex_token_dirty_top = line
+        else:
+            self.doc.lex_token_dirty_top = min( self.doc.lex_token_dirty_top, line )
+
+    ## 複数の行の置き換えと削除を、1回の編集としてまとめて行う
+    #
+    #  @param self              -
+    #  @param edits             ( 行番号, 新しい行の文字列 ) のリスト
+    #  @param notify_modified   変更を通知するか
+    #  @param paint             再描画するか
+    #  @param ignore_readonly   読み取り専用の文書も変更するか
+    #  @return                  変更した範囲の ( 先頭, 変更前の終端, 変更後の終端 )。変更しなかった場合は None
+    #
+    #  edits は行番号の昇順に並べます。行の文字列には行末の改行を含めません。
+    #  文字列が None の場合は、その行を削除します。文字列が改行を含む場合は、複数の行に分割します。
+    #
+    #  modifyText() を行ごとに呼び出す場合と違って、行のリストの置き換え、Undo 情報の登録、変更の通知を
+    #  1回だけ行うので、文書全体の置換でも行数に比例する時間で処理できます。
+    #
+    def modifyLines( self, edits, notify_modified=True, paint=True, ignore_readonly=False ):
+
+        if self.doc.readonly and not ignore_readonly:
+            self.setMessage( ckit_resource.strings["readonly"], 1000, error=True )
+            return None
+
+        if not edits : return None
+
+        lines = self.doc.lines
+        first = edits[0][0]
+        last = edits[-1][0]
+
+        self.doc.removeWordIndexLines( first, last-first+1 )
+
+        # 変更前の範囲
+        old_lines = lines[ first : last+1 ]
+        old_text = "".join( [ line.s + line.end for line in old_lines ] )
+        if old_lines[-1].end:
+            old_right = self.point( last+1, 0 )
+        else:
+            old_right = self.point( last, len(old_lines[-1].s) )
+
+        new_lines = []
+        lineno = first
+        for edit_lineno, text in edits:
+
+            new_lines.extend( lines[ lineno : edit_lineno ] )
+            lineno = edit_lineno + 1
+
+            line = lines[edit_lineno]
+
+            if text==None:
+                # 文書の最後の行は削除できないので空にする
+                if edit_lineno < len(lines)-1 : continue
+                text = ""
+
+            line.s = text
+            line.tokens = None
+            line.modified = True
+            new_lines.append(line)
+
+            # 改行を含む場合は、行を分割する
+            if _line_break_re.search(text):
+                parts = _line_break_re.split(text)
+                lineend = line.end
+                bg = line.bg
+                line.s = parts[0]
+                line.end = self.doc.lineend
+                for i, part in enumerate( parts[1:], 2 ):
+                    if i<len(parts):
+                        line2 = Line( part + self.doc.lineend )
+                    else:
+                        line2 = Line( part + lineend )
+                    if part.strip() : line2.bg = bg
+                    line2.modified = True
+                    new_lines.append(line2)
+
+        for line in new_lines[1:]:
+            line.ctx = None
+
+        lines[ first : last+1 ] = new_lines
+
+        # 先頭の行を削除した場合は、後ろの行が first に詰まるので、first から開始コンテキストを求め直す
+        if first<len(lines) and lines[first] is not old_lines[0]:
+            lines[first].ctx = None
+            if self.doc.lex_ctx_dirty_top==None:
+                self.doc.lex_ctx_dirty_top = first
+            else:
+                self.doc.lex_ctx_dirty_top = min( self.doc.lex_ctx_dirty_top, first )
+
+        # 変更後の範囲
+        left = self.point( first, 0 )
+        if not new_lines:
+            new_right = left.copy()
+        elif new_lines[-1].end:
+            new_right = self.point( first+len(new_lines), 0 )
         else:
-            self.doc.lex_token_dirty_top = min( self.doc.lex_token_dirty_top, left.line )
+            new_right = self.point( first+len(new_lines)-1, len(new_lines[-1].s) )
+
+        # Undo情報の登録
+        new_text = "".join( [ line.s + line.end for line in new_lines ] )
+        self.appendUndo( left, old_text, new_text, left, old_right, left, new_right )
+
+        self._updateModifiedLines( first, len(old_lines), len(new_lines), 1 )
 
         if notify_modified:
-            self._notifyTextModified(left, right, cursor)
+            self._notifyTextModified( left, old_right, new_right )
 
         if paint:
             self.paint()
 
+        return ( left, old_right, new_right )
+
     def replaceLines( self, func ):
 
         left = self.selection.left()
@@ -1743,24 +2489,30 @@ class TextWidget(ckit_widget.Widget):
         if right.index>0:
             right = right.lineEnd().right()
 
-        self.atomicUndoBegin( True, left, right )
-        try:
-            point1 = left.copy()
-            while point1<right:
-
-                point2 = point1.lineEnd()
-                
-                old_text = self.getText(point1,point2)
-                new_text = func(old_text)
-                if new_text != old_text:
-                    self.modifyText( point1, point2, new_text, move_cursor=False, notify_modified=False, paint=False )
-            
-                point1.line += 1
-                
-        finally:
-            self.atomicUndoEnd( left, right )
+        if right.index>0:
+            end_line = right.line+1
+        else:
+            end_line = right.line
+
+        edits = []
+        lines = self.doc.lines
+        for lineno in range( left.line, end_line ):
+            old_text = lines[lineno].s
+            new_text = func(old_text)
+            if new_text != old_text:
+                edits.append( ( lineno, new_text ) )
+
+        old_right = right
+        if edits:
+            self.atomicUndoBegin( True, left, right )
+            try:
+                result = self.modifyLines( edits, notify_modified=False, paint=False )
+                if result:
+                    right = self._adjustLinesRight( right, result )
+            finally:
+                self.atomicUndoEnd( left, right )
 
-        self._notifyTextModified(left, right, right)
+        self._notifyTextModified(left, old_right, right)
 
         self.setSelection( left, right, block_mode=False )
         self.paint()
@@ -1778,80 +2530,102 @@ class TextWidget(ckit_widget.Widget):
         if right.index>0:
             right = right.lineEnd().right()
 
-        self.atomicUndoBegin( True, left, right )
-        try:
-            point1 = left.copy()
-            while point1<right:
-
-                line = self.doc.lines[point1.line]
-                info = LineInfo()
-                info.bookmark = line.bookmark
-                info.modified = line.modified
-
-                point2 = point1.lineEnd()
-                
-                text = self.getText(point1,point2)
-                if func( text, info ):
-                    point1 = point1.down()
-                else:
-                    self.modifyText( point1, point2.right(), "", move_cursor=False, notify_modified=False, paint=False )
-                    right = right.up()
-                
-        finally:
-            self.atomicUndoEnd( left, right )
+        if right.index>0:
+            end_line = right.line+1
+        else:
+            end_line = right.line
+
+        edits = []
+        lines = self.doc.lines
+        for lineno in range( left.line, end_line ):
+            line = lines[lineno]
+            info = LineInfo()
+            info.bookmark = line.bookmark
+            info.modified = line.modified
+            if not func( line.s, info ):
+                edits.append( ( lineno, None ) )
+
+        if edits:
+            self.atomicUndoBegin( True, left, right )
+            try:
+                result = self.modifyLines( edits, notify_modified=False, paint=False )
+                if result:
+                    right = self._adjustLinesRight( right, result )
+            finally:
+                self.atomicUndoEnd( left, right )
 
         self._notifyTextModified(left, old_right, right)
 
         self.setSelection( left, right, block_mode=False )
         self.paint()
 
-    def appendUndo( self, info ):
+    ## modifyLines() で変更した範囲より後ろの位置を、変更後の位置に変換する
+    def _adjustLinesRight( self, point, result ):
+        left, old_right, new_right = result
+        point = self.point( point.line + new_right.line - old_right.line, point.index )
+        return min( point, point.lineEnd() )
+
+    def appendUndo( self, left, old_text, new_text, old_anchor, old_cursor, new_anchor, new_cursor, coalesce=False ):
 
         # Redoリストをクリアするので、未変更状態に戻せない
         if self.doc.modcount!=None and self.doc.modcount<0:
             self.doc.modcount = None
 
-        self.doc.redo_list = []
+        # 未変更状態からの入力は、それより前の入力とまとめない
+        if self.doc.modcount==0:
+            coalesce = False
 
-        if self.doc.atomic_undo==None:
-            self.doc.undo_list.append(info)
-        else:
-            self.doc.atomic_undo.items.append(info)
+        dropped = self.doc.undo_journal.append(
+            ( left.line, left.index ),
+            old_text,
+            new_text,
+            ( old_anchor.line, old_anchor.index ),
+            ( old_cursor.line, old_cursor.index ),
+            ( new_anchor.line, new_anchor.index ),
+            ( new_cursor.line, new_cursor.index ),
+            coalesce )
+
+        # この編集の分を加えた変更カウントで判定する
+        if dropped:
+            self._checkUndoDropped(1)
+
+    def _checkUndoDropped( self, modstep=0 ):
+
+        # 古いUndo情報が捨てられたので、未変更状態に戻せない
+        if self.doc.modcount!=None and self.doc.modcount+modstep > self.doc.undo_journal.getUndoCount():
+            self.doc.modcount = None
     
     def atomicUndoBegin( self, undo_select=False, anchor=None, cursor=None ):
 
         if anchor==None : anchor = self.selection.anchor()
         if cursor==None : cursor = self.selection.cursor()
 
-        self.doc.atomic_undo = AtomicUndoInfo()
-        self.doc.atomic_undo.old_anchor = anchor.copy()
-        self.doc.atomic_undo.old_cursor = cursor.copy()
+        self.doc.undo_journal.beginGroup( ( anchor.line, anchor.index ), ( cursor.line, cursor.index ) )
 
     def atomicUndoEnd( self, anchor=None, cursor=None ):
 
         if anchor==None : anchor = self.selection.anchor()
         if cursor==None : cursor = self.selection.cursor()
 
-        self.doc.atomic_undo.new_anchor = anchor.copy()
-        self.doc.atomic_undo.new_cursor = cursor.copy()
-        self.doc.undo_list.append(self.doc.atomic_undo)
-        self.doc.atomic_undo = None
+        if self.doc.undo_journal.endGroup( ( anchor.line, anchor.index ), ( cursor.line, cursor.index ) ):
+            self._checkUndoDropped()
 
     def undo(self):
 
-        if len(self.doc.undo_list)==0 : return False
+        result = self.doc.undo_journal.undo()
+        if result==None : return False
 
-        info = self.doc.undo_list.pop()
-        self.doc.redo_list.append(info)
-        
-        if isinstance(info,UndoInfo):
-            self.modifyText( info.new_text_left, info.new_text_right, info.old_text, move_cursor=False, paint=False, modstep=-1, append_undo=False )
-        elif isinstance(info,AtomicUndoInfo):
-            for i, item in enumerate(reversed(info.items)):
-                self.modifyText( item.new_text_left, item.new_text_right, item.old_text, move_cursor=False, notify_modified=False, paint=False, modstep=-1, append_undo=False )
-            self._notifyTextModified( info.new_anchor, info.new_cursor, info.old_cursor )
+        old_anchor, old_cursor, new_anchor, new_cursor, atomic, edits = result
+
+        if not atomic:
+            for line1, index1, line2, index2, text, count in edits:
+                self.modifyText( self.point(line1,index1), self.point(line2,index2), text, move_cursor=False, paint=False, modstep=-count, append_undo=False, keep_lineend=True )
+        else:
+            for line1, index1, line2, index2, text, count in edits:
+                self.modifyText( self.point(line1,index1), self.point(line2,index2), text, move_cursor=False, notify_modified=False, paint=False, modstep=-count, append_undo=False, keep_lineend=True )
+            self._notifyTextModified( self.point(*new_anchor), self.point(*new_cursor), self.point(*old_cursor) )
 
-        self.setSelection( info.old_anchor, info.old_cursor, paint=False )
+        self.setSelection( self.point(*old_anchor), self.point(*old_cursor), paint=False )
 
         self.paint()
 
@@ -1859,19 +2633,20 @@ class TextWidget(ckit_widget.Widget):
 
     def redo(self):
 
-        if len(self.doc.redo_list)==0 : return False
+        result = self.doc.undo_journal.redo()
+        if result==None : return False
 
-        info = self.doc.redo_list.pop()
-        self.doc.undo_list.append(info)
+        old_anchor, old_cursor, new_anchor, new_cursor, atomic, edits = result
 
-        if isinstance(info,UndoInfo):
-            self.modifyText( info.old_text_left, info.old_text_right, info.new_text, move_cursor=False, paint=False, append_undo=False )
-        elif isinstance(info,AtomicUndoInfo):
-            for i, item in enumerate(info.items):
-                self.modifyText( item.old_text_left, item.old_text_right, item.new_text, move_cursor=False, notify_modified=False, paint=False, append_undo=False )
-            self._notifyTextModified( info.old_anchor, info.old_cursor, info.new_cursor )
+        if not atomic:
+            for line1, index1, line2, index2, text, count in edits:
+                self.modifyText( self.point(line1,index1), self.point(line2,index2), text, move_cursor=False, paint=False, modstep=count, append_undo=False, keep_lineend=True )
+        else:
+            for line1, index1, line2, index2, text, count in edits:
+                self.modifyText( self.point(line1,index1), self.point(line2,index2), text, move_cursor=False, notify_modified=False, paint=False, modstep=count, append_undo=False, keep_lineend=True )
+            self._notifyTextModified( self.point(*old_anchor), self.point(*old_cursor), self.point(*new_cursor) )
 
-        self.setSelection( info.new_anchor, info.new_cursor, paint=False )
+        self.setSelection( self.point(*new_anchor), self.point(*new_cursor), paint=False )
             
         self.paint()
 
@@ -1961,6 +2736,14 @@ class TextWidget(ckit_widget.Widget):
                 line.bg = 0
             self.doc.diff_mode = False
 
+    ## 現在の検索条件に一致する全ての範囲のインデックスを取得する
+    #
+    #  len() でヒットの数を、インデックスで ( 行番号, 開始位置, 終了位置 ) を取得できます。
+    #  検索条件が無い場合や、インデックスを作らない場合は None を返します。
+    #
+    def getSearchHitIndex(self):
+        return self.doc.getSearchHitIndex(self.search_object)
+
     def seek( self, direction, func, move_cursor=True ):
 
         cursor = self.selection.cursor()
@@ -1983,6 +2766,18 @@ class TextWidget(ckit_widget.Widget):
 
         return cursor
 
+    ## 最後の search() の正規表現のマッチの結果 ( re.Match )
+    #
+    #  置換などでグループを使うときに、最初に参照されたときに re でマッチしなおして求めます。
+    #
+    @property
+    def search_re_result(self):
+        return self.lazy_search_re_result.get()
+
+    @search_re_result.setter
+    def search_re_result( self, re_result ):
+        self.lazy_search_re_result = LazyReResult( re_result=re_result )
+
     def search( self, search_object=None, point=None, direction=1, oneline=False, move_cursor=True, select=True, hitmark=True, paint=True, message=True ):
     
         if search_object==None:
@@ -2002,63 +2797,68 @@ class TextWidget(ckit_widget.Widget):
             else:
                 point = self.selection.left()
 
-        def foundMessage():
+        def foundMessage( number=None ):
             if message:
-               self.setMessage( ckit_resource.strings["search_found"] % search_object, 1000 )
+                if number==None:
+                    self.setMessage( ckit_resource.strings["search_found"] % search_object, 1000 )
+                else:
+                    self.setMessage( ckit_resource.strings["search_found_count"] % ( search_object, number+1, len(hit_index) ), 1000 )
 
         def notFoundMessage():
             if message:
                 self.setMessage( ckit_resource.strings["search_not_found"] % search_object, 3000, error=True )
 
-        while True:
+        # ヒットマークを表示する検索条件は、検索結果のインデックスを使って前後のヒットに移動する
+        hit_index = None
+        if hitmark and not oneline:
+            hit_index = self.doc.getSearchHitIndex(search_object)
+
+        if hit_index!=None:
 
             if direction>0:
-                if point.line>=len(self.doc.lines):
-                    notFoundMessage()
-                    return None
+                number = hit_index.findNext( point.line, point.index )
             else:
-                if point.line<0:
-                    notFoundMessage()
-                    return None
+                number = hit_index.findPrev( point.line, point.index )
 
-            line = self.doc.lines[point.line].s
+            if number==None:
+                notFoundMessage()
+                return None
 
-            if direction>0:
-                result = search_object.search( line, point.index )
-                self.search_re_result = search_object.re_result
-            else:
+            result = hit_index[number]
 
-                def rsearch( end ):
-                    pos = 0
-                    last_found = None
-                    while pos<len(line):
-                        search_result = search_object.search( line, pos, end )
-                        if not search_result : break
-                        if last_found==None or last_found[0] < search_result[0] :
-                            self.search_re_result = search_object.re_result
-                            last_found = search_result
-                        pos = search_result[0] + 1
-                    return last_found
+            # 正規表現のマッチの結果は、ヒットの位置から re でマッチしなおして求める ( search_re_result が参照されるまで遅らせる )
+            search_object._matchReResult( self.doc.lines[result[0]].s, result[1:] )
+            self.lazy_search_re_result = search_object.lazy_re_result
 
-                result = rsearch( point.index )
+        elif search_object.multiline:
 
-            if result:
-                cursor = self.point( point.line, result[0] )
-                anchor = self.point( point.line, result[1] )
-                break
-                
-            if oneline:
+            number = None
+
+            result = self.searchMultiLine( search_object, point, direction )
+            self.lazy_search_re_result = search_object.lazy_re_result
+
+            if not result or ( oneline and result[0].line!=point.line ):
                 notFoundMessage()
                 return None
 
-            if direction>0:
-                point.line += 1
-                point.index = 0
-            else:
-                point.line -= 1
-                point.index = len(self.doc.lines[point.line].s)
+        else:
+
+            number = None
+
+            result = search_object.searchLines( self.doc.lines, point.line, point.index, direction, oneline )
+            self.lazy_search_re_result = search_object.lazy_re_result
+
+            if not result:
+                notFoundMessage()
+                return None
+
+        if search_object.multiline:
+            cursor, anchor = result
+        else:
+            cursor = self.point( result[0], result[1] )
+            anchor = self.point( result[0], result[2] )
 
-        foundMessage()
+        foundMessage(number)
 
         if move_cursor:
             if select:
@@ -2070,6 +2870,19 @@ class TextWidget(ckit_widget.Widget):
 
         return cursor.copy()
 
+    ## 行をまたいで検索する
+    #
+    #  point から direction の方向に検索し、見つかった範囲の ( 開始位置, 終了位置 ) を Point で返します。
+    #  見つからない場合は None を返します。
+    #
+    def searchMultiLine( self, search_object, point, direction=1 ):
+
+        result = search_object.searchMultiLine( self.doc.lines, point.line, point.index, direction )
+        if not result:
+            return None
+
+        return ( self.point( result[0], result[1] ), self.point( result[2], result[3] ) )
+
     def jumpLineNo( self, lineno ):
         lineno = max( lineno, 0 )
         lineno = min( lineno, len(self.doc.lines)-1 )
@@ -2196,6 +3009,41 @@ class TextWidget(ckit_widget.Widget):
         gray_select_bg = (TextWidget.color_select_bg[0]+TextWidget.color_select_bg[1]+TextWidget.color_select_bg[2])//3
         TextWidget.color_select_bg_inactive = ( gray_select_bg, gray_select_bg, gray_select_bg )
 
+    ## バックグラウンドのシンタックス分析の結果を受け取り、変化した行だけを再描画する
+    def _onSyntaxWorkerResult( self, job, result ):
+        changed_range = self.doc.applySyntaxResult( job, result )
+        if changed_range:
+            visible_bottom = self.visible_first_line + self.height
+            if changed_range[0] < visible_bottom and changed_range[1] > self.visible_first_line:
+                self.paint( line_range=changed_range )
+
+    ## シンタックス情報をバックグラウンドで少しずつ更新し、コンテキストが変化した行だけを再描画する
+    #
+    #  描画のあとにシンタックス情報が残っている場合に、タイマーから呼ばれます。
+    #  すべての行の更新が終わると、タイマーを止めます。
+    #
+    def updateSyntaxTimer(self):
+        changed_range = self.doc.updateSyntaxTimer()
+        if changed_range:
+            visible_bottom = self.visible_first_line + self.height
+            if changed_range[0] < visible_bottom and changed_range[1] > self.visible_first_line:
+                self.paint( line_range=changed_range )
+        if not self._isSyntaxTimerNeeded():
+            self._stopSyntaxTimer()
+
+    def _isSyntaxTimerNeeded(self):
+        return not isinstance( self.doc.lexer, TextLexer ) and self.doc.isSyntaxDirty()
+
+    def _startSyntaxTimer(self):
+        if not self.syntax_timer_running:
+            self.window.setTimer( self.updateSyntaxTimer, TextWidget.syntax_timer_interval )
+            self.syntax_timer_running = True
+
+    def _stopSyntaxTimer(self):
+        if self.syntax_timer_running:
+            self.window.killTimer( self.updateSyntaxTimer )
+            self.syntax_timer_running = False
+
     def paint( self, line_range=None, paint_cursor=True ):
 
         if not self.visible: return
@@ -2284,10 +3132,27 @@ class TextWidget(ckit_widget.Widget):
         visible_bottom = self.visible_first_line + self.height
         if isinstance( self.doc.lexer, TextLexer ):
             self.doc.fillSyntaxContextAndTokens( start=self.visible_first_line, stop=visible_bottom, ctx=rootContext(), tokens=TextLexer.tokens )
+        elif self.doc.requestSyntaxWorker( self.window, self.visible_first_line, visible_bottom, self._onSyntaxWorkerResult ):
+            # バックグラウンドで分析中は、コンテキストが確定している行だけトークンを分析する
+            # それ以外の行は、分析結果が届いたときに描画し直す
+            stop = min( visible_bottom, self.doc.lex_ctx_dirty_top )
+            if self.visible_first_line < stop:
+                self.doc.updateSyntaxTokens( start=self.visible_first_line, stop=stop )
         else:
-            self.doc.updateSyntaxContext( stop=visible_bottom )
+            changed_range = self.doc.updateSyntaxContext( stop=visible_bottom )
             self.doc.updateSyntaxTokens( start=self.visible_first_line, stop=visible_bottom )
 
+            # 一部の行だけを描画する場合も、コンテキストが変化した行は描画し直す
+            if line_range and changed_range:
+                line_range = ( min( line_range[0], changed_range[0] ), max( line_range[1], changed_range[1] ) )
+
+        # 見えていない行のシンタックス情報は、タイマーで少しずつ更新する
+        if self._isSyntaxTimerNeeded():
+            self._startSyntaxTimer()
+
+        # 検索のヒットマークは、検索結果のインデックスから行ごとに取得する
+        search_hit_index = self.doc.getSearchHitIndex(self.search_object)
+
         # テキストの描画
         x2 = x+lineno_width
         width2 = width-lineno_width
@@ -2352,7 +3217,9 @@ class TextWidget(ckit_widget.Widget):
                 if paint_cursor and active and line==cursor.line : line_cursor = 1
                 
                 search_hit = []
-                if self.search_object:
+                if search_hit_index!=None:
+                    search_hit = search_hit_index.getLineHits(line)
+                elif self.search_object and not self.search_object.multiline:
                     search_pos = 0
                     while True:
                         search_result = self.search_object.search( self.doc.lines[line].s, search_pos )
@@ -2443,39 +3310,43 @@ class TextWidget(ckit_widget.Widget):
 
                             pos = new_pos+1
 
-                def paintNormal( s, begin, end, tokens ):
-
-                    for t in range(len(tokens)):
+                def paintTokenRange( s, pos1, pos2, token_type ):
 
-                        pos1 = tokens[t][0]
-                        if t+1<len(tokens):
-                            pos2 = tokens[t+1][0]
-                        else:
-                            pos2 = end
-                        
-                        if pos2<=begin : continue
-                        if pos1>=end : break
+                    for h in range(len(search_hit)):
+                    
+                        if search_hit[h][1]<=pos1 : continue
+                        if search_hit[h][0]>=pos2 : break
                         
-                        pos1 = max( pos1, begin )
-                        pos2 = min( pos2, end )
+                        hit1 = max( search_hit[h][0], pos1 )
+                        hit2 = min( search_hit[h][1], pos2 )
 
-                        for h in range(len(search_hit)):
-                        
-                            if search_hit[h][1]<=pos1 : continue
-                            if search_hit[h][0]>=pos2 : break
+                        if pos1 < hit1:
+                            paintToken( s, pos1, hit1, attribute_table[ ( token_type, bg, line_cursor, False ) ], attribute_table[ ( Token_Space, bg, line_cursor, False ) ] )
+
+                        if hit1 < hit2:
+                            paintToken( s, hit1, hit2, attribute_table[ ( token_type, bg, line_cursor, True ) ], attribute_table[ ( Token_Space, bg, line_cursor, True ) ] )
                             
-                            hit1 = max( search_hit[h][0], pos1 )
-                            hit2 = min( search_hit[h][1], pos2 )
+                        pos1 = hit2
+                        
+                    paintToken( s, pos1, pos2, attribute_table[ ( token_type, bg, line_cursor, False ) ], attribute_table[ ( Token_Space, bg, line_cursor, False ) ] )
+
+                def paintNormal( s, begin, end, tokens ):
 
-                            if pos1 < hit1:
-                                paintToken( s, pos1, hit1, attribute_table[ ( tokens[t][1], bg, line_cursor, False ) ], attribute_table[ ( Token_Space, bg, line_cursor, False ) ] )
+                    # TokenArray を先頭から読み、次のトークンの位置を終端として描画する
+                    pos1 = None
+                    token_type = None
+                    for pos2, next_type in tokens:
 
-                            if hit1 < hit2:
-                                paintToken( s, hit1, hit2, attribute_table[ ( tokens[t][1], bg, line_cursor, True ) ], attribute_table[ ( Token_Space, bg, line_cursor, True ) ] )
-                                
-                            pos1 = hit2
-                            
-                        paintToken( s, pos1, pos2, attribute_table[ ( tokens[t][1], bg, line_cursor, False ) ], attribute_table[ ( Token_Space, bg, line_cursor, False ) ] )
+                        if pos1!=None:
+                            if pos1>=end : return
+                            if pos2>begin:
+                                paintTokenRange( s, max( pos1, begin ), min( pos2, end ), token_type )
+
+                        pos1 = pos2
+                        token_type = next_type
+
+                    if pos1!=None and pos1<end and begin<end:
+                        paintTokenRange( s, max( pos1, begin ), end, token_type )
 
                 def paintSelected( s, begin, end ):
 
@@ -2533,11 +3404,9 @@ class TextWidget(ckit_widget.Widget):
 
                 tokens = self.doc.lines[line].tokens
 
+                # バックグラウンドで分析中の行は、分析結果が届くまでテキストとして描画する
                 if tokens==None:
-                    print( "no syntax info", line )
-                    continue
-
-                tokens = Token.unpack(tokens)
+                    tokens = Token.stock_SimpleTextLine
 
                 # 完全に選択範囲外の行
                 if self.selection.direction==0 or line < selection_left.line or line > selection_right.line:
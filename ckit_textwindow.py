@@ -145,6 +145,9 @@ class TextWindow( ckitcore.Window ):
     def getStringColumns( self, *args ):
         return self.__text.getStringColumns( *args )
 
+    def getLinesText( self, *args ):
+        return self.__text.getLinesText( *args )
+
     def getClientRect(self):
         return (0,0) + self.getClientSize()
 
@@ -1,6 +1,7 @@
 ﻿import time
 import _thread
 import threading
+import functools
 import traceback
 
 from ckit import ckitcore
@@ -109,7 +110,9 @@ class JobItem:
 
     ## ジョブのキャンセルを要求する
     def cancel(self):
-        self.cancel_requested = True
+        with _job_cond:
+            self.cancel_requested = True
+            _job_cond.notify_all()
 
     ## ジョブのキャンセルが要求されているかをチェックする
     #
@@ -120,11 +123,14 @@ class JobItem:
 
     ## ジョブの一時停止を要求する
     def pause(self):
-        self.pause_requested = True
+        with _job_cond:
+            self.pause_requested = True
 
     ## ジョブの再開を要求する
     def restart(self):
-        self.pause_requested = False
+        with _job_cond:
+            self.pause_requested = False
+            _job_cond.notify_all()
 
     ## ジョブの一時停止が要求されているかをチェックする
     #
@@ -137,18 +143,25 @@ class JobItem:
     #
     #  @return True:一時停止が発生した  False:一時停止しなかった
     #
+    #  再開かキャンセルが要求されるまで、スリープせずに待機します。
+    #
     def waitPaused(self):
         if self.pause_requested:
             print( 'Suspended …\n' )
-            while self.pause_requested and not self.cancel_requested:
+            with _job_cond:
                 self.pause_waiting = True
-                time.sleep(0.1)
-            self.pause_waiting = False
+                _job_cond.notify_all()
+                while self.pause_requested and not self.cancel_requested:
+                    _job_cond.wait()
+                self.pause_waiting = False
             print( '… Resumed' )
             return True
         return False    
 
 
+# JobItem と JobQueue の状態の変化を待つための条件変数
+_job_cond = threading.Condition()
+
 _job_queue_list = []
 _job_queue = None
 
@@ -156,9 +169,17 @@ _job_queue = None
 #
 #  ジョブのアイテムを順番に処理する機能を持つクラスです。
 #
+#  サブスレッド処理は、ckitcore のスレッドプールで実行されます。
+#  キューごとにスレッドを持たないので、たくさんのキューを作っても、スレッドは増えません。
+#  １つのキューの中のアイテムは、これまでどおり登録された順に１つずつ処理されます。
+#
+#  window を指定した場合は、サブスレッド処理の終了が window のメッセージキューに通知され、
+#  finished_func の呼び出しと次のアイテムの開始が自動的に行われます。
+#  window を指定しない場合は、これまでどおり check() を定期的に呼び出す必要があります。
+#
 #  @sa JobItem
 #
-class JobQueue(threading.Thread):
+class JobQueue:
 
     ## すべてのJobQueueに関してcheck()を呼び出す
     #
@@ -183,10 +204,12 @@ class JobQueue(threading.Thread):
 
     ## デフォルトキューを作成する
     #
+    #  @param window    ジョブの終了を通知するウインドウ
+    #
     @staticmethod
-    def createDefaultQueue():
+    def createDefaultQueue( window=None ):
         global _job_queue
-        _job_queue = JobQueue()
+        _job_queue = JobQueue(window)
 
     ## デフォルトキューを取得する
     #
@@ -196,43 +219,46 @@ class JobQueue(threading.Thread):
         return _job_queue
 
     ## コンストラクタ
-    def __init__(self):
-        threading.Thread.__init__(self)
-        self.sema = threading.Semaphore(0)
+    #  @param self      -
+    #  @param window    ジョブの終了を通知するウインドウ ( None の場合は check() を定期的に呼び出す必要がある )
+    #  @param priority  スレッドプールでの優先度 ( 大きいほど先に実行される )
+    def __init__( self, window=None, priority=0 ):
+        self.window = window
+        self.priority = priority
         self.items = []
         self.cancel_requested = False
         self.pause_requested = False
         self.pause_waiting = False
         _job_queue_list.append(self)
-        self.start()
 
     ## キューを破棄する
     def destroy(self):
         _job_queue_list.remove(self)
 
-    def run(self):
+    # スレッドプールのワーカーの中で呼ばれる
+    def _run( self, item ):
 
         ckitcore.setBlockDetector()
 
-        while True:
-
-            self.sema.acquire()
+        try:
+            if item.subthread_func : item.subthread_func( item )
+        except:
+            traceback.print_exc()
 
-            if self.cancel_requested : break
+        with _job_cond:
+            item.status = JOB_STATUS_FINISHED
+            _job_cond.notify_all()
 
-            while self.pause_requested and not self.cancel_requested:
-                self.pause_waiting = True
-                time.sleep(0.1)
-            self.pause_waiting = False
-     
-            item = self.items[0]
+        self._notify()
 
+    # window に check() の呼び出しを依頼する
+    def _notify(self):
+        if self.window:
             try:
-                if item.subthread_func : item.subthread_func( item )
-            except:
-                traceback.print_exc()
-
-            item.status = JOB_STATUS_FINISHED
+                self.window.postCall( self.check )
+            except ValueError:
+                # ウインドウが破棄された
+                pass
 
     ## キューにジョブを投入する
     #
@@ -241,42 +267,52 @@ class JobQueue(threading.Thread):
     #
     def enqueue( self, item ):
         self.items.append(item)
+        self._notify()
 
     ## キューの状態をチェックし必要な処理を実行する
     #
+    #  終了したアイテムの finished_func を呼び出し、次のアイテムをスレッドプールで開始します。
+    #  window を指定した場合は、自動的に呼び出されます。
+    #
     def check(self):
 
         while True:
 
-            if len(self.items)==0 : return
+            with _job_cond:
 
-            item = self.items[0]
+                if len(self.items)==0 : return
 
-            if item.status == JOB_STATUS_WAITING:
+                item = self.items[0]
 
-                if item.isCanceled():
-                    item.status = JOB_STATUS_FINISHED
-                else:
-                    item.status = JOB_STATUS_RUNNING
-                    self.sema.release()
+                if item.status == JOB_STATUS_WAITING:
+
+                    if item.isCanceled():
+                        item.status = JOB_STATUS_FINISHED
+                    elif self.pause_requested or self.cancel_requested:
+                        # 一時停止中は次のアイテムを開始しない
+                        self.pause_waiting = self.pause_requested
+                        _job_cond.notify_all()
+                        return
+                    else:
+                        item.status = JOB_STATUS_RUNNING
+                        ckitcore.submitTask( functools.partial( self._run, item ), self.priority )
+                        return
+
+                elif item.status == JOB_STATUS_RUNNING:
                     return
 
-            elif item.status == JOB_STATUS_RUNNING:
-                return
+                else:
+                    assert( item.status == JOB_STATUS_FINISHED )
 
-            elif item.status == JOB_STATUS_FINISHED:
-                for finished_func in item.finished_func_list:
-                    if finished_func:
-                        try:
-                            finished_func( item )
-                        except:
-                            traceback.print_exc()
-    
-                if len(self.items):
-                    del self.items[0]
+            for finished_func in item.finished_func_list:
+                if finished_func:
+                    try:
+                        finished_func( item )
+                    except:
+                        traceback.print_exc()
 
-            else:
-                assert(0)
+            if len(self.items):
+                del self.items[0]
 
     ## キューに登録されているジョブの数を調査する
     def numItems(self):
@@ -291,34 +327,48 @@ class JobQueue(threading.Thread):
     def join(self):
 
         while True:
-            if len(self.items)==0 : break
+
             self.check()
-            time.sleep(0.1)
 
-        self.cancel_requested = True
-        self.sema.release()
+            with _job_cond:
+                if len(self.items)==0 : break
+                # 一時停止中でなければ、実行中のアイテムの終了で起こされる
+                _job_cond.wait(0.1)
 
-        threading.Thread.join(self)
+        self.cancel_requested = True
 
     ## キューの処理を一時停止する
+    #
+    #  実行中のアイテムが一時停止するか、終了するまで待ちます。
+    #
     def pause(self):
 
-        self.pause_requested = True
-        for item in self.items:
-            item.pause()
-            
-        while True:
-            if len(self.items)==0 : break
-            if self.cancel_requested: break
-            if self.pause_waiting: break
-            if self.items[0].pause_waiting: break
-            time.sleep(0.1)
+        with _job_cond:
+
+            self.pause_requested = True
+            for item in self.items:
+                item.pause()
+
+            while True:
+                if len(self.items)==0 : break
+                if self.cancel_requested: break
+                if self.items[0].status != JOB_STATUS_RUNNING: break
+                if self.items[0].pause_waiting: break
+                _job_cond.wait()
+
+            self.pause_waiting = ( len(self.items)>0 and self.items[0].status == JOB_STATUS_WAITING )
     
     ## 一時停止されたキューの処理を再開する
     def restart(self):
-        self.pause_requested = False
-        for item in self.items:
-            item.restart()
+
+        with _job_cond:
+            self.pause_requested = False
+            self.pause_waiting = False
+            for item in self.items:
+                item.restart()
+            _job_cond.notify_all()
+
+        self._notify()
 
 
 #-------------------------------------------------------------------------
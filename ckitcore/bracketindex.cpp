@@ -0,0 +1,474 @@
+﻿#include <algorithm>
+#include <iterator>
+
+#include "bracketindex.h"
+
+using namespace ckit;
+
+//-----------------------------------------------------------------------------
+
+static const size_t NOT_FOUND = (size_t)-1;
+
+BracketIndex::BracketIndex( const std::vector<Pair> & _pairs )
+	:
+	pairs(_pairs)
+{
+	Clear();
+}
+
+void BracketIndex::Clear()
+{
+	leaves.clear();
+	_rebuildTree();
+}
+
+void BracketIndex::Leaf::AppendLines( const std::vector<unsigned int> & src_ends, const std::vector<Bracket> & src_brackets, size_t begin, size_t end )
+{
+	if( begin>=end ) return;
+
+	unsigned int src_begin = begin>0 ? src_ends[begin-1] : 0;
+	unsigned int base = (unsigned int)brackets.size();
+
+	brackets.insert( brackets.end(), src_brackets.begin()+src_begin, src_brackets.begin()+src_ends[end-1] );
+
+	for( size_t i=begin ; i<end ; ++i )
+	{
+		ends.push_back( base + src_ends[i] - src_begin );
+	}
+}
+
+template<typename CHAR>
+static void _scanLine( const CHAR * text, size_t len, const std::vector<BracketIndex::Pair> & pairs, const BracketIndex::Range * ignore, size_t num_ignore, std::vector<BracketIndex::Bracket> * brackets )
+{
+	size_t ignore_pos = 0;
+
+	for( size_t i=0 ; i<len ; ++i )
+	{
+		unsigned int c = text[i];
+
+		// 括弧として扱わない範囲
+		while( ignore_pos<num_ignore && ignore[ignore_pos].end<=i ) ++ignore_pos;
+		if( ignore_pos<num_ignore && ignore[ignore_pos].start<=i )
+		{
+			i = ignore[ignore_pos].end - 1;
+			continue;
+		}
+
+		for( size_t p=0 ; p<pairs.size() ; ++p )
+		{
+			if( c==pairs[p].open || c==pairs[p].close )
+			{
+				BracketIndex::Bracket bracket;
+				bracket.index = (unsigned int)i;
+				bracket.pair = (unsigned short)p;
+				bracket.open = ( c==pairs[p].open );
+				brackets->push_back(bracket);
+				break;
+			}
+		}
+	}
+}
+
+void BracketIndex::ScanLine( const TextSearch::LineText & text, const Range * ignore, size_t num_ignore, std::vector<Bracket> * brackets ) const
+{
+	switch( text.char_size )
+	{
+	case 1:
+		_scanLine( (const unsigned char*)text.data, text.len, pairs, ignore, num_ignore, brackets );
+		break;
+	case 2:
+		_scanLine( (const unsigned short*)text.data, text.len, pairs, ignore, num_ignore, brackets );
+		break;
+	default:
+		_scanLine( (const unsigned int*)text.data, text.len, pairs, ignore, num_ignore, brackets );
+		break;
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+// line を含む葉の番号と、その葉の先頭の行を得る
+size_t BracketIndex::_findLeaf( size_t line, size_t * leaf_first_line ) const
+{
+	size_t node = 1;
+	size_t first = 0;
+
+	while( node<cap )
+	{
+		if( line < first + tree_lines[node*2] )
+		{
+			node = node*2;
+		}
+		else
+		{
+			first += tree_lines[node*2];
+			node = node*2+1;
+		}
+	}
+
+	*leaf_first_line = first;
+	return node - cap;
+}
+
+size_t BracketIndex::_leafFirstLine( size_t leaf ) const
+{
+	size_t first = 0;
+
+	for( size_t node=cap+leaf ; node>1 ; node>>=1 )
+	{
+		if( node & 1 ) first += tree_lines[node-1];
+	}
+
+	return first;
+}
+
+void BracketIndex::_setLeafNode( size_t leaf )
+{
+	size_t node = cap + leaf;
+
+	for( size_t p=0 ; p<pairs.size() ; ++p )
+	{
+		Summary & sum = _sum(node,(int)p);
+		sum.total = 0;
+		sum.min_prefix = 0;
+	}
+
+	if( leaf>=leaves.size() )
+	{
+		tree_lines[node] = 0;
+		return;
+	}
+
+	const Leaf & l = leaves[leaf];
+	tree_lines[node] = l.NumLines();
+
+	for( size_t i=0 ; i<l.brackets.size() ; ++i )
+	{
+		Summary & sum = _sum(node,l.brackets[i].pair);
+		sum.total += l.brackets[i].open ? 1 : -1;
+		sum.min_prefix = std::min( sum.min_prefix, sum.total );
+	}
+}
+
+void BracketIndex::_pullNode( size_t node )
+{
+	tree_lines[node] = tree_lines[node*2] + tree_lines[node*2+1];
+
+	for( size_t p=0 ; p<pairs.size() ; ++p )
+	{
+		const Summary & left = _sum(node*2,(int)p);
+		const Summary & right = _sum(node*2+1,(int)p);
+		Summary & sum = _sum(node,(int)p);
+		sum.total = left.total + right.total;
+		sum.min_prefix = std::min( left.min_prefix, left.total + right.min_prefix );
+	}
+}
+
+void BracketIndex::_rebuildTree()
+{
+	cap = 1;
+	while( cap<leaves.size() ) cap *= 2;
+
+	tree_lines.assign( cap*2, 0 );
+	tree_sums.resize( cap*2*pairs.size() );
+
+	for( size_t i=0 ; i<cap ; ++i )
+	{
+		_setLeafNode(i);
+	}
+
+	for( size_t node=cap-1 ; node>=1 ; --node )
+	{
+		_pullNode(node);
+	}
+}
+
+void BracketIndex::_updateLeaf( size_t leaf )
+{
+	_setLeafNode(leaf);
+
+	for( size_t node=(cap+leaf)>>1 ; node>=1 ; node>>=1 )
+	{
+		_pullNode(node);
+	}
+}
+
+void BracketIndex::ReplaceLines( size_t line, size_t old_count, const std::vector<unsigned int> & line_ends, const std::vector<Bracket> & brackets )
+{
+	// 変更する行を含む葉 [first_leaf,end_leaf) の行を1つにまとめて、新しい行で置き換える
+	size_t first_leaf = 0;
+	size_t end_leaf = 0;
+	Leaf merged;
+
+	if( !leaves.empty() )
+	{
+		size_t first_leaf_line;
+		if( line<GetNumLines() )
+		{
+			first_leaf = _findLeaf( line, &first_leaf_line );
+		}
+		else
+		{
+			first_leaf = leaves.size()-1;
+			first_leaf_line = _leafFirstLine(first_leaf);
+		}
+
+		size_t last_leaf = first_leaf;
+		size_t last_leaf_line = first_leaf_line;
+		if( old_count>0 )
+		{
+			last_leaf = _findLeaf( line+old_count-1, &last_leaf_line );
+		}
+		end_leaf = last_leaf + 1;
+
+		const Leaf & first = leaves[first_leaf];
+		const Leaf & last = leaves[last_leaf];
+		merged.AppendLines( first.ends, first.brackets, 0, line-first_leaf_line );
+		merged.AppendLines( line_ends, brackets, 0, line_ends.size() );
+		merged.AppendLines( last.ends, last.brackets, line+old_count-last_leaf_line, last.NumLines() );
+	}
+	else
+	{
+		merged.AppendLines( line_ends, brackets, 0, line_ends.size() );
+	}
+
+	// 行の少ない葉が増えないように、隣の葉とまとめる
+	if( merged.NumLines()<LEAF_MIN_LINES )
+	{
+		if( end_leaf<leaves.size() )
+		{
+			const Leaf & next = leaves[end_leaf];
+			merged.AppendLines( next.ends, next.brackets, 0, next.NumLines() );
+			end_leaf++;
+		}
+		else if( first_leaf>0 )
+		{
+			first_leaf--;
+			Leaf prev;
+			prev.AppendLines( leaves[first_leaf].ends, leaves[first_leaf].brackets, 0, leaves[first_leaf].NumLines() );
+			prev.AppendLines( merged.ends, merged.brackets, 0, merged.NumLines() );
+			merged.ends.swap(prev.ends);
+			merged.brackets.swap(prev.brackets);
+		}
+	}
+
+	// LEAF_MAX_LINES 行以下になるように分ける
+	std::vector<Leaf> new_leaves;
+	size_t num_lines = merged.NumLines();
+	if( num_lines>0 )
+	{
+		size_t num_leaves = num_lines<=LEAF_MAX_LINES ? 1 : num_lines/LEAF_LINES;
+		new_leaves.resize(num_leaves);
+		for( size_t i=0 ; i<num_leaves ; ++i )
+		{
+			new_leaves[i].AppendLines( merged.ends, merged.brackets, num_lines*i/num_leaves, num_lines*(i+1)/num_leaves );
+		}
+	}
+
+	if( new_leaves.size()==end_leaf-first_leaf )
+	{
+		for( size_t i=0 ; i<new_leaves.size() ; ++i )
+		{
+			leaves[first_leaf+i].ends.swap(new_leaves[i].ends);
+			leaves[first_leaf+i].brackets.swap(new_leaves[i].brackets);
+			_updateLeaf(first_leaf+i);
+		}
+	}
+	else
+	{
+		leaves.erase( leaves.begin()+first_leaf, leaves.begin()+end_leaf );
+		leaves.insert( leaves.begin()+first_leaf, std::make_move_iterator(new_leaves.begin()), std::make_move_iterator(new_leaves.end()) );
+		_rebuildTree();
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+// 葉 leaf 以降で、開き括弧の深さ depth が 0 になる最初の葉を探す
+// 見つかった場合は、その葉の直前での深さを depth に返す
+size_t BracketIndex::_findForward( size_t leaf, int pair, int * depth ) const
+{
+	if( leaf>=leaves.size() ) return NOT_FOUND;
+
+	int d = *depth;
+	size_t node = cap + leaf;
+
+	do
+	{
+		// node から始まる最も大きい部分木に移動する
+		while( (node & 1)==0 ) node >>= 1;
+
+		if( d + _sum(node,pair).min_prefix <= 0 )
+		{
+			// この部分木の中にあるので、左から順に降りる
+			while( node<cap )
+			{
+				node = node*2;
+				const Summary & sum = _sum(node,pair);
+				if( d + sum.min_prefix > 0 )
+				{
+					d += sum.total;
+					node++;
+				}
+			}
+
+			*depth = d;
+			return node - cap;
+		}
+
+		d += _sum(node,pair).total;
+		node++;
+
+	} while( (node & (~node+1)) != node );
+
+	return NOT_FOUND;
+}
+
+// 葉 leaf より前で、閉じ括弧の深さ depth が 0 になる最後の葉を探す
+// 見つかった場合は、その葉の直後での深さを depth に返す
+size_t BracketIndex::_findBackward( size_t leaf, int pair, int * depth ) const
+{
+	if( leaf==0 ) return NOT_FOUND;
+
+	int d = *depth;
+	size_t node = cap + leaf;
+
+	do
+	{
+		// node の直前で終わる最も大きい部分木に移動する
+		node--;
+		while( node>1 && (node & 1) ) node >>= 1;
+
+		// 末尾からの累積の最大値が d 以上なら、その部分木の中にある
+		const Summary & sum = _sum(node,pair);
+		if( d - ( sum.total - sum.min_prefix ) <= 0 )
+		{
+			// 右から順に降りる
+			while( node<cap )
+			{
+				node = node*2+1;
+				const Summary & sum2 = _sum(node,pair);
+				if( d - ( sum2.total - sum2.min_prefix ) > 0 )
+				{
+					d -= sum2.total;
+					node--;
+				}
+			}
+
+			*depth = d;
+			return node - cap;
+		}
+
+		d -= sum.total;
+
+	} while( (node & (~node+1)) != node );
+
+	return NOT_FOUND;
+}
+
+bool BracketIndex::FindPair( size_t line, size_t index, size_t * match_line, size_t * match_index ) const
+{
+	if( line>=GetNumLines() ) return false;
+
+	size_t leaf_first_line;
+	size_t leaf = _findLeaf( line, &leaf_first_line );
+
+	// ( line, index ) の括弧
+	const Leaf * l = &leaves[leaf];
+	size_t local_line = line - leaf_first_line;
+	std::vector<Bracket>::const_iterator line_begin = l->brackets.begin() + ( local_line>0 ? l->ends[local_line-1] : 0 );
+	std::vector<Bracket>::const_iterator line_end = l->brackets.begin() + l->ends[local_line];
+	std::vector<Bracket>::const_iterator it = std::lower_bound( line_begin, line_end, index, []( const Bracket & bracket, size_t index ){ return bracket.index < index; } );
+	if( it==line_end || it->index!=index ) return false;
+
+	int pair = it->pair;
+	int depth = 1;
+	size_t found;
+
+	if( it->open )
+	{
+		// 同じ葉の後ろの括弧
+		for( found=(it-l->brackets.begin())+1 ; found<l->brackets.size() ; ++found )
+		{
+			const Bracket & bracket = l->brackets[found];
+			if( bracket.pair!=pair ) continue;
+			depth += bracket.open ? 1 : -1;
+			if( depth==0 ) break;
+		}
+
+		// 後ろの葉
+		if( depth>0 )
+		{
+			leaf = _findForward( leaf+1, pair, &depth );
+			if( leaf==NOT_FOUND ) return false;
+
+			l = &leaves[leaf];
+			leaf_first_line = _leafFirstLine(leaf);
+
+			for( found=0 ; found<l->brackets.size() ; ++found )
+			{
+				const Bracket & bracket = l->brackets[found];
+				if( bracket.pair!=pair ) continue;
+				depth += bracket.open ? 1 : -1;
+				if( depth==0 ) break;
+			}
+		}
+	}
+	else
+	{
+		// 同じ葉の前の括弧
+		for( found=(it-l->brackets.begin()) ; found>0 ; --found )
+		{
+			const Bracket & bracket = l->brackets[found-1];
+			if( bracket.pair!=pair ) continue;
+			depth += bracket.open ? -1 : 1;
+			if( depth==0 ) break;
+		}
+
+		// 前の葉
+		if( depth>0 )
+		{
+			leaf = _findBackward( leaf, pair, &depth );
+			if( leaf==NOT_FOUND ) return false;
+
+			l = &leaves[leaf];
+			leaf_first_line = _leafFirstLine(leaf);
+
+			for( found=l->brackets.size() ; found>0 ; --found )
+			{
+				const Bracket & bracket = l->brackets[found-1];
+				if( bracket.pair!=pair ) continue;
+				depth += bracket.open ? -1 : 1;
+				if( depth==0 ) break;
+			}
+		}
+
+		found--;
+	}
+
+	if( depth!=0 ) return false;
+
+	// 括弧の番号から行を求める
+	local_line = std::upper_bound( l->ends.begin(), l->ends.end(), (unsigned int)found ) - l->ends.begin();
+
+	*match_line = leaf_first_line + local_line;
+	*match_index = l->brackets[found].index;
+	return true;
+}
+
+size_t BracketIndex::GetMemorySize() const
+{
+	size_t size = sizeof(*this);
+
+	size += leaves.capacity() * sizeof(Leaf);
+	for( size_t i=0 ; i<leaves.size() ; ++i )
+	{
+		size += leaves[i].ends.capacity() * sizeof(unsigned int);
+		size += leaves[i].brackets.capacity() * sizeof(Bracket);
+	}
+
+	size += tree_lines.capacity() * sizeof(size_t);
+	size += tree_sums.capacity() * sizeof(Summary);
+
+	return size;
+}
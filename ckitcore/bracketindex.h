@@ -0,0 +1,115 @@
+﻿#ifndef _BRACKETINDEX_H_
+#define _BRACKETINDEX_H_
+
+#include <stddef.h>
+#include <vector>
+
+#include "textsearch.h"
+
+namespace ckit
+{
+	// 対応する括弧を探すためのインデックス
+	//
+	// 文書の全ての行の括弧を、連続する最大 LEAF_MAX_LINES 行ずつの葉にまとめて保持する。
+	// 各葉は括弧の種類ごとに、開き括弧を +1、閉じ括弧を -1 とした合計と、先頭からの累積の最小値を持ち、
+	// 葉の列の上のセグメント木で、任意の範囲の合計と累積の最小値を O(log n) で求められるようにする。
+	//
+	// 対応する括弧は、括弧のある葉の中を調べた後、セグメント木を降りて深さが 0 になる葉を探し、
+	// その葉の中を調べて求める。括弧の間の距離に関係なく、O(log n + 葉の中の括弧の数) で見つかる。
+	//
+	// 行の変更は ReplaceLines で反映する。変更した範囲を含む葉だけを作り直す。
+	class BracketIndex
+	{
+	public:
+		// 括弧の種類 (開き括弧と閉じ括弧の文字)
+		struct Pair
+		{
+			unsigned int open;
+			unsigned int close;
+		};
+
+		// 行の中の括弧
+		struct Bracket
+		{
+			unsigned int index;		// 行の中の位置
+			unsigned short pair;	// 括弧の種類の番号
+			unsigned short open;	// 開き括弧かどうか
+		};
+
+		// 括弧の判定から除外する範囲 [start,end)
+		struct Range
+		{
+			size_t start;
+			size_t end;
+		};
+
+		BracketIndex( const std::vector<Pair> & pairs );
+
+		void Clear();
+
+		size_t GetNumLines() const { return tree_lines.empty() ? 0 : tree_lines[1]; }
+
+		// text の括弧を行の中の位置の順に brackets に追加する
+		// ignore[0,num_ignore) は括弧として扱わない範囲 (文字列やコメント) で、位置の順に並んでいる必要がある
+		void ScanLine( const TextSearch::LineText & text, const Range * ignore, size_t num_ignore, std::vector<Bracket> * brackets ) const;
+
+		// 行 [line,line+old_count) を、新しい行に置き換える
+		// 新しい行の括弧は brackets に行の順に並べ、各行の括弧の終端 (brackets の中の位置) を line_ends に入れる
+		void ReplaceLines( size_t line, size_t old_count, const std::vector<unsigned int> & line_ends, const std::vector<Bracket> & brackets );
+
+		// ( line, index ) の括弧に対応する括弧の位置を探す
+		// ( line, index ) が括弧でない場合や、対応する括弧が無い場合は false を返す
+		bool FindPair( size_t line, size_t index, size_t * match_line, size_t * match_index ) const;
+
+		size_t GetMemorySize() const;
+
+	private:
+		enum
+		{
+			LEAF_LINES = 64,		// 作り直す葉の目安の行数
+			LEAF_MAX_LINES = 128,	// これより多い行は、複数の葉に分ける
+			LEAF_MIN_LINES = 16,	// これより少ない行は、隣の葉とまとめる
+		};
+
+		// 連続する行の括弧
+		struct Leaf
+		{
+			std::vector<unsigned int> ends;		// 各行の括弧の終端 (brackets の中の位置)
+			std::vector<Bracket> brackets;
+
+			size_t NumLines() const { return ends.size(); }
+			void AppendLines( const std::vector<unsigned int> & src_ends, const std::vector<Bracket> & src_brackets, size_t begin, size_t end );
+		};
+
+		// 括弧の列の、開き括弧を +1、閉じ括弧を -1 とした合計と、先頭からの累積の最小値 (空の累積 0 を含む)
+		// 末尾からの累積の最大値は total - min_prefix になる
+		struct Summary
+		{
+			int total;
+			int min_prefix;
+		};
+
+		const Summary & _sum( size_t node, int pair ) const { return tree_sums[ node * pairs.size() + pair ]; }
+		Summary & _sum( size_t node, int pair ) { return tree_sums[ node * pairs.size() + pair ]; }
+
+		size_t _findLeaf( size_t line, size_t * leaf_first_line ) const;
+		size_t _leafFirstLine( size_t leaf ) const;
+		void _setLeafNode( size_t leaf );
+		void _pullNode( size_t node );
+		void _rebuildTree();
+		void _updateLeaf( size_t leaf );
+
+		size_t _findForward( size_t leaf, int pair, int * depth ) const;
+		size_t _findBackward( size_t leaf, int pair, int * depth ) const;
+
+		std::vector<Pair> pairs;
+		std::vector<Leaf> leaves;
+
+		// 葉の上のセグメント木 (ノード 1 が根、ノード cap+i が葉 i)
+		size_t cap;
+		std::vector<size_t> tree_lines;		// ノードの行数
+		std::vector<Summary> tree_sums;		// ノードの括弧の種類ごとの Summary
+	};
+};
+
+#endif // _BRACKETINDEX_H_
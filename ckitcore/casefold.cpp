@@ -0,0 +1,95 @@
+﻿#include <algorithm>
+
+#include "casefold.h"
+
+using namespace ckit;
+
+//-----------------------------------------------------------------------------
+
+// 大文字が同じになる小文字の組 ( re._casefix._EXTRA_CASES と同じ )
+// 組の2番目以降の文字と、その組の最初の文字の対応を、2番目以降の文字の順に並べる
+static const unsigned int equivalent_lowers[][2] =
+{
+	{ 0x0131, 0x0069 },		// ı → i
+	{ 0x017f, 0x0073 },		// ſ → s
+	{ 0x03b9, 0x0345 },		// ι → U+0345
+	{ 0x03bc, 0x00b5 },		// μ → µ
+	{ 0x03c3, 0x03c2 },		// σ → ς
+	{ 0x03d0, 0x03b2 },		// ϐ → β
+	{ 0x03d1, 0x03b8 },		// ϑ → θ
+	{ 0x03d5, 0x03c6 },		// ϕ → φ
+	{ 0x03d6, 0x03c0 },		// ϖ → π
+	{ 0x03f0, 0x03ba },		// ϰ → κ
+	{ 0x03f1, 0x03c1 },		// ϱ → ρ
+	{ 0x03f5, 0x03b5 },		// ϵ → ε
+	{ 0x1c80, 0x0432 },		// ᲀ → в
+	{ 0x1c81, 0x0434 },		// ᲁ → д
+	{ 0x1c82, 0x043e },		// ᲂ → о
+	{ 0x1c83, 0x0441 },		// ᲃ → с
+	{ 0x1c84, 0x0442 },		// ᲄ → т
+	{ 0x1c85, 0x0442 },		// ᲅ → т
+	{ 0x1c86, 0x044a },		// ᲆ → ъ
+	{ 0x1c87, 0x0463 },		// ᲇ → ѣ
+	{ 0x1e9b, 0x1e61 },		// ẛ → ṡ
+	{ 0x1fbe, 0x0345 },		// ι → U+0345
+	{ 0x1fd3, 0x0390 },		// ΐ → ΐ
+	{ 0x1fe3, 0x03b0 },		// ΰ → ΰ
+	{ 0xa64b, 0x1c88 },		// ꙋ → ᲈ
+	{ 0xfb06, 0xfb05 },		// ﬆ → ﬅ
+};
+
+static const size_t num_equivalent_lowers = sizeof(equivalent_lowers) / sizeof(equivalent_lowers[0]);
+
+//-----------------------------------------------------------------------------
+
+CaseFold::CaseFold( ToLowerFunc _to_lower )
+	:
+	to_lower(_to_lower)
+{
+}
+
+unsigned int CaseFold::Fold( unsigned int c ) const
+{
+	// ASCII の文字の組 (i と s) は、ASCII の文字が組の最初なので変換しなくてよい
+	if( c<128 ) return ( c>='A' && c<='Z' ) ? c-'A'+'a' : c;
+
+	unsigned int lower = to_lower(c);
+
+	size_t lo = 0;
+	size_t hi = num_equivalent_lowers;
+	while( lo<hi )
+	{
+		size_t mid = (lo+hi)/2;
+		if( equivalent_lowers[mid][0]<lower ) lo = mid+1; else hi = mid;
+	}
+
+	if( lo<num_equivalent_lowers && equivalent_lowers[lo][0]==lower ) return equivalent_lowers[lo][1];
+	return lower;
+}
+
+void CaseFold::_makeInverse() const
+{
+	for( unsigned int c=0 ; c<0x110000 ; ++c )
+	{
+		unsigned int folded = Fold(c);
+		if( folded!=c ) inverse.push_back( std::make_pair( folded, c ) );
+	}
+
+	std::sort( inverse.begin(), inverse.end() );
+}
+
+int CaseFold::GetChars( unsigned int folded, unsigned int * chars ) const
+{
+	std::call_once( inverse_once, [this](){ _makeInverse(); } );
+
+	int num = 0;
+
+	if( Fold(folded)==folded ) chars[num++] = folded;
+
+	for( auto it = std::lower_bound( inverse.begin(), inverse.end(), std::make_pair( folded, 0u ) ) ; it!=inverse.end() && it->first==folded && num<MAX_CHARS ; ++it )
+	{
+		chars[num++] = it->second;
+	}
+
+	return num;
+}
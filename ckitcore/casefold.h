@@ -0,0 +1,46 @@
+﻿#ifndef _CASEFOLD_H_
+#define _CASEFOLD_H_
+
+#include <vector>
+#include <utility>
+#include <mutex>
+
+namespace ckit
+{
+	// 大文字小文字を区別しない比較のための文字の変換
+	//
+	// re の IGNORECASE と同じ規則で文字を同一視する。
+	// 文字を小文字に変換し、大文字が同じになる別の小文字 (s と ſ、σ と ς など。re._casefix と同じ組) は、その組の最初の文字にする。
+	// 2つの文字は、Fold の結果が等しい場合に一致する。
+	class CaseFold
+	{
+	public:
+		typedef unsigned int (*ToLowerFunc)( unsigned int c );
+
+		enum
+		{
+			MAX_CHARS = 8,		// Fold の結果が同じになる文字の最大数 (Unicode 15 では 4)
+		};
+
+		// to_lower : ASCII 以外の文字を小文字に変換する関数
+		CaseFold( ToLowerFunc to_lower );
+
+		// 最初の GetChars より前に呼び出す
+		void SetToLower( ToLowerFunc to_lower ) { this->to_lower = to_lower; }
+
+		unsigned int Fold( unsigned int c ) const;
+
+		// Fold の結果が folded になる文字を chars[0,MAX_CHARS) に格納し、その数を返す
+		// 逆引きの表は、最初に呼び出されたときに全ての文字を調べて作る
+		int GetChars( unsigned int folded, unsigned int * chars ) const;
+
+	private:
+		void _makeInverse() const;
+
+		ToLowerFunc to_lower;
+		mutable std::vector< std::pair<unsigned int,unsigned int> > inverse;	// Fold の結果が元の文字と異なる ( Fold の結果, 元の文字 ) の組
+		mutable std::once_flag inverse_once;
+	};
+};
+
+#endif // _CASEFOLD_H_
@@ -16,6 +16,15 @@
 #include "frameobject.h"
 
 #include "pythonutil.h"
+#include "textcodec.h"
+#include "threadutil.h"
+#include "lineindex.h"
+#include "regexlexer.h"
+#include "textsearch.h"
+#include "undojournal.h"
+#include "wordindex.h"
+#include "bracketindex.h"
+#include "wordbreak.h"
 #include "ckitcore.h"
 
 using namespace ckit;
@@ -54,6 +63,7 @@ const int MOUSE_CURSOR_UPARROW	    = 13;
 const int MOUSE_CURSOR_WAIT         = 14;
 
 const int WM_USER_NTFYICON  = WM_USER + 100;
+const int WM_USER_POSTCALL  = WM_USER + 101;
 const int ID_MENUITEM       = 256;
 const int ID_MENUITEM_MAX   = 256+1024-1;
 const int ID_POPUP_MENUITEM       = ID_MENUITEM_MAX+1;
@@ -62,6 +72,8 @@ const int ID_POPUP_MENUITEM_MAX   = ID_POPUP_MENUITEM+1024;
 const int TIMER_PAINT		   			= 0x101;
 const int TIMER_PAINT_INTERVAL 			= 10;
 const int TIMER_CARET_BLINK   			= 0x102;
+const int TIMER_DELAYED_CALL   			= 0x103;
+const int TIMER_INPUT		   			= 0x104;
 
 const int GLOBAL_OPTION_XXXX = 0x101;
 
@@ -1240,6 +1252,7 @@ Window::Param::Param()
     mousemove_handler = NULL;
     mousewheel_handler = NULL;
     nchittest_handler = NULL;
+    input_handler = NULL;
 }
 
 Window::Window( Param & param )
@@ -1247,6 +1260,7 @@ Window::Window( Param & param )
 	FUNC_TRACE;
 
     hwnd = NULL;
+    paint_requested = false;
     pyobj = NULL;
     quit_requested = false;
     active = false;
@@ -1299,9 +1313,16 @@ Window::Window( Param & param )
     mousemove_handler = param.mousemove_handler; Py_XINCREF(mousemove_handler);
     mousewheel_handler = param.mousewheel_handler; Py_XINCREF(mousewheel_handler);
     nchittest_handler = param.nchittest_handler; Py_XINCREF(nchittest_handler);
+    input_handler = param.input_handler; Py_XINCREF(input_handler);
+
+    input_flush_pos = 0;
+    input_timer = false;
+    input_received_count = 0;
+    input_delivered_count = 0;
+    input_call_count = 0;
 
 	timer_list_ref_count = 0;
-	delayed_call_list_ref_count = 0;
+	delayed_call_seq = 0;
 	hotkey_list_ref_count = 0;
 
     if(!bg_brush) bg_brush = CreateSolidBrush(param.bg_color);
@@ -1364,9 +1385,21 @@ void Window::appendDirtyRect( const RECT & rect )
 	{
 		dirty_rect = rect;
 		dirty = true;
+
+		_requestPaint();
 	}
 }
 
+// 描画が必要になったときだけ、TIMER_PAINT_INTERVAL 後の描画を予約する
+// 予約までの間の描画要求は、まとめて1回で描画する
+void Window::_requestPaint()
+{
+	if( paint_requested || !hwnd ) return;
+
+	SetTimer( hwnd, TIMER_PAINT, TIMER_PAINT_INTERVAL, NULL );
+	paint_requested = true;
+}
+
 void Window::clearDirtyRect()
 {
 	if(dirty)
@@ -1739,6 +1772,407 @@ void Window::_onTimerCaretBlink()
 	}
 }
 
+// キャレットの点滅は、ウインドウがアクティブな間だけ行う
+void Window::_startCaretBlink()
+{
+	if( !caret || !hwnd ) return;
+
+	SetTimer( hwnd, TIMER_CARET_BLINK, GetCaretBlinkTime(), NULL );
+}
+
+// 非アクティブなウインドウのキャレットは、点滅を止めて表示したままにする
+void Window::_stopCaretBlink()
+{
+	if( !hwnd ) return;
+
+	KillTimer( hwnd, TIMER_CARET_BLINK );
+
+	if( caret && caret_blink==0 )
+	{
+		caret_blink = 1;
+
+		if( caret_rect.right>0 && caret_rect.bottom>0 )
+		{
+			appendDirtyRect( caret_rect );
+		}
+	}
+}
+
+static bool _DelayedCallLater( const DelayedCallInfo & a, const DelayedCallInfo & b )
+{
+	if( a.due != b.due ) return a.due > b.due;
+	return (int)(a.seq - b.seq) > 0;
+}
+
+// 次に呼び出す delayedCall の時刻に TIMER_DELAYED_CALL を設定する
+// 呼び出しが無いときはタイマーを止める
+void Window::_setDelayedCallTimer()
+{
+	if( !hwnd ) return;
+
+	if( delayed_call_heap.empty() )
+	{
+		KillTimer( hwnd, TIMER_DELAYED_CALL );
+		return;
+	}
+
+	ULONGLONG now = GetTickCount64();
+	ULONGLONG due = delayed_call_heap.front().due;
+
+	UINT elapse = USER_TIMER_MINIMUM;
+	if( due > now )
+	{
+		elapse = (UINT)std::min<ULONGLONG>( due - now, USER_TIMER_MAXIMUM );
+		if( elapse < USER_TIMER_MINIMUM ) elapse = USER_TIMER_MINIMUM;
+	}
+
+	SetTimer( hwnd, TIMER_DELAYED_CALL, elapse, NULL );
+}
+
+void Window::_onTimerDelayedCall()
+{
+	FUNC_TRACE;
+
+	ULONGLONG now = GetTickCount64();
+
+	// 呼び出しの中で登録された関数は、次のタイマーで呼ぶ
+	unsigned int seq_end = delayed_call_seq;
+
+	while( delayed_call_heap.size() )
+	{
+		const DelayedCallInfo & front = delayed_call_heap.front();
+		if( front.due > now || (int)(front.seq - seq_end) >= 0 ) break;
+
+		// ネストした呼び出しが起きないように、呼び出し前にヒープから取り除く。
+		PyObject * pyobj = front.pyobj;
+		std::pop_heap( delayed_call_heap.begin(), delayed_call_heap.end(), _DelayedCallLater );
+		delayed_call_heap.pop_back();
+
+		PyObject * pyarglist = Py_BuildValue("()" );
+		PyObject * pyresult = PyObject_Call( pyobj, pyarglist, NULL );
+		Py_DECREF(pyarglist);
+		if(pyresult)
+		{
+			Py_DECREF(pyresult);
+		}
+		else
+		{
+			PyErr_Print();
+		}
+
+		Py_XDECREF(pyobj);
+	}
+
+	_setDelayedCallTimer();
+}
+
+// 入力イベントを input_queue に追加する
+//
+// まだ渡していない最後のイベントと同じ種類なら、1つにまとめる。
+// マウスの移動は最後の位置だけを、ホイールは回転量の合計を、キーの繰り返しはメッセージの数を残す。
+// 後続の入力メッセージが届いているときは、それを受け取ってからまとめて Python に渡す。
+void Window::_queueInput( const InputEvent & ev, bool repeat )
+{
+	input_received_count ++;
+
+	bool merged = false;
+	if( input_queue.size() > input_flush_pos )
+	{
+		InputEvent & last = input_queue.back();
+		if( last.type==ev.type && last.mod==ev.mod )
+		{
+			switch(ev.type)
+			{
+			case InputEvent::MouseMove:
+				last.x = ev.x;
+				last.y = ev.y;
+				merged = true;
+				break;
+
+			case InputEvent::MouseWheel:
+				if( last.x==ev.x && last.y==ev.y )
+				{
+					last.wheel += ev.wheel;
+					merged = true;
+				}
+				break;
+
+			case InputEvent::KeyDown:
+			case InputEvent::Char:
+				if( repeat && last.code==ev.code )
+				{
+					merged = true;
+				}
+				break;
+			}
+
+			if(merged)
+			{
+				last.count += ev.count;
+			}
+		}
+	}
+
+	if(!merged)
+	{
+		input_queue.push_back(ev);
+	}
+
+	// 入力以外のメッセージで止まっても渡せるように、TIMER_INPUT も設定しておく
+	if( HIWORD( GetQueueStatus( QS_INPUT | QS_POSTMESSAGE ) ) )
+	{
+		if(!input_timer)
+		{
+			SetTimer( hwnd, TIMER_INPUT, USER_TIMER_MINIMUM, NULL );
+			input_timer = true;
+		}
+		return;
+	}
+
+	_flushInput();
+}
+
+// まだ渡していない入力イベントを Python に渡す
+//
+// input_handler があれば、イベントのリストを1回の呼び出しで渡す。
+// 無ければ、イベントの種類ごとのハンドラを呼ぶ。まとめたキーの繰り返しは、メッセージの数だけ呼ぶ。
+//
+// ハンドラの中でウインドウが破棄された場合は false を返す。その場合 this は既に無効。
+bool Window::_flushInput()
+{
+	FUNC_TRACE;
+
+	HWND _hwnd = hwnd;
+
+	if(input_timer)
+	{
+		KillTimer( hwnd, TIMER_INPUT );
+		input_timer = false;
+	}
+
+	// ハンドラの中でメッセージが処理されてイベントが追加されることがあるので、位置で扱う
+	while( input_flush_pos < input_queue.size() )
+	{
+		if(input_handler)
+		{
+			size_t num = input_queue.size() - input_flush_pos;
+
+			PyObject * pyevents = PyList_New(num);
+			for( size_t i=0 ; i<num ; ++i )
+			{
+				const InputEvent & ev = input_queue[input_flush_pos+i];
+
+				PyObject * pyevent = NULL;
+				switch(ev.type)
+				{
+				case InputEvent::MouseMove:
+					pyevent = Py_BuildValue( "(siiii)", "mousemove", ev.x, ev.y, ev.mod, ev.count );
+					break;
+				case InputEvent::MouseWheel:
+					pyevent = Py_BuildValue( "(siifii)", "mousewheel", ev.x, ev.y, ev.wheel, ev.mod, ev.count );
+					break;
+				case InputEvent::KeyDown:
+					pyevent = Py_BuildValue( "(siii)", "keydown", ev.code, ev.mod, ev.count );
+					break;
+				case InputEvent::Char:
+					pyevent = Py_BuildValue( "(siii)", "char", ev.code, ev.mod, ev.count );
+					break;
+				}
+
+				PyList_SET_ITEM( pyevents, i, pyevent );
+			}
+
+			input_flush_pos += num;
+			input_delivered_count += num;
+			input_call_count ++;
+
+			PyObject * pyarglist = Py_BuildValue("(O)", pyevents );
+			Py_DECREF(pyevents);
+			PyObject * pyresult = PyObject_Call( input_handler, pyarglist, NULL );
+			Py_DECREF(pyarglist);
+			if(pyresult)
+			{
+				Py_DECREF(pyresult);
+			}
+			else
+			{
+				PyErr_Print();
+			}
+		}
+		else
+		{
+			InputEvent ev = input_queue[input_flush_pos];
+
+			// キーの繰り返しは、残りの数を減らして次も同じイベントを渡す
+			// 途中で removeKeyMessage された場合は、残りを捨てる
+			if( (ev.type==InputEvent::KeyDown || ev.type==InputEvent::Char) && ev.count>1 )
+			{
+				input_queue[input_flush_pos].count --;
+			}
+			else
+			{
+				input_flush_pos ++;
+				input_delivered_count ++;
+			}
+
+			PyObject * handler = NULL;
+			PyObject * pyarglist = NULL;
+			switch(ev.type)
+			{
+			case InputEvent::MouseMove:
+				handler = mousemove_handler;
+				pyarglist = Py_BuildValue( "(iii)", ev.x, ev.y, ev.mod );
+				break;
+			case InputEvent::MouseWheel:
+				handler = mousewheel_handler;
+				pyarglist = Py_BuildValue( "(iifi)", ev.x, ev.y, ev.wheel, ev.mod );
+				break;
+			case InputEvent::KeyDown:
+				handler = keydown_handler;
+				pyarglist = Py_BuildValue( "(ii)", ev.code, ev.mod );
+				break;
+			case InputEvent::Char:
+				handler = char_handler;
+				pyarglist = Py_BuildValue( "(ii)", ev.code, ev.mod );
+				break;
+			}
+
+			if(handler)
+			{
+				input_call_count ++;
+
+				PyObject * pyresult = PyObject_Call( handler, pyarglist, NULL );
+				if(pyresult)
+				{
+					Py_DECREF(pyresult);
+				}
+				else
+				{
+					PyErr_Print();
+				}
+			}
+
+			Py_XDECREF(pyarglist);
+		}
+
+		// ハンドラの中でウインドウが破棄された
+		if( !IsWindow(_hwnd) || (Window*)GetProp( _hwnd, L"ckit_userdata" )!=this )
+		{
+			return false;
+		}
+	}
+
+	input_queue.clear();
+	input_flush_pos = 0;
+
+	return true;
+}
+
+static bool _IsKeyInput( const InputEvent & ev )
+{
+	return ev.type==InputEvent::KeyDown || ev.type==InputEvent::Char;
+}
+
+// まだ渡していないキー入力を捨てる (removeKeyMessage)
+void Window::_removeQueuedKeyInput()
+{
+	input_queue.erase(
+		std::remove_if( input_queue.begin() + input_flush_pos, input_queue.end(), _IsKeyInput ),
+		input_queue.end() );
+}
+
+// 入力イベントをまとめている間に届いたときに、先にまとめたイベントを渡す必要があるメッセージ
+// 順番が入れ替わると困る、キューから取り出されるメッセージだけを対象にする
+static bool _IsInputOrderedMessage( UINT msg )
+{
+	switch(msg)
+	{
+	case WM_LBUTTONDOWN:
+	case WM_LBUTTONUP:
+	case WM_LBUTTONDBLCLK:
+	case WM_RBUTTONDOWN:
+	case WM_RBUTTONUP:
+	case WM_RBUTTONDBLCLK:
+	case WM_MBUTTONDOWN:
+	case WM_MBUTTONUP:
+	case WM_MBUTTONDBLCLK:
+	case WM_KEYUP:
+	case WM_SYSKEYUP:
+	case WM_TIMER:
+	case WM_PAINT:
+	case WM_COMMAND:
+	case WM_HOTKEY:
+	case WM_DROPFILES:
+	case WM_USER_POSTCALL:
+		return true;
+	}
+	return false;
+}
+
+// Python のオブジェクトに触れずに処理できるメッセージかどうか
+// 描画、キャレットの点滅、ハンドラが登録されていないメッセージは、GIL を取得せずに処理する
+static bool _IsNativeMessage( Window * window, UINT msg, WPARAM wp )
+{
+	// WM_CREATE より前のメッセージ
+	if(!window) return true;
+
+	// まとめている入力イベントを先に渡す
+	if( window->input_queue.size()>window->input_flush_pos && _IsInputOrderedMessage(msg) ) return false;
+
+	switch(msg)
+	{
+	case WM_ERASEBKGND:
+	case WM_PAINT:
+	case WM_NCPAINT:
+	case WM_IME_STARTCOMPOSITION:
+	case WM_IME_NOTIFY:
+	case WM_VSCROLL:
+		return true;
+
+	case WM_TIMER:
+		return wp==TIMER_PAINT || wp==TIMER_CARET_BLINK;
+
+	case WM_CLOSE:				return window->close_handler==NULL;
+	case WM_ACTIVATE:			return window->activate_handler==NULL;
+	case WM_DPICHANGED:			return window->dpi_handler==NULL;
+	case WM_COPYDATA:			return window->ipc_handler==NULL;
+	case WM_ENDSESSION:			return window->endsession_handler==NULL;
+	case WM_NCHITTEST:			return window->nchittest_handler==NULL;
+	case WM_LBUTTONDOWN:		return window->lbuttondown_handler==NULL;
+	case WM_LBUTTONUP:			return window->lbuttonup_handler==NULL;
+	case WM_MBUTTONDOWN:		return window->mbuttondown_handler==NULL;
+	case WM_MBUTTONUP:			return window->mbuttonup_handler==NULL;
+	case WM_RBUTTONDOWN:		return window->rbuttondown_handler==NULL;
+	case WM_RBUTTONUP:			return window->rbuttonup_handler==NULL;
+	case WM_LBUTTONDBLCLK:		return window->lbuttondoubleclick_handler==NULL;
+	case WM_MBUTTONDBLCLK:		return window->mbuttondoubleclick_handler==NULL;
+	case WM_RBUTTONDBLCLK:		return window->rbuttondoubleclick_handler==NULL;
+	case WM_KEYUP:
+	case WM_SYSKEYUP:			return window->keyup_handler==NULL;
+	case WM_MOUSEMOVE:			return window->mousemove_handler==NULL && window->input_handler==NULL;
+	case WM_MOUSEWHEEL:			return window->mousewheel_handler==NULL && window->input_handler==NULL;
+	case WM_KEYDOWN:
+	case WM_SYSKEYDOWN:			return window->keydown_handler==NULL && window->input_handler==NULL;
+	case WM_CHAR:
+	case WM_IME_CHAR:			return window->char_handler==NULL && window->input_handler==NULL;
+
+	// Python の関数やオブジェクトを扱う
+	case WM_DESTROY:
+	case WM_INITMENU:
+	case WM_COMMAND:
+	case WM_USER_POSTCALL:
+	case WM_HOTKEY:
+	case WM_SIZING:
+	case WM_WINDOWPOSCHANGING:
+	case WM_WINDOWPOSCHANGED:
+	case WM_DROPFILES:
+		return false;
+	}
+
+	// その他のメッセージは DefWindowProc に渡すだけ
+	return true;
+}
+
 int Window::_getModKey()
 {
 	int mod = 0;
@@ -1775,6 +2209,7 @@ void Window::_clearCallables()
     Py_XDECREF(rbuttondoubleclick_handler); rbuttondoubleclick_handler=NULL;
     Py_XDECREF(mousemove_handler); mousemove_handler=NULL;
     Py_XDECREF(mousewheel_handler); mousewheel_handler=NULL;
+    Py_XDECREF(input_handler); input_handler=NULL;
 
 	for( std::list<TimerInfo>::const_iterator i=timer_list.begin(); i!=timer_list.end() ; i++ )
 	{
@@ -1782,11 +2217,17 @@ void Window::_clearCallables()
 	}
 	timer_list.clear();
 
-	for( std::list<DelayedCallInfo>::const_iterator i=delayed_call_list.begin(); i!=delayed_call_list.end() ; i++ )
+	for( std::vector<DelayedCallInfo>::const_iterator i=delayed_call_heap.begin(); i!=delayed_call_heap.end() ; i++ )
 	{
 		Py_XDECREF( i->pyobj );
 	}
-	delayed_call_list.clear();
+	delayed_call_heap.clear();
+
+	for( std::list<PyObject*>::const_iterator i=posted_call_list.begin(); i!=posted_call_list.end() ; i++ )
+	{
+		Py_XDECREF( *i );
+	}
+	posted_call_list.clear();
 
 	for( std::list<HotKeyInfo>::const_iterator i=hotkey_list.begin(); i!=hotkey_list.end() ; i++ )
 	{
@@ -1822,7 +2263,17 @@ LRESULT CALLBACK Window::_wndProc( HWND hwnd, UINT msg, WPARAM wp, LPARAM lp)
 
     Window * window = (Window*)GetProp( hwnd, L"ckit_userdata" );
 
-	PythonUtil::GIL_Ensure gil_ensure;
+	// messageLoop は GIL を解放してメッセージを処理するので、Python を呼ぶメッセージのときだけ GIL を取得する
+	PythonUtil::GIL_Ensure gil_ensure( ! _IsNativeMessage( window, msg, wp ) );
+
+	// まとめている入力イベントを先に渡す
+	if( window && window->input_queue.size()>window->input_flush_pos && _IsInputOrderedMessage(msg) )
+	{
+		if( ! window->_flushInput() )
+		{
+			return( DefWindowProc( hwnd, msg, wp, lp) );
+		}
+	}
 
     switch(msg)
     {
@@ -1835,8 +2286,8 @@ LRESULT CALLBACK Window::_wndProc( HWND hwnd, UINT msg, WPARAM wp, LPARAM lp)
 		
 			window->enableIme(false);
 
-            SetTimer(hwnd, TIMER_PAINT, TIMER_PAINT_INTERVAL, NULL);
-            SetTimer(hwnd, TIMER_CARET_BLINK, GetCaretBlinkTime(), NULL);
+            // 定期的なタイマーは使わない
+            // 描画、キャレットの点滅、delayedCall は、必要なときだけタイマーを設定する
         }
         break;
 
@@ -1844,6 +2295,8 @@ LRESULT CALLBACK Window::_wndProc( HWND hwnd, UINT msg, WPARAM wp, LPARAM lp)
         {
             KillTimer( hwnd, TIMER_PAINT );
             KillTimer( hwnd, TIMER_CARET_BLINK );
+            KillTimer( hwnd, TIMER_DELAYED_CALL );
+            KillTimer( hwnd, TIMER_INPUT );
 
             RemoveProp( hwnd, L"ckit_userdata" );
 
@@ -1879,10 +2332,12 @@ LRESULT CALLBACK Window::_wndProc( HWND hwnd, UINT msg, WPARAM wp, LPARAM lp)
 			case WA_ACTIVE:
 			case WA_CLICKACTIVE:
 				window->active = true;
+				window->_startCaretBlink();
 				break;
 			case WA_INACTIVE:
 			default:
 				window->active = false;
+				window->_stopCaretBlink();
 				break;
 			}
 
@@ -1999,58 +2454,19 @@ LRESULT CALLBACK Window::_wndProc( HWND hwnd, UINT msg, WPARAM wp, LPARAM lp)
     	{
 	    	if(wp==TIMER_PAINT)
 	    	{
-		        window->flushPaint();
-		        
-		        if( window->delayed_call_list.size() )
-		        {
-		    		window->delayed_call_list_ref_count ++;
-
-					for( std::list<DelayedCallInfo>::iterator i=window->delayed_call_list.begin(); i!=window->delayed_call_list.end() ; i++ )
-					{
-						if(i->pyobj)
-						{
-							i->timeout -= TIMER_PAINT_INTERVAL;
-							if(i->timeout<=0)
-							{
-								// ネストした呼び出しが起きないように、呼び出し前にNULLにする。
-								PyObject * pyobj = i->pyobj;
-								i->pyobj = NULL;
-
-								PyObject * pyarglist = Py_BuildValue("()" );
-								PyObject * pyresult = PyObject_Call( pyobj, pyarglist, NULL );
-								Py_DECREF(pyarglist);
-								if(pyresult)
-								{
-									Py_DECREF(pyresult);
-								}
-								else
-								{
-									PyErr_Print();
-								}
-						
-								Py_XDECREF(pyobj);
-							}
-						}
-					}
+	    		// 1回だけのタイマーとして使う
+	    		KillTimer( hwnd, TIMER_PAINT );
+	    		window->paint_requested = false;
 
-					window->delayed_call_list_ref_count --;
-
-					// 無効化されたノードを削除
-		    		if(window->delayed_call_list_ref_count==0)
-		    		{
-						for( std::list<DelayedCallInfo>::iterator i=window->delayed_call_list.begin(); i!=window->delayed_call_list.end() ; )
-						{
-							if( (i->pyobj)==0 )
-							{
-								i = window->delayed_call_list.erase(i);
-							}
-							else
-							{
-								i++;
-							}
-						}
-		    		}
-				}
+		        window->flushPaint();
+	    	}
+	    	else if(wp==TIMER_DELAYED_CALL)
+	    	{
+	    		window->_onTimerDelayedCall();
+	    	}
+	    	else if(wp==TIMER_INPUT)
+	    	{
+	    		window->_flushInput();
 	    	}
 	    	else if(wp==TIMER_CARET_BLINK)
 			{
@@ -2117,6 +2533,31 @@ LRESULT CALLBACK Window::_wndProc( HWND hwnd, UINT msg, WPARAM wp, LPARAM lp)
     	}
         break;
 
+    case WM_USER_POSTCALL:
+		{
+			// 呼び出し中に postCall されたものは次のメッセージで呼ぶ
+			std::list<PyObject*> call_list;
+			call_list.swap( window->posted_call_list );
+
+			for( std::list<PyObject*>::iterator i=call_list.begin(); i!=call_list.end() ; i++ )
+			{
+				PyObject * pyarglist = Py_BuildValue("()" );
+				PyObject * pyresult = PyObject_Call( *i, pyarglist, NULL );
+				Py_DECREF(pyarglist);
+				if(pyresult)
+				{
+					Py_DECREF(pyresult);
+				}
+				else
+				{
+					PyErr_Print();
+				}
+
+				Py_DECREF(*i);
+			}
+		}
+		break;
+
     case WM_HOTKEY:
 		if( ! window->quit_requested )
 		{
@@ -2397,40 +2838,22 @@ LRESULT CALLBACK Window::_wndProc( HWND hwnd, UINT msg, WPARAM wp, LPARAM lp)
         break;
 
     case WM_MOUSEMOVE:
-		if(window->mousemove_handler)
+		if( window->mousemove_handler || window->input_handler )
 		{
 			int mod = _getModKey();
 
-			PyObject * pyarglist = Py_BuildValue("(iii)", (short)LOWORD(lp), (short)HIWORD(lp), mod );
-			PyObject * pyresult = PyObject_Call( window->mousemove_handler, pyarglist, NULL );
-			Py_DECREF(pyarglist);
-			if(pyresult)
-			{
-				Py_DECREF(pyresult);
-			}
-			else
-			{
-				PyErr_Print();
-			}
+			InputEvent ev( InputEvent::MouseMove, (short)LOWORD(lp), (short)HIWORD(lp), 0, 0, mod );
+			window->_queueInput( ev, false );
 		}
         break;
 
 	case WM_MOUSEWHEEL:
-		if(window->mousewheel_handler)
+		if( window->mousewheel_handler || window->input_handler )
 		{
 			int mod = _getModKey();
 			
-			PyObject * pyarglist = Py_BuildValue("(iifi)", (short)LOWORD(lp), (short)HIWORD(lp), (float)GET_WHEEL_DELTA_WPARAM(wp)/WHEEL_DELTA, mod );
-			PyObject * pyresult = PyObject_Call( window->mousewheel_handler, pyarglist, NULL );
-			Py_DECREF(pyarglist);
-			if(pyresult)
-			{
-				Py_DECREF(pyresult);
-			}
-			else
-			{
-				PyErr_Print();
-			}
+			InputEvent ev( InputEvent::MouseWheel, (short)LOWORD(lp), (short)HIWORD(lp), (float)GET_WHEEL_DELTA_WPARAM(wp)/WHEEL_DELTA, 0, mod );
+			window->_queueInput( ev, false );
 		}
 		break;
 
@@ -2515,22 +2938,14 @@ LRESULT CALLBACK Window::_wndProc( HWND hwnd, UINT msg, WPARAM wp, LPARAM lp)
 
     case WM_KEYDOWN:
     case WM_SYSKEYDOWN:
-		if(window->keydown_handler)
+		if( window->keydown_handler || window->input_handler )
 		{
 			INT_PTR vk = wp;
 			int mod = _getModKey();
 
-			PyObject * pyarglist = Py_BuildValue("(ii)", vk, mod );
-			PyObject * pyresult = PyObject_Call( window->keydown_handler, pyarglist, NULL );
-			Py_DECREF(pyarglist);
-			if(pyresult)
-			{
-				Py_DECREF(pyresult);
-			}
-			else
-			{
-				PyErr_Print();
-			}
+			// lp の bit 30 は、キーの繰り返しかどうか
+			InputEvent ev( InputEvent::KeyDown, 0, 0, 0, (int)vk, mod );
+			window->_queueInput( ev, (lp & 0x40000000)!=0 );
 		}
     	break;
 
@@ -2557,22 +2972,13 @@ LRESULT CALLBACK Window::_wndProc( HWND hwnd, UINT msg, WPARAM wp, LPARAM lp)
 
     case WM_CHAR:
     case WM_IME_CHAR:
-		if(window->char_handler)
+		if( window->char_handler || window->input_handler )
 		{
 			INT_PTR ch = wp;
 			int mod = _getModKey();
 
-			PyObject * pyarglist = Py_BuildValue("(ii)", ch, mod );
-			PyObject * pyresult = PyObject_Call( window->char_handler, pyarglist, NULL );
-			Py_DECREF(pyarglist);
-			if(pyresult)
-			{
-				Py_DECREF(pyresult);
-			}
-			else
-			{
-				PyErr_Print();
-			}
+			InputEvent ev( InputEvent::Char, 0, 0, 0, (int)ch, mod );
+			window->_queueInput( ev, (lp & 0x40000000)!=0 );
 		}
         break;
 
@@ -5149,6 +5555,9 @@ static PyObject * TextPlane_setCaretPosition(PyObject* self, PyObject* args)
     return Py_None;
 }
 
+// Line の定義より後で実装する
+static PyObject * TextPlane_getLinesText(PyObject* self, PyObject* args);
+
 static PyMethodDef TextPlane_methods[] = {
 
 	{ "destroy", TextPlane_destroy, METH_VARARGS, "" },
@@ -5173,6 +5582,7 @@ static PyMethodDef TextPlane_methods[] = {
     { "charToClient", TextPlane_charToClient, METH_VARARGS, "" },
     { "getStringWidth", TextPlane_getStringWidth, METH_VARARGS, "" },
     { "getStringColumns", TextPlane_getStringColumns, METH_VARARGS, "" },
+    { "getLinesText", TextPlane_getLinesText, METH_VARARGS, "" },
 
 	{ "setCaretPosition", TextPlane_setCaretPosition, METH_VARARGS, "" },
 
@@ -5485,6 +5895,7 @@ static int Window_init( PyObject * self, PyObject * args, PyObject * kwds)
     PyObject * mousemove_handler = NULL;
     PyObject * mousewheel_handler = NULL;
     PyObject * nchittest_handler = NULL;
+    PyObject * input_handler = NULL;
 
     static char * kwlist[] = {
 
@@ -5540,6 +5951,7 @@ static int Window_init( PyObject * self, PyObject * args, PyObject * kwds)
         "mousemove_handler",
         "mousewheel_handler",
         "nchittest_handler",
+        "input_handler",
         NULL
     };
 
@@ -5548,7 +5960,7 @@ static int Window_init( PyObject * self, PyObject * args, PyObject * kwds)
     	"OOOOO"
     	"iOOiO"
     	"iiiiiiiii"
-    	"OOOOOOOOOOOOOOOOOOOOOOOO", kwlist,
+    	"OOOOOOOOOOOOOOOOOOOOOOOOO", kwlist,
 
         &x,
         &y,
@@ -5601,7 +6013,8 @@ static int Window_init( PyObject * self, PyObject * args, PyObject * kwds)
         &rbuttondoubleclick_handler,
         &mousemove_handler,
         &mousewheel_handler,
-        &nchittest_handler
+        &nchittest_handler,
+        &input_handler
     ))
     {
         return -1;
@@ -5723,6 +6136,7 @@ static int Window_init( PyObject * self, PyObject * args, PyObject * kwds)
     param.mousemove_handler = mousemove_handler;
     param.mousewheel_handler = mousewheel_handler;
     param.nchittest_handler = nchittest_handler;
+    param.input_handler = input_handler;
 
     Window * window = new Window(param);
 
@@ -6378,21 +6792,41 @@ static PyObject * Window_messageLoop(PyObject* self, PyObject* args, PyObject *
 		return NULL;
 	}
 
+	// メッセージの処理は GIL を解放したまま行い、Python を呼ぶメッセージだけ _wndProc の中で GIL を取得する
+	// WaitMessage から戻った後も、GIL を取得せずにそのままメッセージを処理する
+	bool wait = false;
+	bool quit = false;
+
     for(;;)
     {
+        Py_BEGIN_ALLOW_THREADS
+
+        if(wait)
+        {
+            WaitMessage();
+        }
+
 		// メッセージがなくなるまで処理
 		MSG msg;
 		while( PeekMessage( &msg, NULL, 0, 0, PM_REMOVE ) )
         {
             if(msg.message==WM_QUIT)
             {
-                goto end;
+                quit = true;
+                break;
             }
 
             TranslateMessage(&msg);
             DispatchMessage(&msg);
         }
 
+        Py_END_ALLOW_THREADS
+
+        if(quit)
+        {
+            goto end;
+        }
+
 		// メッセージループを抜けるのは、メッセージがなくなってから
 		{
 			Window* window = ((Window_Object*)self)->p;
@@ -6430,11 +6864,7 @@ static PyObject * Window_messageLoop(PyObject* self, PyObject* args, PyObject *
 			}
 		}
 
-        Py_BEGIN_ALLOW_THREADS
-
-        WaitMessage();
-
-        Py_END_ALLOW_THREADS
+        wait = true;
     }
 
     end:
@@ -6461,10 +6891,33 @@ static PyObject * Window_removeKeyMessage(PyObject* self, PyObject* args)
     {
     }
 
+	// まとめていて、まだ渡していないキー入力も捨てる
+	((Window_Object*)self)->p->_removeQueuedKeyInput();
+
     Py_INCREF(Py_None);
     return Py_None;
 }
 
+// 入力イベントの統計 ( 受け取ったメッセージの数, まとめた後に渡したイベントの数, Python の呼び出しの数 )
+static PyObject * Window_getInputStats(PyObject* self, PyObject* args)
+{
+	//FUNC_TRACE;
+
+    if( ! PyArg_ParseTuple( args, "" ) )
+        return NULL;
+
+	if( ! ((Window_Object*)self)->p )
+	{
+		PyErr_SetString( PyExc_ValueError, "already destroyed." );
+		return NULL;
+	}
+
+	Window * window = ((Window_Object*)self)->p;
+
+	PyObject * pyret = Py_BuildValue( "(KKK)", window->input_received_count, window->input_delivered_count, window->input_call_count );
+	return pyret;
+}
+
 static PyObject * Window_quit(PyObject* self, PyObject* args)
 {
 	//FUNC_TRACE;
@@ -6748,8 +7201,46 @@ static PyObject * Window_delayedCall( PyObject * self, PyObject * args )
 
 	Window * window = ((Window_Object*)self)->p;
 
+	if(timeout<0) timeout=0;
+
 	Py_XINCREF(func);
-	window->delayed_call_list.push_back( DelayedCallInfo(func,timeout) );
+	window->delayed_call_heap.push_back( DelayedCallInfo( func, GetTickCount64()+timeout, window->delayed_call_seq++ ) );
+	std::push_heap( window->delayed_call_heap.begin(), window->delayed_call_heap.end(), _DelayedCallLater );
+
+	// 一番早い呼び出しが変わったときだけ、タイマーを設定し直す
+	if( window->delayed_call_heap.front().seq==window->delayed_call_seq-1 )
+	{
+		window->_setDelayedCallTimer();
+	}
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+// 任意のスレッドから、ウインドウのスレッドで関数を呼び出すように要求する
+// 呼び出しはウインドウのメッセージキューを経由して行われる
+static PyObject * Window_postCall( PyObject * self, PyObject * args )
+{
+	//FUNC_TRACE;
+
+	PyObject * func;
+
+	if( ! PyArg_ParseTuple(args,"O", &func ) )
+		return NULL;
+
+	if( ! ((Window_Object*)self)->p )
+	{
+		PyErr_SetString( PyExc_ValueError, "already destroyed." );
+		return NULL;
+	}
+
+	Window * window = ((Window_Object*)self)->p;
+
+	// posted_call_list は GIL を保持しているスレッドだけが操作する
+	Py_INCREF(func);
+	window->posted_call_list.push_back(func);
+
+	PostMessage( window->hwnd, WM_USER_POSTCALL, 0, 0 );
 
 	Py_INCREF(Py_None);
 	return Py_None;
@@ -7270,6 +7761,7 @@ static PyMethodDef Window_methods[] = {
     { "bitBlt", Window_bitBlt, METH_VARARGS, "" },
     { "messageLoop", (PyCFunction)Window_messageLoop, METH_VARARGS|METH_KEYWORDS, "" },
     { "removeKeyMessage", Window_removeKeyMessage, METH_VARARGS, "" },
+    { "getInputStats", Window_getInputStats, METH_VARARGS, "" },
     { "quit", Window_quit, METH_VARARGS, "" },
     { "getWindowRect", Window_getWindowRect, METH_VARARGS, "" },
     { "getClientSize", Window_getClientSize, METH_VARARGS, "" },
@@ -7282,6 +7774,7 @@ static PyMethodDef Window_methods[] = {
     { "setTimer", Window_setTimer, METH_VARARGS, "" },
     { "killTimer", Window_killTimer, METH_VARARGS, "" },
     { "delayedCall", Window_delayedCall, METH_VARARGS, "" },
+    { "postCall", Window_postCall, METH_VARARGS, "" },
     { "setHotKey", Window_setHotKey, METH_VARARGS, "" },
     { "killHotKey", Window_killHotKey, METH_VARARGS, "" },
     { "setImeRect", Window_setImeRect, METH_VARARGS, "" },
@@ -7967,6 +8460,61 @@ static int Line_SetAttrString( PyObject * self, const char * attr_name, PyObject
 	return -1;
 }
 
+// デコード済みの行から Line オブジェクトを生成する
+static PyObject * _Line_FromDecodedLine( const unsigned short * text, const TextCodec::DecodedLine & decoded_line )
+{
+	PyObject * s = PyUnicode_New( decoded_line.num_chars, decoded_line.max_char );
+	if(!s) return NULL;
+
+	const unsigned short * src = text + decoded_line.offset;
+	const unsigned short * src_end = src + decoded_line.length;
+
+	switch( PyUnicode_KIND(s) )
+	{
+	case PyUnicode_1BYTE_KIND:
+		{
+			Py_UCS1 * dst = PyUnicode_1BYTE_DATA(s);
+			while( src<src_end ) *dst++ = (Py_UCS1)*src++;
+		}
+		break;
+
+	case PyUnicode_2BYTE_KIND:
+		{
+			memcpy( PyUnicode_2BYTE_DATA(s), src, decoded_line.length * sizeof(Py_UCS2) );
+		}
+		break;
+
+	case PyUnicode_4BYTE_KIND:
+		{
+			Py_UCS4 * dst = PyUnicode_4BYTE_DATA(s);
+			while( src<src_end )
+			{
+				Py_UCS4 c = *src++;
+				if( c>=0xd800 && c<=0xdbff && src<src_end )
+				{
+					c = 0x10000 + ( ((c & 0x3ff)<<10) | (*src++ & 0x3ff) );
+				}
+				*dst++ = c;
+			}
+		}
+		break;
+	}
+
+	PyObject * pyline = Line_Type.tp_alloc( &Line_Type, 0 );
+	if(!pyline)
+	{
+		Py_DECREF(s);
+		return NULL;
+	}
+
+	((Line_Object*)pyline)->s = s;
+	((Line_Object*)pyline)->ctx = NULL;
+	((Line_Object*)pyline)->tokens = NULL;
+	((Line_Object*)pyline)->flags = decoded_line.lineend;
+
+	return pyline;
+}
+
 static PyMethodDef Line_methods[] = {
 	{NULL,NULL}
 };
@@ -8017,149 +8565,4220 @@ PyTypeObject Line_Type = {
 //
 // ----------------------------------------------------------------------------
 
-static PyObject * _registerWindowClass( PyObject * self, PyObject * args )
+// 文字の桁数 (TextPlane::GetStringWidth と同じ規則)
+// 0xffff を超える文字は、UTF-16 のサロゲートペアの2文字として数える
+static inline int _LinesText_CharColumns( const std::vector<bool> & zenkaku_table, Py_UCS4 c, int width, int tab_width )
 {
-	FUNC_TRACE;
-
-    PyObject * pyprefix;
-
-    if( ! PyArg_ParseTuple(args, "O", &pyprefix ) )
-        return NULL;
-
-    std::wstring prefix;
-    if(pyprefix)
-    {
-        if( !PythonUtil::PyStringToWideString( pyprefix, &prefix ) )
-        {
-            return NULL;
-        }
-    }
-
-	WINDOW_CLASS_NAME 			= prefix + L"WindowClass";
-	TASKTRAY_WINDOW_CLASS_NAME  = prefix + L"TaskTrayWindowClass";
-
-    if( ! Window::_registerWindowClass() )
-    {
-		PyErr_SetFromWindowsErr(0);
-        return NULL;
-    }
+	if( c=='\t' )
+	{
+		return tab_width - width % tab_width;
+	}
 
-    if( ! TaskTrayIcon::_registerWindowClass() )
-    {
-		PyErr_SetFromWindowsErr(0);
-        return NULL;
-    }
+	if( c<=0xffff )
+	{
+		return zenkaku_table[c] ? 2 : 1;
+	}
 
-    Py_INCREF(Py_None);
-    return Py_None;
+	c -= 0x10000;
+	return ( zenkaku_table[ 0xd800 + (c>>10) ] ? 2 : 1 ) + ( zenkaku_table[ 0xdc00 + (c&0x3ff) ] ? 2 : 1 );
 }
 
-static PyObject * _registerCommandInfoConstructor( PyObject * self, PyObject * args )
+// TextWidget.getColumnFromIndex と同じ
+static int _LinesText_GetColumnFromIndex( const std::vector<bool> & zenkaku_table, PyObject * s, Py_ssize_t index, int tab_width )
 {
-	PyObject * _command_info_constructor;
+	int kind = PyUnicode_KIND(s);
+	const void * data = PyUnicode_DATA(s);
+	Py_ssize_t len = PyUnicode_GET_LENGTH(s);
 
-	if( ! PyArg_ParseTuple(args,"O", &_command_info_constructor ) )
-		return NULL;
-	
-	Py_XDECREF(command_info_constructor);
-	command_info_constructor = _command_info_constructor;
-	Py_INCREF(command_info_constructor);
+	int width = 0;
+	for( Py_ssize_t i=0 ; i<index && i<len ; ++i )
+	{
+		width += _LinesText_CharColumns( zenkaku_table, PyUnicode_READ(kind,data,i), width, tab_width );
+	}
 
-	Py_INCREF(Py_None);
-	return Py_None;
+	if(index>len) width += (int)(index-len);
+
+	return width;
 }
 
-static PyObject * _setGlobalOption( PyObject * self, PyObject * args )
+// TextWidget.getIndexFromColumn ( block_mode=False ) と同じ
+// column 桁目が文字の中央より左にあれば、その文字の位置を返す
+static Py_ssize_t _LinesText_GetIndexFromColumn( const std::vector<bool> & zenkaku_table, PyObject * s, int column, double sub_x, int tab_width )
 {
-	FUNC_TRACE;
-
-    int option;
-    int enable;
+	int kind = PyUnicode_KIND(s);
+	const void * data = PyUnicode_DATA(s);
+	Py_ssize_t len = PyUnicode_GET_LENGTH(s);
 
-    if( ! PyArg_ParseTuple(args, "ii", &option, &enable ) )
-        return NULL;
-
-	switch(option)
+	int width = 0;
+	for( Py_ssize_t i=0 ; i<len ; ++i )
 	{
-	case GLOBAL_OPTION_XXXX:
-		{
-		}
-		break;
-	
-	default:
+		int next = width + _LinesText_CharColumns( zenkaku_table, PyUnicode_READ(kind,data,i), width, tab_width );
+		if( next > column )
 		{
-			PyErr_SetString( PyExc_ValueError, "unknown option id." );
-			return NULL;
+			if( column + sub_x < ( width + next ) * 0.5 + 0.25 )
+			{
+				return i;
+			}
+			return i+1;
 		}
+		width = next;
 	}
 
-    Py_INCREF(Py_None);
-    return Py_None;
+	return len;
 }
 
-static int _blockDetectorCallback( PyObject * py_report_func, PyFrameObject * frame, int what, PyObject * arg )
+// s[start,end) を格納するのに必要な文字の最大値
+// 結果の文字列は、内容に応じた最小の種類 (ASCII / UCS1 / UCS2 / UCS4) で作らなければならない
+static Py_UCS4 _LinesText_GetMaxChar( PyObject * s, Py_ssize_t start, Py_ssize_t end, Py_UCS4 maxchar )
 {
-	static DWORD tick_prev = GetTickCount();
-	DWORD tick = GetTickCount();
-	DWORD delta = tick-tick_prev;
-	tick_prev = tick;
-	
-	if( delta > 1000 )
+	Py_UCS4 s_maxchar = PyUnicode_MAX_CHAR_VALUE(s);
+	if( s_maxchar <= maxchar ) return maxchar;
+
+	// 文字列全体の場合は、文字列の種類で決まる
+	if( start==0 && end==PyUnicode_GET_LENGTH(s) ) return s_maxchar;
+
+	int kind = PyUnicode_KIND(s);
+	const void * data = PyUnicode_DATA(s);
+
+	for( Py_ssize_t i=start ; i<end ; ++i )
 	{
-		PyObject * pyarglist = Py_BuildValue("()");
-		PyObject * pyresult = PyObject_Call( py_report_func, pyarglist, NULL );
-		Py_DECREF(pyarglist);
-		if(pyresult)
-		{
-			Py_DECREF(pyresult);
-		}
-		else
+		Py_UCS4 c = PyUnicode_READ(kind,data,i);
+		if( c > maxchar )
 		{
-			PyErr_Print();
+			if( c<0x80 ) maxchar = 0x7f;
+			else if( c<0x100 ) maxchar = 0xff;
+			else if( c<0x10000 ) maxchar = 0xffff;
+			else maxchar = 0x10ffff;
+
+			if( maxchar >= s_maxchar ) break;
 		}
 	}
-	
-	return 0;
+
+	return maxchar;
 }
 
-static PyObject * py_report_func;
+// TextPlane.getLinesText( lines, (left_line,left_index), (right_line,right_index), block_mode=False, tab_width=4, column_offset=0.0 )
+//
+// TextWidget.getText の実装
+// 範囲のテキストの長さと文字の種類を先に求めて、1つの文字列に書き込む。
+// 矩形選択の場合は、フォントの全角判定テーブルで桁数から文字の位置を求める。
+static PyObject * TextPlane_getLinesText(PyObject* self, PyObject* args)
+{
+	PyObject * lines;
+	Py_ssize_t left_line, left_index;
+	Py_ssize_t right_line, right_index;
+	int block_mode = 0;
+	int tab_width = 4;
+	double column_offset = 0.0;
 
-static PyObject * _enableBlockDetector( PyObject * self, PyObject * args )
-{
-	PyObject * _py_report_func;
+	if( ! PyArg_ParseTuple(args, "O(nn)(nn)|iid", &lines, &left_line, &left_index, &right_line, &right_index, &block_mode, &tab_width, &column_offset ) )
+		return NULL;
 
-	if( ! PyArg_ParseTuple(args,"O", &_py_report_func ) )
+	if( ! ((TextPlane_Object*)self)->p )
+	{
+		PyErr_SetString( PyExc_ValueError, "already destroyed." );
 		return NULL;
-	
-	Py_XDECREF(py_report_func);
-	py_report_func = _py_report_func;
-	Py_INCREF(py_report_func);
+	}
 
-	Py_INCREF(Py_None);
-	return Py_None;
-}
+	if( !PyList_Check(lines) )
+	{
+		PyErr_SetString( PyExc_TypeError, "lines must be a list." );
+		return NULL;
+	}
 
-static PyObject * _setBlockDetector( PyObject * self, PyObject * args )
-{
-	if( ! PyArg_ParseTuple(args,"") )
+	Py_ssize_t num_lines = PyList_GET_SIZE(lines);
+	if( left_line<0 || left_line>=num_lines || right_line<0 || right_line>=num_lines )
+	{
+		PyErr_SetString( PyExc_IndexError, "line index out of range" );
 		return NULL;
+	}
 
-	if(py_report_func)
+	if( left_line>right_line )
 	{
-		PyEval_SetProfile( _blockDetectorCallback, py_report_func );
+		return PyUnicode_New( 0, 0 );
 	}
 
-	Py_INCREF(Py_None);
-	return Py_None;
-}
+	for( Py_ssize_t i=left_line ; i<=right_line ; ++i )
+	{
+		PyObject * item = PyList_GET_ITEM( lines, i );
+		PyObject * s = Line_Check(item) ? ((Line_Object*)item)->s : NULL;
+		if( !s || !PyUnicode_Check(s) || PyUnicode_READY(s)<0 )
+		{
+			PyErr_SetString( PyExc_TypeError, "lines must be a list of Line." );
+			return NULL;
+		}
+	}
 
-static PyMethodDef ckit_funcs[] =
-{
-    { "registerWindowClass", _registerWindowClass, METH_VARARGS, "" },
+	const std::vector<bool> & zenkaku_table = ((TextPlane_Object*)self)->p->font->zenkaku_table;
+	if( tab_width<1 ) tab_width = 1;
+
+	// 文字列に含める範囲
+	struct Piece
+	{
+		PyObject * s;
+		Py_ssize_t start;
+		Py_ssize_t end;
+		int lineend;
+	};
+
+	std::vector<Piece> pieces;
+	pieces.reserve( right_line-left_line+1 );
+
+	if( left_line==right_line )
+	{
+		Piece piece = { ((Line_Object*)PyList_GET_ITEM( lines, left_line ))->s, left_index, right_index, 0 };
+		pieces.push_back(piece);
+	}
+	else if( !block_mode )
+	{
+		for( Py_ssize_t i=left_line ; i<=right_line ; ++i )
+		{
+			Line_Object * line = (Line_Object*)PyList_GET_ITEM( lines, i );
+
+			Piece piece = { line->s, 0, PyUnicode_GET_LENGTH(line->s), line->flags & Line_End_CRLF };
+			if( i==left_line )
+			{
+				piece.start = left_index;
+			}
+			if( i==right_line )
+			{
+				piece.end = right_index;
+				piece.lineend = 0;
+			}
+			pieces.push_back(piece);
+		}
+	}
+	else
+	{
+		int column1 = _LinesText_GetColumnFromIndex( zenkaku_table, ((Line_Object*)PyList_GET_ITEM( lines, left_line ))->s, left_index, tab_width );
+		int column2 = _LinesText_GetColumnFromIndex( zenkaku_table, ((Line_Object*)PyList_GET_ITEM( lines, right_line ))->s, right_index, tab_width );
+		int rect_column_left = std::min(column1,column2);
+		int rect_column_right = std::max(column1,column2);
+
+		for( Py_ssize_t i=left_line ; i<=right_line ; ++i )
+		{
+			Line_Object * line = (Line_Object*)PyList_GET_ITEM( lines, i );
+
+			Piece piece;
+			piece.s = line->s;
+			piece.start = _LinesText_GetIndexFromColumn( zenkaku_table, line->s, rect_column_left, column_offset, tab_width );
+			piece.end = _LinesText_GetIndexFromColumn( zenkaku_table, line->s, rect_column_right, column_offset, tab_width );
+			piece.lineend = line->flags & Line_End_CRLF;
+			pieces.push_back(piece);
+		}
+	}
+
+	// 長さと文字の種類を求める
+	Py_ssize_t total = 0;
+	Py_UCS4 maxchar = 0;
+	for( size_t i=0 ; i<pieces.size() ; ++i )
+	{
+		Piece & piece = pieces[i];
+
+		Py_ssize_t len = PyUnicode_GET_LENGTH(piece.s);
+		piece.start = std::min( std::max<Py_ssize_t>( piece.start, 0 ), len );
+		piece.end = std::min( std::max<Py_ssize_t>( piece.end, piece.start ), len );
+
+		total += piece.end - piece.start;
+		total += ( piece.lineend==Line_End_CRLF ) ? 2 : ( piece.lineend ? 1 : 0 );
+
+		maxchar = _LinesText_GetMaxChar( piece.s, piece.start, piece.end, maxchar );
+	}
+
+	PyObject * result = PyUnicode_New( total, maxchar );
+	if(!result) return NULL;
+
+	int kind = PyUnicode_KIND(result);
+	void * data = PyUnicode_DATA(result);
+
+	Py_ssize_t pos = 0;
+	for( size_t i=0 ; i<pieces.size() ; ++i )
+	{
+		const Piece & piece = pieces[i];
+
+		// PyUnicode_CopyCharacters は範囲外の文字で種類を判定することがあるので、自前でコピーする
+		int s_kind = PyUnicode_KIND(piece.s);
+		const void * s_data = PyUnicode_DATA(piece.s);
+		if( s_kind==kind )
+		{
+			memcpy( (char*)data + pos * kind, (const char*)s_data + piece.start * kind, ( piece.end - piece.start ) * kind );
+			pos += piece.end - piece.start;
+		}
+		else
+		{
+			for( Py_ssize_t j=piece.start ; j<piece.end ; ++j )
+			{
+				PyUnicode_WRITE( kind, data, pos++, PyUnicode_READ( s_kind, s_data, j ) );
+			}
+		}
+
+		if( piece.lineend & Line_End_CR )
+		{
+			PyUnicode_WRITE( kind, data, pos++, '\r' );
+		}
+		if( piece.lineend & Line_End_LF )
+		{
+			PyUnicode_WRITE( kind, data, pos++, '\n' );
+		}
+	}
+
+	return result;
+}
+
+// ----------------------------------------------------------------------------
+//
+// ----------------------------------------------------------------------------
+
+// 位置と種類を読み書きする
+static inline Py_ssize_t _TokenArray_GetPos( const TokenArray_Object * self, Py_ssize_t i )
+{
+	if( self->pos_size==2 ) return ((const unsigned short*)self->data)[i];
+	return ((const unsigned int*)self->data)[i];
+}
+
+static inline int _TokenArray_GetType( const TokenArray_Object * self, Py_ssize_t i )
+{
+	const char * types = self->data + self->num * self->pos_size;
+	if( self->type_size==1 ) return ((const signed char*)types)[i];
+	return ((const short*)types)[i];
+}
+
+static inline void _TokenArray_Set( TokenArray_Object * self, Py_ssize_t i, Py_ssize_t pos, int type )
+{
+	if( self->pos_size==2 ) ((unsigned short*)self->data)[i] = (unsigned short)pos;
+	else ((unsigned int*)self->data)[i] = (unsigned int)pos;
+
+	char * types = self->data + self->num * self->pos_size;
+	if( self->type_size==1 ) ((signed char*)types)[i] = (signed char)type;
+	else ((short*)types)[i] = (short)type;
+}
+
+// 位置と種類の範囲から、要素のサイズを決めて TokenArray を生成する
+static TokenArray_Object * _TokenArray_Create( Py_ssize_t num, Py_ssize_t max_pos, int min_type, int max_type )
+{
+	if( max_pos>0xffffffffLL || min_type<SHRT_MIN || max_type>SHRT_MAX )
+	{
+		PyErr_SetString( PyExc_ValueError, "token position or type out of range." );
+		return NULL;
+	}
+
+	int pos_size = max_pos<=0xffff ? 2 : 4;
+	int type_size = ( SCHAR_MIN<=min_type && max_type<=SCHAR_MAX ) ? 1 : 2;
+
+	TokenArray_Object * self = PyObject_NewVar( TokenArray_Object, &TokenArray_Type, num * (pos_size+type_size) );
+	if(!self) return NULL;
+
+	self->num = num;
+	self->pos_size = (unsigned char)pos_size;
+	self->type_size = (unsigned char)type_size;
+
+	return self;
+}
+
+// RegexLexer の分析結果から TokenArray を生成する
+static PyObject * _TokenArray_FromTokens( const std::vector<RegexLexer::Token> & tokens )
+{
+	Py_ssize_t max_pos = 0;
+	int min_type = 0;
+	int max_type = 0;
+	for( size_t i=0 ; i<tokens.size() ; ++i )
+	{
+		max_pos = std::max( max_pos, (Py_ssize_t)tokens[i].pos );
+		min_type = std::min( min_type, tokens[i].type );
+		max_type = std::max( max_type, tokens[i].type );
+	}
+
+	TokenArray_Object * self = _TokenArray_Create( tokens.size(), max_pos, min_type, max_type );
+	if(!self) return NULL;
+
+	for( size_t i=0 ; i<tokens.size() ; ++i )
+	{
+		_TokenArray_Set( self, i, tokens[i].pos, tokens[i].type );
+	}
+
+	return (PyObject*)self;
+}
+
+// TokenArray のイテレータ
+//
+// (pos,type) のタプルを返す。呼び出し側がタプルを保持していない場合は、同じタプルを使い回す。
+struct TokenArrayIter_Object
+{
+    PyObject_HEAD
+    TokenArray_Object * array;
+    Py_ssize_t index;
+    PyObject * result;
+};
+
+static void TokenArrayIter_dealloc(PyObject* self)
+{
+	Py_XDECREF( ((TokenArrayIter_Object*)self)->array );
+	Py_XDECREF( ((TokenArrayIter_Object*)self)->result );
+	PyObject_Del(self);
+}
+
+static PyObject * TokenArrayIter_next( PyObject * self )
+{
+	TokenArrayIter_Object * iter = (TokenArrayIter_Object*)self;
+	TokenArray_Object * array = iter->array;
+
+	if( !array || iter->index>=array->num )
+	{
+		Py_CLEAR(iter->array);
+		return NULL;
+	}
+
+	PyObject * pos = PyLong_FromSsize_t( _TokenArray_GetPos( array, iter->index ) );
+	PyObject * type = PyLong_FromLong( _TokenArray_GetType( array, iter->index ) );
+	if( !pos || !type )
+	{
+		Py_XDECREF(pos);
+		Py_XDECREF(type);
+		return NULL;
+	}
+
+	iter->index++;
+
+	PyObject * result = iter->result;
+	if( result && Py_REFCNT(result)==1 )
+	{
+		Py_DECREF( PyTuple_GET_ITEM(result,0) );
+		Py_DECREF( PyTuple_GET_ITEM(result,1) );
+	}
+	else
+	{
+		result = PyTuple_New(2);
+		if(!result)
+		{
+			Py_DECREF(pos);
+			Py_DECREF(type);
+			return NULL;
+		}
+		Py_XDECREF(iter->result);
+		iter->result = result;
+	}
+
+	PyTuple_SET_ITEM( result, 0, pos );
+	PyTuple_SET_ITEM( result, 1, type );
+
+	Py_INCREF(result);
+	return result;
+}
+
+static PyTypeObject TokenArrayIter_Type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+    "TokenArrayIterator",/* tp_name */
+    sizeof(TokenArrayIter_Object), /* tp_basicsize */
+    0,					/* tp_itemsize */
+    (destructor)TokenArrayIter_dealloc,/* tp_dealloc */
+    0,					/* tp_print */
+    0,					/* tp_getattr */
+    0,					/* tp_setattr */
+    0,					/* tp_reserved */
+    0, 					/* tp_repr */
+    0,					/* tp_as_number */
+    0,					/* tp_as_sequence */
+    0,					/* tp_as_mapping */
+    0,					/* tp_hash */
+    0,					/* tp_call */
+    0,					/* tp_str */
+    0,					/* tp_getattro */
+    0,					/* tp_setattro */
+    0,					/* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,	/* tp_flags */
+    "",					/* tp_doc */
+    0,					/* tp_traverse */
+    0,					/* tp_clear */
+    0,					/* tp_richcompare */
+    0,					/* tp_weaklistoffset */
+    PyObject_SelfIter,	/* tp_iter */
+    TokenArrayIter_next,/* tp_iternext */
+};
+
+static PyObject * TokenArray_iter( PyObject * self )
+{
+	TokenArrayIter_Object * iter = PyObject_New( TokenArrayIter_Object, &TokenArrayIter_Type );
+	if(!iter) return NULL;
+
+	Py_INCREF(self);
+	iter->array = (TokenArray_Object*)self;
+	iter->index = 0;
+	iter->result = NULL;
+
+	return (PyObject*)iter;
+}
+
+// TokenArray( [ (pos,type), ... ] )
+static PyObject * TokenArray_new( PyTypeObject * type, PyObject * args, PyObject * kwds )
+{
+	PyObject * pytokens;
+
+	if( ! PyArg_ParseTuple( args, "O", &pytokens ) )
+		return NULL;
+
+	PyObject * seq = PySequence_Fast( pytokens, "tokens must be a sequence." );
+	if(!seq) return NULL;
+
+	Py_ssize_t num = PySequence_Fast_GET_SIZE(seq);
+	PyObject ** items = PySequence_Fast_ITEMS(seq);
+
+	std::vector<RegexLexer::Token> tokens(num);
+
+	for( Py_ssize_t i=0 ; i<num ; ++i )
+	{
+		Py_ssize_t pos;
+		int token_type;
+		if( ! PyTuple_Check(items[i]) )
+		{
+			PyErr_SetString( PyExc_TypeError, "token must be a tuple (pos,type)." );
+			Py_DECREF(seq);
+			return NULL;
+		}
+		if( ! PyArg_ParseTuple( items[i], "ni", &pos, &token_type ) || pos<0 )
+		{
+			if( !PyErr_Occurred() ) PyErr_SetString( PyExc_ValueError, "token position out of range." );
+			Py_DECREF(seq);
+			return NULL;
+		}
+
+		if( pos>INT_MAX )
+		{
+			PyErr_SetString( PyExc_ValueError, "token position out of range." );
+			Py_DECREF(seq);
+			return NULL;
+		}
+
+		tokens[i].pos = (int)pos;
+		tokens[i].type = token_type;
+	}
+
+	Py_DECREF(seq);
+
+	return _TokenArray_FromTokens(tokens);
+}
+
+static void TokenArray_dealloc(PyObject* self)
+{
+	Py_TYPE(self)->tp_free(self);
+}
+
+static Py_ssize_t TokenArray_length( PyObject * self )
+{
+	return ((TokenArray_Object*)self)->num;
+}
+
+static PyObject * TokenArray_item( PyObject * self, Py_ssize_t i )
+{
+	TokenArray_Object * array = (TokenArray_Object*)self;
+
+	if( i<0 || i>=array->num )
+	{
+		PyErr_SetString( PyExc_IndexError, "index out of range." );
+		return NULL;
+	}
+
+	return Py_BuildValue( "(ni)", _TokenArray_GetPos(array,i), _TokenArray_GetType(array,i) );
+}
+
+static int TokenArray_getbuffer( PyObject * self, Py_buffer * view, int flags )
+{
+	return PyBuffer_FillInfo( view, self, ((TokenArray_Object*)self)->data, Py_SIZE(self), 1, flags );
+}
+
+static PySequenceMethods TokenArray_as_sequence = {
+	TokenArray_length,	/* sq_length */
+	0,					/* sq_concat */
+	0,					/* sq_repeat */
+	TokenArray_item,	/* sq_item */
+	0,					/* sq_slice */
+	0,					/* sq_ass_item */
+	0,					/* sq_ass_slice */
+	0,					/* sq_contains */
+	0,					/* sq_inplace_concat */
+	0,					/* sq_inplace_repeat */
+};
+
+static PyBufferProcs TokenArray_as_buffer = {
+	TokenArray_getbuffer,/* bf_getbuffer */
+	0,					/* bf_releasebuffer */
+};
+
+PyTypeObject TokenArray_Type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+    "TokenArray",		/* tp_name */
+    offsetof(TokenArray_Object,data), /* tp_basicsize */
+    1,					/* tp_itemsize */
+    (destructor)TokenArray_dealloc,/* tp_dealloc */
+    0,					/* tp_print */
+    0,					/* tp_getattr */
+    0,					/* tp_setattr */
+    0,					/* tp_reserved */
+    0, 					/* tp_repr */
+    0,					/* tp_as_number */
+    &TokenArray_as_sequence,/* tp_as_sequence */
+    0,					/* tp_as_mapping */
+    0,					/* tp_hash */
+    0,					/* tp_call */
+    0,					/* tp_str */
+    0,					/* tp_getattro */
+    0,					/* tp_setattro */
+    &TokenArray_as_buffer,/* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,	/* tp_flags */
+    "",					/* tp_doc */
+    0,					/* tp_traverse */
+    0,					/* tp_clear */
+    0,					/* tp_richcompare */
+    0,					/* tp_weaklistoffset */
+    TokenArray_iter,	/* tp_iter */
+    0,					/* tp_iternext */
+    0,					/* tp_methods */
+    0,					/* tp_members */
+    0,					/* tp_getset */
+    0,					/* tp_base */
+    0,					/* tp_dict */
+    0,					/* tp_descr_get */
+    0,					/* tp_descr_set */
+    0,					/* tp_dictoffset */
+    0,					/* tp_init */
+    0,					/* tp_alloc */
+    TokenArray_new,		/* tp_new */
+    0,					/* tp_free */
+};
+
+
+// ----------------------------------------------------------------------------
+//
+// ----------------------------------------------------------------------------
+
+static int LineIndex_init( PyObject * self, PyObject * args, PyObject * kwds)
+{
+	FUNC_TRACE;
+
+	const char * encoding_name;
+	Py_ssize_t offset = 0;
+	int sampling = 1;
+
+    static char * kwlist[] = {
+		"encoding",
+		"offset",
+		"sampling",
+		NULL
+    };
+
+    if(!PyArg_ParseTupleAndKeywords( args, kwds, "s|ni", kwlist,
+        &encoding_name, &offset, &sampling
+    ))
+    {
+        return -1;
+	}
+
+	TextCodec::Encoding encoding = TextCodec::GetEncoding(encoding_name);
+	bool utf16 = ( encoding==TextCodec::Encoding_Utf16LE || encoding==TextCodec::Encoding_Utf16BE );
+
+	((LineIndex_Object*)self)->p = new LineIndex( utf16 ? 2 : 1, encoding==TextCodec::Encoding_Utf16BE, offset, sampling );
+
+	return 0;
+}
+
+static void LineIndex_dealloc(PyObject* self)
+{
+	FUNC_TRACE;
+
+	delete ((LineIndex_Object*)self)->p;
+	self->ob_type->tp_free(self);
+}
+
+static PyObject * LineIndex_scan(PyObject* self, PyObject* args)
+{
+	Py_buffer data;
+	Py_ssize_t max_size = -1;
+
+	if( ! PyArg_ParseTuple(args, "y*|n", &data, &max_size ) )
+		return NULL;
+
+	LineIndex * line_index = ((LineIndex_Object*)self)->p;
+	bool completed;
+
+	Py_BEGIN_ALLOW_THREADS
+
+	completed = line_index->Scan( (const unsigned char*)data.buf, data.len, max_size<0 ? (size_t)-1 : max_size );
+
+	Py_END_ALLOW_THREADS
+
+	PyBuffer_Release(&data);
+
+	PyObject * pyret = completed ? Py_True : Py_False;
+	Py_INCREF(pyret);
+	return pyret;
+}
+
+static PyObject * LineIndex_numLines(PyObject* self, PyObject* args)
+{
+	if( ! PyArg_ParseTuple(args, "" ) )
+		return NULL;
+
+	LineIndex * line_index = ((LineIndex_Object*)self)->p;
+
+	return PyLong_FromSize_t( line_index->GetNumLines() );
+}
+
+static PyObject * LineIndex_scannedSize(PyObject* self, PyObject* args)
+{
+	if( ! PyArg_ParseTuple(args, "" ) )
+		return NULL;
+
+	LineIndex * line_index = ((LineIndex_Object*)self)->p;
+
+	return PyLong_FromUnsignedLongLong( line_index->GetScannedPos() );
+}
+
+static PyObject * LineIndex_memorySize(PyObject* self, PyObject* args)
+{
+	if( ! PyArg_ParseTuple(args, "" ) )
+		return NULL;
+
+	LineIndex * line_index = ((LineIndex_Object*)self)->p;
+
+	return PyLong_FromSize_t( line_index->GetMemorySize() );
+}
+
+static PyObject * LineIndex_getLineRange(PyObject* self, PyObject* args)
+{
+	Py_buffer data;
+	Py_ssize_t lineno;
+
+	if( ! PyArg_ParseTuple(args, "y*n", &data, &lineno ) )
+		return NULL;
+
+	LineIndex * line_index = ((LineIndex_Object*)self)->p;
+
+	size_t start = 0, end = 0;
+	bool result = false;
+
+	if( lineno>=0 )
+	{
+		// sampling が大きい場合は行の走査が入るので GIL を解放する
+		Py_BEGIN_ALLOW_THREADS
+
+		result = line_index->GetLineRange( (const unsigned char*)data.buf, data.len, lineno, &start, &end );
+
+		Py_END_ALLOW_THREADS
+	}
+
+	PyBuffer_Release(&data);
+
+	if(!result)
+	{
+		PyErr_SetString( PyExc_IndexError, "line index out of range." );
+		return NULL;
+	}
+
+	return Py_BuildValue( "(nn)", (Py_ssize_t)start, (Py_ssize_t)end );
+}
+
+static PyObject * LineIndex_dump(PyObject* self, PyObject* args)
+{
+	if( ! PyArg_ParseTuple(args, "" ) )
+		return NULL;
+
+	LineIndex * line_index = ((LineIndex_Object*)self)->p;
+
+	std::vector<unsigned char> buf;
+
+	Py_BEGIN_ALLOW_THREADS
+
+	line_index->Dump(&buf);
+
+	Py_END_ALLOW_THREADS
+
+	return PyBytes_FromStringAndSize( buf.empty() ? "" : (const char*)&buf[0], buf.size() );
+}
+
+static PyObject * LineIndex_load(PyObject* self, PyObject* args)
+{
+	Py_buffer data;
+
+	if( ! PyArg_ParseTuple(args, "y*", &data ) )
+		return NULL;
+
+	LineIndex * line_index = ((LineIndex_Object*)self)->p;
+	bool result;
+
+	Py_BEGIN_ALLOW_THREADS
+
+	result = line_index->Load( (const unsigned char*)data.buf, data.len );
+
+	Py_END_ALLOW_THREADS
+
+	PyBuffer_Release(&data);
+
+	PyObject * pyret = result ? Py_True : Py_False;
+	Py_INCREF(pyret);
+	return pyret;
+}
+
+static PyMethodDef LineIndex_methods[] = {
+    { "scan", LineIndex_scan, METH_VARARGS, "" },
+    { "numLines", LineIndex_numLines, METH_VARARGS, "" },
+    { "scannedSize", LineIndex_scannedSize, METH_VARARGS, "" },
+    { "memorySize", LineIndex_memorySize, METH_VARARGS, "" },
+    { "getLineRange", LineIndex_getLineRange, METH_VARARGS, "" },
+    { "dump", LineIndex_dump, METH_VARARGS, "" },
+    { "load", LineIndex_load, METH_VARARGS, "" },
+	{NULL,NULL}
+};
+
+PyTypeObject LineIndex_Type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+    "LineIndex",		/* tp_name */
+    sizeof(LineIndex_Object), /* tp_basicsize */
+    0,					/* tp_itemsize */
+    (destructor)LineIndex_dealloc,/* tp_dealloc */
+    0,					/* tp_print */
+    0,					/* tp_getattr */
+    0,					/* tp_setattr */
+    0,					/* tp_reserved */
+    0, 					/* tp_repr */
+    0,					/* tp_as_number */
+    0,					/* tp_as_sequence */
+    0,					/* tp_as_mapping */
+    0,					/* tp_hash */
+    0,					/* tp_call */
+    0,					/* tp_str */
+    PyObject_GenericGetAttr,/* tp_getattro */
+    PyObject_GenericSetAttr,/* tp_setattro */
+    0,					/* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,/* tp_flags */
+    "",					/* tp_doc */
+    0,					/* tp_traverse */
+    0,					/* tp_clear */
+    0,					/* tp_richcompare */
+    0,					/* tp_weaklistoffset */
+    0,					/* tp_iter */
+    0,					/* tp_iternext */
+    LineIndex_methods,	/* tp_methods */
+    0,					/* tp_members */
+    0,					/* tp_getset */
+    0,					/* tp_base */
+    0,					/* tp_dict */
+    0,					/* tp_descr_get */
+    0,					/* tp_descr_set */
+    0,					/* tp_dictoffset */
+    LineIndex_init,		/* tp_init */
+    0,					/* tp_alloc */
+    PyType_GenericNew,	/* tp_new */
+    0,					/* tp_free */
+};
+
+// ----------------------------------------------------------------------------
+//
+// ----------------------------------------------------------------------------
+
+// re モジュールのフラグ
+enum
+{
+	Re_IgnoreCase = 2,
+	Re_Locale = 4,
+	Re_Multiline = 8,
+	Re_DotAll = 16,
+	Re_Verbose = 64,
+	Re_Ascii = 256,
+};
+
+static bool _Regex_IsWord( unsigned int c )
+{
+	return Py_UNICODE_ISALNUM(c) || c=='_';
+}
+
+static bool _Regex_IsDigit( unsigned int c )
+{
+	return Py_UNICODE_ISDECIMAL(c)!=0;
+}
+
+static bool _Regex_IsSpace( unsigned int c )
+{
+	return Py_UNICODE_ISSPACE(c)!=0;
+}
+
+static unsigned int _Regex_ToLower( unsigned int c )
+{
+	return Py_UNICODE_TOLOWER(c);
+}
+
+// コンパイル済みの re のパターンオブジェクトを Regex::Pattern に変換する
+// 対応していない場合は false を返す
+static bool _Regex_PatternFromPyObject( PyObject * pyregex, Regex::Pattern * pattern )
+{
+	PyObject * pypattern = PyObject_GetAttrString( pyregex, "pattern" );
+	PyObject * pyflags = PyObject_GetAttrString( pyregex, "flags" );
+
+	bool result = false;
+
+	if( pypattern && pyflags && PyUnicode_Check(pypattern) && PyLong_Check(pyflags) && PyUnicode_READY(pypattern)==0 )
+	{
+		long flags = PyLong_AsLong(pyflags);
+
+		if( (flags & (Re_Locale|Re_Verbose))==0 )
+		{
+			pattern->flags = 0;
+			if( flags & Re_IgnoreCase ) pattern->flags |= Regex::Flag_IgnoreCase;
+			if( flags & Re_Multiline ) pattern->flags |= Regex::Flag_Multiline;
+			if( flags & Re_DotAll ) pattern->flags |= Regex::Flag_DotAll;
+			if( flags & Re_Ascii ) pattern->flags |= Regex::Flag_Ascii;
+
+			int kind = PyUnicode_KIND(pypattern);
+			void * data = PyUnicode_DATA(pypattern);
+			Py_ssize_t len = PyUnicode_GET_LENGTH(pypattern);
+
+			pattern->text.resize(len);
+			for( Py_ssize_t i=0 ; i<len ; ++i )
+			{
+				pattern->text[i] = PyUnicode_READ( kind, data, i );
+			}
+
+			result = true;
+		}
+	}
+
+	Py_XDECREF(pypattern);
+	Py_XDECREF(pyflags);
+	PyErr_Clear();
+
+	return result;
+}
+
+// ----------------------------------------------------------------------------
+//
+// ----------------------------------------------------------------------------
+
+// 分析する文字数の合計がこれ以上の場合だけ GIL を解放する
+// paint などで1行ずつ分析する場合は、GIL を手放した隙に他のスレッドに割り込まれないように保持したままにする
+static const size_t REGEXLEXER_RELEASE_GIL_CHARS = 64 * 1024;
+
+// 文字数の合計が多い場合だけ GIL を解放する
+// 解放した場合は、戻すための PyThreadState を返す
+static PyThreadState * _RegexLexer_ReleaseGIL( const std::vector<RegexLexer::LineText> & texts )
+{
+	size_t num_chars = 0;
+	for( size_t i=0 ; i<texts.size() ; ++i )
+	{
+		num_chars += texts[i].len;
+	}
+
+	return num_chars>=REGEXLEXER_RELEASE_GIL_CHARS ? PyEval_SaveThread() : NULL;
+}
+
+// コンテキストのオブジェクトに番号を割り当てる
+static int _RegexLexer_GetContextId( PyObject * self, PyObject * ctx )
+{
+	RegexLexer_Object * lexer = (RegexLexer_Object*)self;
+
+	PyObject * pyid = PyDict_GetItem( lexer->ctx_map, ctx );
+	if(pyid)
+	{
+		return PyLong_AsLong(pyid);
+	}
+
+	int id = (int)PyList_GET_SIZE(lexer->ctx_list);
+
+	pyid = PyLong_FromLong(id);
+	int ret = PyDict_SetItem( lexer->ctx_map, ctx, pyid );
+	Py_XDECREF(pyid);
+	if( ret<0 ) return -1;
+
+	if( PyList_Append( lexer->ctx_list, ctx )<0 ) return -1;
+
+	return id;
+}
+
+// ルールのトークンの種類と次のコンテキストを取得する
+// 対応していない場合は 0、エラーの場合は -1 を返す
+static int _RegexLexer_RuleFromPyObject( PyObject * self, PyObject * pyrule, RegexLexer::Rule * rule )
+{
+	Py_ssize_t rule_len = PySequence_Size(pyrule);
+	if( rule_len<2 ) return 0;
+
+	PyObject * pytokens = PySequence_GetItem( pyrule, 1 );
+	if(!pytokens) return -1;
+
+	int result = 1;
+
+	if( PyTuple_Check(pytokens) || PyList_Check(pytokens) )
+	{
+		rule->group_action = true;
+
+		Py_ssize_t num = PySequence_Size(pytokens);
+		for( Py_ssize_t i=0 ; i<num ; ++i )
+		{
+			PyObject * item = PySequence_GetItem( pytokens, i );
+			if( item && PyLong_Check(item) )
+			{
+				rule->tokens.push_back( PyLong_AsLong(item) );
+			}
+			else
+			{
+				result = 0;
+			}
+			Py_XDECREF(item);
+		}
+	}
+	else if( PyLong_Check(pytokens) )
+	{
+		rule->tokens.push_back( PyLong_AsLong(pytokens) );
+	}
+	else
+	{
+		result = 0;
+	}
+
+	Py_XDECREF(pytokens);
+
+	if( result>0 && rule_len>=3 )
+	{
+		PyObject * pynext = PySequence_GetItem( pyrule, 2 );
+		if(!pynext) return -1;
+
+		int is_true = PyObject_IsTrue(pynext);
+		if( is_true<0 )
+		{
+			result = -1;
+		}
+		else if( is_true )
+		{
+			rule->next_ctx = _RegexLexer_GetContextId( self, pynext );
+			if( rule->next_ctx<0 ) result = -1;
+		}
+
+		Py_XDECREF(pynext);
+	}
+
+	return result;
+}
+
+// rule_map の全てのコンテキストを RegexLexer に設定する
+static int _RegexLexer_SetRuleMap( PyObject * self, PyObject * rule_map, bool detail )
+{
+	RegexLexer * lexer = ((RegexLexer_Object*)self)->p;
+
+	PyObject * key;
+	PyObject * pyrule_list;
+	Py_ssize_t dict_pos = 0;
+
+	while( PyDict_Next( rule_map, &dict_pos, &key, &pyrule_list ) )
+	{
+		int ctx = _RegexLexer_GetContextId( self, key );
+		if( ctx<0 ) return -1;
+
+		RegexLexer::Context context;
+		bool supported = true;
+
+		Py_ssize_t num_rules = PySequence_Size(pyrule_list);
+		if( num_rules<0 ) return -1;
+
+		for( Py_ssize_t i=0 ; i<num_rules && supported ; ++i )
+		{
+			PyObject * pyrule = PySequence_GetItem( pyrule_list, i );
+			if(!pyrule) return -1;
+
+			PyObject * pyregex = PySequence_GetItem( pyrule, 0 );
+			if(!pyregex)
+			{
+				Py_XDECREF(pyrule);
+				return -1;
+			}
+
+			RegexLexer::Rule rule;
+			int ret = _RegexLexer_RuleFromPyObject( self, pyrule, &rule );
+
+			if( ret<0 )
+			{
+				Py_XDECREF(pyregex);
+				Py_XDECREF(pyrule);
+				return -1;
+			}
+			else if( ret==0 )
+			{
+				supported = false;
+			}
+			else if( pyregex==Py_None )
+			{
+				// デフォルトルールより後ろのルールは使われない
+				context.has_default = true;
+				context.default_rule = rule;
+				num_rules = i;
+			}
+			else
+			{
+				Regex::Pattern pattern;
+				if( _Regex_PatternFromPyObject( pyregex, &pattern ) )
+				{
+					context.patterns.push_back(pattern);
+					context.rules.push_back(rule);
+				}
+				else
+				{
+					supported = false;
+				}
+			}
+
+			Py_XDECREF(pyregex);
+			Py_XDECREF(pyrule);
+		}
+
+		// 対応していないルールを含むコンテキストは設定しない (Python の実装で分析する)
+		if(supported)
+		{
+			lexer->SetContext( ctx, detail, context );
+		}
+	}
+
+	return 0;
+}
+
+static int RegexLexer_init( PyObject * self, PyObject * args, PyObject * kwds)
+{
+	FUNC_TRACE;
+
+	PyObject * rule_map;
+	PyObject * rule_map_ctx;
+
+	if( ! PyArg_ParseTuple(args, "O!O!", &PyDict_Type, &rule_map, &PyDict_Type, &rule_map_ctx ) )
+		return -1;
+
+	RegexLexer_Object * lexer = (RegexLexer_Object*)self;
+
+	lexer->p = new RegexLexer();
+	lexer->ctx_map = PyDict_New();
+	lexer->ctx_list = PyList_New(0);
+
+	if( !lexer->ctx_map || !lexer->ctx_list ) return -1;
+
+	if( _RegexLexer_SetRuleMap( self, rule_map, true )<0 ) return -1;
+	if( _RegexLexer_SetRuleMap( self, rule_map_ctx, false )<0 ) return -1;
+
+	return 0;
+}
+
+static void RegexLexer_dealloc(PyObject* self)
+{
+	FUNC_TRACE;
+
+	RegexLexer_Object * lexer = (RegexLexer_Object*)self;
+
+	delete lexer->p;
+	Py_XDECREF(lexer->ctx_map);
+	Py_XDECREF(lexer->ctx_list);
+	self->ob_type->tp_free(self);
+}
+
+// 1行を分析する
+// 処理できない場合は false を返す
+static bool _RegexLexer_Lex( PyObject * self, PyObject * pyctx, PyObject * s, bool detail, std::vector<RegexLexer::Token> * tokens, int * end_ctx )
+{
+	RegexLexer_Object * lexer = (RegexLexer_Object*)self;
+
+	if( !pyctx || !s || !PyUnicode_Check(s) || PyUnicode_READY(s)<0 )
+	{
+		PyErr_Clear();
+		return false;
+	}
+
+	PyObject * pyid = PyDict_GetItem( lexer->ctx_map, pyctx );
+	if(!pyid)
+	{
+		PyErr_Clear();
+		return false;
+	}
+
+	int ctx = PyLong_AsLong(pyid);
+	int kind = PyUnicode_KIND(s);
+	void * data = PyUnicode_DATA(s);
+	size_t len = PyUnicode_GET_LENGTH(s);
+	bool result = false;
+
+	// 1行の分析は GIL を保持したまま行う
+	switch(kind)
+	{
+	case PyUnicode_1BYTE_KIND:
+		result = lexer->p->Lex( ctx, (const unsigned char*)data, len, detail, tokens, end_ctx );
+		break;
+	case PyUnicode_2BYTE_KIND:
+		result = lexer->p->Lex( ctx, (const unsigned short*)data, len, detail, tokens, end_ctx );
+		break;
+	case PyUnicode_4BYTE_KIND:
+		result = lexer->p->Lex( ctx, (const unsigned int*)data, len, detail, tokens, end_ctx );
+		break;
+	}
+
+	return result;
+}
+
+static PyObject * RegexLexer_lex(PyObject* self, PyObject* args)
+{
+	PyObject * pyctx;
+	PyObject * s;
+	int detail;
+
+	if( ! PyArg_ParseTuple(args, "OOi", &pyctx, &s, &detail ) )
+		return NULL;
+
+	std::vector<RegexLexer::Token> tokens;
+	int end_ctx;
+
+	if( ! _RegexLexer_Lex( self, pyctx, s, detail!=0, detail ? &tokens : NULL, &end_ctx ) )
+	{
+		Py_INCREF(Py_None);
+		return Py_None;
+	}
+
+	PyObject * pyend_ctx = PyList_GET_ITEM( ((RegexLexer_Object*)self)->ctx_list, end_ctx );
+
+	if(!detail)
+	{
+		Py_INCREF(pyend_ctx);
+		return pyend_ctx;
+	}
+
+	PyObject * pytokens = PyList_New(tokens.size());
+	if(!pytokens) return NULL;
+
+	for( size_t i=0 ; i<tokens.size() ; ++i )
+	{
+		PyList_SET_ITEM( pytokens, i, Py_BuildValue( "(ii)", tokens[i].pos, tokens[i].type ) );
+	}
+
+	PyObject * pyret = Py_BuildValue( "(NO)", pytokens, pyend_ctx );
+	return pyret;
+}
+
+static PyObject * RegexLexer_lexLine(PyObject* self, PyObject* args)
+{
+	PyObject * pyline;
+
+	if( ! PyArg_ParseTuple(args, "O!", &Line_Type, &pyline ) )
+		return NULL;
+
+	Line_Object * line = (Line_Object*)pyline;
+
+	std::vector<RegexLexer::Token> tokens;
+	int end_ctx;
+
+	if( ! _RegexLexer_Lex( self, line->ctx, line->s, true, &tokens, &end_ctx ) )
+	{
+		Py_INCREF(Py_False);
+		return Py_False;
+	}
+
+	PyObject * pytokens = _TokenArray_FromTokens(tokens);
+	if(!pytokens) return NULL;
+
+	Py_XDECREF( line->tokens );
+	line->tokens = pytokens;
+
+	Py_INCREF(Py_True);
+	return Py_True;
+}
+
+// 文字列とコンテキストを RegexLexer に渡す形式にする
+// 文字列は参照を増やして refs に追加する
+static bool _RegexLexer_GetTextState( PyObject * self, PyObject * s, PyObject * pyctx, RegexLexer::LineText * text, int * ctx, std::vector<PyObject*> * refs )
+{
+	if( !s || !PyUnicode_Check(s) || PyUnicode_READY(s)<0 )
+	{
+		PyErr_Clear();
+		return false;
+	}
+
+	Py_INCREF(s);
+	refs->push_back(s);
+
+	text->data = PyUnicode_DATA(s);
+	text->char_size = PyUnicode_KIND(s);
+	text->len = PyUnicode_GET_LENGTH(s);
+
+	if( !pyctx || pyctx==Py_None )
+	{
+		*ctx = RegexLexer::Context_None;
+	}
+	else
+	{
+		// 未知のコンテキストは、分析しようとすると失敗する番号にする
+		PyObject * pyid = PyDict_GetItem( ((RegexLexer_Object*)self)->ctx_map, pyctx );
+		*ctx = pyid ? PyLong_AsLong(pyid) : INT_MAX;
+		PyErr_Clear();
+	}
+
+	return true;
+}
+
+// 行の文字列とコンテキストを取得する関数と、コンテキストを設定する関数
+typedef std::function<bool( Py_ssize_t index, PyObject ** s, PyObject ** ctx )> _RegexLexer_GetState;
+typedef std::function<void( Py_ssize_t index, PyObject * ctx )> _RegexLexer_SetContext;
+
+// Line のリストと、文字列とコンテキストのリストの両方で使う、updateContexts の本体
+static PyObject * _RegexLexer_UpdateContexts( PyObject * self, Py_ssize_t num_lines, const _RegexLexer_GetState & get_state, const _RegexLexer_SetContext & set_ctx, Py_ssize_t start, Py_ssize_t stop, PyObject * root_ctx, Py_ssize_t max_lex )
+{
+	RegexLexer_Object * lexer = (RegexLexer_Object*)self;
+
+	stop = std::min( stop, num_lines );
+
+	// max_lex は Python の実装で1回に分析する行数なので、ワーカーの数だけ多く処理する
+	if( max_lex>=0 && start + max_lex * ThreadUtil::GetNumWorkers() < stop )
+	{
+		stop = start + max_lex * ThreadUtil::GetNumWorkers();
+	}
+
+	if( start<0 || start>=stop )
+	{
+		return Py_BuildValue( "(nNnO)", start, PyBool_FromLong(0), (Py_ssize_t)0, Py_None );
+	}
+
+	int root_id = _RegexLexer_GetContextId( self, root_ctx );
+	if( root_id<0 ) return NULL;
+
+	std::vector<PyObject*> refs;
+	std::vector<RegexLexer::LineText> texts( stop - start );
+	std::vector<int> ctxs( stop - start );
+
+	bool ok = true;
+	PyObject * s;
+	PyObject * pyctx;
+
+	RegexLexer::LineText prev_text;
+	int prev_ctx = root_id;
+	if( start>0 )
+	{
+		ok = get_state( start-1, &s, &pyctx ) && _RegexLexer_GetTextState( self, s, pyctx, &prev_text, &prev_ctx, &refs ) && prev_ctx>=0;
+	}
+
+	for( Py_ssize_t i=start ; i<stop && ok ; ++i )
+	{
+		ok = get_state( i, &s, &pyctx ) && _RegexLexer_GetTextState( self, s, pyctx, &texts[i-start], &ctxs[i-start], &refs );
+	}
+
+	size_t num_updated = 0;
+	bool prev_dirty = false;
+	size_t num_lexed = 0;
+
+	// コンテキストが変化した行の範囲
+	Py_ssize_t changed_begin = -1;
+	Py_ssize_t changed_end = -1;
+
+	if(ok)
+	{
+		std::vector<int> old_ctxs = ctxs;
+
+		PyThreadState * thread_state = _RegexLexer_ReleaseGIL(texts);
+
+		num_updated = lexer->p->UpdateContexts( start>0 ? &prev_text : NULL, prev_ctx, root_id, texts, &ctxs, &prev_dirty, &num_lexed );
+
+		if(thread_state) PyEval_RestoreThread(thread_state);
+
+		for( size_t i=0 ; i<num_updated ; ++i )
+		{
+			if( ctxs[i]==old_ctxs[i] ) continue;
+
+			if( changed_begin<0 ) changed_begin = start+i;
+			changed_end = start+i+1;
+
+			set_ctx( start+i, PyList_GET_ITEM( lexer->ctx_list, ctxs[i] ) );
+		}
+	}
+
+	for( size_t i=0 ; i<refs.size() ; ++i )
+	{
+		Py_DECREF(refs[i]);
+	}
+
+	if( num_updated==0 )
+	{
+		// 先頭の行から Python の実装で処理する
+		prev_dirty = !get_state( start, &s, &pyctx ) || !pyctx || pyctx==Py_None;
+	}
+
+	PyObject * pychanged;
+	if( changed_begin>=0 )
+	{
+		pychanged = Py_BuildValue( "(nn)", changed_begin, changed_end );
+	}
+	else
+	{
+		pychanged = Py_None;
+		Py_INCREF(pychanged);
+	}
+
+	return Py_BuildValue( "(nNnN)", (Py_ssize_t)(start+num_updated), PyBool_FromLong(prev_dirty), (Py_ssize_t)num_lexed, pychanged );
+}
+
+static PyObject * RegexLexer_updateContexts(PyObject* self, PyObject* args)
+{
+	PyObject * pylines;
+	Py_ssize_t start;
+	Py_ssize_t stop;
+	PyObject * root_ctx;
+	Py_ssize_t max_lex = -1;
+
+	if( ! PyArg_ParseTuple(args, "O!nnO|n", &PyList_Type, &pylines, &start, &stop, &root_ctx, &max_lex ) )
+		return NULL;
+
+	auto get_state = [pylines]( Py_ssize_t index, PyObject ** s, PyObject ** ctx ) -> bool
+	{
+		PyObject * pyline = PyList_GET_ITEM( pylines, index );
+		if( !Line_Check(pyline) ) return false;
+
+		*s = ((Line_Object*)pyline)->s;
+		*ctx = ((Line_Object*)pyline)->ctx;
+		return true;
+	};
+
+	// コンテキストが変化した行は、トークンを無効にする
+	auto set_ctx = [pylines]( Py_ssize_t index, PyObject * ctx )
+	{
+		Line_Object * line = (Line_Object*)PyList_GET_ITEM( pylines, index );
+
+		Py_INCREF(ctx);
+		Py_XDECREF(line->ctx);
+		line->ctx = ctx;
+
+		Py_CLEAR(line->tokens);
+	};
+
+	return _RegexLexer_UpdateContexts( self, PyList_GET_SIZE(pylines), get_state, set_ctx, start, stop, root_ctx, max_lex );
+}
+
+// 文字列のリストとコンテキストのリストに対して updateContexts と同じ処理を行う
+// バックグラウンドのスレッドが、ドキュメントのスナップショットに対して使う
+static PyObject * RegexLexer_updateContextList(PyObject* self, PyObject* args)
+{
+	PyObject * pytexts;
+	PyObject * pyctxs;
+	Py_ssize_t start;
+	Py_ssize_t stop;
+	PyObject * root_ctx;
+	Py_ssize_t max_lex = -1;
+
+	if( ! PyArg_ParseTuple(args, "O!O!nnO|n", &PyList_Type, &pytexts, &PyList_Type, &pyctxs, &start, &stop, &root_ctx, &max_lex ) )
+		return NULL;
+
+	if( PyList_GET_SIZE(pytexts)!=PyList_GET_SIZE(pyctxs) )
+	{
+		PyErr_SetString( PyExc_ValueError, "texts and ctxs must have the same length." );
+		return NULL;
+	}
+
+	auto get_state = [pytexts,pyctxs]( Py_ssize_t index, PyObject ** s, PyObject ** ctx ) -> bool
+	{
+		*s = PyList_GET_ITEM( pytexts, index );
+		*ctx = PyList_GET_ITEM( pyctxs, index );
+		return true;
+	};
+
+	auto set_ctx = [pyctxs]( Py_ssize_t index, PyObject * ctx )
+	{
+		Py_INCREF(ctx);
+		PyList_SetItem( pyctxs, index, ctx );
+	};
+
+	return _RegexLexer_UpdateContexts( self, PyList_GET_SIZE(pytexts), get_state, set_ctx, start, stop, root_ctx, max_lex );
+}
+
+// 文字列のリストとコンテキストのリストから、[start,stop) の行のトークンを分析する
+// TokenArray のリストを返す。このエンジンで分析できない行は None になる
+static PyObject * RegexLexer_lexTokenList(PyObject* self, PyObject* args)
+{
+	PyObject * pytexts;
+	PyObject * pyctxs;
+	Py_ssize_t start;
+	Py_ssize_t stop;
+
+	if( ! PyArg_ParseTuple(args, "O!O!nn", &PyList_Type, &pytexts, &PyList_Type, &pyctxs, &start, &stop ) )
+		return NULL;
+
+	RegexLexer_Object * lexer = (RegexLexer_Object*)self;
+
+	start = std::max( start, (Py_ssize_t)0 );
+	stop = std::min( stop, std::min( PyList_GET_SIZE(pytexts), PyList_GET_SIZE(pyctxs) ) );
+	Py_ssize_t num = std::max( stop - start, (Py_ssize_t)0 );
+
+	std::vector<PyObject*> refs;
+	std::vector<RegexLexer::LineText> texts(num);
+	std::vector<int> ctxs(num);
+	std::vector<char> valid(num);
+
+	for( Py_ssize_t i=0 ; i<num ; ++i )
+	{
+		valid[i] = _RegexLexer_GetTextState( self, PyList_GET_ITEM(pytexts,start+i), PyList_GET_ITEM(pyctxs,start+i), &texts[i], &ctxs[i], &refs ) && ctxs[i]>=0;
+	}
+
+	std::vector< std::vector<RegexLexer::Token> > tokens(num);
+
+	PyThreadState * thread_state = _RegexLexer_ReleaseGIL(texts);
+
+	for( Py_ssize_t i=0 ; i<num ; ++i )
+	{
+		int end_ctx;
+		if( valid[i] && !lexer->p->LexText( ctxs[i], texts[i], true, &tokens[i], &end_ctx ) )
+		{
+			valid[i] = false;
+		}
+	}
+
+	if(thread_state) PyEval_RestoreThread(thread_state);
+
+	for( size_t i=0 ; i<refs.size() ; ++i )
+	{
+		Py_DECREF(refs[i]);
+	}
+
+	PyObject * pyresult = PyList_New(num);
+	if(!pyresult) return NULL;
+
+	for( Py_ssize_t i=0 ; i<num ; ++i )
+	{
+		PyObject * pytokens;
+		if(valid[i])
+		{
+			pytokens = _TokenArray_FromTokens(tokens[i]);
+			if(!pytokens)
+			{
+				Py_DECREF(pyresult);
+				return NULL;
+			}
+		}
+		else
+		{
+			pytokens = Py_None;
+			Py_INCREF(pytokens);
+		}
+		PyList_SET_ITEM( pyresult, i, pytokens );
+	}
+
+	return pyresult;
+}
+
+static PyMethodDef RegexLexer_methods[] = {
+    { "lex", RegexLexer_lex, METH_VARARGS, "" },
+    { "lexLine", RegexLexer_lexLine, METH_VARARGS, "" },
+    { "updateContexts", RegexLexer_updateContexts, METH_VARARGS, "" },
+    { "updateContextList", RegexLexer_updateContextList, METH_VARARGS, "" },
+    { "lexTokenList", RegexLexer_lexTokenList, METH_VARARGS, "" },
+	{NULL,NULL}
+};
+
+PyTypeObject RegexLexer_Type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+    "RegexLexer",		/* tp_name */
+    sizeof(RegexLexer_Object), /* tp_basicsize */
+    0,					/* tp_itemsize */
+    (destructor)RegexLexer_dealloc,/* tp_dealloc */
+    0,					/* tp_print */
+    0,					/* tp_getattr */
+    0,					/* tp_setattr */
+    0,					/* tp_reserved */
+    0, 					/* tp_repr */
+    0,					/* tp_as_number */
+    0,					/* tp_as_sequence */
+    0,					/* tp_as_mapping */
+    0,					/* tp_hash */
+    0,					/* tp_call */
+    0,					/* tp_str */
+    PyObject_GenericGetAttr,/* tp_getattro */
+    PyObject_GenericSetAttr,/* tp_setattro */
+    0,					/* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,/* tp_flags */
+    "",					/* tp_doc */
+    0,					/* tp_traverse */
+    0,					/* tp_clear */
+    0,					/* tp_richcompare */
+    0,					/* tp_weaklistoffset */
+    0,					/* tp_iter */
+    0,					/* tp_iternext */
+    RegexLexer_methods,	/* tp_methods */
+    0,					/* tp_members */
+    0,					/* tp_getset */
+    0,					/* tp_base */
+    0,					/* tp_dict */
+    0,					/* tp_descr_get */
+    0,					/* tp_descr_set */
+    0,					/* tp_dictoffset */
+    RegexLexer_init,	/* tp_init */
+    0,					/* tp_alloc */
+    PyType_GenericNew,	/* tp_new */
+    0,					/* tp_free */
+};
+
+// ----------------------------------------------------------------------------
+//
+// ----------------------------------------------------------------------------
+
+// searchLines で GIL を解放してまとめて検索する行数と文字数
+static const Py_ssize_t TEXTSEARCH_BATCH_LINES = 16384;
+static const size_t TEXTSEARCH_BATCH_CHARS = 4 * 1024 * 1024;
+
+// SearchHitIndex.findLines で GIL を解放してまとめて検索する行数
+static const Py_ssize_t TEXTSEARCH_FIND_BATCH_LINES = 1024 * 1024;
+
+static int TextSearch_init( PyObject * self, PyObject * args, PyObject * kwds)
+{
+	FUNC_TRACE;
+
+	PyObject * pytext;
+	int word;
+	int case_sensitive;
+
+	if( ! PyArg_ParseTuple(args, "Uii", &pytext, &word, &case_sensitive ) )
+		return -1;
+
+	if( PyUnicode_READY(pytext)<0 )
+		return -1;
+
+	int kind = PyUnicode_KIND(pytext);
+	void * data = PyUnicode_DATA(pytext);
+	Py_ssize_t len = PyUnicode_GET_LENGTH(pytext);
+
+	std::vector<unsigned int> pattern(len);
+	for( Py_ssize_t i=0 ; i<len ; ++i )
+	{
+		pattern[i] = PyUnicode_READ( kind, data, i );
+	}
+
+	TextSearch_Object * search = (TextSearch_Object*)self;
+
+	delete search->p;
+	search->p = new TextSearch( pattern.data(), pattern.size(), case_sensitive==0, word!=0 );
+
+	return 0;
+}
+
+static void TextSearch_dealloc(PyObject* self)
+{
+	FUNC_TRACE;
+
+	TextSearch_Object * search = (TextSearch_Object*)self;
+
+	delete search->p;
+	self->ob_type->tp_free(self);
+}
+
+// 1つの文字列を検索する関数
+// text[pos,end) の中で、最も左で始まるマッチを探す
+// direction が負の場合は、text[0,end) の中で最も右で始まるマッチを探す
+// GIL を保持せずに呼び出される
+typedef std::function<bool( const TextSearch::LineText & text, size_t pos, size_t end, int direction, size_t * match_start, size_t * match_end )> _SearchFunc;
+
+static bool _TextSearch_Search( const TextSearch * search, const TextSearch::LineText & text, size_t pos, size_t end, int direction, size_t * match_start, size_t * match_end )
+{
+	bool found = false;
+
+	switch(text.char_size)
+	{
+	case PyUnicode_1BYTE_KIND:
+		if( direction<0 ) found = search->ReverseSearch( (const unsigned char*)text.data, text.len, end, match_start );
+		else found = search->Search( (const unsigned char*)text.data, text.len, pos, end, match_start );
+		break;
+	case PyUnicode_2BYTE_KIND:
+		if( direction<0 ) found = search->ReverseSearch( (const unsigned short*)text.data, text.len, end, match_start );
+		else found = search->Search( (const unsigned short*)text.data, text.len, pos, end, match_start );
+		break;
+	case PyUnicode_4BYTE_KIND:
+		if( direction<0 ) found = search->ReverseSearch( (const unsigned int*)text.data, text.len, end, match_start );
+		else found = search->Search( (const unsigned int*)text.data, text.len, pos, end, match_start );
+		break;
+	}
+
+	if(found)
+	{
+		*match_end = *match_start + search->GetLength();
+	}
+
+	return found;
+}
+
+static _SearchFunc _TextSearch_GetSearchFunc( PyObject * self )
+{
+	const TextSearch * search = ((TextSearch_Object*)self)->p;
+
+	return [search]( const TextSearch::LineText & text, size_t pos, size_t end, int direction, size_t * match_start, size_t * match_end )
+	{
+		return _TextSearch_Search( search, text, pos, end, direction, match_start, match_end );
+	};
+}
+
+// 文字列を検索し、( 開始位置, 終了位置 ) を返す
+static PyObject * _SearchString( const _SearchFunc & func, PyObject * s, Py_ssize_t pos, Py_ssize_t end, int direction )
+{
+	if( PyUnicode_READY(s)<0 )
+		return NULL;
+
+	TextSearch::LineText text;
+	text.data = PyUnicode_DATA(s);
+	text.char_size = PyUnicode_KIND(s);
+	text.len = PyUnicode_GET_LENGTH(s);
+
+	size_t match_start;
+	size_t match_end;
+	if( func( text, std::max<Py_ssize_t>(pos,0), std::max<Py_ssize_t>(end,0), direction, &match_start, &match_end ) )
+	{
+		return Py_BuildValue( "(nn)", (Py_ssize_t)match_start, (Py_ssize_t)match_end );
+	}
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject * TextSearch_search(PyObject* self, PyObject* args)
+{
+	PyObject * s;
+	Py_ssize_t pos = 0;
+	Py_ssize_t end = PY_SSIZE_T_MAX;
+
+	if( ! PyArg_ParseTuple(args, "U|nn", &s, &pos, &end ) )
+		return NULL;
+
+	return _SearchString( _TextSearch_GetSearchFunc(self), s, pos, end, 1 );
+}
+
+static PyObject * TextSearch_rsearch(PyObject* self, PyObject* args)
+{
+	PyObject * s;
+	Py_ssize_t end = PY_SSIZE_T_MAX;
+
+	if( ! PyArg_ParseTuple(args, "U|n", &s, &end ) )
+		return NULL;
+
+	return _SearchString( _TextSearch_GetSearchFunc(self), s, 0, end, -1 );
+}
+
+// リストの要素 (Line オブジェクトか文字列) の文字列を取得する
+// GIL を解放している間に別のスレッドからリストが変更されても良いように、文字列は参照を増やして refs に追加する
+static bool _TextSearch_GetLineText( PyObject * item, TextSearch::LineText * text, std::vector<PyObject*> * refs )
+{
+	PyObject * s = Line_Check(item) ? ((Line_Object*)item)->s : item;
+
+	if( !s || !PyUnicode_Check(s) )
+	{
+		PyErr_SetString( PyExc_TypeError, "item must be Line or string." );
+		return false;
+	}
+
+	if( PyUnicode_READY(s)<0 )
+		return false;
+
+	Py_INCREF(s);
+	refs->push_back(s);
+
+	text->data = PyUnicode_DATA(s);
+	text->char_size = PyUnicode_KIND(s);
+	text->len = PyUnicode_GET_LENGTH(s);
+
+	return true;
+}
+
+static void _TextSearch_ReleaseRefs( std::vector<PyObject*> * refs )
+{
+	for( size_t i=0 ; i<refs->size() ; ++i ) Py_DECREF( (*refs)[i] );
+	refs->clear();
+}
+
+// 行のリストを line から direction の方向に検索し、( 行番号, 開始位置, 終了位置 ) を返す
+// 最初の行は、前方の検索では index から、後方の検索では index までを検索する
+// リストの要素は Line オブジェクトか文字列
+static PyObject * _SearchLines( const _SearchFunc & func, PyObject * args )
+{
+	PyObject * lines;
+	Py_ssize_t line;
+	Py_ssize_t index;
+	int direction;
+	int oneline = 0;
+
+	if( ! PyArg_ParseTuple(args, "O!nni|i", &PyList_Type, &lines, &line, &index, &direction, &oneline ) )
+		return NULL;
+
+	int step = direction<0 ? -1 : 1;
+	const Py_ssize_t start_line = line;
+
+	std::vector<TextSearch::LineText> batch;
+	std::vector<PyObject*> refs;
+
+	while( 0<=line && line<PyList_GET_SIZE(lines) )
+	{
+		// GIL を保持している間に、次にまとめて検索する行の文字列を集める
+		// batch[i] は line + i*step 行目
+		batch.clear();
+
+		size_t num_chars = 0;
+		for( Py_ssize_t i=line ; 0<=i && i<PyList_GET_SIZE(lines) ; i+=step )
+		{
+			TextSearch::LineText text;
+			if( ! _TextSearch_GetLineText( PyList_GET_ITEM( lines, i ), &text, &refs ) )
+			{
+				_TextSearch_ReleaseRefs(&refs);
+				return NULL;
+			}
+
+			batch.push_back(text);
+
+			num_chars += text.len;
+			if( oneline || (Py_ssize_t)batch.size()>=TEXTSEARCH_BATCH_LINES || num_chars>=TEXTSEARCH_BATCH_CHARS ) break;
+		}
+
+		Py_ssize_t found_lineno = -1;
+		size_t match_start = 0;
+		size_t match_end = 0;
+
+		Py_BEGIN_ALLOW_THREADS
+
+		for( size_t i=0 ; i<batch.size() ; ++i )
+		{
+			const TextSearch::LineText & text = batch[i];
+			Py_ssize_t lineno = line + (Py_ssize_t)i * step;
+
+			size_t pos = 0;
+			size_t end = text.len;
+			if( lineno==start_line )
+			{
+				if( step>0 ) pos = std::max<Py_ssize_t>( index, 0 );
+				else end = std::max<Py_ssize_t>( index, 0 );
+			}
+
+			if( func( text, pos, end, step, &match_start, &match_end ) )
+			{
+				found_lineno = lineno;
+				break;
+			}
+		}
+
+		Py_END_ALLOW_THREADS
+
+		_TextSearch_ReleaseRefs(&refs);
+
+		if( found_lineno>=0 )
+		{
+			return Py_BuildValue( "(nnn)", found_lineno, (Py_ssize_t)match_start, (Py_ssize_t)match_end );
+		}
+
+		if( oneline || batch.empty() ) break;
+
+		line += (Py_ssize_t)batch.size() * step;
+	}
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+// 行をまたぐ検索で連結する行を取得する
+// リストの要素が文字列の場合は、最後の要素以外は後ろに改行があるものとして扱う
+static bool _MultiLine_GetLine( PyObject * lines, Py_ssize_t i, MultiLineText::Line * line, std::vector<PyObject*> * refs )
+{
+	PyObject * item = PyList_GET_ITEM( lines, i );
+
+	if( ! _TextSearch_GetLineText( item, &line->text, refs ) )
+		return false;
+
+	if( Line_Check(item) )
+	{
+		line->lineend = ( ((Line_Object*)item)->flags & ( Line_End_CR | Line_End_LF ) ) != 0;
+	}
+	else
+	{
+		line->lineend = i+1 < PyList_GET_SIZE(lines);
+	}
+
+	return true;
+}
+
+// 行のリストを改行でつないだ1つのテキストとして検索し、( 開始行, 開始位置, 終了行, 終了位置 ) を返す
+// 前方の検索では ( line, index ) 以降で始まる最初のマッチを探す
+// 後方の検索では ( line, index ) までで終わるマッチの中で、最も右で始まるものを探す
+//
+// ドキュメント全体は連結せずに、マッチの開始行の範囲を区切って、その後ろの max_lines-1 行も含めて連結して検索する。
+// そのため、各行から始まるマッチは、少なくともその行から max_lines 行の範囲で探される。
+static PyObject * _SearchMultiLine( const _SearchFunc & func, PyObject * args )
+{
+	PyObject * lines;
+	Py_ssize_t line;
+	Py_ssize_t index;
+	int direction;
+	Py_ssize_t max_lines;
+
+	if( ! PyArg_ParseTuple(args, "O!nnin", &PyList_Type, &lines, &line, &index, &direction, &max_lines ) )
+		return NULL;
+
+	const Py_ssize_t num_lines = PyList_GET_SIZE(lines);
+
+	if( line<0 || line>=num_lines )
+	{
+		Py_INCREF(Py_None);
+		return Py_None;
+	}
+
+	index = std::max<Py_ssize_t>( index, 0 );
+	max_lines = std::max<Py_ssize_t>( max_lines, 1 );
+
+	// マッチの開始行の範囲 [begin,end)
+	Py_ssize_t begin = line;
+	Py_ssize_t end = line+1;
+
+	std::vector<MultiLineText::Line> window;
+	std::vector<PyObject*> refs;
+	MultiLineText text;
+
+	while(true)
+	{
+		// GIL を保持している間に、マッチの開始行の範囲を決めて、連結する行を集める
+		window.clear();
+
+		size_t num_chars = 0;
+		if( direction>=0 )
+		{
+			for( end=begin ; end<num_lines ; ++end )
+			{
+				if( (Py_ssize_t)window.size()>=TEXTSEARCH_BATCH_LINES || num_chars>=TEXTSEARCH_BATCH_CHARS ) break;
+
+				MultiLineText::Line item;
+				if( ! _MultiLine_GetLine( lines, end, &item, &refs ) )
+				{
+					_TextSearch_ReleaseRefs(&refs);
+					return NULL;
+				}
+
+				window.push_back(item);
+				num_chars += item.text.len;
+			}
+		}
+		else
+		{
+			for( begin=end ; begin>0 ; --begin )
+			{
+				if( (Py_ssize_t)window.size()>=TEXTSEARCH_BATCH_LINES || num_chars>=TEXTSEARCH_BATCH_CHARS ) break;
+
+				MultiLineText::Line item;
+				if( ! _MultiLine_GetLine( lines, begin-1, &item, &refs ) )
+				{
+					_TextSearch_ReleaseRefs(&refs);
+					return NULL;
+				}
+
+				window.push_back(item);
+				num_chars += item.text.len;
+			}
+
+			std::reverse( window.begin(), window.end() );
+		}
+
+		// マッチが続く可能性のある行
+		// 後方の検索では、( line, index ) より後ろは検索しない
+		Py_ssize_t window_end = std::min( end + max_lines - 1, direction>=0 ? num_lines : line+1 );
+		for( Py_ssize_t i=end ; i<window_end ; ++i )
+		{
+			MultiLineText::Line item;
+			if( ! _MultiLine_GetLine( lines, i, &item, &refs ) )
+			{
+				_TextSearch_ReleaseRefs(&refs);
+				return NULL;
+			}
+
+			window.push_back(item);
+		}
+
+		bool found = false;
+		size_t match_start = 0;
+		size_t match_end = 0;
+
+		Py_BEGIN_ALLOW_THREADS
+
+		text.Assign( window.data(), window.size() );
+		TextSearch::LineText t = text.GetText();
+
+		// 連結した範囲がドキュメントの最後 (後方の検索では ( line, index ) ) まで達している場合は、どこで始まるマッチも対象にする
+		// そうでない場合は、最後の改行の後ろは次の範囲の行の先頭なので、そこで始まるマッチは対象にしない
+		size_t limit = ( window_end < ( direction>=0 ? num_lines : line+1 ) ) ? text.GetOffset( end-begin, 0 ) : t.len + 1;
+
+		if( direction>=0 )
+		{
+			size_t pos = ( begin==line ) ? text.GetOffset( 0, index ) : 0;
+			found = func( t, pos, t.len, 1, &match_start, &match_end ) && match_start<limit;
+		}
+		else
+		{
+			size_t stop = ( window_end==line+1 ) ? text.GetOffset( line-begin, index ) : t.len;
+
+			// 開始位置を進めながら前方に検索を繰り返し、開始行の範囲で最も右で始まるマッチを探す
+			size_t p = 0;
+			size_t start;
+			size_t last;
+			while( p<=stop && func( t, p, stop, 1, &start, &last ) && start<limit )
+			{
+				match_start = start;
+				match_end = last;
+				found = true;
+				p = start+1;
+			}
+		}
+
+		Py_END_ALLOW_THREADS
+
+		_TextSearch_ReleaseRefs(&refs);
+
+		if(found)
+		{
+			size_t start_line, start_index, end_line, end_index;
+			text.GetPosition( match_start, &start_line, &start_index );
+			text.GetPosition( match_end, &end_line, &end_index );
+
+			return Py_BuildValue( "(nnnn)", begin + (Py_ssize_t)start_line, (Py_ssize_t)start_index, begin + (Py_ssize_t)end_line, (Py_ssize_t)end_index );
+		}
+
+		if( direction>=0 )
+		{
+			if( end>=num_lines ) break;
+			begin = end;
+		}
+		else
+		{
+			if( begin<=0 ) break;
+			end = begin;
+		}
+	}
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject * TextSearch_searchLines(PyObject* self, PyObject* args)
+{
+	return _SearchLines( _TextSearch_GetSearchFunc(self), args );
+}
+
+static PyObject * TextSearch_searchMultiLine(PyObject* self, PyObject* args)
+{
+	return _SearchMultiLine( _TextSearch_GetSearchFunc(self), args );
+}
+
+static PyMethodDef TextSearch_methods[] = {
+    { "search", TextSearch_search, METH_VARARGS, "" },
+    { "rsearch", TextSearch_rsearch, METH_VARARGS, "" },
+    { "searchLines", TextSearch_searchLines, METH_VARARGS, "" },
+    { "searchMultiLine", TextSearch_searchMultiLine, METH_VARARGS, "" },
+	{NULL,NULL}
+};
+
+PyTypeObject TextSearch_Type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+    "TextSearch",		/* tp_name */
+    sizeof(TextSearch_Object), /* tp_basicsize */
+    0,					/* tp_itemsize */
+    (destructor)TextSearch_dealloc,/* tp_dealloc */
+    0,					/* tp_print */
+    0,					/* tp_getattr */
+    0,					/* tp_setattr */
+    0,					/* tp_reserved */
+    0, 					/* tp_repr */
+    0,					/* tp_as_number */
+    0,					/* tp_as_sequence */
+    0,					/* tp_as_mapping */
+    0,					/* tp_hash */
+    0,					/* tp_call */
+    0,					/* tp_str */
+    PyObject_GenericGetAttr,/* tp_getattro */
+    PyObject_GenericSetAttr,/* tp_setattro */
+    0,					/* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,/* tp_flags */
+    "",					/* tp_doc */
+    0,					/* tp_traverse */
+    0,					/* tp_clear */
+    0,					/* tp_richcompare */
+    0,					/* tp_weaklistoffset */
+    0,					/* tp_iter */
+    0,					/* tp_iternext */
+    TextSearch_methods,	/* tp_methods */
+    0,					/* tp_members */
+    0,					/* tp_getset */
+    0,					/* tp_base */
+    0,					/* tp_dict */
+    0,					/* tp_descr_get */
+    0,					/* tp_descr_set */
+    0,					/* tp_dictoffset */
+    TextSearch_init,	/* tp_init */
+    0,					/* tp_alloc */
+    PyType_GenericNew,	/* tp_new */
+    0,					/* tp_free */
+};
+
+// ----------------------------------------------------------------------------
+//
+// ----------------------------------------------------------------------------
+
+static int Regex_init( PyObject * self, PyObject * args, PyObject * kwds)
+{
+	FUNC_TRACE;
+
+	PyObject * pyregex;
+
+	if( ! PyArg_ParseTuple(args, "O", &pyregex ) )
+		return -1;
+
+	// 対応していない構文の場合は、呼び出し側で re を使う
+	std::vector<Regex::Pattern> patterns(1);
+	if( ! _Regex_PatternFromPyObject( pyregex, &patterns[0] ) )
+	{
+		PyErr_SetString( PyExc_ValueError, "unsupported pattern." );
+		return -1;
+	}
+
+	Regex * regex = new Regex();
+	if( ! regex->Compile(patterns) )
+	{
+		delete regex;
+		PyErr_SetString( PyExc_ValueError, "unsupported pattern." );
+		return -1;
+	}
+
+	Regex_Object * regex_object = (Regex_Object*)self;
+
+	delete regex_object->p;
+	regex_object->p = regex;
+
+	return 0;
+}
+
+static void Regex_dealloc(PyObject* self)
+{
+	FUNC_TRACE;
+
+	Regex_Object * regex_object = (Regex_Object*)self;
+
+	delete regex_object->p;
+	self->ob_type->tp_free(self);
+}
+
+// text[pos,end) の中で、最も左で始まるマッチを探す
+// end をテキストの終端として扱う (re の search(string,pos,endpos) と同じ)
+static bool _Regex_SearchText( const Regex * regex, const TextSearch::LineText & text, size_t pos, size_t end, size_t * match_start, size_t * match_end )
+{
+	Regex::Match match;
+	bool found = false;
+
+	switch(text.char_size)
+	{
+	case PyUnicode_1BYTE_KIND:
+		found = regex->Search( (const unsigned char*)text.data, end, pos, &match, false );
+		break;
+	case PyUnicode_2BYTE_KIND:
+		found = regex->Search( (const unsigned short*)text.data, end, pos, &match, false );
+		break;
+	case PyUnicode_4BYTE_KIND:
+		found = regex->Search( (const unsigned int*)text.data, end, pos, &match, false );
+		break;
+	}
+
+	if(found)
+	{
+		*match_start = match.Start();
+		*match_end = match.End();
+	}
+
+	return found;
+}
+
+static _SearchFunc _Regex_GetSearchFunc( PyObject * self )
+{
+	const Regex * regex = ((Regex_Object*)self)->p;
+
+	return [regex]( const TextSearch::LineText & text, size_t pos, size_t end, int direction, size_t * match_start, size_t * match_end )
+	{
+		end = std::min( end, text.len );
+
+		if( direction>=0 )
+		{
+			return _Regex_SearchText( regex, text, pos, end, match_start, match_end );
+		}
+
+		// 開始位置を1文字ずつ進めながら検索を繰り返し、最も右で始まるマッチを探す
+		// (Search.rsearch で re の search を繰り返すのと同じ結果になる)
+		bool found = false;
+		size_t p = 0;
+		size_t start;
+		size_t stop;
+
+		while( p<text.len && _Regex_SearchText( regex, text, p, end, &start, &stop ) )
+		{
+			if( !found || start>*match_start )
+			{
+				*match_start = start;
+				*match_end = stop;
+				found = true;
+			}
+			p = start+1;
+		}
+
+		return found;
+	};
+}
+
+static PyObject * Regex_search(PyObject* self, PyObject* args)
+{
+	PyObject * s;
+	Py_ssize_t pos = 0;
+	Py_ssize_t end = PY_SSIZE_T_MAX;
+
+	if( ! PyArg_ParseTuple(args, "U|nn", &s, &pos, &end ) )
+		return NULL;
+
+	return _SearchString( _Regex_GetSearchFunc(self), s, pos, end, 1 );
+}
+
+static PyObject * Regex_rsearch(PyObject* self, PyObject* args)
+{
+	PyObject * s;
+	Py_ssize_t end = PY_SSIZE_T_MAX;
+
+	if( ! PyArg_ParseTuple(args, "U|n", &s, &end ) )
+		return NULL;
+
+	return _SearchString( _Regex_GetSearchFunc(self), s, 0, end, -1 );
+}
+
+static PyObject * Regex_searchLines(PyObject* self, PyObject* args)
+{
+	return _SearchLines( _Regex_GetSearchFunc(self), args );
+}
+
+static PyObject * Regex_searchMultiLine(PyObject* self, PyObject* args)
+{
+	return _SearchMultiLine( _Regex_GetSearchFunc(self), args );
+}
+
+static PyMethodDef Regex_methods[] = {
+    { "search", Regex_search, METH_VARARGS, "" },
+    { "rsearch", Regex_rsearch, METH_VARARGS, "" },
+    { "searchLines", Regex_searchLines, METH_VARARGS, "" },
+    { "searchMultiLine", Regex_searchMultiLine, METH_VARARGS, "" },
+	{NULL,NULL}
+};
+
+PyTypeObject Regex_Type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+    "Regex",			/* tp_name */
+    sizeof(Regex_Object), /* tp_basicsize */
+    0,					/* tp_itemsize */
+    (destructor)Regex_dealloc,/* tp_dealloc */
+    0,					/* tp_print */
+    0,					/* tp_getattr */
+    0,					/* tp_setattr */
+    0,					/* tp_reserved */
+    0, 					/* tp_repr */
+    0,					/* tp_as_number */
+    0,					/* tp_as_sequence */
+    0,					/* tp_as_mapping */
+    0,					/* tp_hash */
+    0,					/* tp_call */
+    0,					/* tp_str */
+    PyObject_GenericGetAttr,/* tp_getattro */
+    PyObject_GenericSetAttr,/* tp_setattro */
+    0,					/* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,/* tp_flags */
+    "",					/* tp_doc */
+    0,					/* tp_traverse */
+    0,					/* tp_clear */
+    0,					/* tp_richcompare */
+    0,					/* tp_weaklistoffset */
+    0,					/* tp_iter */
+    0,					/* tp_iternext */
+    Regex_methods,		/* tp_methods */
+    0,					/* tp_members */
+    0,					/* tp_getset */
+    0,					/* tp_base */
+    0,					/* tp_dict */
+    0,					/* tp_descr_get */
+    0,					/* tp_descr_set */
+    0,					/* tp_dictoffset */
+    Regex_init,			/* tp_init */
+    0,					/* tp_alloc */
+    PyType_GenericNew,	/* tp_new */
+    0,					/* tp_free */
+};
+
+// ----------------------------------------------------------------------------
+//
+// ----------------------------------------------------------------------------
+
+static int SearchHitIndex_init( PyObject * self, PyObject * args, PyObject * kwds)
+{
+	FUNC_TRACE;
+
+	if( ! PyArg_ParseTuple(args, "") )
+		return -1;
+
+	SearchHitIndex_Object * index = (SearchHitIndex_Object*)self;
+
+	delete index->p;
+	index->p = new SearchHitIndex();
+
+	return 0;
+}
+
+static void SearchHitIndex_dealloc(PyObject* self)
+{
+	FUNC_TRACE;
+
+	SearchHitIndex_Object * index = (SearchHitIndex_Object*)self;
+
+	delete index->p;
+	self->ob_type->tp_free(self);
+}
+
+static Py_ssize_t SearchHitIndex_length( PyObject * self )
+{
+	return ((SearchHitIndex_Object*)self)->p->Size();
+}
+
+static PyObject * SearchHitIndex_item( PyObject * self, Py_ssize_t i )
+{
+	SearchHitIndex * index = ((SearchHitIndex_Object*)self)->p;
+
+	if( i<0 || i>=(Py_ssize_t)index->Size() )
+	{
+		PyErr_SetString( PyExc_IndexError, "index out of range." );
+		return NULL;
+	}
+
+	SearchHit hit = index->Get(i);
+	return Py_BuildValue( "(nII)", (Py_ssize_t)hit.line, hit.start, hit.end );
+}
+
+// 行の中のヒットの ( 開始位置, 終了位置 ) のリストを返す
+static PyObject * SearchHitIndex_getLineHits(PyObject* self, PyObject* args)
+{
+	Py_ssize_t line;
+
+	if( ! PyArg_ParseTuple(args, "n", &line ) )
+		return NULL;
+
+	SearchHitIndex * index = ((SearchHitIndex_Object*)self)->p;
+
+	size_t begin = line>=0 ? index->LowerBound( line, 0 ) : index->Size();
+	size_t end = line>=0 ? index->LowerBound( line+1, 0 ) : index->Size();
+
+	PyObject * pyresult = PyList_New( end-begin );
+	if(!pyresult) return NULL;
+
+	for( size_t i=begin ; i<end ; ++i )
+	{
+		SearchHit hit = index->Get(i);
+		PyList_SET_ITEM( pyresult, i-begin, Py_BuildValue( "(II)", hit.start, hit.end ) );
+	}
+
+	return pyresult;
+}
+
+// ( line, index ) より後ろの最初のヒットの番号を返す
+static PyObject * SearchHitIndex_findNext(PyObject* self, PyObject* args)
+{
+	Py_ssize_t line;
+	Py_ssize_t pos;
+
+	if( ! PyArg_ParseTuple(args, "nn", &line, &pos ) )
+		return NULL;
+
+	size_t number;
+	if( ((SearchHitIndex_Object*)self)->p->FindNext( std::max<Py_ssize_t>(line,0), std::max<Py_ssize_t>(pos,0), &number ) )
+	{
+		return PyLong_FromSize_t(number);
+	}
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+// ( line, index ) より前の最後のヒットの番号を返す
+static PyObject * SearchHitIndex_findPrev(PyObject* self, PyObject* args)
+{
+	Py_ssize_t line;
+	Py_ssize_t pos;
+
+	if( ! PyArg_ParseTuple(args, "nn", &line, &pos ) )
+		return NULL;
+
+	size_t number;
+	if( line>=0 && ((SearchHitIndex_Object*)self)->p->FindPrev( line, std::max<Py_ssize_t>(pos,0), &number ) )
+	{
+		return PyLong_FromSize_t(number);
+	}
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+// 行 [line,line+old_count) を new_count 行に置き換え、その範囲のヒットを ( 行番号, 開始位置, 終了位置 ) のシーケンスで指定する
+static PyObject * SearchHitIndex_replaceLines(PyObject* self, PyObject* args)
+{
+	Py_ssize_t line;
+	Py_ssize_t old_count;
+	Py_ssize_t new_count;
+	PyObject * pyhits;
+
+	if( ! PyArg_ParseTuple(args, "nnnO", &line, &old_count, &new_count, &pyhits ) )
+		return NULL;
+
+	if( line<0 || old_count<0 || new_count<0 )
+	{
+		PyErr_SetString( PyExc_ValueError, "invalid line range." );
+		return NULL;
+	}
+
+	PyObject * pyhits_fast = PySequence_Fast( pyhits, "hits must be a sequence." );
+	if(!pyhits_fast) return NULL;
+
+	Py_ssize_t num = PySequence_Fast_GET_SIZE(pyhits_fast);
+	std::vector<SearchHit> hits(num);
+
+	for( Py_ssize_t i=0 ; i<num ; ++i )
+	{
+		PyObject * item = PySequence_Fast_GET_ITEM( pyhits_fast, i );
+
+		if( !PyTuple_Check(item) )
+		{
+			Py_DECREF(pyhits_fast);
+			PyErr_SetString( PyExc_TypeError, "hit must be a tuple." );
+			return NULL;
+		}
+
+		Py_ssize_t hit_line;
+		Py_ssize_t start;
+		Py_ssize_t end;
+		if( ! PyArg_ParseTuple( item, "nnn", &hit_line, &start, &end ) )
+		{
+			Py_DECREF(pyhits_fast);
+			return NULL;
+		}
+
+		// 範囲の外のヒットや、順番に並んでいないヒットは受け付けない
+		if( hit_line<line || hit_line>=line+new_count || start<0 || end<start
+			|| ( i>0 && ( (size_t)hit_line<hits[i-1].line || ( (size_t)hit_line==hits[i-1].line && (size_t)start<hits[i-1].start ) ) ) )
+		{
+			Py_DECREF(pyhits_fast);
+			PyErr_SetString( PyExc_ValueError, "invalid hit." );
+			return NULL;
+		}
+
+		hits[i].line = hit_line;
+		hits[i].start = (unsigned int)start;
+		hits[i].end = (unsigned int)end;
+	}
+
+	Py_DECREF(pyhits_fast);
+
+	((SearchHitIndex_Object*)self)->p->ReplaceLines( line, old_count, new_count, hits );
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+// 行 [line,line+old_count) を new_count 行に置き換え、lines[line:line+new_count] を TextSearch か Regex で検索したヒットを登録する
+static PyObject * SearchHitIndex_findLines(PyObject* self, PyObject* args)
+{
+	PyObject * pysearch;
+	PyObject * lines;
+	Py_ssize_t line;
+	Py_ssize_t old_count;
+	Py_ssize_t new_count;
+
+	if( ! PyArg_ParseTuple(args, "OO!nnn", &pysearch, &PyList_Type, &lines, &line, &old_count, &new_count ) )
+		return NULL;
+
+	_SearchFunc search_func;
+	if( TextSearch_Check(pysearch) )
+	{
+		search_func = _TextSearch_GetSearchFunc(pysearch);
+	}
+	else if( Regex_Check(pysearch) )
+	{
+		search_func = _Regex_GetSearchFunc(pysearch);
+	}
+	else
+	{
+		PyErr_SetString( PyExc_TypeError, "search must be TextSearch or Regex." );
+		return NULL;
+	}
+
+	if( line<0 || old_count<0 || new_count<0 || line+new_count>PyList_GET_SIZE(lines) )
+	{
+		PyErr_SetString( PyExc_ValueError, "invalid line range." );
+		return NULL;
+	}
+
+	auto find = [&search_func]( const TextSearch::LineText & text, size_t pos, size_t * match_start, size_t * match_end )
+	{
+		return search_func( text, pos, text.len, 1, match_start, match_end );
+	};
+
+	std::vector<SearchHit> hits;
+	std::vector<TextSearch::LineText> batch;
+	std::vector<PyObject*> refs;
+
+	for( Py_ssize_t batch_start=line ; batch_start<line+new_count ; batch_start+=TEXTSEARCH_FIND_BATCH_LINES )
+	{
+		Py_ssize_t batch_end = std::min( batch_start+TEXTSEARCH_FIND_BATCH_LINES, line+new_count );
+
+		batch.clear();
+		for( Py_ssize_t i=batch_start ; i<batch_end ; ++i )
+		{
+			TextSearch::LineText text;
+			if( ! _TextSearch_GetLineText( PyList_GET_ITEM( lines, i ), &text, &refs ) )
+			{
+				_TextSearch_ReleaseRefs(&refs);
+				return NULL;
+			}
+			batch.push_back(text);
+		}
+
+		Py_BEGIN_ALLOW_THREADS
+
+		SearchHitIndex::FindAll( batch.data(), batch.size(), batch_start, find, &hits );
+
+		Py_END_ALLOW_THREADS
+
+		_TextSearch_ReleaseRefs(&refs);
+	}
+
+	((SearchHitIndex_Object*)self)->p->ReplaceLines( line, old_count, new_count, hits );
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyMethodDef SearchHitIndex_methods[] = {
+    { "getLineHits", SearchHitIndex_getLineHits, METH_VARARGS, "" },
+    { "findNext", SearchHitIndex_findNext, METH_VARARGS, "" },
+    { "findPrev", SearchHitIndex_findPrev, METH_VARARGS, "" },
+    { "replaceLines", SearchHitIndex_replaceLines, METH_VARARGS, "" },
+    { "findLines", SearchHitIndex_findLines, METH_VARARGS, "" },
+	{NULL,NULL}
+};
+
+static PySequenceMethods SearchHitIndex_as_sequence = {
+	SearchHitIndex_length,	/* sq_length */
+	0,					/* sq_concat */
+	0,					/* sq_repeat */
+	SearchHitIndex_item,/* sq_item */
+	0,					/* sq_slice */
+	0,					/* sq_ass_item */
+	0,					/* sq_ass_slice */
+	0,					/* sq_contains */
+	0,					/* sq_inplace_concat */
+	0,					/* sq_inplace_repeat */
+};
+
+PyTypeObject SearchHitIndex_Type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+    "SearchHitIndex",	/* tp_name */
+    sizeof(SearchHitIndex_Object), /* tp_basicsize */
+    0,					/* tp_itemsize */
+    (destructor)SearchHitIndex_dealloc,/* tp_dealloc */
+    0,					/* tp_print */
+    0,					/* tp_getattr */
+    0,					/* tp_setattr */
+    0,					/* tp_reserved */
+    0, 					/* tp_repr */
+    0,					/* tp_as_number */
+    &SearchHitIndex_as_sequence,/* tp_as_sequence */
+    0,					/* tp_as_mapping */
+    0,					/* tp_hash */
+    0,					/* tp_call */
+    0,					/* tp_str */
+    PyObject_GenericGetAttr,/* tp_getattro */
+    PyObject_GenericSetAttr,/* tp_setattro */
+    0,					/* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,/* tp_flags */
+    "",					/* tp_doc */
+    0,					/* tp_traverse */
+    0,					/* tp_clear */
+    0,					/* tp_richcompare */
+    0,					/* tp_weaklistoffset */
+    0,					/* tp_iter */
+    0,					/* tp_iternext */
+    SearchHitIndex_methods,/* tp_methods */
+    0,					/* tp_members */
+    0,					/* tp_getset */
+    0,					/* tp_base */
+    0,					/* tp_dict */
+    0,					/* tp_descr_get */
+    0,					/* tp_descr_set */
+    0,					/* tp_dictoffset */
+    SearchHitIndex_init,/* tp_init */
+    0,					/* tp_alloc */
+    PyType_GenericNew,	/* tp_new */
+    0,					/* tp_free */
+};
+
+// ----------------------------------------------------------------------------
+//
+// ----------------------------------------------------------------------------
+
+static int WordIndex_init( PyObject * self, PyObject * args, PyObject * kwds)
+{
+	FUNC_TRACE;
+
+	if( ! PyArg_ParseTuple(args, "") )
+		return -1;
+
+	WordIndex_Object * index = (WordIndex_Object*)self;
+
+	delete index->p;
+	index->p = new WordIndex();
+
+	return 0;
+}
+
+static void WordIndex_dealloc(PyObject* self)
+{
+	FUNC_TRACE;
+
+	WordIndex_Object * index = (WordIndex_Object*)self;
+
+	delete index->p;
+	self->ob_type->tp_free(self);
+}
+
+static Py_ssize_t WordIndex_length( PyObject * self )
+{
+	return ((WordIndex_Object*)self)->p->Size();
+}
+
+// lines[line:line+count] の単語を加える / 取り除く
+static PyObject * _WordIndex_UpdateLines( PyObject * self, PyObject * args, bool add )
+{
+	PyObject * lines;
+	Py_ssize_t line;
+	Py_ssize_t count;
+
+	if( ! PyArg_ParseTuple(args, "O!nn", &PyList_Type, &lines, &line, &count ) )
+		return NULL;
+
+	if( line<0 || count<0 || line+count>PyList_GET_SIZE(lines) )
+	{
+		PyErr_SetString( PyExc_ValueError, "invalid line range." );
+		return NULL;
+	}
+
+	WordIndex * index = ((WordIndex_Object*)self)->p;
+
+	std::vector<TextSearch::LineText> batch;
+	std::vector<PyObject*> refs;
+
+	for( Py_ssize_t batch_start=line ; batch_start<line+count ; batch_start+=TEXTSEARCH_FIND_BATCH_LINES )
+	{
+		Py_ssize_t batch_end = std::min( batch_start+TEXTSEARCH_FIND_BATCH_LINES, line+count );
+
+		batch.clear();
+		for( Py_ssize_t i=batch_start ; i<batch_end ; ++i )
+		{
+			TextSearch::LineText text;
+			if( ! _TextSearch_GetLineText( PyList_GET_ITEM( lines, i ), &text, &refs ) )
+			{
+				_TextSearch_ReleaseRefs(&refs);
+				return NULL;
+			}
+			batch.push_back(text);
+		}
+
+		Py_BEGIN_ALLOW_THREADS
+
+		if(add)
+		{
+			index->AddLines( batch.data(), batch.size() );
+		}
+		else
+		{
+			index->RemoveLines( batch.data(), batch.size() );
+		}
+
+		Py_END_ALLOW_THREADS
+
+		_TextSearch_ReleaseRefs(&refs);
+	}
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject * WordIndex_addLines(PyObject* self, PyObject* args)
+{
+	return _WordIndex_UpdateLines( self, args, true );
+}
+
+static PyObject * WordIndex_removeLines(PyObject* self, PyObject* args)
+{
+	return _WordIndex_UpdateLines( self, args, false );
+}
+
+static PyObject * WordIndex_clear(PyObject* self, PyObject* args)
+{
+	if( ! PyArg_ParseTuple(args, "") )
+		return NULL;
+
+	((WordIndex_Object*)self)->p->Clear();
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+// prefix で始まり prefix より長い単語を、辞書順のリストで返す
+static PyObject * WordIndex_find(PyObject* self, PyObject* args)
+{
+	PyObject * pyprefix;
+
+	if( ! PyArg_ParseTuple(args, "U", &pyprefix ) )
+		return NULL;
+
+	// 単語は ASCII だけなので、ASCII 以外を含む prefix に一致する単語はない
+	std::vector<std::string> words;
+	if( PyUnicode_IS_ASCII(pyprefix) )
+	{
+		std::string prefix( (const char*)PyUnicode_DATA(pyprefix), PyUnicode_GET_LENGTH(pyprefix) );
+		((WordIndex_Object*)self)->p->Find( prefix, &words );
+	}
+
+	PyObject * pywords = PyList_New( words.size() );
+	if(!pywords) return NULL;
+
+	for( size_t i=0 ; i<words.size() ; ++i )
+	{
+		PyObject * pyword = PyUnicode_FromStringAndSize( words[i].c_str(), words[i].size() );
+		if(!pyword)
+		{
+			Py_DECREF(pywords);
+			return NULL;
+		}
+		PyList_SET_ITEM( pywords, i, pyword );
+	}
+
+	return pywords;
+}
+
+static PyMethodDef WordIndex_methods[] = {
+    { "addLines", WordIndex_addLines, METH_VARARGS, "" },
+    { "removeLines", WordIndex_removeLines, METH_VARARGS, "" },
+    { "clear", WordIndex_clear, METH_VARARGS, "" },
+    { "find", WordIndex_find, METH_VARARGS, "" },
+	{NULL,NULL}
+};
+
+static PySequenceMethods WordIndex_as_sequence = {
+	WordIndex_length,	/* sq_length */
+	0,					/* sq_concat */
+	0,					/* sq_repeat */
+	0,					/* sq_item */
+	0,					/* sq_slice */
+	0,					/* sq_ass_item */
+	0,					/* sq_ass_slice */
+	0,					/* sq_contains */
+	0,					/* sq_inplace_concat */
+	0,					/* sq_inplace_repeat */
+};
+
+PyTypeObject WordIndex_Type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+    "WordIndex",		/* tp_name */
+    sizeof(WordIndex_Object), /* tp_basicsize */
+    0,					/* tp_itemsize */
+    (destructor)WordIndex_dealloc,/* tp_dealloc */
+    0,					/* tp_print */
+    0,					/* tp_getattr */
+    0,					/* tp_setattr */
+    0,					/* tp_reserved */
+    0, 					/* tp_repr */
+    0,					/* tp_as_number */
+    &WordIndex_as_sequence,/* tp_as_sequence */
+    0,					/* tp_as_mapping */
+    0,					/* tp_hash */
+    0,					/* tp_call */
+    0,					/* tp_str */
+    PyObject_GenericGetAttr,/* tp_getattro */
+    PyObject_GenericSetAttr,/* tp_setattro */
+    0,					/* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,/* tp_flags */
+    "",					/* tp_doc */
+    0,					/* tp_traverse */
+    0,					/* tp_clear */
+    0,					/* tp_richcompare */
+    0,					/* tp_weaklistoffset */
+    0,					/* tp_iter */
+    0,					/* tp_iternext */
+    WordIndex_methods,	/* tp_methods */
+    0,					/* tp_members */
+    0,					/* tp_getset */
+    0,					/* tp_base */
+    0,					/* tp_dict */
+    0,					/* tp_descr_get */
+    0,					/* tp_descr_set */
+    0,					/* tp_dictoffset */
+    WordIndex_init,		/* tp_init */
+    0,					/* tp_alloc */
+    PyType_GenericNew,	/* tp_new */
+    0,					/* tp_free */
+};
+
+// ----------------------------------------------------------------------------
+//
+// ----------------------------------------------------------------------------
+
+static int BracketIndex_init( PyObject * self, PyObject * args, PyObject * kwds)
+{
+	FUNC_TRACE;
+
+	PyObject * pypairs;
+	PyObject * pyignore_tokens;
+
+	if( ! PyArg_ParseTuple(args, "OO", &pypairs, &pyignore_tokens ) )
+		return -1;
+
+	// 括弧の種類 ( 開き括弧と閉じ括弧の2文字の文字列 のシーケンス )
+	std::vector<BracketIndex::Pair> pairs;
+	{
+		PyObject * seq = PySequence_Fast( pypairs, "pairs must be a sequence." );
+		if(!seq) return -1;
+
+		for( Py_ssize_t i=0 ; i<PySequence_Fast_GET_SIZE(seq) ; ++i )
+		{
+			PyObject * item = PySequence_Fast_GET_ITEM(seq,i);
+			if( !PyUnicode_Check(item) || PyUnicode_READY(item)<0 || PyUnicode_GET_LENGTH(item)!=2 )
+			{
+				Py_DECREF(seq);
+				PyErr_SetString( PyExc_ValueError, "bracket pair must be a string of 2 characters." );
+				return -1;
+			}
+
+			BracketIndex::Pair pair;
+			pair.open = PyUnicode_READ_CHAR(item,0);
+			pair.close = PyUnicode_READ_CHAR(item,1);
+			pairs.push_back(pair);
+		}
+
+		Py_DECREF(seq);
+	}
+
+	// 括弧として扱わないトークンの種類
+	unsigned int ignore_token_mask = 0;
+	{
+		PyObject * seq = PySequence_Fast( pyignore_tokens, "ignore_tokens must be a sequence." );
+		if(!seq) return -1;
+
+		for( Py_ssize_t i=0 ; i<PySequence_Fast_GET_SIZE(seq) ; ++i )
+		{
+			long type = PyLong_AsLong( PySequence_Fast_GET_ITEM(seq,i) );
+			if( type==-1 && PyErr_Occurred() )
+			{
+				Py_DECREF(seq);
+				return -1;
+			}
+
+			if( type<0 || type>=32 )
+			{
+				Py_DECREF(seq);
+				PyErr_SetString( PyExc_ValueError, "invalid token type." );
+				return -1;
+			}
+
+			ignore_token_mask |= 1U << type;
+		}
+
+		Py_DECREF(seq);
+	}
+
+	BracketIndex_Object * index = (BracketIndex_Object*)self;
+
+	delete index->p;
+	index->p = new BracketIndex(pairs);
+	index->ignore_token_mask = ignore_token_mask;
+
+	return 0;
+}
+
+static void BracketIndex_dealloc(PyObject* self)
+{
+	FUNC_TRACE;
+
+	BracketIndex_Object * index = (BracketIndex_Object*)self;
+
+	delete index->p;
+	self->ob_type->tp_free(self);
+}
+
+// 行のトークンから、括弧として扱わない範囲を ignore に追加する
+static void _BracketIndex_GetIgnoreRanges( PyObject * item, size_t len, unsigned int ignore_token_mask, std::vector<BracketIndex::Range> * ignore )
+{
+	if( !Line_Check(item) ) return;
+
+	PyObject * tokens = ((Line_Object*)item)->tokens;
+	if( !tokens || !TokenArray_Check(tokens) ) return;
+
+	const TokenArray_Object * array = (const TokenArray_Object*)tokens;
+
+	// ignore には前の行の範囲も入っているので、この行の範囲だけをまとめる
+	size_t line_begin = ignore->size();
+
+	for( Py_ssize_t i=0 ; i<array->num ; ++i )
+	{
+		int type = _TokenArray_GetType( array, i );
+		if( type<0 || type>=32 || (ignore_token_mask & (1U<<type))==0 ) continue;
+
+		size_t start = _TokenArray_GetPos( array, i );
+		size_t end = i+1<array->num ? _TokenArray_GetPos( array, i+1 ) : len;
+		if( start>=end ) continue;
+
+		// 連続する範囲はまとめる
+		if( ignore->size()>line_begin && ignore->back().end==start )
+		{
+			ignore->back().end = end;
+		}
+		else
+		{
+			BracketIndex::Range range;
+			range.start = start;
+			range.end = end;
+			ignore->push_back(range);
+		}
+	}
+}
+
+// 行 [line,line+old_count) が lines[line:line+new_count] に置き換わったことを反映する
+// lines の要素は Line オブジェクトか文字列で、Line オブジェクトのトークンが分析済みの場合は、文字列やコメントの中の括弧を除外する
+static PyObject * BracketIndex_updateLines(PyObject* self, PyObject* args)
+{
+	PyObject * lines;
+	Py_ssize_t line;
+	Py_ssize_t old_count;
+	Py_ssize_t new_count;
+
+	if( ! PyArg_ParseTuple(args, "O!nnn", &PyList_Type, &lines, &line, &old_count, &new_count ) )
+		return NULL;
+
+	BracketIndex_Object * index = (BracketIndex_Object*)self;
+
+	if( line<0 || old_count<0 || new_count<0 || line+old_count>(Py_ssize_t)index->p->GetNumLines() || line+new_count>PyList_GET_SIZE(lines) )
+	{
+		PyErr_SetString( PyExc_ValueError, "invalid line range." );
+		return NULL;
+	}
+
+	std::vector<TextSearch::LineText> texts;
+	std::vector<size_t> ignore_ends;
+	std::vector<BracketIndex::Range> ignore;
+	std::vector<unsigned int> line_ends;
+	std::vector<BracketIndex::Bracket> brackets;
+	std::vector<PyObject*> refs;
+
+	Py_ssize_t batch_start = line;
+	do
+	{
+		Py_ssize_t batch_end = std::min( batch_start+TEXTSEARCH_FIND_BATCH_LINES, line+new_count );
+
+		texts.clear();
+		ignore_ends.clear();
+		ignore.clear();
+		for( Py_ssize_t i=batch_start ; i<batch_end ; ++i )
+		{
+			PyObject * item = PyList_GET_ITEM( lines, i );
+
+			TextSearch::LineText text;
+			if( ! _TextSearch_GetLineText( item, &text, &refs ) )
+			{
+				_TextSearch_ReleaseRefs(&refs);
+				return NULL;
+			}
+			texts.push_back(text);
+
+			_BracketIndex_GetIgnoreRanges( item, text.len, index->ignore_token_mask, &ignore );
+			ignore_ends.push_back( ignore.size() );
+		}
+
+		Py_BEGIN_ALLOW_THREADS
+
+		line_ends.clear();
+		brackets.clear();
+		for( size_t i=0 ; i<texts.size() ; ++i )
+		{
+			size_t ignore_begin = i>0 ? ignore_ends[i-1] : 0;
+			index->p->ScanLine( texts[i], ignore.data()+ignore_begin, ignore_ends[i]-ignore_begin, &brackets );
+			line_ends.push_back( (unsigned int)brackets.size() );
+		}
+
+		// 最初のバッチで古い行を置き換え、以降のバッチは挿入する
+		index->p->ReplaceLines( batch_start, batch_start==line ? old_count : 0, line_ends, brackets );
+
+		Py_END_ALLOW_THREADS
+
+		_TextSearch_ReleaseRefs(&refs);
+
+		batch_start = batch_end;
+
+	} while( batch_start<line+new_count );
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject * BracketIndex_clear(PyObject* self, PyObject* args)
+{
+	if( ! PyArg_ParseTuple(args, "") )
+		return NULL;
+
+	((BracketIndex_Object*)self)->p->Clear();
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+// ( line, index ) の括弧に対応する括弧の位置を ( line, index ) で返す
+// 括弧でない場合や、対応する括弧が無い場合は None を返す
+static PyObject * BracketIndex_findPair(PyObject* self, PyObject* args)
+{
+	Py_ssize_t line;
+	Py_ssize_t index;
+
+	if( ! PyArg_ParseTuple(args, "nn", &line, &index ) )
+		return NULL;
+
+	size_t match_line, match_index;
+	if( line<0 || index<0 || ! ((BracketIndex_Object*)self)->p->FindPair( line, index, &match_line, &match_index ) )
+	{
+		Py_INCREF(Py_None);
+		return Py_None;
+	}
+
+	return Py_BuildValue( "(nn)", (Py_ssize_t)match_line, (Py_ssize_t)match_index );
+}
+
+static PyObject * BracketIndex_getMemorySize(PyObject* self, PyObject* args)
+{
+	if( ! PyArg_ParseTuple(args, "") )
+		return NULL;
+
+	return PyLong_FromSize_t( ((BracketIndex_Object*)self)->p->GetMemorySize() );
+}
+
+static PyMethodDef BracketIndex_methods[] = {
+    { "updateLines", BracketIndex_updateLines, METH_VARARGS, "" },
+    { "clear", BracketIndex_clear, METH_VARARGS, "" },
+    { "findPair", BracketIndex_findPair, METH_VARARGS, "" },
+    { "getMemorySize", BracketIndex_getMemorySize, METH_VARARGS, "" },
+	{NULL,NULL}
+};
+
+PyTypeObject BracketIndex_Type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+    "BracketIndex",		/* tp_name */
+    sizeof(BracketIndex_Object), /* tp_basicsize */
+    0,					/* tp_itemsize */
+    (destructor)BracketIndex_dealloc,/* tp_dealloc */
+    0,					/* tp_print */
+    0,					/* tp_getattr */
+    0,					/* tp_setattr */
+    0,					/* tp_reserved */
+    0, 					/* tp_repr */
+    0,					/* tp_as_number */
+    0,					/* tp_as_sequence */
+    0,					/* tp_as_mapping */
+    0,					/* tp_hash */
+    0,					/* tp_call */
+    0,					/* tp_str */
+    PyObject_GenericGetAttr,/* tp_getattro */
+    PyObject_GenericSetAttr,/* tp_setattro */
+    0,					/* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,/* tp_flags */
+    "",					/* tp_doc */
+    0,					/* tp_traverse */
+    0,					/* tp_clear */
+    0,					/* tp_richcompare */
+    0,					/* tp_weaklistoffset */
+    0,					/* tp_iter */
+    0,					/* tp_iternext */
+    BracketIndex_methods,	/* tp_methods */
+    0,					/* tp_members */
+    0,					/* tp_getset */
+    0,					/* tp_base */
+    0,					/* tp_dict */
+    0,					/* tp_descr_get */
+    0,					/* tp_descr_set */
+    0,					/* tp_dictoffset */
+    BracketIndex_init,	/* tp_init */
+    0,					/* tp_alloc */
+    PyType_GenericNew,	/* tp_new */
+    0,					/* tp_free */
+};
+
+// ----------------------------------------------------------------------------
+//
+// ----------------------------------------------------------------------------
+
+// 1文字の文字列のコードポイントを得る
+static bool _WordBreak_GetChar( PyObject * obj, unsigned int * c )
+{
+	if( !obj || !PyUnicode_Check(obj) || PyUnicode_READY(obj)<0 || PyUnicode_GET_LENGTH(obj)!=1 ) return false;
+
+	*c = PyUnicode_READ_CHAR(obj,0);
+	return true;
+}
+
+// ckit_misc.WordBreak の char_types の要素を、文字の範囲のリストに変換する
+// 要素は文字の集合の文字列か、1文字の start と end を持つ範囲 (ckit_misc.UnicodeRange)
+static bool _WordBreak_GetRanges( PyObject * item, std::vector<WordBreak::Range> * ranges )
+{
+	if( PyUnicode_Check(item) )
+	{
+		if( PyUnicode_READY(item)<0 ) return false;
+
+		std::vector<unsigned int> chars;
+		for( Py_ssize_t i=0 ; i<PyUnicode_GET_LENGTH(item) ; ++i )
+		{
+			chars.push_back( PyUnicode_READ_CHAR(item,i) );
+		}
+		std::sort( chars.begin(), chars.end() );
+
+		// 連続する文字は1つの範囲にまとめる
+		for( size_t i=0 ; i<chars.size() ; ++i )
+		{
+			if( !ranges->empty() && ranges->back().last+1>=chars[i] )
+			{
+				ranges->back().last = std::max( ranges->back().last, chars[i] );
+			}
+			else
+			{
+				WordBreak::Range range = { chars[i], chars[i] };
+				ranges->push_back(range);
+			}
+		}
+
+		return true;
+	}
+
+	PyObject * start = PyObject_GetAttrString( item, "start" );
+	PyObject * end = PyObject_GetAttrString( item, "end" );
+
+	WordBreak::Range range;
+	bool result = _WordBreak_GetChar( start, &range.first ) && _WordBreak_GetChar( end, &range.last );
+
+	Py_XDECREF(start);
+	Py_XDECREF(end);
+
+	if(!result)
+	{
+		PyErr_Clear();
+		PyErr_SetString( PyExc_ValueError, "unsupported char type." );
+		return false;
+	}
+
+	ranges->push_back(range);
+	return true;
+}
+
+static int WordBreak_init( PyObject * self, PyObject * args, PyObject * kwds)
+{
+	FUNC_TRACE;
+
+	PyObject * pychar_types;
+	PyObject * pytype_bounds;
+
+	if( ! PyArg_ParseTuple(args, "OO!", &pychar_types, &PyDict_Type, &pytype_bounds ) )
+		return -1;
+
+	// 文字の種類
+	std::vector< std::vector<WordBreak::Range> > char_types;
+	{
+		PyObject * seq = PySequence_Fast( pychar_types, "char_types must be a sequence." );
+		if(!seq) return -1;
+
+		// 種類の番号は文字の表に signed char で保持する
+		if( PySequence_Fast_GET_SIZE(seq)>SCHAR_MAX )
+		{
+			Py_DECREF(seq);
+			PyErr_SetString( PyExc_ValueError, "too many char types." );
+			return -1;
+		}
+
+		for( Py_ssize_t i=0 ; i<PySequence_Fast_GET_SIZE(seq) ; ++i )
+		{
+			char_types.push_back( std::vector<WordBreak::Range>() );
+			if( ! _WordBreak_GetRanges( PySequence_Fast_GET_ITEM(seq,i), &char_types.back() ) )
+			{
+				Py_DECREF(seq);
+				return -1;
+			}
+		}
+
+		Py_DECREF(seq);
+	}
+
+	// 単語を区切る種類の組み合わせ ( 左の種類 -> 右の種類のリスト の辞書 )
+	std::vector< std::pair<int,int> > type_bounds;
+	{
+		PyObject * key;
+		PyObject * value;
+		Py_ssize_t pos = 0;
+
+		while( PyDict_Next( pytype_bounds, &pos, &key, &value ) )
+		{
+			long left = PyLong_AsLong(key);
+			if( left==-1 && PyErr_Occurred() ) return -1;
+
+			PyObject * seq = PySequence_Fast( value, "type_bounds value must be a sequence." );
+			if(!seq) return -1;
+
+			for( Py_ssize_t i=0 ; i<PySequence_Fast_GET_SIZE(seq) ; ++i )
+			{
+				long right = PyLong_AsLong( PySequence_Fast_GET_ITEM(seq,i) );
+				if( right==-1 && PyErr_Occurred() )
+				{
+					Py_DECREF(seq);
+					return -1;
+				}
+
+				type_bounds.push_back( std::pair<int,int>( (int)left, (int)right ) );
+			}
+
+			Py_DECREF(seq);
+		}
+	}
+
+	WordBreak_Object * word_break = (WordBreak_Object*)self;
+
+	delete word_break->p;
+	word_break->p = new WordBreak( char_types, type_bounds );
+
+	return 0;
+}
+
+static void WordBreak_dealloc(PyObject* self)
+{
+	FUNC_TRACE;
+
+	WordBreak_Object * word_break = (WordBreak_Object*)self;
+
+	delete word_break->p;
+	self->ob_type->tp_free(self);
+}
+
+// s の pos から step の方向に、次の単語区切りの位置を返す (ckit_misc.WordBreak.__call__ と同じ)
+static PyObject * WordBreak_find(PyObject* self, PyObject* args)
+{
+	PyObject * s;
+	Py_ssize_t pos;
+	int step;
+	int use_type_bounds = 1;
+
+	if( ! PyArg_ParseTuple(args, "Uni|i", &s, &pos, &step, &use_type_bounds ) )
+		return NULL;
+
+	if( PyUnicode_READY(s)<0 )
+		return NULL;
+
+	const WordBreak * word_break = ((WordBreak_Object*)self)->p;
+	size_t len = PyUnicode_GET_LENGTH(s);
+	if( pos<0 ) pos = 0;
+
+	size_t result = 0;
+	switch( PyUnicode_KIND(s) )
+	{
+	case PyUnicode_1BYTE_KIND:
+		result = word_break->Find( (const unsigned char*)PyUnicode_DATA(s), len, pos, step, use_type_bounds!=0 );
+		break;
+	case PyUnicode_2BYTE_KIND:
+		result = word_break->Find( (const unsigned short*)PyUnicode_DATA(s), len, pos, step, use_type_bounds!=0 );
+		break;
+	case PyUnicode_4BYTE_KIND:
+		result = word_break->Find( (const unsigned int*)PyUnicode_DATA(s), len, pos, step, use_type_bounds!=0 );
+		break;
+	}
+
+	return PyLong_FromSize_t(result);
+}
+
+// s の中の全ての単語区切りの位置 (文字列の端を除く) のリストを返す
+static PyObject * WordBreak_findAll(PyObject* self, PyObject* args)
+{
+	PyObject * s;
+	int use_type_bounds = 1;
+
+	if( ! PyArg_ParseTuple(args, "U|i", &s, &use_type_bounds ) )
+		return NULL;
+
+	if( PyUnicode_READY(s)<0 )
+		return NULL;
+
+	const WordBreak * word_break = ((WordBreak_Object*)self)->p;
+	size_t len = PyUnicode_GET_LENGTH(s);
+
+	std::vector<size_t> positions;
+	switch( PyUnicode_KIND(s) )
+	{
+	case PyUnicode_1BYTE_KIND:
+		word_break->FindAll( (const unsigned char*)PyUnicode_DATA(s), len, use_type_bounds!=0, &positions );
+		break;
+	case PyUnicode_2BYTE_KIND:
+		word_break->FindAll( (const unsigned short*)PyUnicode_DATA(s), len, use_type_bounds!=0, &positions );
+		break;
+	case PyUnicode_4BYTE_KIND:
+		word_break->FindAll( (const unsigned int*)PyUnicode_DATA(s), len, use_type_bounds!=0, &positions );
+		break;
+	}
+
+	PyObject * pypositions = PyList_New( positions.size() );
+	if(!pypositions) return NULL;
+
+	for( size_t i=0 ; i<positions.size() ; ++i )
+	{
+		PyList_SET_ITEM( pypositions, i, PyLong_FromSize_t(positions[i]) );
+	}
+
+	return pypositions;
+}
+
+static PyMethodDef WordBreak_methods[] = {
+    { "find", WordBreak_find, METH_VARARGS, "" },
+    { "findAll", WordBreak_findAll, METH_VARARGS, "" },
+	{NULL,NULL}
+};
+
+PyTypeObject WordBreak_Type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+    "WordBreak",		/* tp_name */
+    sizeof(WordBreak_Object), /* tp_basicsize */
+    0,					/* tp_itemsize */
+    (destructor)WordBreak_dealloc,/* tp_dealloc */
+    0,					/* tp_print */
+    0,					/* tp_getattr */
+    0,					/* tp_setattr */
+    0,					/* tp_reserved */
+    0, 					/* tp_repr */
+    0,					/* tp_as_number */
+    0,					/* tp_as_sequence */
+    0,					/* tp_as_mapping */
+    0,					/* tp_hash */
+    0,					/* tp_call */
+    0,					/* tp_str */
+    PyObject_GenericGetAttr,/* tp_getattro */
+    PyObject_GenericSetAttr,/* tp_setattro */
+    0,					/* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,/* tp_flags */
+    "",					/* tp_doc */
+    0,					/* tp_traverse */
+    0,					/* tp_clear */
+    0,					/* tp_richcompare */
+    0,					/* tp_weaklistoffset */
+    0,					/* tp_iter */
+    0,					/* tp_iternext */
+    WordBreak_methods,	/* tp_methods */
+    0,					/* tp_members */
+    0,					/* tp_getset */
+    0,					/* tp_base */
+    0,					/* tp_dict */
+    0,					/* tp_descr_get */
+    0,					/* tp_descr_set */
+    0,					/* tp_dictoffset */
+    WordBreak_init,		/* tp_init */
+    0,					/* tp_alloc */
+    PyType_GenericNew,	/* tp_new */
+    0,					/* tp_free */
+};
+
+// ----------------------------------------------------------------------------
+//
+// ----------------------------------------------------------------------------
+
+static int CancelToken_init( PyObject * self, PyObject * args, PyObject * kwds)
+{
+	FUNC_TRACE;
+
+	if( ! PyArg_ParseTuple(args, "") )
+		return -1;
+
+	CancelToken_Object * token = (CancelToken_Object*)self;
+
+	delete token->p;
+	token->p = new ThreadUtil::CancelToken();
+
+	return 0;
+}
+
+static void CancelToken_dealloc(PyObject* self)
+{
+	FUNC_TRACE;
+
+	CancelToken_Object * token = (CancelToken_Object*)self;
+
+	delete token->p;
+	self->ob_type->tp_free(self);
+}
+
+static PyObject * CancelToken_cancel( PyObject * self, PyObject * args )
+{
+	if( ! PyArg_ParseTuple(args, "") )
+		return NULL;
+
+	((CancelToken_Object*)self)->p->Cancel();
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject * CancelToken_isCanceled( PyObject * self, PyObject * args )
+{
+	if( ! PyArg_ParseTuple(args, "") )
+		return NULL;
+
+	return PyBool_FromLong( ((CancelToken_Object*)self)->p->IsCanceled() );
+}
+
+static PyMethodDef CancelToken_methods[] = {
+    { "cancel", CancelToken_cancel, METH_VARARGS, "" },
+    { "isCanceled", CancelToken_isCanceled, METH_VARARGS, "" },
+	{NULL,NULL}
+};
+
+PyTypeObject CancelToken_Type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+    "CancelToken",		/* tp_name */
+    sizeof(CancelToken_Object), /* tp_basicsize */
+    0,					/* tp_itemsize */
+    (destructor)CancelToken_dealloc,/* tp_dealloc */
+    0,					/* tp_print */
+    0,					/* tp_getattr */
+    0,					/* tp_setattr */
+    0,					/* tp_reserved */
+    0, 					/* tp_repr */
+    0,					/* tp_as_number */
+    0,					/* tp_as_sequence */
+    0,					/* tp_as_mapping */
+    0,					/* tp_hash */
+    0,					/* tp_call */
+    0,					/* tp_str */
+    PyObject_GenericGetAttr,/* tp_getattro */
+    PyObject_GenericSetAttr,/* tp_setattro */
+    0,					/* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,/* tp_flags */
+    "",					/* tp_doc */
+    0,					/* tp_traverse */
+    0,					/* tp_clear */
+    0,					/* tp_richcompare */
+    0,					/* tp_weaklistoffset */
+    0,					/* tp_iter */
+    0,					/* tp_iternext */
+    CancelToken_methods,/* tp_methods */
+    0,					/* tp_members */
+    0,					/* tp_getset */
+    0,					/* tp_base */
+    0,					/* tp_dict */
+    0,					/* tp_descr_get */
+    0,					/* tp_descr_set */
+    0,					/* tp_dictoffset */
+    CancelToken_init,	/* tp_init */
+    0,					/* tp_alloc */
+    PyType_GenericNew,	/* tp_new */
+    0,					/* tp_free */
+};
+
+// ----------------------------------------------------------------------------
+//
+// ----------------------------------------------------------------------------
+
+static int UndoJournal_init( PyObject * self, PyObject * args, PyObject * kwds)
+{
+	FUNC_TRACE;
+
+	Py_ssize_t memory_limit = 0;
+	PyObject * pyspill_filename = Py_None;
+
+	if( ! PyArg_ParseTuple(args, "|nO", &memory_limit, &pyspill_filename ) )
+		return -1;
+
+	std::string spill_filename;
+	if( pyspill_filename!=Py_None )
+	{
+		if( !PyUnicode_Check(pyspill_filename) )
+		{
+			PyErr_SetString( PyExc_TypeError, "spill_filename must be string or None." );
+			return -1;
+		}
+
+		PyObject * pybytes = PyUnicode_EncodeFSDefault(pyspill_filename);
+		if(!pybytes) return -1;
+		spill_filename = PyBytes_AS_STRING(pybytes);
+		Py_DECREF(pybytes);
+	}
+
+	UndoJournal_Object * journal = (UndoJournal_Object*)self;
+
+	delete journal->p;
+	journal->p = new UndoJournal( std::max<Py_ssize_t>(memory_limit,0), spill_filename );
+
+	return 0;
+}
+
+static void UndoJournal_dealloc(PyObject* self)
+{
+	FUNC_TRACE;
+
+	UndoJournal_Object * journal = (UndoJournal_Object*)self;
+
+	delete journal->p;
+	self->ob_type->tp_free(self);
+}
+
+static bool _UndoJournal_GetText( PyObject * s, UndoJournal::Text * text )
+{
+	if( PyUnicode_READY(s)<0 )
+		return false;
+
+	text->data = PyUnicode_DATA(s);
+	text->char_size = PyUnicode_KIND(s);
+	text->len = PyUnicode_GET_LENGTH(s);
+
+	return true;
+}
+
+static PyObject * _UndoJournal_BuildResult( const UndoJournal::Selection & selection, const std::vector<UndoJournal::Edit> & edits )
+{
+	PyObject * pyedits = PyList_New( edits.size() );
+	if(!pyedits) return NULL;
+
+	for( size_t i=0 ; i<edits.size() ; ++i )
+	{
+		const UndoJournal::Edit & edit = edits[i];
+
+		PyObject * pytext = PyUnicode_FromKindAndData( edit.char_size, edit.text.data(), edit.len );
+		if(!pytext)
+		{
+			Py_DECREF(pyedits);
+			return NULL;
+		}
+
+		PyObject * pyedit = Py_BuildValue( "(nnnnNI)",
+			(Py_ssize_t)edit.left.line, (Py_ssize_t)edit.left.index,
+			(Py_ssize_t)edit.right.line, (Py_ssize_t)edit.right.index,
+			pytext, edit.count );
+		if(!pyedit)
+		{
+			Py_DECREF(pyedits);
+			return NULL;
+		}
+
+		PyList_SET_ITEM( pyedits, i, pyedit );
+	}
+
+	return Py_BuildValue( "((nn)(nn)(nn)(nn)iN)",
+		(Py_ssize_t)selection.old_anchor.line, (Py_ssize_t)selection.old_anchor.index,
+		(Py_ssize_t)selection.old_cursor.line, (Py_ssize_t)selection.old_cursor.index,
+		(Py_ssize_t)selection.new_anchor.line, (Py_ssize_t)selection.new_anchor.index,
+		(Py_ssize_t)selection.new_cursor.line, (Py_ssize_t)selection.new_cursor.index,
+		selection.atomic ? 1 : 0,
+		pyedits );
+}
+
+static PyObject * UndoJournal_append(PyObject* self, PyObject* args)
+{
+	Py_ssize_t left[2];
+	PyObject * old_text;
+	PyObject * new_text;
+	Py_ssize_t pos[4][2];
+	int coalesce = 0;
+
+	if( ! PyArg_ParseTuple(args, "(nn)UU(nn)(nn)(nn)(nn)|i",
+		&left[0], &left[1], &old_text, &new_text,
+		&pos[0][0], &pos[0][1], &pos[1][0], &pos[1][1], &pos[2][0], &pos[2][1], &pos[3][0], &pos[3][1],
+		&coalesce ) )
+		return NULL;
+
+	UndoJournal::Text old_t;
+	UndoJournal::Text new_t;
+	if( !_UndoJournal_GetText( old_text, &old_t ) || !_UndoJournal_GetText( new_text, &new_t ) )
+		return NULL;
+
+	UndoJournal::Position left_pos = { (size_t)left[0], (size_t)left[1] };
+
+	UndoJournal::Selection selection;
+	UndoJournal::Position * sel_pos[] = { &selection.old_anchor, &selection.old_cursor, &selection.new_anchor, &selection.new_cursor };
+	for( int i=0 ; i<4 ; ++i )
+	{
+		sel_pos[i]->line = (size_t)pos[i][0];
+		sel_pos[i]->index = (size_t)pos[i][1];
+	}
+	selection.atomic = false;
+
+	bool dropped = ((UndoJournal_Object*)self)->p->Append( left_pos, old_t, new_t, selection, coalesce!=0 );
+
+	return PyBool_FromLong(dropped);
+}
+
+static PyObject * UndoJournal_beginGroup(PyObject* self, PyObject* args)
+{
+	UndoJournal::Position anchor;
+	UndoJournal::Position cursor;
+
+	if( ! PyArg_ParseTuple(args, "(nn)(nn)", &anchor.line, &anchor.index, &cursor.line, &cursor.index ) )
+		return NULL;
+
+	((UndoJournal_Object*)self)->p->BeginGroup( anchor, cursor );
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject * UndoJournal_endGroup(PyObject* self, PyObject* args)
+{
+	UndoJournal::Position anchor;
+	UndoJournal::Position cursor;
+
+	if( ! PyArg_ParseTuple(args, "(nn)(nn)", &anchor.line, &anchor.index, &cursor.line, &cursor.index ) )
+		return NULL;
+
+	bool dropped = ((UndoJournal_Object*)self)->p->EndGroup( anchor, cursor );
+
+	return PyBool_FromLong(dropped);
+}
+
+static PyObject * UndoJournal_undo(PyObject* self, PyObject* args)
+{
+	if( ! PyArg_ParseTuple(args, "") )
+		return NULL;
+
+	UndoJournal::Selection selection;
+	std::vector<UndoJournal::Edit> edits;
+
+	if( ! ((UndoJournal_Object*)self)->p->Undo( &selection, &edits ) )
+	{
+		Py_INCREF(Py_None);
+		return Py_None;
+	}
+
+	return _UndoJournal_BuildResult( selection, edits );
+}
+
+static PyObject * UndoJournal_redo(PyObject* self, PyObject* args)
+{
+	if( ! PyArg_ParseTuple(args, "") )
+		return NULL;
+
+	UndoJournal::Selection selection;
+	std::vector<UndoJournal::Edit> edits;
+
+	if( ! ((UndoJournal_Object*)self)->p->Redo( &selection, &edits ) )
+	{
+		Py_INCREF(Py_None);
+		return Py_None;
+	}
+
+	return _UndoJournal_BuildResult( selection, edits );
+}
+
+static PyObject * UndoJournal_canUndo(PyObject* self, PyObject* args)
+{
+	if( ! PyArg_ParseTuple(args, "") )
+		return NULL;
+
+	return PyBool_FromLong( ((UndoJournal_Object*)self)->p->CanUndo() );
+}
+
+static PyObject * UndoJournal_canRedo(PyObject* self, PyObject* args)
+{
+	if( ! PyArg_ParseTuple(args, "") )
+		return NULL;
+
+	return PyBool_FromLong( ((UndoJournal_Object*)self)->p->CanRedo() );
+}
+
+static PyObject * UndoJournal_clear(PyObject* self, PyObject* args)
+{
+	if( ! PyArg_ParseTuple(args, "") )
+		return NULL;
+
+	((UndoJournal_Object*)self)->p->Clear();
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject * UndoJournal_getUndoCount(PyObject* self, PyObject* args)
+{
+	if( ! PyArg_ParseTuple(args, "") )
+		return NULL;
+
+	return PyLong_FromSize_t( ((UndoJournal_Object*)self)->p->GetUndoCount() );
+}
+
+static PyObject * UndoJournal_getMemorySize(PyObject* self, PyObject* args)
+{
+	if( ! PyArg_ParseTuple(args, "") )
+		return NULL;
+
+	return PyLong_FromSize_t( ((UndoJournal_Object*)self)->p->GetMemorySize() );
+}
+
+static PyObject * UndoJournal_getSpilledSize(PyObject* self, PyObject* args)
+{
+	if( ! PyArg_ParseTuple(args, "") )
+		return NULL;
+
+	return PyLong_FromUnsignedLongLong( ((UndoJournal_Object*)self)->p->GetSpilledSize() );
+}
+
+static PyMethodDef UndoJournal_methods[] = {
+    { "append", UndoJournal_append, METH_VARARGS, "" },
+    { "beginGroup", UndoJournal_beginGroup, METH_VARARGS, "" },
+    { "endGroup", UndoJournal_endGroup, METH_VARARGS, "" },
+    { "undo", UndoJournal_undo, METH_VARARGS, "" },
+    { "redo", UndoJournal_redo, METH_VARARGS, "" },
+    { "canUndo", UndoJournal_canUndo, METH_VARARGS, "" },
+    { "canRedo", UndoJournal_canRedo, METH_VARARGS, "" },
+    { "clear", UndoJournal_clear, METH_VARARGS, "" },
+    { "getUndoCount", UndoJournal_getUndoCount, METH_VARARGS, "" },
+    { "getMemorySize", UndoJournal_getMemorySize, METH_VARARGS, "" },
+    { "getSpilledSize", UndoJournal_getSpilledSize, METH_VARARGS, "" },
+	{NULL,NULL}
+};
+
+PyTypeObject UndoJournal_Type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+    "UndoJournal",		/* tp_name */
+    sizeof(UndoJournal_Object), /* tp_basicsize */
+    0,					/* tp_itemsize */
+    (destructor)UndoJournal_dealloc,/* tp_dealloc */
+    0,					/* tp_print */
+    0,					/* tp_getattr */
+    0,					/* tp_setattr */
+    0,					/* tp_reserved */
+    0, 					/* tp_repr */
+    0,					/* tp_as_number */
+    0,					/* tp_as_sequence */
+    0,					/* tp_as_mapping */
+    0,					/* tp_hash */
+    0,					/* tp_call */
+    0,					/* tp_str */
+    PyObject_GenericGetAttr,/* tp_getattro */
+    PyObject_GenericSetAttr,/* tp_setattro */
+    0,					/* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,/* tp_flags */
+    "",					/* tp_doc */
+    0,					/* tp_traverse */
+    0,					/* tp_clear */
+    0,					/* tp_richcompare */
+    0,					/* tp_weaklistoffset */
+    0,					/* tp_iter */
+    0,					/* tp_iternext */
+    UndoJournal_methods,/* tp_methods */
+    0,					/* tp_members */
+    0,					/* tp_getset */
+    0,					/* tp_base */
+    0,					/* tp_dict */
+    0,					/* tp_descr_get */
+    0,					/* tp_descr_set */
+    0,					/* tp_dictoffset */
+    UndoJournal_init,	/* tp_init */
+    0,					/* tp_alloc */
+    PyType_GenericNew,	/* tp_new */
+    0,					/* tp_free */
+};
+
+// ----------------------------------------------------------------------------
+//
+// ----------------------------------------------------------------------------
+
+static PyObject * _registerWindowClass( PyObject * self, PyObject * args )
+{
+	FUNC_TRACE;
+
+    PyObject * pyprefix;
+
+    if( ! PyArg_ParseTuple(args, "O", &pyprefix ) )
+        return NULL;
+
+    std::wstring prefix;
+    if(pyprefix)
+    {
+        if( !PythonUtil::PyStringToWideString( pyprefix, &prefix ) )
+        {
+            return NULL;
+        }
+    }
+
+	WINDOW_CLASS_NAME 			= prefix + L"WindowClass";
+	TASKTRAY_WINDOW_CLASS_NAME  = prefix + L"TaskTrayWindowClass";
+
+    if( ! Window::_registerWindowClass() )
+    {
+		PyErr_SetFromWindowsErr(0);
+        return NULL;
+    }
+
+    if( ! TaskTrayIcon::_registerWindowClass() )
+    {
+		PyErr_SetFromWindowsErr(0);
+        return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject * _registerCommandInfoConstructor( PyObject * self, PyObject * args )
+{
+	PyObject * _command_info_constructor;
+
+	if( ! PyArg_ParseTuple(args,"O", &_command_info_constructor ) )
+		return NULL;
+	
+	Py_XDECREF(command_info_constructor);
+	command_info_constructor = _command_info_constructor;
+	Py_INCREF(command_info_constructor);
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject * _setGlobalOption( PyObject * self, PyObject * args )
+{
+	FUNC_TRACE;
+
+    int option;
+    int enable;
+
+    if( ! PyArg_ParseTuple(args, "ii", &option, &enable ) )
+        return NULL;
+
+	switch(option)
+	{
+	case GLOBAL_OPTION_XXXX:
+		{
+		}
+		break;
+	
+	default:
+		{
+			PyErr_SetString( PyExc_ValueError, "unknown option id." );
+			return NULL;
+		}
+	}
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static int _blockDetectorCallback( PyObject * py_report_func, PyFrameObject * frame, int what, PyObject * arg )
+{
+	static DWORD tick_prev = GetTickCount();
+	DWORD tick = GetTickCount();
+	DWORD delta = tick-tick_prev;
+	tick_prev = tick;
+	
+	if( delta > 1000 )
+	{
+		PyObject * pyarglist = Py_BuildValue("()");
+		PyObject * pyresult = PyObject_Call( py_report_func, pyarglist, NULL );
+		Py_DECREF(pyarglist);
+		if(pyresult)
+		{
+			Py_DECREF(pyresult);
+		}
+		else
+		{
+			PyErr_Print();
+		}
+	}
+	
+	return 0;
+}
+
+static PyObject * py_report_func;
+
+static PyObject * _enableBlockDetector( PyObject * self, PyObject * args )
+{
+	PyObject * _py_report_func;
+
+	if( ! PyArg_ParseTuple(args,"O", &_py_report_func ) )
+		return NULL;
+	
+	Py_XDECREF(py_report_func);
+	py_report_func = _py_report_func;
+	Py_INCREF(py_report_func);
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject * _setBlockDetector( PyObject * self, PyObject * args )
+{
+	if( ! PyArg_ParseTuple(args,"") )
+		return NULL;
+
+	if(py_report_func)
+	{
+		PyEval_SetProfile( _blockDetectorCallback, py_report_func );
+	}
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyObject * _decodeLines( PyObject * self, PyObject * args )
+{
+	FUNC_TRACE;
+
+	Py_buffer data;
+	const char * encoding_name;
+	Py_ssize_t offset = 0;
+
+	if( ! PyArg_ParseTuple(args,"y*s|n", &data, &encoding_name, &offset ) )
+		return NULL;
+
+	// ネイティブで扱えないエンコーディングは None を返し、呼び出し側に任せる
+	TextCodec::Encoding encoding = TextCodec::GetEncoding(encoding_name);
+	if( encoding==TextCodec::Encoding_Unknown )
+	{
+		PyBuffer_Release(&data);
+		Py_INCREF(Py_None);
+		return Py_None;
+	}
+
+	offset = std::min( std::max( offset, (Py_ssize_t)0 ), data.len );
+
+	std::vector<TextCodec::DecodedChunk> chunks;
+
+	Py_BEGIN_ALLOW_THREADS
+
+	TextCodec::DecodeLines( encoding, (const char*)data.buf + offset, data.len - offset, &chunks );
+
+	Py_END_ALLOW_THREADS
+
+	PyBuffer_Release(&data);
+
+	Py_ssize_t num_lines = 0;
+	for( size_t i=0 ; i<chunks.size() ; ++i )
+	{
+		num_lines += chunks[i].lines.size();
+	}
+
+	PyObject * pylines = PyList_New(num_lines);
+	if(!pylines) return NULL;
+
+	Py_ssize_t index = 0;
+	for( size_t i=0 ; i<chunks.size() ; ++i )
+	{
+		TextCodec::DecodedChunk & chunk = chunks[i];
+
+		for( size_t j=0 ; j<chunk.lines.size() ; ++j )
+		{
+			PyObject * pyline = _Line_FromDecodedLine( chunk.text.data(), chunk.lines[j] );
+			if(!pyline)
+			{
+				Py_DECREF(pylines);
+				return NULL;
+			}
+			PyList_SET_ITEM( pylines, index++, pyline );
+		}
+
+		// 変換の済んだチャンクのメモリは早めに解放する
+		std::vector<unsigned short>().swap(chunk.text);
+		std::vector<TextCodec::DecodedLine>().swap(chunk.lines);
+	}
+
+	return pylines;
+}
+
+// Line オブジェクトのリストから、エンコード用の行情報を集める
+//
+// GIL を解放している間に Line.s が差し替えられても問題ないように、
+// 文字列の参照カウントを増やして refs に保持する。
+static bool _collectSourceLines( PyObject * pylines, std::vector<TextCodec::SourceLine> * lines, std::vector<PyObject*> * refs )
+{
+	PyObject * seq = PySequence_Fast( pylines, "lines must be a sequence." );
+	if(!seq) return false;
+
+	Py_ssize_t num = PySequence_Fast_GET_SIZE(seq);
+	PyObject ** items = PySequence_Fast_ITEMS(seq);
+
+	lines->reserve(num);
+	refs->reserve(num);
+
+	for( Py_ssize_t i=0 ; i<num ; ++i )
+	{
+		if( !Line_Check(items[i]) )
+		{
+			PyErr_SetString( PyExc_TypeError, "must be Line." );
+			Py_DECREF(seq);
+			return false;
+		}
+
+		Line_Object * pyline = (Line_Object*)items[i];
+
+		if( !pyline->s || !PyUnicode_Check(pyline->s) )
+		{
+			PyErr_SetString( PyExc_TypeError, "Line.s must be a unicode object." );
+			Py_DECREF(seq);
+			return false;
+		}
+
+		Py_INCREF(pyline->s);
+		refs->push_back(pyline->s);
+
+		TextCodec::SourceLine line;
+		line.data = PyUnicode_DATA(pyline->s);
+		line.length = PyUnicode_GET_LENGTH(pyline->s);
+		line.kind = PyUnicode_KIND(pyline->s);
+		line.lineend = pyline->flags & (Line_End_CR|Line_End_LF);
+		lines->push_back(line);
+	}
+
+	Py_DECREF(seq);
+	return true;
+}
+
+static void _releaseSourceLines( std::vector<PyObject*> * refs )
+{
+	for( size_t i=0 ; i<refs->size() ; ++i )
+	{
+		Py_DECREF( (*refs)[i] );
+	}
+	refs->clear();
+}
+
+static PyObject * _encodeLines( PyObject * self, PyObject * args )
+{
+	FUNC_TRACE;
+
+	PyObject * pylines;
+	const char * encoding_name;
+	PyObject * write_func;
+
+	if( ! PyArg_ParseTuple(args,"OsO", &pylines, &encoding_name, &write_func ) )
+		return NULL;
+
+	// ネイティブで扱えないエンコーディングは False を返し、呼び出し側に任せる
+	TextCodec::Encoding encoding = TextCodec::GetEncoding(encoding_name);
+	if( encoding==TextCodec::Encoding_Unknown )
+	{
+		Py_INCREF(Py_False);
+		return Py_False;
+	}
+
+	std::vector<TextCodec::SourceLine> lines;
+	std::vector<PyObject*> refs;
+	if( !_collectSourceLines( pylines, &lines, &refs ) )
+	{
+		_releaseSourceLines(&refs);
+		return NULL;
+	}
+
+	// エンコードは GIL を解放して行い、バッファが一杯になったときだけ GIL を取得して write_func を呼ぶ
+	PyThreadState * thread_state = PyEval_SaveThread();
+
+	bool result = TextCodec::EncodeLines( encoding, lines, [&]( const char * data, size_t len )
+	{
+		PyEval_RestoreThread(thread_state);
+
+		bool ok = false;
+		PyObject * pydata = PyBytes_FromStringAndSize( data, len );
+		if(pydata)
+		{
+			PyObject * pyarglist = Py_BuildValue( "(O)", pydata );
+			PyObject * pyresult = PyObject_Call( write_func, pyarglist, NULL );
+			Py_DECREF(pyarglist);
+			Py_DECREF(pydata);
+			if(pyresult)
+			{
+				Py_DECREF(pyresult);
+				ok = true;
+			}
+		}
+
+		thread_state = PyEval_SaveThread();
+
+		return ok;
+	});
+
+	// 変換に失敗した場合のエラーコードは、GIL を取得する前に取り出しておく
+	unsigned long error = result ? 0 : ::GetLastError();
+
+	PyEval_RestoreThread(thread_state);
+
+	_releaseSourceLines(&refs);
+
+	if(!result)
+	{
+		// write_func の例外でなければ、変換の失敗として例外にする
+		if( !PyErr_Occurred() )
+		{
+			PyErr_SetFromWindowsErr(error);
+		}
+		return NULL;
+	}
+
+	Py_INCREF(Py_True);
+	return Py_True;
+}
+
+static PyObject * _saveLines( PyObject * self, PyObject * args )
+{
+	FUNC_TRACE;
+
+	PyObject * pyfilename;
+	PyObject * pylines;
+	const char * encoding_name;
+	PyObject * pybom;
+
+	if( ! PyArg_ParseTuple(args,"OOsO", &pyfilename, &pylines, &encoding_name, &pybom ) )
+		return NULL;
+
+	std::wstring filename;
+	if( !PythonUtil::PyStringToWideString( pyfilename, &filename ) )
+	{
+		return NULL;
+	}
+
+	char * bom = NULL;
+	Py_ssize_t bom_len = 0;
+	if( pybom!=Py_None )
+	{
+		if( PyBytes_AsStringAndSize( pybom, &bom, &bom_len )<0 )
+		{
+			return NULL;
+		}
+	}
+
+	// ネイティブで扱えないエンコーディングは False を返し、呼び出し側に任せる
+	TextCodec::Encoding encoding = TextCodec::GetEncoding(encoding_name);
+	if( encoding==TextCodec::Encoding_Unknown )
+	{
+		Py_INCREF(Py_False);
+		return Py_False;
+	}
+
+	std::vector<TextCodec::SourceLine> lines;
+	std::vector<PyObject*> refs;
+	if( !_collectSourceLines( pylines, &lines, &refs ) )
+	{
+		_releaseSourceLines(&refs);
+		return NULL;
+	}
+
+	bool result;
+	unsigned long error = 0;
+
+	Py_BEGIN_ALLOW_THREADS
+
+	result = TextCodec::SaveFile( filename.c_str(), encoding, bom, bom_len, lines, &error );
+
+	Py_END_ALLOW_THREADS
+
+	_releaseSourceLines(&refs);
+
+	if(!result)
+	{
+		PyErr_SetFromWindowsErr(error);
+		return NULL;
+	}
+
+	Py_INCREF(Py_True);
+	return Py_True;
+}
+
+// スレッドプールのワーカーで Python の関数を呼ぶ
+//
+// ワーカーのスレッドの状態は最初のタスクで作って解放せずに残し、
+// setBlockDetector などのスレッドごとの設定が、タスクをまたいで有効になるようにする。
+static void _callOnThreadPool( PyObject * func, const ThreadUtil::CancelToken & token )
+{
+	static thread_local bool thread_state_created = false;
+	if(!thread_state_created)
+	{
+		PyGILState_Ensure();
+		PyEval_SaveThread();
+		thread_state_created = true;
+	}
+
+	PythonUtil::GIL_Ensure gil_ensure;
+
+	if( ! token.IsCanceled() )
+	{
+		PyObject * pyarglist = Py_BuildValue("()");
+		PyObject * pyresult = PyObject_Call( func, pyarglist, NULL );
+		Py_DECREF(pyarglist);
+		if(pyresult)
+		{
+			Py_DECREF(pyresult);
+		}
+		else
+		{
+			PyErr_Print();
+		}
+	}
+
+	Py_DECREF(func);
+}
+
+// func をスレッドプールで実行する
+//
+// priority が大きいタスクほど先に実行する。
+// 実行の前に cancel_token がキャンセルされた場合は、func は呼ばれない。
+static PyObject * _submitTask( PyObject * self, PyObject * args, PyObject * kwds )
+{
+	FUNC_TRACE;
+
+	PyObject * func;
+	int priority = 0;
+	PyObject * pycancel_token = NULL;
+
+    static char * kwlist[] = {
+        "func",
+        "priority",
+        "cancel_token",
+        NULL
+    };
+
+    if(!PyArg_ParseTupleAndKeywords( args, kwds, "O|iO", kwlist,
+        &func,
+        &priority,
+        &pycancel_token
+    ))
+    {
+        return NULL;
+	}
+
+	ThreadUtil::CancelToken token;
+	if( pycancel_token && pycancel_token!=Py_None )
+	{
+		if( ! CancelToken_Check(pycancel_token) )
+		{
+			PyErr_SetString( PyExc_TypeError, "cancel_token must be a CancelToken." );
+			return NULL;
+		}
+		token = *((CancelToken_Object*)pycancel_token)->p;
+	}
+
+	Py_INCREF(func);
+
+	// Python の関数は I/O や GIL を待つことがあるので、blocking なタスクとして投入する
+	// キャンセルされていても func の参照を減らす必要があるので、キャンセルは _callOnThreadPool で判定する
+	ThreadUtil::GetThreadPool().Submit( [func,token]()
+	{
+		_callOnThreadPool( func, token );
+	}, priority, ThreadUtil::CancelToken(), true );
+
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+static PyMethodDef ckit_funcs[] =
+{
+    { "registerWindowClass", _registerWindowClass, METH_VARARGS, "" },
     { "registerCommandInfoConstructor", _registerCommandInfoConstructor, METH_VARARGS, "" },
     { "setGlobalOption", _setGlobalOption, METH_VARARGS, "" },
     { "enableBlockDetector", _enableBlockDetector, METH_VARARGS, "" },
     { "setBlockDetector", _setBlockDetector, METH_VARARGS, "" },
+    { "decodeLines", _decodeLines, METH_VARARGS, "" },
+    { "encodeLines", _encodeLines, METH_VARARGS, "" },
+    { "saveLines", _saveLines, METH_VARARGS, "" },
+    { "submitTask", (PyCFunction)_submitTask, METH_VARARGS|METH_KEYWORDS, "" },
     {NULL,NULL}
 };
 
@@ -8190,6 +12809,18 @@ PyMODINIT_FUNC PyInit_ckitcore(void)
     if( PyType_Ready(&Window_Type)<0 ) return NULL;
     if( PyType_Ready(&TaskTrayIcon_Type)<0 ) return NULL;
     if( PyType_Ready(&Line_Type)<0 ) return NULL;
+    if( PyType_Ready(&TokenArray_Type)<0 ) return NULL;
+    if( PyType_Ready(&TokenArrayIter_Type)<0 ) return NULL;
+    if( PyType_Ready(&LineIndex_Type)<0 ) return NULL;
+    if( PyType_Ready(&RegexLexer_Type)<0 ) return NULL;
+    if( PyType_Ready(&TextSearch_Type)<0 ) return NULL;
+    if( PyType_Ready(&Regex_Type)<0 ) return NULL;
+    if( PyType_Ready(&SearchHitIndex_Type)<0 ) return NULL;
+    if( PyType_Ready(&UndoJournal_Type)<0 ) return NULL;
+    if( PyType_Ready(&WordIndex_Type)<0 ) return NULL;
+    if( PyType_Ready(&BracketIndex_Type)<0 ) return NULL;
+    if( PyType_Ready(&WordBreak_Type)<0 ) return NULL;
+    if( PyType_Ready(&CancelToken_Type)<0 ) return NULL;
 
     PyObject *m, *d;
 
@@ -8223,8 +12854,57 @@ PyMODINIT_FUNC PyInit_ckitcore(void)
     Py_INCREF(&Line_Type);
     PyModule_AddObject( m, "Line", (PyObject*)&Line_Type );
 
+    Py_INCREF(&TokenArray_Type);
+    PyModule_AddObject( m, "TokenArray", (PyObject*)&TokenArray_Type );
+
+    Py_INCREF(&LineIndex_Type);
+    PyModule_AddObject( m, "LineIndex", (PyObject*)&LineIndex_Type );
+
+    Py_INCREF(&RegexLexer_Type);
+    PyModule_AddObject( m, "RegexLexer", (PyObject*)&RegexLexer_Type );
+
+    Py_INCREF(&TextSearch_Type);
+    PyModule_AddObject( m, "TextSearch", (PyObject*)&TextSearch_Type );
+
+    Py_INCREF(&Regex_Type);
+    PyModule_AddObject( m, "Regex", (PyObject*)&Regex_Type );
+
+    Py_INCREF(&SearchHitIndex_Type);
+    PyModule_AddObject( m, "SearchHitIndex", (PyObject*)&SearchHitIndex_Type );
+
+    Py_INCREF(&UndoJournal_Type);
+    PyModule_AddObject( m, "UndoJournal", (PyObject*)&UndoJournal_Type );
+
+    Py_INCREF(&WordIndex_Type);
+    PyModule_AddObject( m, "WordIndex", (PyObject*)&WordIndex_Type );
+
+    Py_INCREF(&BracketIndex_Type);
+    PyModule_AddObject( m, "BracketIndex", (PyObject*)&BracketIndex_Type );
+
+    Py_INCREF(&WordBreak_Type);
+    PyModule_AddObject( m, "WordBreak", (PyObject*)&WordBreak_Type );
+
+    Py_INCREF(&CancelToken_Type);
+    PyModule_AddObject( m, "CancelToken", (PyObject*)&CancelToken_Type );
+
 	Line_static_init();
 
+	Regex::UnicodeFuncs unicode_funcs;
+	unicode_funcs.is_word = _Regex_IsWord;
+	unicode_funcs.is_digit = _Regex_IsDigit;
+	unicode_funcs.is_space = _Regex_IsSpace;
+	unicode_funcs.to_lower = _Regex_ToLower;
+	Regex::SetUnicodeFuncs(unicode_funcs);
+
+	TextSearch::UnicodeFuncs search_unicode_funcs;
+	search_unicode_funcs.is_word = _Regex_IsWord;
+	search_unicode_funcs.to_lower = _Regex_ToLower;
+	TextSearch::SetUnicodeFuncs(search_unicode_funcs);
+
+	WordIndex::UnicodeFuncs word_unicode_funcs;
+	word_unicode_funcs.is_word = _Regex_IsWord;
+	WordIndex::SetUnicodeFuncs(word_unicode_funcs);
+
     d = PyModule_GetDict(m);
 
     Error = PyErr_NewException( MODULE_NAME".Error", NULL, NULL);
@@ -228,11 +228,32 @@ namespace ckit
 
     struct DelayedCallInfo
     {
-    	DelayedCallInfo( PyObject * _pyobj, int _timeout ) : pyobj(_pyobj), timeout(_timeout), calling(false) {}
+    	DelayedCallInfo( PyObject * _pyobj, ULONGLONG _due, unsigned int _seq ) : pyobj(_pyobj), due(_due), seq(_seq) {}
 
     	PyObject * pyobj;
-    	int timeout;
-    	bool calling;
+    	ULONGLONG due;		// 呼び出す時刻 (GetTickCount64)
+    	unsigned int seq;	// 登録の順番 (同じ時刻の呼び出しは登録順に呼ぶ)
+    };
+
+    // まとめて Python に渡す入力イベント
+    struct InputEvent
+    {
+    	InputEvent( int _type, int _x, int _y, float _wheel, int _code, int _mod ) : type(_type), x(_x), y(_y), wheel(_wheel), code(_code), mod(_mod), count(1) {}
+
+    	enum Type
+    	{
+    		MouseMove,
+    		MouseWheel,
+    		KeyDown,
+    		Char,
+    	};
+
+    	int type;
+    	int x, y;		// MouseMove, MouseWheel の位置
+    	float wheel;	// MouseWheel の回転量 (まとめたイベントの合計)
+    	int code;		// KeyDown の仮想キーコード、Char の文字
+    	int mod;
+    	int count;		// まとめたメッセージの数
     };
 
     struct HotKeyInfo
@@ -338,6 +359,7 @@ namespace ckit
 		    PyObject * mousemove_handler;
 		    PyObject * mousewheel_handler;
 		    PyObject * nchittest_handler;
+		    PyObject * input_handler;
 	    };
 
         Window( Param & param );
@@ -392,6 +414,14 @@ namespace ckit
         void _setImePosition();
         void flushPaint( HDC hDC=0, bool bitblt=true );
         void _onTimerCaretBlink();
+        void _requestPaint();
+        void _startCaretBlink();
+        void _stopCaretBlink();
+        void _setDelayedCallTimer();
+        void _onTimerDelayedCall();
+        void _queueInput( const InputEvent & ev, bool repeat );
+        bool _flushInput();
+        void _removeQueuedKeyInput();
         static LRESULT CALLBACK _wndProc(HWND hWnd, UINT msg, WPARAM wp, LPARAM lp);
         static int _getModKey();
 	    static bool _registerWindowClass();
@@ -433,6 +463,7 @@ namespace ckit
         RECT ime_rect;
         bool dirty;
         RECT dirty_rect;
+        bool paint_requested;		// TIMER_PAINT を設定済みかどうか
 		int perf_fillrect_count;
 		int perf_drawtext_count;
 		int perf_drawplane_count;
@@ -462,12 +493,22 @@ namespace ckit
 	    PyObject * mousemove_handler;
 	    PyObject * mousewheel_handler;
 	    PyObject * nchittest_handler;
+	    PyObject * input_handler;					// まとめた入力イベントのリストを受け取るハンドラ
+
+	    std::vector<InputEvent> input_queue;		// まだ Python に渡していない入力イベント
+	    size_t input_flush_pos;					// input_queue の中の、次に渡すイベントの位置
+	    bool input_timer;						// TIMER_INPUT を設定済みかどうか
+	    ULONGLONG input_received_count;			// 受け取った入力メッセージの数
+	    ULONGLONG input_delivered_count;			// まとめた後に Python に渡したイベントの数
+	    ULONGLONG input_call_count;				// 入力イベントのための Python の呼び出しの数
 
 	    std::list<TimerInfo> timer_list;
 	    int timer_list_ref_count;
 
-	    std::list<DelayedCallInfo> delayed_call_list;
-	    int delayed_call_list_ref_count;
+	    std::vector<DelayedCallInfo> delayed_call_heap;	// delayedCall で登録された関数 (呼び出す時刻が早い順のヒープ)
+	    unsigned int delayed_call_seq;
+
+	    std::list<PyObject*> posted_call_list;		// postCall で別のスレッドから登録された関数 (GIL で保護する)
 
 	    std::list<HotKeyInfo> hotkey_list;
 	    int hotkey_list_ref_count;
@@ -613,4 +654,123 @@ struct Line_Object
 };
 
 
+extern PyTypeObject TokenArray_Type;
+#define TokenArray_Check(op) PyObject_TypeCheck(op, &TokenArray_Type)
+
+// 1行分のトークン (位置と種類) の配列
+// data には位置の配列 (pos_size バイトずつ) と種類の配列 (type_size バイトずつ) が続けて並ぶ
+// 位置の配列を 4バイト単位で読めるように、data は 4バイト境界から始める
+struct TokenArray_Object
+{
+    PyObject_VAR_HEAD			// ob_size は data のバイト数
+    Py_ssize_t num;
+    unsigned char pos_size;		// 2 or 4
+    unsigned char type_size;	// 1 or 2
+    alignas(4) char data[1];
+};
+
+
+extern PyTypeObject LineIndex_Type;
+#define LineIndex_Check(op) PyObject_TypeCheck(op, &LineIndex_Type)
+
+struct LineIndex_Object
+{
+    PyObject_HEAD
+    ckit::LineIndex * p;
+};
+
+
+extern PyTypeObject RegexLexer_Type;
+#define RegexLexer_Check(op) PyObject_TypeCheck(op, &RegexLexer_Type)
+
+struct RegexLexer_Object
+{
+    PyObject_HEAD
+    ckit::RegexLexer * p;
+    PyObject * ctx_map;		// コンテキスト -> 番号
+    PyObject * ctx_list;	// 番号 -> コンテキスト
+};
+
+
+extern PyTypeObject TextSearch_Type;
+#define TextSearch_Check(op) PyObject_TypeCheck(op, &TextSearch_Type)
+
+struct TextSearch_Object
+{
+    PyObject_HEAD
+    ckit::TextSearch * p;
+};
+
+
+extern PyTypeObject Regex_Type;
+#define Regex_Check(op) PyObject_TypeCheck(op, &Regex_Type)
+
+struct Regex_Object
+{
+    PyObject_HEAD
+    ckit::Regex * p;
+};
+
+
+extern PyTypeObject SearchHitIndex_Type;
+#define SearchHitIndex_Check(op) PyObject_TypeCheck(op, &SearchHitIndex_Type)
+
+struct SearchHitIndex_Object
+{
+    PyObject_HEAD
+    ckit::SearchHitIndex * p;
+};
+
+
+extern PyTypeObject UndoJournal_Type;
+#define UndoJournal_Check(op) PyObject_TypeCheck(op, &UndoJournal_Type)
+
+struct UndoJournal_Object
+{
+    PyObject_HEAD
+    ckit::UndoJournal * p;
+};
+
+
+extern PyTypeObject WordIndex_Type;
+#define WordIndex_Check(op) PyObject_TypeCheck(op, &WordIndex_Type)
+
+struct WordIndex_Object
+{
+    PyObject_HEAD
+    ckit::WordIndex * p;
+};
+
+
+extern PyTypeObject BracketIndex_Type;
+#define BracketIndex_Check(op) PyObject_TypeCheck(op, &BracketIndex_Type)
+
+struct BracketIndex_Object
+{
+    PyObject_HEAD
+    ckit::BracketIndex * p;
+    unsigned int ignore_token_mask;	// 括弧として扱わないトークンの種類 (1<<種類 の組み合わせ)
+};
+
+
+extern PyTypeObject WordBreak_Type;
+#define WordBreak_Check(op) PyObject_TypeCheck(op, &WordBreak_Type)
+
+struct WordBreak_Object
+{
+    PyObject_HEAD
+    ckit::WordBreak * p;
+};
+
+
+extern PyTypeObject CancelToken_Type;
+#define CancelToken_Check(op) PyObject_TypeCheck(op, &CancelToken_Type)
+
+struct CancelToken_Object
+{
+    PyObject_HEAD
+    ThreadUtil::CancelToken * p;
+};
+
+
 #endif //__CKITCORE_H__
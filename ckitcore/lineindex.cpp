@@ -0,0 +1,497 @@
+﻿#include <algorithm>
+#include <string.h>
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define LINEINDEX_USE_SSE2
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#include "threadutil.h"
+#include "lineindex.h"
+
+using namespace ckit;
+
+//-----------------------------------------------------------------------------
+
+// 並列にスキャンする場合の1チャンクの大きさ
+static const size_t SCAN_CHUNK_SIZE = 4 * 1024 * 1024;
+
+//-----------------------------------------------------------------------------
+
+LineOffsetArray::LineOffsetArray()
+	:
+	size(0)
+{
+}
+
+void LineOffsetArray::Clear()
+{
+	bases.clear();
+	deltas.clear();
+	large.clear();
+	size = 0;
+}
+
+void LineOffsetArray::Swap( LineOffsetArray & other )
+{
+	bases.swap(other.bases);
+	deltas.swap(other.deltas);
+	large.swap(other.large);
+	std::swap( size, other.size );
+}
+
+void LineOffsetArray::PushBack( unsigned long long offset )
+{
+	if( size % BLOCK_SIZE == 0 )
+	{
+		bases.push_back(offset);
+	}
+
+	deltas.push_back(0);
+	size++;
+
+	SetBack(offset);
+}
+
+void LineOffsetArray::SetBack( unsigned long long offset )
+{
+	size_t index = size-1;
+	unsigned long long delta = offset - bases[ index / BLOCK_SIZE ];
+
+	if( delta < LARGE_DELTA )
+	{
+		deltas[index] = (unsigned int)delta;
+		large.erase(index);
+	}
+	else
+	{
+		deltas[index] = LARGE_DELTA;
+		large[index] = offset;
+	}
+}
+
+unsigned long long LineOffsetArray::Get( size_t index ) const
+{
+	unsigned int delta = deltas[index];
+
+	if( delta==LARGE_DELTA )
+	{
+		return large.find(index)->second;
+	}
+
+	return bases[ index / BLOCK_SIZE ] + delta;
+}
+
+size_t LineOffsetArray::GetMemorySize() const
+{
+	return bases.capacity() * sizeof(bases[0]) + deltas.capacity() * sizeof(deltas[0]) + large.size() * 32;
+}
+
+//-----------------------------------------------------------------------------
+
+static inline int _countTrailingZeros( unsigned int x )
+{
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward( &index, x );
+	return (int)index;
+#else
+	return __builtin_ctz(x);
+#endif
+}
+
+static inline unsigned int _readUnit( const unsigned char * p, int unit_size, bool big_endian )
+{
+	if( unit_size==1 ) return p[0];
+	return big_endian ? ( (p[0]<<8) | p[1] ) : ( p[0] | (p[1]<<8) );
+}
+
+// data[begin,end) の改行を探し、改行の直後(次の行頭)ごとに func を呼ぶ
+//
+// func が false を返すとその行頭位置を返して終了する。最後まで進んだ場合は end を返す。
+// CRLF の判定のために、end より先 (len まで) を参照することがある。
+// begin と end は unit_size の単位で揃っている必要がある。
+template<typename FUNC>
+static size_t _scanLineStarts( int unit_size, bool big_endian, const unsigned char * data, size_t len, size_t begin, size_t end, FUNC func )
+{
+	size_t i = begin;
+
+	// 改行が見つかった位置の処理
+	// 行頭位置を返す。CRLF の CR の場合は 0 を返す。
+	auto line_start = [&]( size_t p ) -> size_t
+	{
+		if( _readUnit( data+p, unit_size, big_endian )=='\r'
+			&& p+unit_size*2<=len
+			&& _readUnit( data+p+unit_size, unit_size, big_endian )=='\n' )
+		{
+			return 0;
+		}
+		return p+unit_size;
+	};
+
+#if defined(LINEINDEX_USE_SSE2)
+	if( unit_size==1 )
+	{
+		const __m128i lf = _mm_set1_epi8('\n');
+		const __m128i cr = _mm_set1_epi8('\r');
+
+		for( ; i+16<=end ; i+=16 )
+		{
+			__m128i v = _mm_loadu_si128( (const __m128i*)(data+i) );
+			unsigned int mask = _mm_movemask_epi8( _mm_or_si128( _mm_cmpeq_epi8(v,lf), _mm_cmpeq_epi8(v,cr) ) );
+
+			while(mask)
+			{
+				size_t p = i + _countTrailingZeros(mask);
+				mask &= mask-1;
+
+				size_t start = line_start(p);
+				if( start && !func(start) ) return start;
+			}
+		}
+	}
+	else
+	{
+		// メモリ上のバイト順のまま比較する
+		const __m128i lf = _mm_set1_epi16( big_endian ? 0x0a00 : 0x000a );
+		const __m128i cr = _mm_set1_epi16( big_endian ? 0x0d00 : 0x000d );
+
+		for( ; i+16<=end ; i+=16 )
+		{
+			__m128i v = _mm_loadu_si128( (const __m128i*)(data+i) );
+			unsigned int mask = _mm_movemask_epi8( _mm_or_si128( _mm_cmpeq_epi16(v,lf), _mm_cmpeq_epi16(v,cr) ) );
+			mask &= 0x5555;
+
+			while(mask)
+			{
+				size_t p = i + _countTrailingZeros(mask);
+				mask &= mask-1;
+
+				size_t start = line_start(p);
+				if( start && !func(start) ) return start;
+			}
+		}
+	}
+#endif
+
+	for( ; i+unit_size<=end ; i+=unit_size )
+	{
+		unsigned int c = _readUnit( data+i, unit_size, big_endian );
+		if( c=='\n' || c=='\r' )
+		{
+			size_t start = line_start(i);
+			if( start && !func(start) ) return start;
+		}
+	}
+
+	return end;
+}
+
+//-----------------------------------------------------------------------------
+
+LineIndex::LineIndex( int _unit_size, bool _big_endian, unsigned long long origin, int _sampling )
+	:
+	unit_size(_unit_size),
+	big_endian(_big_endian),
+	sampling( std::max(_sampling,1) ),
+	num_lines(1),
+	scanned_pos(origin),
+	last_cr(false)
+{
+	offsets.PushBack(origin);
+}
+
+size_t LineIndex::GetNumLines() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return num_lines;
+}
+
+unsigned long long LineIndex::GetScannedPos() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return scanned_pos;
+}
+
+size_t LineIndex::GetMemorySize() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return offsets.GetMemorySize();
+}
+
+bool LineIndex::Scan( const unsigned char * data, size_t len, size_t max_size )
+{
+	// スキャンは同時に1つだけ実行する
+	// 読み込み側は、結果を反映するときにだけ待たされる
+	std::lock_guard<std::mutex> scan_lock(scan_mutex);
+
+	size_t begin;
+	size_t first_lineno;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		if( scanned_pos+unit_size > len ) return true;
+
+		// 前回のスキャンが CR で終わっていて、その後に LF が追加された場合は CRLF として扱う
+		if( last_cr )
+		{
+			last_cr = false;
+
+			if( _readUnit( data+scanned_pos, unit_size, big_endian )=='\n' )
+			{
+				scanned_pos += unit_size;
+				if( (num_lines-1) % sampling == 0 )
+				{
+					offsets.SetBack(scanned_pos);
+				}
+			}
+		}
+
+		begin = (size_t)scanned_pos;
+		first_lineno = num_lines;
+	}
+
+	if( begin+unit_size > len ) return true;
+
+	size_t stop = begin + std::min( std::max( max_size, (size_t)unit_size ), len-begin );
+
+	// 単位の途中で終わらないようにする (utf-16 の奇数バイトの端数はスキャンしない)
+	stop = begin + ( stop-begin ) / unit_size * unit_size;
+	if( stop==begin ) return true;
+
+	// ロックの外でスキャンし、sampling 行ごとの行頭位置を recorded に集める
+	std::vector<unsigned long long> recorded;
+	size_t count;
+	if( stop-begin >= SCAN_CHUNK_SIZE*2 && ThreadUtil::GetNumWorkers()>1 )
+	{
+		count = _scanParallel( data, len, begin, stop, first_lineno, &recorded );
+	}
+	else
+	{
+		count = _scanSerial( data, len, begin, stop, first_lineno, &recorded );
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		for( size_t i=0 ; i<recorded.size() ; ++i )
+		{
+			offsets.PushBack( recorded[i] );
+		}
+
+		num_lines = first_lineno + count;
+		scanned_pos = stop;
+		last_cr = ( stop+unit_size > len && _readUnit( data+stop-unit_size, unit_size, big_endian )=='\r' );
+	}
+
+	return stop+unit_size > len;
+}
+
+size_t LineIndex::_scanSerial( const unsigned char * data, size_t len, size_t begin, size_t stop, size_t first_lineno, std::vector<unsigned long long> * recorded ) const
+{
+	size_t lineno = first_lineno;
+	_scanLineStarts( unit_size, big_endian, data, len, begin, stop, [&]( size_t start )
+	{
+		if( lineno % sampling == 0 )
+		{
+			recorded->push_back(start);
+		}
+		lineno++;
+		return true;
+	});
+
+	return lineno - first_lineno;
+}
+
+size_t LineIndex::_scanParallel( const unsigned char * data, size_t len, size_t begin, size_t stop, size_t first_lineno, std::vector<unsigned long long> * recorded ) const
+{
+	size_t chunk_size = SCAN_CHUNK_SIZE / unit_size * unit_size;
+	int num_chunks = (int)( ( stop - begin + chunk_size - 1 ) / chunk_size );
+
+	auto chunk_begin = [&]( int index ) { return std::min( begin + chunk_size*index, stop ); };
+
+	// 1パス目 : チャンクごとの行数を数える
+	std::vector<size_t> counts(num_chunks);
+	ThreadUtil::ParallelFor( num_chunks, [&]( int index )
+	{
+		size_t count = 0;
+		_scanLineStarts( unit_size, big_endian, data, len, chunk_begin(index), chunk_begin(index+1), [&count]( size_t )
+		{
+			count++;
+			return true;
+		});
+		counts[index] = count;
+	});
+
+	// 2パス目 : 各チャンクの先頭の行番号がわかったので、sampling 行ごとの行頭位置を記録する
+	std::vector<size_t> chunk_first_lineno(num_chunks);
+	size_t lineno = first_lineno;
+	for( int i=0 ; i<num_chunks ; ++i )
+	{
+		chunk_first_lineno[i] = lineno;
+		lineno += counts[i];
+	}
+
+	std::vector< std::vector<unsigned long long> > chunk_recorded(num_chunks);
+	ThreadUtil::ParallelFor( num_chunks, [&]( int index )
+	{
+		_scanSerial( data, len, chunk_begin(index), chunk_begin(index+1), chunk_first_lineno[index], &chunk_recorded[index] );
+	});
+
+	for( int i=0 ; i<num_chunks ; ++i )
+	{
+		recorded->insert( recorded->end(), chunk_recorded[i].begin(), chunk_recorded[i].end() );
+	}
+
+	return lineno - first_lineno;
+}
+
+bool LineIndex::GetLineRange( const unsigned char * data, size_t len, size_t lineno, size_t * start, size_t * end ) const
+{
+	size_t pos;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		if( lineno >= num_lines ) return false;
+
+		pos = (size_t)offsets.Get( lineno / sampling );
+	}
+
+	if( pos > len ) return false;
+
+	// サンプリングされた行から、目的の行まで進める
+	size_t skip = lineno % sampling;
+	if( skip>0 )
+	{
+		size_t count = 0;
+		pos = _scanLineStarts( unit_size, big_endian, data, len, pos, len - (len-pos) % unit_size, [&]( size_t )
+		{
+			return ++count < skip;
+		});
+	}
+
+	*start = pos;
+
+	bool found = false;
+	size_t next = _scanLineStarts( unit_size, big_endian, data, len, pos, len - (len-pos) % unit_size, [&]( size_t )
+	{
+		found = true;
+		return false;
+	});
+
+	*end = found ? next : len;
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+
+// 保存形式
+//
+//   "CKLI" version unit_size big_endian sampling num_lines scanned_pos last_cr num_offsets
+//   行頭位置の差分 x num_offsets
+//
+// 数値はすべて可変長(7bitずつ、下位から)で保存する。
+
+static const unsigned char DUMP_MAGIC[4] = { 'C', 'K', 'L', 'I' };
+static const unsigned int DUMP_VERSION = 1;
+
+static void _writeVarint( std::vector<unsigned char> * buf, unsigned long long value )
+{
+	while( value >= 0x80 )
+	{
+		buf->push_back( (unsigned char)( value | 0x80 ) );
+		value >>= 7;
+	}
+	buf->push_back( (unsigned char)value );
+}
+
+static bool _readVarint( const unsigned char ** p, const unsigned char * end, unsigned long long * value )
+{
+	unsigned long long result = 0;
+	for( int shift=0 ; shift<64 ; shift+=7 )
+	{
+		if( *p>=end ) return false;
+		unsigned char c = *(*p)++;
+		result |= (unsigned long long)(c & 0x7f) << shift;
+		if( (c & 0x80)==0 )
+		{
+			*value = result;
+			return true;
+		}
+	}
+	return false;
+}
+
+void LineIndex::Dump( std::vector<unsigned char> * buf ) const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	buf->clear();
+	buf->reserve( offsets.Size() * 2 + 64 );
+
+	buf->insert( buf->end(), DUMP_MAGIC, DUMP_MAGIC+4 );
+	_writeVarint( buf, DUMP_VERSION );
+	_writeVarint( buf, unit_size );
+	_writeVarint( buf, big_endian ? 1 : 0 );
+	_writeVarint( buf, sampling );
+	_writeVarint( buf, num_lines );
+	_writeVarint( buf, scanned_pos );
+	_writeVarint( buf, last_cr ? 1 : 0 );
+	_writeVarint( buf, offsets.Size() );
+
+	unsigned long long prev = 0;
+	for( size_t i=0 ; i<offsets.Size() ; ++i )
+	{
+		unsigned long long offset = offsets.Get(i);
+		_writeVarint( buf, offset - prev );
+		prev = offset;
+	}
+}
+
+bool LineIndex::Load( const unsigned char * data, size_t len )
+{
+	const unsigned char * p = data;
+	const unsigned char * end = data + len;
+
+	if( len<4 || memcmp( p, DUMP_MAGIC, 4 )!=0 ) return false;
+	p += 4;
+
+	unsigned long long version, _unit_size, _big_endian, _sampling, _num_lines, _scanned_pos, _last_cr, num_offsets;
+	if( !_readVarint( &p, end, &version ) || version!=DUMP_VERSION ) return false;
+	if( !_readVarint( &p, end, &_unit_size ) || _unit_size!=(unsigned long long)unit_size ) return false;
+	if( !_readVarint( &p, end, &_big_endian ) || (_big_endian!=0)!=big_endian ) return false;
+	if( !_readVarint( &p, end, &_sampling ) || _sampling!=(unsigned long long)sampling ) return false;
+	if( !_readVarint( &p, end, &_num_lines ) ) return false;
+	if( !_readVarint( &p, end, &_scanned_pos ) ) return false;
+	if( !_readVarint( &p, end, &_last_cr ) ) return false;
+	if( !_readVarint( &p, end, &num_offsets ) ) return false;
+
+	if( num_offsets==0 || num_offsets != ( _num_lines + sampling - 1 ) / sampling ) return false;
+
+	LineOffsetArray loaded;
+	unsigned long long offset = 0;
+	for( unsigned long long i=0 ; i<num_offsets ; ++i )
+	{
+		unsigned long long delta;
+		if( !_readVarint( &p, end, &delta ) ) return false;
+		offset += delta;
+		loaded.PushBack(offset);
+	}
+
+	if( offset > _scanned_pos ) return false;
+
+	std::lock_guard<std::mutex> scan_lock(scan_mutex);
+	std::lock_guard<std::mutex> lock(mutex);
+
+	offsets.Swap(loaded);
+	num_lines = (size_t)_num_lines;
+	scanned_pos = _scanned_pos;
+	last_cr = _last_cr!=0;
+
+	return true;
+}
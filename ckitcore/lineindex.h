@@ -0,0 +1,99 @@
+﻿#ifndef _LINEINDEX_H_
+#define _LINEINDEX_H_
+
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+
+namespace ckit
+{
+	// 行頭位置の配列
+	//
+	// BLOCK_SIZE 個ごとに 64bit の基準位置を持ち、各要素は基準位置からの
+	// 32bit の差分で保持する (1行あたり約4バイト)。
+	// 差分が 32bit に収まらない要素は large に保持する。
+	class LineOffsetArray
+	{
+	public:
+		LineOffsetArray();
+
+		void Clear();
+		void Swap( LineOffsetArray & other );
+		void PushBack( unsigned long long offset );
+		void SetBack( unsigned long long offset );
+		unsigned long long Get( size_t index ) const;
+		size_t Size() const { return size; }
+		size_t GetMemorySize() const;
+
+	private:
+		enum
+		{
+			BLOCK_SIZE = 64,
+			LARGE_DELTA = 0xffffffff,
+		};
+
+		std::vector<unsigned long long> bases;
+		std::vector<unsigned int> deltas;
+		std::unordered_map<size_t,unsigned long long> large;
+		size_t size;
+	};
+
+	// 巨大なテキストファイルの行インデックス
+	//
+	// メモリマップされたファイルの内容から改行 (CR / LF / CRLF) を探し、
+	// sampling 行ごとの行頭位置を記録する。
+	// sampling が 1 の場合は O(1)、それ以外の場合は O(sampling) で任意の行に移動できる。
+	//
+	// Scan をバックグラウンドのスレッドで実行しながら、
+	// 別のスレッドから GetNumLines / GetLineRange などを呼び出すことができる。
+	class LineIndex
+	{
+	public:
+		// unit_size : 1文字の単位のバイト数 (utf-16 の場合は 2)
+		// origin : 最初の行の開始位置 (BOM の直後)
+		LineIndex( int unit_size, bool big_endian, unsigned long long origin, int sampling );
+
+		// data[0,len) のうち、未スキャンの部分を最大 max_size バイトスキャンする
+		// 最後までスキャンし終わった場合は true を返す
+		// Python の GIL を保持せずに呼び出すことができる
+		bool Scan( const unsigned char * data, size_t len, size_t max_size );
+
+		// 行頭位置がわかっている行の数
+		size_t GetNumLines() const;
+
+		// スキャン済みの位置
+		unsigned long long GetScannedPos() const;
+
+		// 行の範囲 [start,end) を得る (end は改行の直後)
+		// lineno がわかっていない行の場合は false を返す
+		bool GetLineRange( const unsigned char * data, size_t len, size_t lineno, size_t * start, size_t * end ) const;
+
+		int GetSampling() const { return sampling; }
+		size_t GetMemorySize() const;
+
+		// インデックスをバイト列に保存する
+		void Dump( std::vector<unsigned char> * buf ) const;
+
+		// Dump で保存したバイト列からインデックスを復元する
+		// 形式が正しくない場合や、unit_size / big_endian / sampling が異なる場合は false を返す
+		bool Load( const unsigned char * data, size_t len );
+
+	private:
+		size_t _scanSerial( const unsigned char * data, size_t len, size_t begin, size_t stop, size_t first_lineno, std::vector<unsigned long long> * recorded ) const;
+		size_t _scanParallel( const unsigned char * data, size_t len, size_t begin, size_t stop, size_t first_lineno, std::vector<unsigned long long> * recorded ) const;
+
+		int unit_size;
+		bool big_endian;
+		int sampling;
+
+		LineOffsetArray offsets;		// sampling 行ごとの行頭位置
+		size_t num_lines;
+		unsigned long long scanned_pos;
+		bool last_cr;					// スキャン済みの範囲が CR で終わっている (後に LF が続くと CRLF になる)
+
+		mutable std::mutex mutex;		// offsets / num_lines / scanned_pos / last_cr を保護する
+		std::mutex scan_mutex;			// Scan と Load を直列化する
+	};
+};
+
+#endif // _LINEINDEX_H_
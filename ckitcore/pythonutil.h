@@ -19,25 +19,29 @@ namespace PythonUtil
 	//#define GIL_Ensure_TRACE printf("%s(%d) : %s\n",__FILE__,__LINE__,__FUNCTION__)
 	#define GIL_Ensure_TRACE
 
+	// ensure が false のときは GIL を取得しない
 	class GIL_Ensure
 	{
 	public:
-		GIL_Ensure()
+		GIL_Ensure( bool _ensure=true )
+			:
+			ensured(_ensure)
 		{
 			GIL_Ensure_TRACE;
-			state = PyGILState_Ensure();
+			if(ensured) state = PyGILState_Ensure();
 			GIL_Ensure_TRACE;
 		};
 
 		~GIL_Ensure()
 		{
 			GIL_Ensure_TRACE;
-			PyGILState_Release(state);
+			if(ensured) PyGILState_Release(state);
 			GIL_Ensure_TRACE;
 		};
 		
 	private:
 		PyGILState_STATE state;
+		bool ensured;
 	};
 };
 
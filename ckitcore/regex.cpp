@@ -0,0 +1,2364 @@
+﻿#include <string.h>
+#include <algorithm>
+#include <memory>
+#include <map>
+#include <unordered_map>
+#include <mutex>
+#include <shared_mutex>
+
+#include "unicodefuncs.h"
+#include "casefold.h"
+#include "regex.h"
+
+using namespace ckit;
+
+//-----------------------------------------------------------------------------
+
+// 命令数の上限 (繰り返し回数の指定で命令数が増えすぎる場合はコンパイルしない)
+static const size_t MAX_INSTS = 100000;
+
+// 無限の繰り返し
+static const int REPEAT_INFINITE = -1;
+
+// 先読みで読む文字数の上限
+// 先読みは位置ごとに部分プログラムを実行するので、読む文字数が制限されていないと全体が O(n^2) になる
+static const int LOOKAHEAD_MAX_WIDTH = 256;
+
+// 入れ子になった「空文字列にマッチできる繰り返し」の深さの上限
+// Pike VM は命令ごとに 2^深さ 個の状態を持つので、超える場合はコンパイルしない
+static const int MAX_NULLABLE_LOOP_DEPTH = 4;
+
+enum Escape
+{
+	Escape_Word = 1<<0,
+	Escape_NotWord = 1<<1,
+	Escape_Digit = 1<<2,
+	Escape_NotDigit = 1<<3,
+	Escape_Space = 1<<4,
+	Escape_NotSpace = 1<<5,
+};
+
+//-----------------------------------------------------------------------------
+
+static Regex::UnicodeFuncs unicode_funcs =
+{
+	UnicodeFuncsDefault::IsNone,
+	UnicodeFuncsDefault::IsNone,
+	UnicodeFuncsDefault::IsNone,
+	UnicodeFuncsDefault::Identity,
+};
+
+static CaseFold case_fold( UnicodeFuncsDefault::Identity );
+
+void Regex::SetUnicodeFuncs( const UnicodeFuncs & funcs )
+{
+	unicode_funcs = funcs;
+	case_fold.SetToLower(funcs.to_lower);
+}
+
+static inline bool _isWord( unsigned int c, bool ascii )
+{
+	if( c<128 ) return ( c>='a' && c<='z' ) || ( c>='A' && c<='Z' ) || ( c>='0' && c<='9' ) || c=='_';
+	return !ascii && unicode_funcs.is_word(c);
+}
+
+static inline bool _isDigit( unsigned int c, bool ascii )
+{
+	if( c<128 ) return c>='0' && c<='9';
+	return !ascii && unicode_funcs.is_digit(c);
+}
+
+static inline bool _isSpace( unsigned int c, bool ascii )
+{
+	if( c<128 ) return c==' ' || ( c>='\t' && c<='\r' ) || ( c>=0x1c && c<=0x1f );
+	return !ascii && unicode_funcs.is_space(c);
+}
+
+// 大文字小文字を区別しない比較のための変換 (結果が等しい文字同士が一致する)
+// ASCII モードでは ASCII の範囲だけで変換し、それ以外では re の IGNORECASE と同じ規則で変換する
+static inline unsigned int _fold( unsigned int c, bool ascii )
+{
+	if( c<128 ) return ( c>='A' && c<='Z' ) ? c+0x20 : c;
+	return ascii ? c : case_fold.Fold(c);
+}
+
+static inline bool _bitmapTest( const unsigned int * bitmap, unsigned int c )
+{
+	return ( bitmap[c>>5] >> (c&31) ) & 1;
+}
+
+static inline void _bitmapSet( unsigned int * bitmap, unsigned int c )
+{
+	bitmap[c>>5] |= 1u << (c&31);
+}
+
+//-----------------------------------------------------------------------------
+
+bool Regex::CharClass::_matchRaw( unsigned int c ) const
+{
+	for( size_t i=0 ; i<ranges.size() ; ++i )
+	{
+		if( ranges[i].first<=c && c<=ranges[i].second ) return true;
+	}
+
+	if( escapes )
+	{
+		if( (escapes & Escape_Word) && _isWord(c,ascii) ) return true;
+		if( (escapes & Escape_NotWord) && !_isWord(c,ascii) ) return true;
+		if( (escapes & Escape_Digit) && _isDigit(c,ascii) ) return true;
+		if( (escapes & Escape_NotDigit) && !_isDigit(c,ascii) ) return true;
+		if( (escapes & Escape_Space) && _isSpace(c,ascii) ) return true;
+		if( (escapes & Escape_NotSpace) && !_isSpace(c,ascii) ) return true;
+	}
+
+	return false;
+}
+
+bool Regex::CharClass::_matchNoCase( unsigned int c ) const
+{
+	if( _matchRaw(c) ) return true;
+
+	if( ignore_case )
+	{
+		if( ascii )
+		{
+			if( c>='A' && c<='Z' ) return _matchRaw(c+0x20);
+			if( c>='a' && c<='z' ) return _matchRaw(c-0x20);
+			return false;
+		}
+
+		// K (KELVIN SIGN) と k と K のように、変換の結果が同じになる全ての文字を調べる
+		unsigned int chars[CaseFold::MAX_CHARS];
+		int num = case_fold.GetChars( case_fold.Fold(c), chars );
+		for( int i=0 ; i<num ; ++i )
+		{
+			if( chars[i]!=c && _matchRaw(chars[i]) ) return true;
+		}
+	}
+
+	return false;
+}
+
+bool Regex::CharClass::Match( unsigned int c ) const
+{
+	if( c<256 ) return _bitmapTest( bitmap, c );
+	return _matchNoCase(c) != negate;
+}
+
+bool Regex::CharClass::CanMatchHigh() const
+{
+	if( negate || escapes || ignore_case ) return true;
+
+	for( size_t i=0 ; i<ranges.size() ; ++i )
+	{
+		if( ranges[i].second>=256 ) return true;
+	}
+
+	return false;
+}
+
+//-----------------------------------------------------------------------------
+
+namespace
+{
+	// 構文木のノード
+	struct Node
+	{
+		enum Type
+		{
+			Type_Empty,
+			Type_Char,
+			Type_Any,
+			Type_Class,
+			Type_Concat,
+			Type_Alternate,
+			Type_Repeat,
+			Type_Group,
+			Type_Assert,
+			Type_Look,
+		};
+
+		Node( int _type ) : type(_type), c(0), flags(0), index(0), min(0), max(0), greedy(true), ahead(true), negate(false) {}
+
+		int type;
+		unsigned int c;
+		int flags;
+		int index;					// 文字クラス / グループ / アサーションの番号
+		int min, max;
+		bool greedy;
+		bool ahead, negate;
+		std::vector<int> children;
+	};
+
+	// パターンの構文解析
+	//
+	// re モジュール (sre_parse) の構文に従う。
+	// パターンは re.compile で正しいことが確認済みである前提で、対応していない構文を見つけたら失敗する。
+	class Parser
+	{
+	public:
+		Parser( const std::vector<unsigned int> & _pattern, int _flags, std::vector<Regex::CharClass> * _classes )
+			:
+			pattern(_pattern),
+			pos(0),
+			num_groups(0),
+			classes(_classes)
+		{
+			flags_stack.push_back(_flags);
+		}
+
+		bool Parse( int * root )
+		{
+			if( !_parseAlternate(root) ) return false;
+			return pos==pattern.size();
+		}
+
+		int GetNumGroups() const { return num_groups; }
+		const Node & GetNode( int index ) const { return nodes[index]; }
+
+	private:
+		int _newNode( int type )
+		{
+			nodes.push_back( Node(type) );
+			nodes.back().flags = flags_stack.back();
+			return (int)nodes.size()-1;
+		}
+
+		bool _eof() const { return pos>=pattern.size(); }
+		unsigned int _peek( size_t offset=0 ) const { return pos+offset<pattern.size() ? pattern[pos+offset] : 0; }
+		bool _match( unsigned int c ) { if( !_eof() && pattern[pos]==c ) { pos++; return true; } return false; }
+
+		static bool _isOctDigit( unsigned int c ) { return c>='0' && c<='7'; }
+		static bool _isDecDigit( unsigned int c ) { return c>='0' && c<='9'; }
+
+		static int _hexValue( unsigned int c )
+		{
+			if( c>='0' && c<='9' ) return c-'0';
+			if( c>='a' && c<='f' ) return c-'a'+10;
+			if( c>='A' && c<='F' ) return c-'A'+10;
+			return -1;
+		}
+
+		bool _parseHex( int digits, unsigned int * value )
+		{
+			unsigned int result = 0;
+			for( int i=0 ; i<digits ; ++i )
+			{
+				int v = _hexValue(_peek());
+				if(v<0) return false;
+				result = result*16 + v;
+				pos++;
+			}
+			*value = result;
+			return true;
+		}
+
+		bool _parseAlternate( int * result )
+		{
+			int node = _newNode(Node::Type_Alternate);
+
+			while(true)
+			{
+				int branch;
+				if( !_parseConcat(&branch) ) return false;
+				nodes[node].children.push_back(branch);
+
+				if( !_match('|') ) break;
+			}
+
+			if( nodes[node].children.size()==1 )
+			{
+				*result = nodes[node].children[0];
+			}
+			else
+			{
+				*result = node;
+			}
+			return true;
+		}
+
+		bool _parseConcat( int * result )
+		{
+			int node = _newNode(Node::Type_Concat);
+
+			while( !_eof() && _peek()!='|' && _peek()!=')' )
+			{
+				int item;
+				bool skip = false;
+				if( !_parseRepeat( &item, &skip ) ) return false;
+				if(!skip)
+				{
+					nodes[node].children.push_back(item);
+				}
+			}
+
+			*result = node;
+			return true;
+		}
+
+		bool _parseRepeat( int * result, bool * skip )
+		{
+			int atom;
+			if( !_parseAtom( &atom, skip ) ) return false;
+			if( *skip ) return true;
+
+			while( !_eof() )
+			{
+				int min, max;
+				size_t save_pos = pos;
+				unsigned int c = _peek();
+
+				if( c=='*' ) { pos++; min=0; max=REPEAT_INFINITE; }
+				else if( c=='+' ) { pos++; min=1; max=REPEAT_INFINITE; }
+				else if( c=='?' ) { pos++; min=0; max=1; }
+				else if( c=='{' )
+				{
+					pos++;
+					if( _peek()=='}' ) { pos = save_pos; break; }
+
+					std::vector<unsigned int> lo, hi;
+					while( _isDecDigit(_peek()) ) lo.push_back(pattern[pos++]);
+					if( _match(',') )
+					{
+						while( _isDecDigit(_peek()) ) hi.push_back(pattern[pos++]);
+					}
+					else
+					{
+						hi = lo;
+					}
+
+					if( !_match('}') ) { pos = save_pos; break; }
+
+					min = 0;
+					max = REPEAT_INFINITE;
+					if( !lo.empty() && !_parseCount( lo, &min ) ) return false;
+					if( !hi.empty() && !_parseCount( hi, &max ) ) return false;
+				}
+				else
+				{
+					break;
+				}
+
+				bool greedy = true;
+				if( _match('?') )
+				{
+					greedy = false;
+				}
+				else if( _peek()=='+' )
+				{
+					// 強欲な量指定子 (Python 3.11 以降) には対応しない
+					return false;
+				}
+
+				int node = _newNode(Node::Type_Repeat);
+				nodes[node].min = min;
+				nodes[node].max = max;
+				nodes[node].greedy = greedy;
+				nodes[node].children.push_back(atom);
+				atom = node;
+
+				// re では量指定子の連続はエラーなので、ここには来ない
+				break;
+			}
+
+			*result = atom;
+			return true;
+		}
+
+		bool _parseCount( const std::vector<unsigned int> & digits, int * value )
+		{
+			long long result = 0;
+			for( size_t i=0 ; i<digits.size() ; ++i )
+			{
+				result = result*10 + ( digits[i]-'0' );
+				if( result>(long long)MAX_INSTS ) return false;
+			}
+			*value = (int)result;
+			return true;
+		}
+
+		bool _parseAtom( int * result, bool * skip )
+		{
+			unsigned int c = pattern[pos++];
+			int flags = flags_stack.back();
+
+			switch(c)
+			{
+			case '.':
+				*result = _newNode(Node::Type_Any);
+				return true;
+
+			case '^':
+				*result = _newNode(Node::Type_Assert);
+				nodes[*result].index = (flags & Regex::Flag_Multiline) ? Regex::Assert_BeginLine : Regex::Assert_BeginText;
+				return true;
+
+			case '$':
+				*result = _newNode(Node::Type_Assert);
+				nodes[*result].index = (flags & Regex::Flag_Multiline) ? Regex::Assert_EndLine : Regex::Assert_EndTextOrNL;
+				return true;
+
+			case '[':
+				return _parseClass(result);
+
+			case '(':
+				return _parseGroup( result, skip );
+
+			case '\\':
+				return _parseEscape(result);
+
+			default:
+				*result = _newNode(Node::Type_Char);
+				nodes[*result].c = c;
+				return true;
+			}
+		}
+
+		bool _parseGroup( int * result, bool * skip )
+		{
+			bool capture = true;
+
+			if( _match('?') )
+			{
+				unsigned int c = _peek();
+
+				if( c==':' )
+				{
+					pos++;
+					capture = false;
+				}
+				else if( c=='P' )
+				{
+					pos++;
+					if( !_match('<') ) return false;	// (?P=name) は後方参照
+					while( !_eof() && _peek()!='>' ) pos++;
+					if( !_match('>') ) return false;
+				}
+				else if( c=='#' )
+				{
+					// コメント
+					while( !_eof() && _peek()!=')' ) pos++;
+					if( !_match(')') ) return false;
+					*skip = true;
+					return true;
+				}
+				else if( c=='=' || c=='!' )
+				{
+					pos++;
+					return _parseLook( result, true, c=='!' );
+				}
+				else if( c=='<' && ( _peek(1)=='=' || _peek(1)=='!' ) )
+				{
+					pos += 2;
+					return _parseLook( result, false, pattern[pos-1]=='!' );
+				}
+				else
+				{
+					// フラグ (?aiLmsux) / (?aiLmsux-imsx:...)
+					int add = 0, remove = 0;
+					bool minus = false;
+					while(true)
+					{
+						c = _peek();
+						if( c=='-' && !minus )
+						{
+							pos++;
+							minus = true;
+							continue;
+						}
+
+						int flag;
+						if( c=='i' ) flag = Regex::Flag_IgnoreCase;
+						else if( c=='m' ) flag = Regex::Flag_Multiline;
+						else if( c=='s' ) flag = Regex::Flag_DotAll;
+						else if( c=='a' ) flag = Regex::Flag_Ascii;
+						else if( c=='u' ) flag = 0;
+						else break;
+
+						pos++;
+						if(minus) remove |= flag; else add |= flag;
+					}
+
+					if( _match(')') )
+					{
+						// パターン全体に対するフラグは、呼び出し側から渡されるフラグに含まれている
+						if(minus) return false;
+						*skip = true;
+						return true;
+					}
+
+					// (?x) (?L) や、条件分岐 (?(1)...)、アトミックグループ (?>...) には対応しない
+					if( !_match(':') ) return false;
+
+					flags_stack.push_back( ( flags_stack.back() | add ) & ~remove );
+					int node;
+					bool ok = _parseAlternate(&node);
+					flags_stack.pop_back();
+					if( !ok || !_match(')') ) return false;
+
+					*result = node;
+					return true;
+				}
+			}
+
+			int group_index = 0;
+			if(capture)
+			{
+				group_index = ++num_groups;
+			}
+
+			int child;
+			if( !_parseAlternate(&child) ) return false;
+			if( !_match(')') ) return false;
+
+			if(capture)
+			{
+				int node = _newNode(Node::Type_Group);
+				nodes[node].index = group_index;
+				nodes[node].children.push_back(child);
+				*result = node;
+			}
+			else
+			{
+				*result = child;
+			}
+			return true;
+		}
+
+		bool _parseLook( int * result, bool ahead, bool negate )
+		{
+			// 先読み/後読みの中のグループには対応しない (外から参照できるキャプチャを設定するため)
+			int groups_before = num_groups;
+
+			int child;
+			if( !_parseAlternate(&child) ) return false;
+			if( !_match(')') ) return false;
+
+			if( num_groups!=groups_before ) return false;
+
+			int node = _newNode(Node::Type_Look);
+			nodes[node].ahead = ahead;
+			nodes[node].negate = negate;
+			nodes[node].children.push_back(child);
+			*result = node;
+			return true;
+		}
+
+		// 文字クラスのエスケープ以外のエスケープで表される文字
+		bool _parseEscapeChar( unsigned int c, bool in_class, unsigned int * value )
+		{
+			switch(c)
+			{
+			case 'a': *value = 7; return true;
+			case 'f': *value = 12; return true;
+			case 'n': *value = 10; return true;
+			case 'r': *value = 13; return true;
+			case 't': *value = 9; return true;
+			case 'v': *value = 11; return true;
+			case 'x': return _parseHex( 2, value );
+			case 'u': return _parseHex( 4, value );
+			case 'U': return _parseHex( 8, value );
+			case 'N': return false;	// \N{name} には対応しない
+			}
+
+			if( in_class && c=='b' )
+			{
+				*value = 8;
+				return true;
+			}
+
+			if( _isOctDigit(c) )
+			{
+				if( c=='0' || in_class )
+				{
+					// 最大3桁の8進数
+					unsigned int v = c-'0';
+					for( int i=0 ; i<2 && _isOctDigit(_peek()) ; ++i )
+					{
+						v = v*8 + ( pattern[pos++]-'0' );
+					}
+					*value = v;
+					return true;
+				}
+
+				// \1 などは、3桁の8進数の場合だけ文字として扱う (そうでなければ後方参照)
+				if( _isOctDigit(_peek()) && _isOctDigit(_peek(1)) )
+				{
+					*value = (c-'0')*64 + (pattern[pos]-'0')*8 + (pattern[pos+1]-'0');
+					pos += 2;
+					return true;
+				}
+				return false;
+			}
+
+			if( _isDecDigit(c) ) return false;
+
+			// 英字のエスケープは re の時点でエラーになるので、ここに来るのは記号だけ
+			if( ( c>='a' && c<='z' ) || ( c>='A' && c<='Z' ) ) return false;
+
+			*value = c;
+			return true;
+		}
+
+		bool _parseEscape( int * result )
+		{
+			if( _eof() ) return false;
+
+			unsigned int c = pattern[pos++];
+			int flags = flags_stack.back();
+			bool ascii = (flags & Regex::Flag_Ascii)!=0;
+
+			int escape = 0;
+			switch(c)
+			{
+			case 'd': escape = Escape_Digit; break;
+			case 'D': escape = Escape_NotDigit; break;
+			case 'w': escape = Escape_Word; break;
+			case 'W': escape = Escape_NotWord; break;
+			case 's': escape = Escape_Space; break;
+			case 'S': escape = Escape_NotSpace; break;
+
+			case 'b':
+			case 'B':
+			case 'A':
+			case 'Z':
+				*result = _newNode(Node::Type_Assert);
+				if( c=='b' ) nodes[*result].index = ascii ? Regex::Assert_WordBoundaryAscii : Regex::Assert_WordBoundary;
+				else if( c=='B' ) nodes[*result].index = ascii ? Regex::Assert_NotWordBoundaryAscii : Regex::Assert_NotWordBoundary;
+				else if( c=='A' ) nodes[*result].index = Regex::Assert_BeginText;
+				else nodes[*result].index = Regex::Assert_EndText;
+				return true;
+			}
+
+			if(escape)
+			{
+				Regex::CharClass char_class;
+				char_class.escapes = escape;
+				char_class.ascii = ascii;
+				*result = _newNode(Node::Type_Class);
+				nodes[*result].index = _addClass(char_class);
+				return true;
+			}
+
+			unsigned int value;
+			if( !_parseEscapeChar( c, false, &value ) ) return false;
+
+			*result = _newNode(Node::Type_Char);
+			nodes[*result].c = value;
+			return true;
+		}
+
+		bool _parseClassItem( unsigned int * value, int * escape )
+		{
+			unsigned int c = pattern[pos++];
+			*escape = 0;
+
+			if( c!='\\' )
+			{
+				*value = c;
+				return true;
+			}
+
+			if( _eof() ) return false;
+			c = pattern[pos++];
+
+			switch(c)
+			{
+			case 'd': *escape = Escape_Digit; return true;
+			case 'D': *escape = Escape_NotDigit; return true;
+			case 'w': *escape = Escape_Word; return true;
+			case 'W': *escape = Escape_NotWord; return true;
+			case 's': *escape = Escape_Space; return true;
+			case 'S': *escape = Escape_NotSpace; return true;
+			}
+
+			return _parseEscapeChar( c, true, value );
+		}
+
+		bool _parseClass( int * result )
+		{
+			int flags = flags_stack.back();
+
+			Regex::CharClass char_class;
+			char_class.ignore_case = (flags & Regex::Flag_IgnoreCase)!=0;
+			char_class.ascii = (flags & Regex::Flag_Ascii)!=0;
+
+			if( _match('^') )
+			{
+				char_class.negate = true;
+			}
+
+			bool first = true;
+			while(true)
+			{
+				if( _eof() ) return false;
+
+				if( _peek()==']' && !first )
+				{
+					pos++;
+					break;
+				}
+				first = false;
+
+				unsigned int lo;
+				int escape;
+				if( !_parseClassItem( &lo, &escape ) ) return false;
+
+				if(escape)
+				{
+					char_class.escapes |= escape;
+					continue;
+				}
+
+				if( _peek()=='-' && _peek(1)!=']' && pos+1<pattern.size() )
+				{
+					pos++;
+
+					unsigned int hi;
+					if( !_parseClassItem( &hi, &escape ) ) return false;
+					if( escape || hi<lo ) return false;
+
+					char_class.ranges.push_back( std::make_pair(lo,hi) );
+				}
+				else
+				{
+					char_class.ranges.push_back( std::make_pair(lo,lo) );
+				}
+			}
+
+			*result = _newNode(Node::Type_Class);
+			nodes[*result].index = _addClass(char_class);
+			return true;
+		}
+
+		int _addClass( Regex::CharClass & char_class )
+		{
+			memset( char_class.bitmap, 0, sizeof(char_class.bitmap) );
+			for( unsigned int c=0 ; c<256 ; ++c )
+			{
+				if( char_class._matchNoCase(c) != char_class.negate )
+				{
+					_bitmapSet( char_class.bitmap, c );
+				}
+			}
+
+			classes->push_back(char_class);
+			return (int)classes->size()-1;
+		}
+
+		const std::vector<unsigned int> & pattern;
+		size_t pos;
+		int num_groups;
+		std::vector<int> flags_stack;
+		std::vector<Node> nodes;
+		std::vector<Regex::CharClass> * classes;
+	};
+
+	// 空文字列にマッチできる繰り返しの本体の命令の範囲 [begin,end] と、繰り返しの開始位置のスロット
+	struct LoopRange
+	{
+		int begin;
+		int end;
+		int slot;
+	};
+
+	// 命令ごとに、その命令を本体に含む繰り返しのスロットを求める
+	// 入れ子が深すぎる場合は false を返す
+	bool _buildLoopScopes( size_t ninsts, std::vector<LoopRange> ranges, Regex::LoopScopes * scopes )
+	{
+		// 範囲は入れ子になっているか重ならないので、開始位置の順 (同じ場合は外側から) に並べて走査する
+		std::sort( ranges.begin(), ranges.end(), []( const LoopRange & a, const LoopRange & b )
+		{
+			return a.begin!=b.begin ? a.begin<b.begin : a.end>b.end;
+		});
+
+		scopes->begin.assign( ninsts+1, 0 );
+		scopes->slots.clear();
+		scopes->mark_base.assign( ninsts, 0 );
+		scopes->num_marks = 0;
+
+		std::vector<const LoopRange*> stack;
+		size_t next = 0;
+		for( size_t pc=0 ; pc<ninsts ; ++pc )
+		{
+			while( !stack.empty() && stack.back()->end < (int)pc ) stack.pop_back();
+			while( next<ranges.size() && ranges[next].begin==(int)pc ) stack.push_back( &ranges[next++] );
+			if( stack.size() > MAX_NULLABLE_LOOP_DEPTH ) return false;
+
+			scopes->begin[pc] = (int)scopes->slots.size();
+			for( size_t i=0 ; i<stack.size() ; ++i )
+			{
+				scopes->slots.push_back( stack[i]->slot );
+			}
+
+			scopes->mark_base[pc] = (int)scopes->num_marks;
+			scopes->num_marks += (size_t)1 << stack.size();
+		}
+		scopes->begin[ninsts] = (int)scopes->slots.size();
+
+		return true;
+	}
+
+	// 構文木から命令列を生成する
+	class Compiler
+	{
+	public:
+		Compiler( std::vector<Regex::Inst> * _insts, std::vector<Regex::Look> * _looks, std::vector<LoopRange> * _loop_ranges, const Parser & _parser, int * _num_slots )
+			:
+			insts(_insts),
+			looks(_looks),
+			loop_ranges(_loop_ranges),
+			parser(_parser),
+			num_slots(_num_slots)
+		{
+		}
+
+		bool Compile( int index )
+		{
+			const Node & node = parser.GetNode(index);
+
+			if( insts->size() > MAX_INSTS ) return false;
+
+			switch(node.type)
+			{
+			case Node::Type_Empty:
+				return true;
+
+			case Node::Type_Char:
+				if( node.flags & Regex::Flag_IgnoreCase )
+				{
+					bool ascii = (node.flags & Regex::Flag_Ascii)!=0;
+					// 同一視される別の文字がない場合は、通常の文字として比較する
+					unsigned int folded = _fold(node.c,ascii);
+					unsigned int chars[CaseFold::MAX_CHARS];
+					if( ascii ? ( folded>='a' && folded<='z' ) : case_fold.GetChars( folded, chars )>1 )
+					{
+						_emit( Regex::Op_CharFold, folded, ascii );
+						return true;
+					}
+				}
+				_emit( Regex::Op_Char, node.c );
+				return true;
+
+			case Node::Type_Any:
+				_emit( (node.flags & Regex::Flag_DotAll) ? Regex::Op_Any : Regex::Op_AnyNoNL );
+				return true;
+
+			case Node::Type_Class:
+				_emit( Regex::Op_Class, node.index );
+				return true;
+
+			case Node::Type_Assert:
+				_emit( Regex::Op_Assert, node.index );
+				return true;
+
+			case Node::Type_Concat:
+				for( size_t i=0 ; i<node.children.size() ; ++i )
+				{
+					if( !Compile(node.children[i]) ) return false;
+				}
+				return true;
+
+			case Node::Type_Alternate:
+				{
+					// split L1, next1 / L1: a / jmp end / next1: split L2, next2 ...
+					std::vector<int> jumps;
+					for( size_t i=0 ; i<node.children.size() ; ++i )
+					{
+						if( i+1<node.children.size() )
+						{
+							int split = _emit( Regex::Op_Split );
+							(*insts)[split].x = (int)insts->size();
+							if( !Compile(node.children[i]) ) return false;
+							jumps.push_back( _emit( Regex::Op_Jmp ) );
+							(*insts)[split].y = (int)insts->size();
+						}
+						else
+						{
+							if( !Compile(node.children[i]) ) return false;
+						}
+					}
+					for( size_t i=0 ; i<jumps.size() ; ++i )
+					{
+						(*insts)[jumps[i]].x = (int)insts->size();
+					}
+					return true;
+				}
+
+			case Node::Type_Group:
+				_emit( Regex::Op_Save, node.index*2 );
+				if( !Compile(node.children[0]) ) return false;
+				_emit( Regex::Op_Save, node.index*2+1 );
+				return true;
+
+			case Node::Type_Repeat:
+				return _compileRepeat(node);
+
+			case Node::Type_Look:
+				{
+					int width = 0;
+					if( node.ahead )
+					{
+						// 先読みは読む文字数に上限があるものだけに対応する (線形時間を保つため)
+						int max_width = _maxWidth(node.children[0]);
+						if( max_width<0 || max_width>LOOKAHEAD_MAX_WIDTH ) return false;
+					}
+					else
+					{
+						// 後読みは固定幅のみ (re と同じ)
+						width = _width(node.children[0]);
+						if( width<0 ) return false;
+					}
+
+					// 部分プログラムは CompileLooks で生成する
+					Regex::Look look;
+					look.ahead = node.ahead;
+					look.negate = node.negate;
+					look.width = width;
+					looks->push_back(look);
+
+					int look_index = (int)looks->size()-1;
+					_emit( Regex::Op_Look, look_index );
+					pending_looks.push_back( std::make_pair( look_index, node.children[0] ) );
+					return true;
+				}
+			}
+
+			return false;
+		}
+
+		// 先読み/後読みの部分プログラムを生成する
+		bool CompileLooks()
+		{
+			for( size_t i=0 ; i<pending_looks.size() ; ++i )
+			{
+				std::vector<Regex::Inst> sub_insts;
+				std::vector<LoopRange> sub_loop_ranges;
+				Compiler sub( &sub_insts, looks, &sub_loop_ranges, parser, num_slots );
+				if( !sub.Compile( pending_looks[i].second ) ) return false;
+				sub._emit( Regex::Op_Match, -1 );
+				if( !sub.CompileLooks() ) return false;
+
+				Regex::Look & look = (*looks)[ pending_looks[i].first ];
+				if( !_buildLoopScopes( sub_insts.size(), sub_loop_ranges, &look.loop_scopes ) ) return false;
+				look.insts.swap(sub_insts);
+			}
+			pending_looks.clear();
+			return true;
+		}
+
+		int _emit( int op, int x=0, int y=0 )
+		{
+			Regex::Inst inst;
+			inst.op = op;
+			inst.x = x;
+			inst.y = y;
+			insts->push_back(inst);
+			return (int)insts->size()-1;
+		}
+
+	private:
+		bool _compileRepeat( const Node & node )
+		{
+			int child = node.children[0];
+
+			// 必須の繰り返し
+			for( int i=0 ; i<node.min ; ++i )
+			{
+				if( !Compile(child) ) return false;
+			}
+
+			// 空文字列にマッチできる繰り返しは、re と同じく、空の繰り返しの後は繰り返しを終えて後続に進む
+			// (繰り返しの開始位置をスロットに記録し、位置が進んでいなければ抜ける)
+			int loop_slot = -1;
+			if( _nullable(child) )
+			{
+				loop_slot = (*num_slots)++;
+			}
+
+			std::vector<int> exits;
+
+			if( node.max==REPEAT_INFINITE )
+			{
+				// L1: split L2, L3 / L2: child / jmp L1 / L3:
+				int split = _emit( Regex::Op_Split );
+				int body = (int)insts->size();
+				if( loop_slot>=0 ) _emit( Regex::Op_LoopSet, loop_slot );
+				if( !Compile(child) ) return false;
+				if( loop_slot>=0 ) exits.push_back( _emitLoopCheck( body+1, loop_slot ) );
+				_emit( Regex::Op_Jmp, split );
+				_setSplit( split, body, (int)insts->size(), node.greedy );
+			}
+			else
+			{
+				// 省略可能な繰り返し (入れ子にして、途中で抜けられるようにする)
+				std::vector<int> splits;
+				for( int i=node.min ; i<node.max ; ++i )
+				{
+					splits.push_back( _emit( Regex::Op_Split ) );
+					if( loop_slot>=0 ) _emit( Regex::Op_LoopSet, loop_slot );
+					if( !Compile(child) ) return false;
+					if( loop_slot>=0 ) exits.push_back( _emitLoopCheck( splits.back()+2, loop_slot ) );
+				}
+				for( size_t i=0 ; i<splits.size() ; ++i )
+				{
+					_setSplit( splits[i], splits[i]+1, (int)insts->size(), node.greedy );
+				}
+			}
+
+			for( size_t i=0 ; i<exits.size() ; ++i )
+			{
+				(*insts)[exits[i]].y = (int)insts->size();
+			}
+			return true;
+		}
+
+		// 空文字列にマッチできるか
+		bool _nullable( int index ) const
+		{
+			const Node & node = parser.GetNode(index);
+
+			switch(node.type)
+			{
+			case Node::Type_Char:
+			case Node::Type_Any:
+			case Node::Type_Class:
+				return false;
+
+			case Node::Type_Group:
+				return _nullable(node.children[0]);
+
+			case Node::Type_Concat:
+				for( size_t i=0 ; i<node.children.size() ; ++i )
+				{
+					if( !_nullable(node.children[i]) ) return false;
+				}
+				return true;
+
+			case Node::Type_Alternate:
+				for( size_t i=0 ; i<node.children.size() ; ++i )
+				{
+					if( _nullable(node.children[i]) ) return true;
+				}
+				return false;
+
+			case Node::Type_Repeat:
+				return node.min==0 || _nullable(node.children[0]);
+			}
+
+			return true;
+		}
+
+		// 繰り返しの本体 (body_begin から) の最後の Op_LoopCheck を生成し、本体の範囲を記録する
+		int _emitLoopCheck( int body_begin, int loop_slot )
+		{
+			int check = _emit( Regex::Op_LoopCheck, loop_slot );
+
+			LoopRange range;
+			range.begin = body_begin;
+			range.end = check;
+			range.slot = loop_slot;
+			loop_ranges->push_back(range);
+
+			return check;
+		}
+
+		void _setSplit( int split, int body, int next, bool greedy )
+		{
+			(*insts)[split].x = greedy ? body : next;
+			(*insts)[split].y = greedy ? next : body;
+		}
+
+		// 文字数の固定幅 (固定でない場合は -1)
+		int _width( int index ) const
+		{
+			const Node & node = parser.GetNode(index);
+
+			switch(node.type)
+			{
+			case Node::Type_Empty:
+			case Node::Type_Assert:
+			case Node::Type_Look:
+				return 0;
+
+			case Node::Type_Char:
+			case Node::Type_Any:
+			case Node::Type_Class:
+				return 1;
+
+			case Node::Type_Group:
+				return _width(node.children[0]);
+
+			case Node::Type_Concat:
+				{
+					int width = 0;
+					for( size_t i=0 ; i<node.children.size() ; ++i )
+					{
+						int w = _width(node.children[i]);
+						if( w<0 ) return -1;
+						width += w;
+					}
+					return width;
+				}
+
+			case Node::Type_Alternate:
+				{
+					int width = -1;
+					for( size_t i=0 ; i<node.children.size() ; ++i )
+					{
+						int w = _width(node.children[i]);
+						if( w<0 || ( width>=0 && w!=width ) ) return -1;
+						width = w;
+					}
+					return width;
+				}
+
+			case Node::Type_Repeat:
+				{
+					if( node.min!=node.max ) return -1;
+					int w = _width(node.children[0]);
+					if( w<0 ) return -1;
+					return w * node.min;
+				}
+			}
+
+			return -1;
+		}
+
+		// 読む文字数の最大値 (上限がない場合は -1)
+		// LOOKAHEAD_MAX_WIDTH を超える値は LOOKAHEAD_MAX_WIDTH+1 にまとめる
+		int _maxWidth( int index ) const
+		{
+			const Node & node = parser.GetNode(index);
+
+			switch(node.type)
+			{
+			case Node::Type_Empty:
+			case Node::Type_Assert:
+			case Node::Type_Look:
+				return 0;
+
+			case Node::Type_Char:
+			case Node::Type_Any:
+			case Node::Type_Class:
+				return 1;
+
+			case Node::Type_Group:
+				return _maxWidth(node.children[0]);
+
+			case Node::Type_Concat:
+				{
+					int width = 0;
+					for( size_t i=0 ; i<node.children.size() ; ++i )
+					{
+						int w = _maxWidth(node.children[i]);
+						if( w<0 ) return -1;
+						width = std::min( width + w, LOOKAHEAD_MAX_WIDTH+1 );
+					}
+					return width;
+				}
+
+			case Node::Type_Alternate:
+				{
+					int width = 0;
+					for( size_t i=0 ; i<node.children.size() ; ++i )
+					{
+						int w = _maxWidth(node.children[i]);
+						if( w<0 ) return -1;
+						width = std::max( width, w );
+					}
+					return width;
+				}
+
+			case Node::Type_Repeat:
+				{
+					int w = _maxWidth(node.children[0]);
+					if( w<0 ) return -1;
+					if( w==0 ) return 0;
+					if( node.max==REPEAT_INFINITE ) return -1;
+					return (int)std::min( (long long)w * node.max, (long long)LOOKAHEAD_MAX_WIDTH+1 );
+				}
+			}
+
+			return -1;
+		}
+
+		std::vector<Regex::Inst> * insts;
+		std::vector<Regex::Look> * looks;
+		std::vector<LoopRange> * loop_ranges;
+		const Parser & parser;
+		int * num_slots;
+		std::vector< std::pair<int,int> > pending_looks;
+	};
+};
+
+//-----------------------------------------------------------------------------
+
+// 遅延 DFA
+//
+// 状態は、文字を読んだ後のスレッドのプログラムカウンタを優先順位の順に並べたものと、直前の文字の情報の組。
+// 遷移は、次の文字 (または終端) を見てアサーションを判定しながら展開し、その文字を読めるスレッドを同じ順に残して求める。
+// 展開中に Match に到達した場合は、それより優先順位の低いスレッドを捨てる (Pike VM と同じ規則)。
+// キャプチャを持たないので、マッチの範囲とパターンの番号だけを求める。
+//
+// 遷移は必要になったときに計算してキャッシュする。
+// 複数のスレッドから同時に検索できるように、参照は共有ロック、追加は排他ロックで行う。
+
+enum
+{
+	DfaFlag_Begin = 1<<0,			// テキストの先頭
+	DfaFlag_PrevNewLine = 1<<1,		// 直前の文字が改行
+	DfaFlag_PrevWord = 1<<2,		// 直前の文字が単語の文字
+	DfaFlag_PrevWordAscii = 1<<3,	// 直前の文字が ASCII の単語の文字
+	DfaFlag_Max = 1<<4,
+};
+
+// 状態の数の上限 (超えた場合はキャッシュを捨てる)
+static const size_t DFA_MAX_STATES = 2000;
+
+// 遷移が未計算
+static const int DFA_UNKNOWN = -1;
+
+// 遷移先がない (全てのスレッドが終了した)
+static const int DFA_DEAD = 0;
+
+// DFA では判定できないので Pike VM を使う
+static const int DFA_FAILED = -2;
+
+struct Regex::DfaState
+{
+	DfaState()
+	{
+		for( int i=0 ; i<256 ; ++i )
+		{
+			next[i] = DFA_UNKNOWN;
+			match[i] = -1;
+		}
+		eot_match = DFA_UNKNOWN;
+	}
+
+	std::vector<int> threads;
+	int flags;
+
+	int next[256];			// 0x00 - 0xff の文字での遷移先
+	int match[256];			// その文字を読む前にマッチしたパターン (-1 の場合はマッチなし)
+	int eot_match;			// 終端でマッチしたパターン
+
+	std::unordered_map< unsigned int, std::pair<int,int> > high;	// 0x100 以上の文字での遷移先とマッチしたパターン
+};
+
+struct Regex::Dfa
+{
+	Dfa() : generation(0)
+	{
+		Clear();
+	}
+
+	void Clear()
+	{
+		states.clear();
+		state_map.clear();
+
+		// 状態 0 は遷移先がない状態
+		states.push_back( std::unique_ptr<DfaState>( new DfaState() ) );
+		states[0]->flags = 0;
+
+		for( int i=0 ; i<DfaFlag_Max ; ++i ) initial_states[i] = DFA_UNKNOWN;
+
+		generation++;
+	}
+
+	std::shared_timed_mutex mutex;
+	std::vector< std::unique_ptr<DfaState> > states;
+	std::map< std::vector<int>, int > state_map;		// [ flags, threads... ] -> 状態
+	int initial_states[DfaFlag_Max];
+	unsigned int generation;
+};
+
+// state から文字 c (eot が true の場合は終端) で遷移する
+// 排他ロックを取得した状態で呼び出す
+int Regex::_dfaTransition( int state, unsigned int c, bool eot, int * match ) const
+{
+	const DfaState & src = *dfa->states[state];
+	int flags = src.flags;
+
+	// 展開する (優先順位の順に、文字を読む命令と Match を並べる)
+	std::vector<int> list;
+	std::vector<bool> visited( insts.size(), false );
+	std::vector<int> stack;
+
+	for( size_t i=0 ; i<src.threads.size() ; ++i )
+	{
+		stack.push_back( src.threads[i] );
+
+		while( !stack.empty() )
+		{
+			int pc = stack.back();
+			stack.pop_back();
+
+			while(true)
+			{
+				if( visited[pc] ) break;
+				visited[pc] = true;
+
+				const Inst & inst = insts[pc];
+				bool follow = true;
+
+				switch(inst.op)
+				{
+				case Op_Jmp:
+					pc = inst.x;
+					break;
+
+				case Op_Split:
+					stack.push_back(inst.y);
+					pc = inst.x;
+					break;
+
+				case Op_Save:
+					pc++;
+					break;
+
+				case Op_Assert:
+					{
+						bool result = false;
+						switch(inst.x)
+						{
+						case Assert_BeginText:
+							result = (flags & DfaFlag_Begin)!=0;
+							break;
+
+						case Assert_EndText:
+							result = eot;
+							break;
+
+						case Assert_EndTextOrNL:
+							// 改行が最後の文字かどうかは、次の文字を読むまで分からない
+							if( !eot && c=='\n' ) return DFA_FAILED;
+							result = eot;
+							break;
+
+						case Assert_BeginLine:
+							result = (flags & (DfaFlag_Begin|DfaFlag_PrevNewLine))!=0;
+							break;
+
+						case Assert_EndLine:
+							result = eot || c=='\n';
+							break;
+
+						case Assert_WordBoundary:
+						case Assert_NotWordBoundary:
+						case Assert_WordBoundaryAscii:
+						case Assert_NotWordBoundaryAscii:
+							// re (Python 3.13 まで) では \B は空文字列にマッチしない
+							if( (flags & DfaFlag_Begin) && eot )
+							{
+								result = false;
+							}
+							else
+							{
+								bool ascii = ( inst.x==Assert_WordBoundaryAscii || inst.x==Assert_NotWordBoundaryAscii );
+								bool before = ( flags & ( ascii ? DfaFlag_PrevWordAscii : DfaFlag_PrevWord ) )!=0;
+								bool after = !eot && _isWord( c, ascii );
+								bool boundary = before!=after;
+								result = ( inst.x==Assert_WordBoundary || inst.x==Assert_WordBoundaryAscii ) ? boundary : !boundary;
+							}
+							break;
+						}
+
+						if(result) pc++; else follow = false;
+					}
+					break;
+
+				case Op_Look:
+				case Op_LoopSet:
+				case Op_LoopCheck:
+					// DFA を使わない
+					return DFA_FAILED;
+
+				default:
+					list.push_back(pc);
+					follow = false;
+					break;
+				}
+
+				if(!follow) break;
+			}
+		}
+	}
+
+	// 文字を読めるスレッドを残す
+	// Match に到達したら、それより優先順位の低いスレッドは捨てる
+	std::vector<int> key;
+	key.push_back(0);
+
+	*match = -1;
+
+	for( size_t i=0 ; i<list.size() ; ++i )
+	{
+		const Inst & inst = insts[list[i]];
+
+		if( inst.op==Op_Match )
+		{
+			*match = inst.x;
+			break;
+		}
+
+		if(eot) continue;
+
+		bool advance = false;
+		switch(inst.op)
+		{
+		case Op_Char:
+			advance = c==(unsigned int)inst.x;
+			break;
+
+		case Op_CharFold:
+			advance = _fold(c,inst.y!=0)==(unsigned int)inst.x;
+			break;
+
+		case Op_Any:
+			advance = true;
+			break;
+
+		case Op_AnyNoNL:
+			advance = c!='\n';
+			break;
+
+		case Op_Class:
+			advance = classes[inst.x].Match(c);
+			break;
+		}
+
+		if(advance)
+		{
+			key.push_back( list[i]+1 );
+		}
+	}
+
+	if( eot || key.size()==1 )
+	{
+		return DFA_DEAD;
+	}
+
+	int next_flags = 0;
+	if( c=='\n' ) next_flags |= DfaFlag_PrevNewLine;
+	if( _isWord(c,false) ) next_flags |= DfaFlag_PrevWord;
+	if( _isWord(c,true) ) next_flags |= DfaFlag_PrevWordAscii;
+	key[0] = next_flags;
+
+	auto it = dfa->state_map.find(key);
+	if( it!=dfa->state_map.end() )
+	{
+		return it->second;
+	}
+
+	if( dfa->states.size()>=DFA_MAX_STATES )
+	{
+		dfa->Clear();
+		return DFA_FAILED;
+	}
+
+	DfaState * dst = new DfaState();
+	dst->flags = next_flags;
+	dst->threads.assign( key.begin()+1, key.end() );
+
+	int index = (int)dfa->states.size();
+	dfa->states.push_back( std::unique_ptr<DfaState>(dst) );
+	dfa->state_map[key] = index;
+
+	return index;
+}
+
+// pos から始まるマッチを DFA で探す
+// マッチしたパターンの番号を返し、end にマッチの終了位置を格納する
+// マッチしない場合は -1、DFA で判定できない場合は DFA_FAILED を返す
+// budget は読んだ文字数だけ減らし、0 になったら DFA_FAILED を返す
+template<typename CHAR>
+int Regex::_dfaMatchAt( const CHAR * text, size_t len, size_t pos, size_t * end, size_t * budget ) const
+{
+	Dfa & cache = *dfa;
+
+	std::shared_lock<std::shared_timed_mutex> lock(cache.mutex);
+	unsigned int generation = cache.generation;
+
+	// 遷移が未計算の場合は、排他ロックを取得して計算する
+	// 待っている間にキャッシュが捨てられた場合は、状態の番号が無効なので DFA_FAILED を返す
+	auto compute = [&]( int state, unsigned int c, bool eot, int * match ) -> int
+	{
+		lock.unlock();
+
+		int next;
+		{
+			std::unique_lock<std::shared_timed_mutex> exclusive_lock(cache.mutex);
+			if( cache.generation!=generation ) return DFA_FAILED;
+
+			next = _dfaTransition( state, c, eot, match );
+			if( next==DFA_FAILED ) return DFA_FAILED;
+
+			DfaState & src = *cache.states[state];
+			if(eot)
+			{
+				src.eot_match = *match;
+			}
+			else if( c<256 )
+			{
+				src.next[c] = next;
+				src.match[c] = *match;
+			}
+			else
+			{
+				src.high[c] = std::make_pair( next, *match );
+			}
+		}
+
+		lock.lock();
+		if( cache.generation!=generation ) return DFA_FAILED;
+
+		return next;
+	};
+
+	int flags = 0;
+	if( pos==0 )
+	{
+		flags |= DfaFlag_Begin;
+	}
+	else
+	{
+		unsigned int prev = text[pos-1];
+		if( prev=='\n' ) flags |= DfaFlag_PrevNewLine;
+		if( _isWord(prev,false) ) flags |= DfaFlag_PrevWord;
+		if( _isWord(prev,true) ) flags |= DfaFlag_PrevWordAscii;
+	}
+
+	int state = cache.initial_states[flags];
+	if( state==DFA_UNKNOWN )
+	{
+		lock.unlock();
+		{
+			std::unique_lock<std::shared_timed_mutex> exclusive_lock(cache.mutex);
+			if( cache.generation!=generation ) return DFA_FAILED;
+
+			if( cache.initial_states[flags]==DFA_UNKNOWN )
+			{
+				std::vector<int> key;
+				key.push_back(flags);
+				key.push_back(0);
+
+				DfaState * dst = new DfaState();
+				dst->flags = flags;
+				dst->threads.push_back(0);
+
+				cache.initial_states[flags] = (int)cache.states.size();
+				cache.states.push_back( std::unique_ptr<DfaState>(dst) );
+				cache.state_map[key] = cache.initial_states[flags];
+			}
+			state = cache.initial_states[flags];
+		}
+		lock.lock();
+		if( cache.generation!=generation ) return DFA_FAILED;
+	}
+
+	int result = -1;
+
+	for( size_t p=pos ; ; ++p )
+	{
+		if( *budget==0 ) return DFA_FAILED;
+		--*budget;
+
+		const DfaState & src = *cache.states[state];
+		int next;
+		int match;
+
+		if( p>=len )
+		{
+			match = src.eot_match;
+			if( match==DFA_UNKNOWN )
+			{
+				if( compute( state, 0, true, &match )==DFA_FAILED ) return DFA_FAILED;
+			}
+			next = DFA_DEAD;
+		}
+		else
+		{
+			unsigned int c = text[p];
+			if( c<256 )
+			{
+				next = src.next[c];
+				match = src.match[c];
+			}
+			else
+			{
+				auto it = src.high.find(c);
+				if( it!=src.high.end() )
+				{
+					next = it->second.first;
+					match = it->second.second;
+				}
+				else
+				{
+					next = DFA_UNKNOWN;
+				}
+			}
+
+			if( next==DFA_UNKNOWN )
+			{
+				next = compute( state, c, false, &match );
+				if( next==DFA_FAILED ) return DFA_FAILED;
+			}
+		}
+
+		if( match>=0 )
+		{
+			result = match;
+			*end = p;
+		}
+
+		if( next==DFA_DEAD ) break;
+		state = next;
+	}
+
+	return result;
+}
+
+//-----------------------------------------------------------------------------
+
+Regex::Regex()
+	:
+	num_capture_slots(2),
+	num_slots(2)
+{
+}
+
+bool Regex::Compile( const std::vector<Pattern> & patterns )
+{
+	insts.clear();
+	classes.clear();
+	looks.clear();
+	num_groups.clear();
+	firsts.clear();
+	dfa.reset();
+
+	std::vector<Parser*> parsers;
+	std::vector<int> roots;
+	std::vector<LoopRange> loop_ranges;
+
+	bool ok = true;
+	for( size_t i=0 ; i<patterns.size() && ok ; ++i )
+	{
+		Parser * parser = new Parser( patterns[i].text, patterns[i].flags, &classes );
+		parsers.push_back(parser);
+
+		int root;
+		ok = parser->Parse(&root);
+		roots.push_back(root);
+		num_groups.push_back( parser->GetNumGroups() );
+	}
+
+	int max_groups = 0;
+	for( size_t i=0 ; i<num_groups.size() ; ++i )
+	{
+		max_groups = std::max( max_groups, num_groups[i] );
+	}
+
+	// キャプチャのスロットの後ろに、繰り返しの開始位置を記録するスロットを置く
+	num_capture_slots = ( max_groups + 1 ) * 2;
+	num_slots = num_capture_slots;
+
+	if(ok && !patterns.empty())
+	{
+		// パターンごとに save 0 / 本体 / save 1 / match を生成し、split で優先順位順につなぐ
+		//
+		// L0: split P0, L1
+		// P0: save 0 / ... / save 1 / match 0
+		// L1: split P1, L2 ...
+
+		for( size_t i=0 ; i<patterns.size() && ok ; ++i )
+		{
+			Compiler compiler( &insts, &looks, &loop_ranges, *parsers[i], &num_slots );
+
+			int split = -1;
+			if( i+1<patterns.size() )
+			{
+				split = compiler._emit( Op_Split );
+				insts[split].x = (int)insts.size();
+			}
+
+			compiler._emit( Op_Save, 0 );
+			ok = compiler.Compile(roots[i]);
+			compiler._emit( Op_Save, 1 );
+			compiler._emit( Op_Match, (int)i );
+
+			if( split>=0 )
+			{
+				insts[split].y = (int)insts.size();
+			}
+
+			ok = ok && compiler.CompileLooks();
+		}
+	}
+
+	for( size_t i=0 ; i<parsers.size() ; ++i ) delete parsers[i];
+
+	ok = ok && _buildLoopScopes( insts.size(), loop_ranges, &loop_scopes );
+
+	if( !ok || insts.size()>MAX_INSTS )
+	{
+		insts.clear();
+		classes.clear();
+		looks.clear();
+		num_groups.clear();
+		return false;
+	}
+
+	_computeFirstChars();
+
+	// 先読み/後読みと、繰り返しの開始位置のスロットは、DFA の状態で表せない
+	if( looks.empty() && num_slots==num_capture_slots )
+	{
+		dfa.reset( new Dfa() );
+	}
+
+	return true;
+}
+
+// 各命令から始まるスレッドが最初に読む文字の集合を求める
+//
+// アサーションや先読みは条件を狭めるだけなので、通過できるものとして扱う。
+// 文字を読まずに Match に到達できる場合は skip を false にする。
+// 繰り返しでループがあるので、変化がなくなるまで後ろから繰り返し計算する。
+void Regex::_computeFirstChars()
+{
+	FirstChars empty;
+	empty.skip = true;
+	empty.high = false;
+	memset( empty.bitmap, 0, sizeof(empty.bitmap) );
+
+	firsts.assign( insts.size(), empty );
+
+	auto merge = []( FirstChars * dst, const FirstChars & src ) -> bool
+	{
+		bool changed = false;
+		if( dst->skip && !src.skip ) { dst->skip = false; changed = true; }
+		if( !dst->high && src.high ) { dst->high = true; changed = true; }
+		for( int i=0 ; i<8 ; ++i )
+		{
+			if( (dst->bitmap[i] | src.bitmap[i]) != dst->bitmap[i] )
+			{
+				dst->bitmap[i] |= src.bitmap[i];
+				changed = true;
+			}
+		}
+		return changed;
+	};
+
+	// 文字を読む命令は、入力によらず決まる
+	for( size_t pc=0 ; pc<insts.size() ; ++pc )
+	{
+		const Inst & inst = insts[pc];
+		FirstChars & first = firsts[pc];
+
+		switch(inst.op)
+		{
+		case Op_Char:
+			if( inst.x<256 ) _bitmapSet( first.bitmap, inst.x ); else first.high = true;
+			break;
+
+		case Op_CharFold:
+			for( unsigned int c=0 ; c<256 ; ++c )
+			{
+				if( _fold(c,inst.y!=0)==(unsigned int)inst.x ) _bitmapSet( first.bitmap, c );
+			}
+			first.high = true;
+			break;
+
+		case Op_Class:
+			for( int i=0 ; i<8 ; ++i ) first.bitmap[i] = classes[inst.x].bitmap[i];
+			if( classes[inst.x].CanMatchHigh() ) first.high = true;
+			break;
+
+		case Op_Any:
+		case Op_AnyNoNL:
+			memset( first.bitmap, 0xff, sizeof(first.bitmap) );
+			if( inst.op==Op_AnyNoNL ) first.bitmap['\n'/32] &= ~( 1u << ('\n'%32) );
+			first.high = true;
+			break;
+
+		case Op_Match:
+			first.skip = false;
+			break;
+		}
+	}
+
+	// 文字を読まない命令は、遷移先の集合の和になる
+	bool changed = true;
+	while(changed)
+	{
+		changed = false;
+
+		for( size_t i=insts.size() ; i>0 ; --i )
+		{
+			int pc = (int)i-1;
+			const Inst & inst = insts[pc];
+			FirstChars & first = firsts[pc];
+
+			switch(inst.op)
+			{
+			case Op_Split:
+				changed |= merge( &first, firsts[inst.x] );
+				changed |= merge( &first, firsts[inst.y] );
+				break;
+
+			case Op_Jmp:
+				changed |= merge( &first, firsts[inst.x] );
+				break;
+
+			case Op_Save:
+			case Op_Assert:
+			case Op_Look:
+			case Op_LoopSet:
+				changed |= merge( &first, firsts[pc+1] );
+				break;
+
+			case Op_LoopCheck:
+				changed |= merge( &first, firsts[inst.y] );
+				changed |= merge( &first, firsts[pc+1] );
+				break;
+			}
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+namespace
+{
+	// スレッドのリスト (プログラムカウンタと、キャプチャのスロット)
+	struct ThreadList
+	{
+		ThreadList()
+			:
+			nslots(0),
+			size(0)
+		{
+		}
+
+		void Reset( size_t capacity, int _nslots )
+		{
+			nslots = _nslots;
+			size = 0;
+
+			if( pcs.size()<capacity ) pcs.resize(capacity);
+			if( caps.size()<capacity*std::max(nslots,1) ) caps.resize( capacity * std::max(nslots,1) );
+		}
+
+		void Add( int pc, const long long * src )
+		{
+			pcs[size] = pc;
+			if(nslots) memcpy( &caps[size*nslots], src, nslots*sizeof(long long) );
+			size++;
+		}
+
+		long long * Caps( size_t index ) { return &caps[index*nslots]; }
+
+		int nslots;
+		size_t size;
+		std::vector<int> pcs;
+		std::vector<long long> caps;
+	};
+
+	struct StackEntry
+	{
+		int pc;				// -1 の場合はスロットの復元
+		int slot;
+		long long value;
+	};
+
+	// _run の作業領域
+	//
+	// 1行ごとに何度も検索するシンタックス分析などで、検索のたびにメモリを確保しないように、
+	// スレッドごとに保持して再利用する。先読み/後読みで _run が入れ子になるので、深さごとに用意する。
+	struct Scratch
+	{
+		Scratch() : gen(0) {}
+
+		ThreadList clist;
+		ThreadList nlist;
+		std::vector<unsigned int> marks;	// 各命令を最後に訪れた世代
+		unsigned int gen;
+		std::vector<StackEntry> stack;
+		std::vector<long long> work;
+	};
+
+	class ScratchHolder
+	{
+	public:
+		ScratchHolder()
+		{
+			if( depth>=pool.size() ) pool.push_back( std::unique_ptr<Scratch>( new Scratch() ) );
+			scratch = pool[depth].get();
+			depth++;
+		}
+
+		~ScratchHolder()
+		{
+			depth--;
+		}
+
+		Scratch * scratch;
+
+	private:
+		static thread_local std::vector< std::unique_ptr<Scratch> > pool;
+		static thread_local size_t depth;
+	};
+
+	thread_local std::vector< std::unique_ptr<Scratch> > ScratchHolder::pool;
+	thread_local size_t ScratchHolder::depth = 0;
+};
+
+template<typename CHAR>
+bool Regex::_checkAssert( int kind, const CHAR * text, size_t len, size_t pos ) const
+{
+	switch(kind)
+	{
+	case Assert_BeginText:
+		return pos==0;
+
+	case Assert_EndText:
+		return pos==len;
+
+	case Assert_EndTextOrNL:
+		return pos==len || ( pos+1==len && text[pos]=='\n' );
+
+	case Assert_BeginLine:
+		return pos==0 || text[pos-1]=='\n';
+
+	case Assert_EndLine:
+		return pos==len || text[pos]=='\n';
+
+	case Assert_WordBoundary:
+	case Assert_NotWordBoundary:
+	case Assert_WordBoundaryAscii:
+	case Assert_NotWordBoundaryAscii:
+		{
+			// re (Python 3.13 まで) では \B は空文字列にマッチしない
+			if( len==0 ) return false;
+
+			bool ascii = ( kind==Assert_WordBoundaryAscii || kind==Assert_NotWordBoundaryAscii );
+			bool before = pos>0 && _isWord( text[pos-1], ascii );
+			bool after = pos<len && _isWord( text[pos], ascii );
+			bool boundary = before!=after;
+			return ( kind==Assert_WordBoundary || kind==Assert_WordBoundaryAscii ) ? boundary : !boundary;
+		}
+	}
+
+	return false;
+}
+
+template<typename CHAR>
+bool Regex::_checkLook( int index, const CHAR * text, size_t len, size_t pos ) const
+{
+	const Look & look = looks[index];
+
+	bool result;
+	if( look.ahead )
+	{
+		result = _run( look.insts, look.loop_scopes, text, len, pos, true, num_slots, NULL );
+	}
+	else if( pos < (size_t)look.width )
+	{
+		result = false;
+	}
+	else
+	{
+		// 固定幅なので、pos-width から始まるマッチは pos で終わる
+		result = _run( look.insts, look.loop_scopes, text, len, pos-look.width, true, num_slots, NULL );
+	}
+
+	return result != look.negate;
+}
+
+// スレッドとしてリストに追加される命令 (文字を読む命令と Match)
+static inline bool _isThreadOp( int op )
+{
+	switch(op)
+	{
+	case Regex::Op_Char:
+	case Regex::Op_CharFold:
+	case Regex::Op_Any:
+	case Regex::Op_AnyNoNL:
+	case Regex::Op_Class:
+	case Regex::Op_Match:
+		return true;
+	}
+	return false;
+}
+
+// Pike VM
+//
+// clist にある現在位置のスレッドを優先順位の順に1文字ずつ進めて nlist を作る。
+// マッチしたスレッドより優先順位の低いスレッドは捨て、優先順位の高いスレッドが残っている間は続ける。
+// anchored が false の場合は、まだマッチしていなければ各位置で新しいスレッドを最低の優先順位で開始する。
+template<typename CHAR>
+bool Regex::_run( const std::vector<Inst> & prog, const LoopScopes & scopes, const CHAR * text, size_t len, size_t pos, bool anchored, int nslots, Match * match ) const
+{
+	size_t ninsts = prog.size();
+
+	ScratchHolder holder;
+	Scratch & scratch = *holder.scratch;
+
+	ThreadList & clist = scratch.clist;
+	ThreadList & nlist = scratch.nlist;
+	clist.Reset( ninsts, nslots );
+	nlist.Reset( ninsts, nslots );
+
+	// 世代は呼び出しをまたいで増やし続けるので、前回の呼び出しの印は消さなくてよい
+	std::vector<unsigned int> & marks = scratch.marks;
+	if( marks.size()<scopes.num_marks ) marks.resize( scopes.num_marks, 0 );
+	if( scratch.gen > 0xf0000000 )
+	{
+		std::fill( marks.begin(), marks.end(), 0 );
+		scratch.gen = 0;
+	}
+	unsigned int & gen = scratch.gen;
+	gen++;
+
+	std::vector<StackEntry> & stack = scratch.stack;
+	stack.clear();
+
+	std::vector<long long> & work = scratch.work;
+	if( work.size()<(size_t)std::max(nslots,1) ) work.resize( std::max(nslots,1) );
+
+	bool matched = false;
+
+	// p の文字で続かないことが分かっているスレッドは作らない
+	// (先読み/後読みの部分プログラムには集合を用意していないので判定しない)
+	const FirstChars * prune = ( &prog==&insts ) ? &firsts[0] : NULL;
+
+	// pc から到達できるスレッドを、優先順位の順に list に追加する
+	auto add_thread = [&]( ThreadList & list, int pc0, size_t p, long long * caps )
+	{
+		unsigned int c = p<len ? text[p] : 0;
+
+		auto can_continue = [&]( int pc ) -> bool
+		{
+			const FirstChars & first = prune[pc];
+			if( !first.skip ) return true;
+			if( p>=len ) return false;
+			return c<256 ? _bitmapTest( first.bitmap, c ) : first.high;
+		};
+
+		if( prune && !can_continue(pc0) ) return;
+
+		StackEntry entry;
+		entry.pc = pc0;
+		entry.slot = 0;
+		entry.value = 0;
+		stack.push_back(entry);
+
+		while( !stack.empty() )
+		{
+			entry = stack.back();
+			stack.pop_back();
+
+			if( entry.pc<0 )
+			{
+				caps[entry.slot] = entry.value;
+				continue;
+			}
+
+			int pc = entry.pc;
+			while(true)
+			{
+				const Inst & inst = prog[pc];
+
+				// 繰り返しの本体の命令は、囲んでいる繰り返しがこの位置で始まったかどうかの組み合わせごとに印を付ける
+				// (re と同じく、空の繰り返しの後はその繰り返しを抜けるので、組み合わせによって後の動作が変わる)
+				// 文字を読む命令と Match は、読んだ後の動作が組み合わせによらないので、命令ごとに1つだけ追加する
+				unsigned int mark = scopes.mark_base[pc];
+				if( !_isThreadOp(inst.op) )
+				{
+					for( int i=scopes.begin[pc] ; i<scopes.begin[pc+1] ; ++i )
+					{
+						if( caps[ scopes.slots[i] ]==(long long)p ) mark += 1u << ( i - scopes.begin[pc] );
+					}
+				}
+
+				if( marks[mark]==gen ) break;
+				marks[mark] = gen;
+
+				bool follow = false;
+
+				switch(inst.op)
+				{
+				case Op_Jmp:
+					pc = inst.x;
+					follow = true;
+					break;
+
+				case Op_Split:
+					if( prune && !can_continue(inst.y) )
+					{
+						if( can_continue(inst.x) )
+						{
+							pc = inst.x;
+							follow = true;
+						}
+					}
+					else if( prune && !can_continue(inst.x) )
+					{
+						pc = inst.y;
+						follow = true;
+					}
+					else
+					{
+						StackEntry next;
+						next.pc = inst.y;
+						next.slot = 0;
+						next.value = 0;
+						stack.push_back(next);
+						pc = inst.x;
+						follow = true;
+					}
+					break;
+
+				case Op_Save:
+				case Op_LoopSet:
+					if( inst.x < nslots )
+					{
+						StackEntry restore;
+						restore.pc = -1;
+						restore.slot = inst.x;
+						restore.value = caps[inst.x];
+						stack.push_back(restore);
+						caps[inst.x] = (long long)p;
+					}
+					pc++;
+					follow = true;
+					break;
+
+				case Op_LoopCheck:
+					// 繰り返しの中で位置が進んでいなければ、繰り返しを抜ける
+					pc = ( caps[inst.x]==(long long)p ) ? inst.y : pc+1;
+					follow = true;
+					break;
+
+				case Op_Assert:
+					if( _checkAssert( inst.x, text, len, p ) )
+					{
+						pc++;
+						follow = true;
+					}
+					break;
+
+				case Op_Look:
+					if( _checkLook( inst.x, text, len, p ) )
+					{
+						pc++;
+						follow = true;
+					}
+					break;
+
+				default:
+					list.Add( pc, caps );
+					break;
+				}
+
+				if(!follow) break;
+			}
+		}
+	};
+
+	size_t p = pos;
+	while(true)
+	{
+		if( !matched && ( !anchored || p==pos ) )
+		{
+			// スレッドがないときは、最初の文字になりえない位置を読み飛ばす
+			if( clist.size==0 && !anchored && prune && prune[0].skip )
+			{
+				while( p<len )
+				{
+					unsigned int c = text[p];
+					if( c<256 ? _bitmapTest( prune[0].bitmap, c ) : prune[0].high ) break;
+					p++;
+				}
+				gen++;
+			}
+
+			std::fill( work.begin(), work.begin()+std::max(nslots,1), -1 );
+			add_thread( clist, 0, p, &work[0] );
+		}
+
+		if( clist.size==0 )
+		{
+			if( matched || anchored || p>=len ) break;
+
+			// 次の位置から始める
+			p++;
+			gen++;
+			continue;
+		}
+
+		gen++;
+		nlist.size = 0;
+
+		unsigned int c = p<len ? text[p] : 0;
+
+		for( size_t i=0 ; i<clist.size ; ++i )
+		{
+			int pc = clist.pcs[i];
+			const Inst & inst = prog[pc];
+
+			bool advance = false;
+			switch(inst.op)
+			{
+			case Op_Match:
+				matched = true;
+				if(match)
+				{
+					match->pattern = inst.x;
+					match->groups.assign( clist.Caps(i), clist.Caps(i)+num_capture_slots );
+				}
+				else
+				{
+					// マッチの有無だけが必要な場合
+					return true;
+				}
+
+				// 優先順位の低いスレッドは捨てる
+				i = clist.size;
+				continue;
+
+			case Op_Char:
+				advance = p<len && c==(unsigned int)inst.x;
+				break;
+
+			case Op_CharFold:
+				advance = p<len && _fold(c,inst.y!=0)==(unsigned int)inst.x;
+				break;
+
+			case Op_Any:
+				advance = p<len;
+				break;
+
+			case Op_AnyNoNL:
+				advance = p<len && c!='\n';
+				break;
+
+			case Op_Class:
+				advance = p<len && classes[inst.x].Match(c);
+				break;
+			}
+
+			if(advance)
+			{
+				if(nslots) memcpy( &work[0], clist.Caps(i), nslots*sizeof(long long) );
+				add_thread( nlist, pc+1, p+1, &work[0] );
+			}
+		}
+
+		std::swap( clist, nlist );
+
+		if( p>=len ) break;
+		p++;
+	}
+
+	return matched;
+}
+
+void Regex::_setMatch( int pattern, size_t start, size_t end, Match * match ) const
+{
+	if(!match) return;
+
+	match->pattern = pattern;
+	match->groups.assign( num_capture_slots, -1 );
+	match->groups[0] = (long long)start;
+	match->groups[1] = (long long)end;
+}
+
+template<typename CHAR>
+bool Regex::Search( const CHAR * text, size_t len, size_t pos, Match * match, bool captures ) const
+{
+	if( insts.empty() || pos>len ) return false;
+
+	if(dfa)
+	{
+		// 開始位置の候補ごとに DFA でマッチを試す
+		// 同じ文字を何度も読むパターンで時間がかかりすぎないように、読んだ文字数が一定を超えたら Pike VM に切り替える
+		size_t budget = (len-pos) * 4 + 256;
+		const FirstChars & first = firsts[0];
+
+		for( size_t p=pos ; p<=len ; ++p )
+		{
+			if( first.skip )
+			{
+				while( p<len )
+				{
+					unsigned int c = text[p];
+					if( c<256 ? _bitmapTest( first.bitmap, c ) : first.high ) break;
+					p++;
+				}
+				if( p>=len ) return false;
+			}
+
+			size_t end;
+			int pattern = _dfaMatchAt( text, len, p, &end, &budget );
+
+			if( pattern==DFA_FAILED )
+			{
+				// p より前で始まるマッチはないので、p から探す
+				return _run( insts, loop_scopes, text, len, p, false, num_slots, match );
+			}
+
+			if( pattern>=0 )
+			{
+				// グループの位置は、同じ位置から Pike VM で求める (同じマッチになる)
+				if( captures && num_groups[pattern]>0 && match )
+				{
+					return _run( insts, loop_scopes, text, len, p, true, num_slots, match );
+				}
+
+				_setMatch( pattern, p, end, match );
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	return _run( insts, loop_scopes, text, len, pos, false, num_slots, match );
+}
+
+template<typename CHAR>
+bool Regex::MatchAt( const CHAR * text, size_t len, size_t pos, Match * match, bool captures ) const
+{
+	if( insts.empty() || pos>len ) return false;
+
+	if(dfa)
+	{
+		size_t budget = (size_t)-1;
+		size_t end;
+		int pattern = _dfaMatchAt( text, len, pos, &end, &budget );
+
+		if( pattern==-1 )
+		{
+			return false;
+		}
+
+		if( pattern>=0 && !( captures && num_groups[pattern]>0 && match ) )
+		{
+			_setMatch( pattern, pos, end, match );
+			return true;
+		}
+	}
+
+	return _run( insts, loop_scopes, text, len, pos, true, num_slots, match );
+}
+
+template bool Regex::Search<unsigned char>( const unsigned char * text, size_t len, size_t pos, Match * match, bool captures ) const;
+template bool Regex::Search<unsigned short>( const unsigned short * text, size_t len, size_t pos, Match * match, bool captures ) const;
+template bool Regex::Search<unsigned int>( const unsigned int * text, size_t len, size_t pos, Match * match, bool captures ) const;
+template bool Regex::MatchAt<unsigned char>( const unsigned char * text, size_t len, size_t pos, Match * match, bool captures ) const;
+template bool Regex::MatchAt<unsigned short>( const unsigned short * text, size_t len, size_t pos, Match * match, bool captures ) const;
+template bool Regex::MatchAt<unsigned int>( const unsigned int * text, size_t len, size_t pos, Match * match, bool captures ) const;
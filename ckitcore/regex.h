@@ -0,0 +1,209 @@
+﻿#ifndef _REGEX_H_
+#define _REGEX_H_
+
+#include <stddef.h>
+#include <vector>
+#include <memory>
+
+namespace ckit
+{
+	// 正規表現
+	//
+	// Python の re モジュールの構文のサブセットを、Pike VM (優先順位付きのスレッドによる NFA のシミュレーション) で実行する。
+	// バックトラックを行わないので、どのようなパターンでも テキストの長さ x 命令数 に比例する時間で検索できる。
+	// マッチの優先順位は re モジュールと同じ (最も左で始まるもの、同じ位置の場合はバックトラックで最初に見つかるもの)。
+	//
+	// 複数のパターンをまとめてコンパイルすることができ、同じ位置で始まるマッチの場合は、先に指定したパターンが優先される。
+	//
+	// 後方参照、条件分岐、アトミックグループ、VERBOSE フラグなど、対応していない構文を含む場合は Compile が失敗するので、
+	// 呼び出し側で re モジュールにフォールバックする。
+	// 先読みは、位置ごとに読む文字数に上限があるもの ( (?=a*b) などは対象外 ) だけに対応する。
+	//
+	// 先読み/後読みと、空文字列にマッチできる繰り返しを含まない場合は、同じ優先順位の規則で動作する遅延 DFA で
+	// マッチの有無と範囲を求め、グループの位置が必要な場合だけ Pike VM を使う。
+	class Regex
+	{
+	public:
+		enum Flag
+		{
+			Flag_IgnoreCase = 1<<0,
+			Flag_Multiline = 1<<1,
+			Flag_DotAll = 1<<2,
+			Flag_Ascii = 1<<3,
+		};
+
+		struct Pattern
+		{
+			Pattern() : flags(0) {}
+
+			std::vector<unsigned int> text;		// パターン文字列 (コードポイントの配列)
+			int flags;
+		};
+
+		struct Match
+		{
+			int pattern;						// マッチしたパターンの番号
+			std::vector<long long> groups;		// [ start0, end0, start1, end1, ... ] 参加しなかったグループは -1
+
+			size_t Start( int group=0 ) const { return (size_t)groups[group*2]; }
+			size_t End( int group=0 ) const { return (size_t)groups[group*2+1]; }
+			bool HasGroup( int group ) const { return group*2+1 < (int)groups.size() && groups[group*2]>=0 && groups[group*2+1]>=0; }
+		};
+
+		// ASCII 以外の文字の分類と小文字への変換
+		// 設定しない場合は ASCII の範囲だけで判定する
+		struct UnicodeFuncs
+		{
+			bool (*is_word)( unsigned int c );
+			bool (*is_digit)( unsigned int c );
+			bool (*is_space)( unsigned int c );
+			unsigned int (*to_lower)( unsigned int c );
+		};
+
+		static void SetUnicodeFuncs( const UnicodeFuncs & funcs );
+
+		Regex();
+
+		// patterns を優先順位付きの選択肢としてコンパイルする
+		// 対応していない構文を含む場合は false を返す
+		bool Compile( const std::vector<Pattern> & patterns );
+
+		bool IsValid() const { return !insts.empty(); }
+		int GetNumGroups( int pattern ) const { return num_groups[pattern]; }
+
+		// text[pos,len) の中で、最も左で始まるマッチを探す
+		// ^ や \b の判定には pos より前の文字も参照する (re の search(string,pos) と同じ)
+		// captures が false の場合は、グループ 0 以外の位置を求めない (-1 になる)
+		template<typename CHAR>
+		bool Search( const CHAR * text, size_t len, size_t pos, Match * match, bool captures=true ) const;
+
+		// text[pos,len) が pos から始まるマッチを持つか (re の match(string,pos) と同じ)
+		template<typename CHAR>
+		bool MatchAt( const CHAR * text, size_t len, size_t pos, Match * match, bool captures=true ) const;
+
+	public:
+		// 以下は実装で使用する型
+
+		enum Op
+		{
+			Op_Char,		// x : 文字
+			Op_CharFold,	// x : 大文字小文字を区別しない比較のために変換した文字、y : ASCII の範囲だけで変換する
+			Op_Any,			// 任意の文字
+			Op_AnyNoNL,		// 改行以外の任意の文字
+			Op_Class,		// x : 文字クラスの番号
+			Op_Split,		// x を優先し y も試す
+			Op_Jmp,			// x
+			Op_Save,		// x : 位置を保存するスロット
+			Op_LoopSet,		// x : 繰り返しの開始位置を保存するスロット
+			Op_LoopCheck,	// x : 繰り返しの開始位置のスロット、y : 位置が進んでいない場合の飛び先
+			Op_Assert,		// x : Assert_xxx
+			Op_Look,		// x : 先読み/後読みの番号
+			Op_Match,		// x : パターンの番号 (先読み/後読みの場合は -1)
+		};
+
+		enum Assert
+		{
+			Assert_BeginText,
+			Assert_EndText,
+			Assert_EndTextOrNL,
+			Assert_BeginLine,
+			Assert_EndLine,
+			Assert_WordBoundary,
+			Assert_NotWordBoundary,
+			Assert_WordBoundaryAscii,
+			Assert_NotWordBoundaryAscii,
+		};
+
+		struct Inst
+		{
+			int op;
+			int x;
+			int y;
+		};
+
+		struct CharClass
+		{
+			CharClass() : escapes(0), negate(false), ignore_case(false), ascii(false) {}
+
+			bool Match( unsigned int c ) const;
+			bool _matchRaw( unsigned int c ) const;
+			bool _matchNoCase( unsigned int c ) const;
+			bool CanMatchHigh() const;
+
+			std::vector< std::pair<unsigned int,unsigned int> > ranges;
+			int escapes;					// Escape_xxx の組み合わせ
+			bool negate;
+			bool ignore_case;
+			bool ascii;
+			unsigned int bitmap[8];			// 0x00 - 0xff の文字に対する判定結果
+		};
+
+		// 命令ごとの、その命令を本体に含む「空文字列にマッチできる繰り返し」の開始位置のスロット
+		//
+		// 繰り返しの本体の命令は、囲んでいる繰り返しが現在位置で始まったかどうかで、その後の動作 (Op_LoopCheck) が変わる。
+		// Pike VM は、同じ命令をその組み合わせごとに別の状態として扱い、印は mark_base[pc] + 組み合わせ の位置に付ける。
+		struct LoopScopes
+		{
+			std::vector<int> begin;		// 命令 pc のスロットは slots[ begin[pc], begin[pc+1] ) (外側の繰り返しから順)
+			std::vector<int> slots;
+			std::vector<int> mark_base;
+			size_t num_marks;
+		};
+
+		struct Look
+		{
+			std::vector<Inst> insts;	// 部分プログラム
+			LoopScopes loop_scopes;
+			bool ahead;
+			bool negate;
+			int width;					// 後読みの幅
+		};
+
+		// ある命令から始まるスレッドが最初に読む文字の集合
+		struct FirstChars
+		{
+			bool skip;					// 文字を読まずにマッチすることがないか (false の場合は判定に使えない)
+			bool high;					// 0x100 以上の文字になりうるか
+			unsigned int bitmap[8];		// 0x00 - 0xff の文字
+		};
+
+	private:
+		template<typename CHAR>
+		bool _run( const std::vector<Inst> & prog, const LoopScopes & scopes, const CHAR * text, size_t len, size_t pos, bool anchored, int nslots, Match * match ) const;
+
+		template<typename CHAR>
+		bool _checkAssert( int kind, const CHAR * text, size_t len, size_t pos ) const;
+
+		template<typename CHAR>
+		bool _checkLook( int index, const CHAR * text, size_t len, size_t pos ) const;
+
+		void _computeFirstChars();
+
+		struct Dfa;
+		struct DfaState;
+
+		template<typename CHAR>
+		int _dfaMatchAt( const CHAR * text, size_t len, size_t pos, size_t * end, size_t * budget ) const;
+
+		int _dfaTransition( int state, unsigned int c, bool eot, int * match ) const;
+
+		void _setMatch( int pattern, size_t start, size_t end, Match * match ) const;
+
+		std::vector<Inst> insts;
+		LoopScopes loop_scopes;
+		std::vector<CharClass> classes;
+		std::vector<Look> looks;
+		std::vector<int> num_groups;
+		int num_capture_slots;
+		int num_slots;
+
+		// 各命令から始まるスレッドが最初に読む文字の集合
+		// マッチの開始位置の読み飛ばしと、その位置で続かないスレッドを作らないために使う
+		std::vector<FirstChars> firsts;
+
+		// 遅延 DFA (使えない場合は NULL)
+		std::shared_ptr<Dfa> dfa;
+	};
+};
+
+#endif // _REGEX_H_
@@ -0,0 +1,346 @@
+﻿#include <algorithm>
+#include <atomic>
+
+#include "threadutil.h"
+#include "regexlexer.h"
+
+using namespace ckit;
+
+//-----------------------------------------------------------------------------
+
+RegexLexer::RegexLexer()
+{
+}
+
+bool RegexLexer::SetContext( int ctx, bool detail, const Context & context )
+{
+	std::vector<Context> & table = contexts[detail?1:0];
+
+	if( (int)table.size()<=ctx )
+	{
+		table.resize(ctx+1);
+	}
+
+	Context & dst = table[ctx];
+	dst = context;
+
+	if( dst.patterns.empty() )
+	{
+		dst.valid = true;
+	}
+	else
+	{
+		dst.valid = dst.regex.Compile( dst.patterns );
+	}
+
+	return dst.valid;
+}
+
+// 直前のトークンと種類が異なる場合だけトークンを追加する
+static inline void _pushToken( std::vector<RegexLexer::Token> * tokens, size_t pos, size_t len, int type )
+{
+	if(!tokens) return;
+
+	if( tokens->empty() || tokens->back().type!=type )
+	{
+		if( pos<len )
+		{
+			RegexLexer::Token token;
+			token.pos = (int)pos;
+			token.type = type;
+			tokens->push_back(token);
+		}
+	}
+}
+
+template<typename CHAR>
+bool RegexLexer::Lex( int ctx, const CHAR * text, size_t len, bool detail, std::vector<Token> * tokens, int * end_ctx ) const
+{
+	const std::vector<Context> & table = contexts[detail?1:0];
+
+	if(tokens) tokens->clear();
+
+	size_t pos = 0;
+	size_t num_stalls = 0;
+	Regex::Match match;
+
+	while( pos<=len )
+	{
+		if( ctx<0 || ctx>=(int)table.size() || !table[ctx].valid )
+		{
+			return false;
+		}
+
+		const Context & context = table[ctx];
+
+		bool last = (pos==len);
+		size_t prev_pos = pos;
+		int prev_ctx = ctx;
+
+		// グループの位置は、グループごとにトークンを分けるルールの場合だけ求める
+		bool found = false;
+		if( !context.patterns.empty() )
+		{
+			found = context.regex.Search( text, len, pos, &match, false );
+			if( found && context.rules[match.pattern].group_action )
+			{
+				context.regex.MatchAt( text, len, match.Start(), &match, true );
+			}
+		}
+
+		// pos から始まるマッチがない場合はデフォルトルールを使う
+		// デフォルトルールもない場合はエラーとして終了する
+		bool use_default = false;
+		if( !found || match.Start()!=pos )
+		{
+			if( !context.has_default )
+			{
+				if( tokens && pos<len )
+				{
+					Token token;
+					token.pos = (int)pos;
+					token.type = Token_Error;
+					tokens->push_back(token);
+				}
+				break;
+			}
+
+			use_default = true;
+
+			if( tokens && context.default_rule.group_action )
+			{
+				return false;
+			}
+
+			_pushToken( tokens, pos, len, context.default_rule.tokens[0] );
+		}
+
+		const Rule * rule = &context.default_rule;
+
+		if(found)
+		{
+			rule = &context.rules[match.pattern];
+			pos = match.Start();
+
+			if( rule->group_action )
+			{
+				for( size_t i=0 ; i<rule->tokens.size() ; ++i )
+				{
+					// 存在しないグループ、参加しなかったグループは Python の実装では例外になる
+					if( !match.HasGroup((int)i+1) || (int)i+1>context.regex.GetNumGroups(match.pattern) )
+					{
+						return false;
+					}
+
+					_pushToken( tokens, pos, len, rule->tokens[i] );
+					pos += match.End((int)i+1) - match.Start((int)i+1);
+				}
+			}
+			else
+			{
+				_pushToken( tokens, pos, len, rule->tokens[0] );
+				pos += match.End() - match.Start();
+			}
+		}
+
+		if( rule->next_ctx>=0 )
+		{
+			ctx = rule->next_ctx;
+		}
+
+		if( use_default && !found )
+		{
+			break;
+		}
+
+		if(last)
+		{
+			break;
+		}
+
+		// 位置が進まないまま繰り返す場合は Python の実装では無限ループになるので打ち切る
+		if( pos==prev_pos )
+		{
+			if( ctx==prev_ctx || ++num_stalls>table.size() )
+			{
+				break;
+			}
+		}
+		else
+		{
+			num_stalls = 0;
+		}
+	}
+
+	*end_ctx = ctx;
+
+	return true;
+}
+
+template bool RegexLexer::Lex<unsigned char>( int ctx, const unsigned char * text, size_t len, bool detail, std::vector<Token> * tokens, int * end_ctx ) const;
+template bool RegexLexer::Lex<unsigned short>( int ctx, const unsigned short * text, size_t len, bool detail, std::vector<Token> * tokens, int * end_ctx ) const;
+template bool RegexLexer::Lex<unsigned int>( int ctx, const unsigned int * text, size_t len, bool detail, std::vector<Token> * tokens, int * end_ctx ) const;
+
+//-----------------------------------------------------------------------------
+
+// 並列に分析する最小の行数
+static const size_t PARALLEL_MIN_LINES = 4096;
+
+// チャンクの最小の行数
+static const size_t CHUNK_MIN_LINES = 1024;
+
+bool RegexLexer::LexText( int ctx, const LineText & line, bool detail, std::vector<Token> * tokens, int * end_ctx ) const
+{
+	switch(line.char_size)
+	{
+	case 1:
+		return Lex( ctx, (const unsigned char*)line.data, line.len, detail, tokens, end_ctx );
+	case 2:
+		return Lex( ctx, (const unsigned short*)line.data, line.len, detail, tokens, end_ctx );
+	case 4:
+		return Lex( ctx, (const unsigned int*)line.data, line.len, detail, tokens, end_ctx );
+	}
+	return false;
+}
+
+size_t RegexLexer::UpdateContexts( const LineText * prev_line, int prev_ctx, int root_ctx, const std::vector<LineText> & lines, std::vector<int> * ctxs, bool * prev_dirty, size_t * num_lexed ) const
+{
+	size_t num_lines = lines.size();
+
+	// 各行の元のコンテキスト
+	const std::vector<int> stored = *ctxs;
+
+	// 各行の処理後の状態 (新しいコンテキストと、変化したかどうか)
+	std::vector<int> & new_ctxs = *ctxs;
+	std::vector<char> dirty( num_lines, 0 );
+
+	std::atomic<size_t> lexed(0);
+
+	// 1行分の状態を進める
+	auto step = [&]( size_t i, int ctx, bool is_dirty, int * out_ctx, bool * out_dirty ) -> bool
+	{
+		if( stored[i]!=Context_None && !is_dirty )
+		{
+			*out_ctx = stored[i];
+			*out_dirty = false;
+			return true;
+		}
+
+		const LineText * prev = i>0 ? &lines[i-1] : prev_line;
+		int next_ctx;
+		if(prev)
+		{
+			if( !LexText( ctx, *prev, false, NULL, &next_ctx ) ) return false;
+			lexed++;
+		}
+		else
+		{
+			next_ctx = root_ctx;
+		}
+
+		*out_ctx = next_ctx;
+		*out_dirty = ( next_ctx!=stored[i] );
+		return true;
+	};
+
+	// [begin,end) の行を、直前の行の状態 (ctx, is_dirty) から順に処理する
+	// converge_end より前の行は処理済みの状態を持っていて、状態が一致した時点で打ち切り、converged を true にする
+	// 処理できない行があった場合は、その行の番号を返す
+	auto run = [&]( size_t begin, size_t end, int ctx, bool is_dirty, size_t converge_end, bool * converged ) -> size_t
+	{
+		*converged = false;
+
+		for( size_t i=begin ; i<end ; ++i )
+		{
+			int out_ctx;
+			bool out_dirty;
+			if( !step( i, ctx, is_dirty, &out_ctx, &out_dirty ) ) return i;
+
+			if( i<converge_end && new_ctxs[i]==out_ctx && (dirty[i]!=0)==out_dirty )
+			{
+				*converged = true;
+				break;
+			}
+
+			new_ctxs[i] = out_ctx;
+			dirty[i] = out_dirty;
+			ctx = out_ctx;
+			is_dirty = out_dirty;
+		}
+		return end;
+	};
+
+	size_t result;
+
+	if( num_lines < PARALLEL_MIN_LINES || ThreadUtil::GetNumWorkers()<=1 )
+	{
+		bool converged;
+		result = run( 0, num_lines, prev_ctx, false, 0, &converged );
+	}
+	else
+	{
+		size_t chunk_size = std::max( CHUNK_MIN_LINES, num_lines / (ThreadUtil::GetNumWorkers()*4) + 1 );
+		int num_chunks = (int)( ( num_lines + chunk_size - 1 ) / chunk_size );
+
+		auto chunk_begin = [&]( int index ) { return std::min( chunk_size*index, num_lines ); };
+
+		// 各チャンクの開始コンテキストを、直前の行の元のコンテキストから推測して並列に処理する
+		std::vector<int> spec_ctxs(num_chunks);
+		std::vector<size_t> stopped(num_chunks);
+		ThreadUtil::ParallelFor( num_chunks, [&]( int index )
+		{
+			size_t begin = chunk_begin(index);
+			int ctx = prev_ctx;
+			if( index>0 )
+			{
+				ctx = stored[begin-1]>=0 ? stored[begin-1] : root_ctx;
+			}
+			spec_ctxs[index] = ctx;
+
+			bool converged;
+			stopped[index] = run( begin, chunk_begin(index+1), ctx, false, 0, &converged );
+		});
+
+		// 先頭のチャンクから順に、推測が外れたチャンクを正しい状態から処理し直す
+		result = num_lines;
+		for( int index=0 ; index<num_chunks ; ++index )
+		{
+			size_t begin = chunk_begin(index);
+			size_t end = chunk_begin(index+1);
+
+			if( index>0 )
+			{
+				int ctx = new_ctxs[begin-1];
+				bool is_dirty = dirty[begin-1]!=0;
+
+				if( ctx!=spec_ctxs[index] || is_dirty )
+				{
+					bool converged;
+					size_t rerun_stopped = run( begin, end, ctx, is_dirty, stopped[index], &converged );
+
+					// 最後まで処理し直した場合は、推測した処理の結果は使わない
+					if( !converged )
+					{
+						if( rerun_stopped<end )
+						{
+							result = rerun_stopped;
+							break;
+						}
+						continue;
+					}
+				}
+			}
+
+			if( stopped[index]<end )
+			{
+				result = stopped[index];
+				break;
+			}
+		}
+	}
+
+	*prev_dirty = result>0 ? dirty[result-1]!=0 : false;
+	*num_lexed = lexed;
+
+	return result;
+}
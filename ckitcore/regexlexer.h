@@ -0,0 +1,105 @@
+﻿#ifndef _REGEXLEXER_H_
+#define _REGEXLEXER_H_
+
+#include <vector>
+
+#include "regex.h"
+
+namespace ckit
+{
+	// 正規表現のテーブルを使ったシンタックス分析
+	//
+	// ckit_textwidget.RegexLexer の lex と同じ結果を返す。
+	// コンテキストごとに、デフォルトルールより前の全てのルールを1つの Regex にまとめてコンパイルし、
+	// 1回の検索で最も近いルールを見つける (同じ位置の場合は先に定義されたルールが優先される)。
+	//
+	// コンテキストの番号の割り当てや Python オブジェクトとの変換は呼び出し側で行う。
+	class RegexLexer
+	{
+	public:
+		// ルール
+		struct Rule
+		{
+			Rule() : group_action(false), next_ctx(-1) {}
+
+			std::vector<int> tokens;	// トークンの種類 (group_action の場合はグループごと)
+			bool group_action;			// グループごとに別のトークンにする
+			int next_ctx;				// 次のコンテキスト (-1 の場合は変更しない)
+		};
+
+		// コンテキストごとのルールのリスト
+		struct Context
+		{
+			Context() : has_default(false), valid(false) {}
+
+			std::vector<Regex::Pattern> patterns;	// デフォルトルールより前のルールの正規表現
+			std::vector<Rule> rules;				// patterns に対応するルール
+			bool has_default;
+			Rule default_rule;						// 正規表現を持たないルール
+
+			// SetContext で設定する
+			bool valid;
+			Regex regex;
+		};
+
+		struct Token
+		{
+			int pos;
+			int type;
+		};
+
+		// 1行の文字列
+		struct LineText
+		{
+			const void * data;
+			int char_size;				// 1文字のバイト数 (1, 2, 4)
+			size_t len;
+		};
+
+		enum
+		{
+			Context_None = -1,			// 未計算
+		};
+
+		enum
+		{
+			Token_Error = -1,
+		};
+
+		RegexLexer();
+
+		// コンテキストのルールを設定する
+		// detail : 詳細な分析 (トークンの取得) に使うルールかどうか
+		// 正規表現をコンパイルできなかった場合は false を返す (そのコンテキストの分析は呼び出し側で行う)
+		bool SetContext( int ctx, bool detail, const Context & context );
+
+		// 1行を分析する
+		// tokens が NULL の場合はトークンを記録しない
+		// このエンジンで処理できない場合は false を返すので、呼び出し側で Python の実装を使う
+		// Python の GIL を保持せずに呼び出すことができる
+		template<typename CHAR>
+		bool Lex( int ctx, const CHAR * text, size_t len, bool detail, std::vector<Token> * tokens, int * end_ctx ) const;
+
+		// LineText の文字列を分析する (Lex と同じ)
+		bool LexText( int ctx, const LineText & line, bool detail, std::vector<Token> * tokens, int * end_ctx ) const;
+
+		// 複数の行の開始コンテキストを更新する
+		//
+		// ctxs には各行の現在のコンテキスト (未計算の場合は Context_None) を渡し、新しいコンテキストが返る。
+		// コンテキストが未計算の行と、直前の行のコンテキストが変化した行だけを分析する (Document.updateSyntaxContext と同じ)。
+		// prev_line は lines[0] の前の行 (NULL の場合は lines[0] が先頭行で、root_ctx になる)。prev_ctx はその行のコンテキスト。
+		//
+		// 行数が多い場合は、行をチャンクに分けて、各チャンクの開始コンテキストを推測して並列に分析し、
+		// 推測が外れたチャンクは、正しいコンテキストから分析し直す (推測した結果と一致した行で打ち切る)。
+		//
+		// 更新できた行数を返す。このエンジンで処理できない行があった場合は、その行の手前で止まる。
+		// prev_dirty には最後に更新した行のコンテキストが変化したかどうか、num_lexed には分析した行数が返る。
+		// Python の GIL を保持せずに呼び出すことができる
+		size_t UpdateContexts( const LineText * prev_line, int prev_ctx, int root_ctx, const std::vector<LineText> & lines, std::vector<int> * ctxs, bool * prev_dirty, size_t * num_lexed ) const;
+
+	private:
+		std::vector<Context> contexts[2];		// [0] : 通常、[1] : 詳細
+	};
+};
+
+#endif // _REGEXLEXER_H_
@@ -0,0 +1,854 @@
+﻿#include <windows.h>
+
+#include <string.h>
+#include <algorithm>
+
+#include "threadutil.h"
+#include "textcodec.h"
+
+using namespace TextCodec;
+
+//-----------------------------------------------------------------------------
+
+// 1チャンクの大きさの下限と上限
+static const size_t CHUNK_SIZE_MIN = 256 * 1024;
+static const size_t CHUNK_SIZE_MAX = 16 * 1024 * 1024;
+
+static const unsigned short REPLACEMENT_CHAR = 0xfffd;
+
+//-----------------------------------------------------------------------------
+
+TextCodec::Encoding TextCodec::GetEncoding( const char * name )
+{
+	std::string s;
+	for( const char * p=name ; *p ; ++p )
+	{
+		char c = *p;
+		if( c>='A' && c<='Z' ) c = c - 'A' + 'a';
+		if( c=='-' ) c = '_';
+		s += c;
+	}
+
+	if( s=="utf_8" || s=="utf8" || s=="u8" )
+	{
+		return Encoding_Utf8;
+	}
+	else if( s=="utf_16_le" || s=="utf_16le" )
+	{
+		return Encoding_Utf16LE;
+	}
+	else if( s=="utf_16_be" || s=="utf_16be" )
+	{
+		return Encoding_Utf16BE;
+	}
+	else if( s=="cp932" || s=="932" || s=="ms932" || s=="mskanji" || s=="ms_kanji" )
+	{
+		return Encoding_Cp932;
+	}
+	else if( s=="euc_jp" || s=="eucjp" || s=="ujis" || s=="u_jis" )
+	{
+		return Encoding_EucJp;
+	}
+
+	return Encoding_Unknown;
+}
+
+//-----------------------------------------------------------------------------
+
+// pos 以降で最初の改行の直後の位置を返す (1バイト単位のエンコーディング用)
+//
+// utf-8 / cp932 / euc-jp では、CR と LF のバイトはマルチバイト文字の一部に
+// 現れないので、改行の直後は安全な分割位置になる。
+static size_t _findBoundary8( const unsigned char * data, size_t len, size_t pos )
+{
+	for( size_t i=pos ; i<len ; ++i )
+	{
+		if( data[i]=='\n' )
+		{
+			return i+1;
+		}
+		else if( data[i]=='\r' && ( i+1>=len || data[i+1]!='\n' ) )
+		{
+			return i+1;
+		}
+	}
+	return len;
+}
+
+static inline unsigned int _readUtf16( const unsigned char * p, bool big_endian )
+{
+	return big_endian ? ( (p[0]<<8) | p[1] ) : ( p[0] | (p[1]<<8) );
+}
+
+// pos 以降で最初の改行の直後の位置を返す (UTF-16用)
+static size_t _findBoundary16( const unsigned char * data, size_t len, size_t pos, bool big_endian )
+{
+	pos = (pos+1) & ~(size_t)1;
+	for( size_t i=pos ; i+1<len ; i+=2 )
+	{
+		unsigned int c = _readUtf16( data+i, big_endian );
+		if( c=='\n' )
+		{
+			return i+2;
+		}
+		else if( c=='\r' && ( i+3>=len || _readUtf16( data+i+2, big_endian )!='\n' ) )
+		{
+			return i+2;
+		}
+	}
+	return len;
+}
+
+//-----------------------------------------------------------------------------
+
+// UTF-8 → UTF-16
+//
+// 不正なバイト列は、Python の errors='replace' と同じく
+// 不正な部分列ごとに U+FFFD 1文字に置き換える。
+static void _decodeUtf8( const unsigned char * src, size_t len, std::vector<unsigned short> * dst )
+{
+	// UTF-16 の単位数は入力のバイト数を超えない
+	dst->resize(len);
+	unsigned short * out = dst->data();
+
+	size_t i = 0;
+	while( i<len )
+	{
+		// ASCII の連続を高速に処理する
+		while( i+8<=len )
+		{
+			unsigned int a, b;
+			memcpy( &a, src+i, 4 );
+			memcpy( &b, src+i+4, 4 );
+			if( (a|b) & 0x80808080 ) break;
+			for( int k=0 ; k<8 ; ++k ) *out++ = src[i+k];
+			i += 8;
+		}
+		if( i>=len ) break;
+
+		unsigned int c = src[i];
+
+		if( c<0x80 )
+		{
+			*out++ = (unsigned short)c;
+			i += 1;
+			continue;
+		}
+
+		// 2バイト目の許容範囲と、後続バイト数
+		unsigned int lo = 0x80, hi = 0xbf;
+		int num_trail;
+		if( c>=0xc2 && c<=0xdf )
+		{
+			num_trail = 1;
+			c &= 0x1f;
+		}
+		else if( c>=0xe0 && c<=0xef )
+		{
+			num_trail = 2;
+			if( c==0xe0 ) lo = 0xa0;
+			if( c==0xed ) hi = 0x9f;
+			c &= 0x0f;
+		}
+		else if( c>=0xf0 && c<=0xf4 )
+		{
+			num_trail = 3;
+			if( c==0xf0 ) lo = 0x90;
+			if( c==0xf4 ) hi = 0x8f;
+			c &= 0x07;
+		}
+		else
+		{
+			*out++ = REPLACEMENT_CHAR;
+			i += 1;
+			continue;
+		}
+
+		size_t j = i+1;
+		int k;
+		for( k=0 ; k<num_trail ; ++k, ++j )
+		{
+			if( j>=len ) break;
+			unsigned int t = src[j];
+			if( t<lo || t>hi ) break;
+			c = (c<<6) | (t & 0x3f);
+			lo = 0x80;
+			hi = 0xbf;
+		}
+
+		if( k<num_trail )
+		{
+			// 不正な部分列は、正しかったところまでを1文字として置き換える
+			*out++ = REPLACEMENT_CHAR;
+			i = j;
+			continue;
+		}
+
+		if( c>=0x10000 )
+		{
+			c -= 0x10000;
+			*out++ = (unsigned short)( 0xd800 | (c>>10) );
+			*out++ = (unsigned short)( 0xdc00 | (c&0x3ff) );
+		}
+		else
+		{
+			*out++ = (unsigned short)c;
+		}
+		i = j;
+	}
+
+	dst->resize( out - dst->data() );
+}
+
+// UTF-16 → UTF-16 (バイトオーダーの変換と不正なサロゲートの置き換え)
+static void _decodeUtf16( const unsigned char * src, size_t len, bool big_endian, std::vector<unsigned short> * dst )
+{
+	dst->resize( len/2 + 1 );
+	unsigned short * out = dst->data();
+
+	size_t i = 0;
+	while( i+1<len )
+	{
+		unsigned int c = _readUtf16( src+i, big_endian );
+		i += 2;
+
+		if( c>=0xd800 && c<=0xdbff )
+		{
+			if( i+1<len )
+			{
+				unsigned int c2 = _readUtf16( src+i, big_endian );
+				if( c2>=0xdc00 && c2<=0xdfff )
+				{
+					*out++ = (unsigned short)c;
+					*out++ = (unsigned short)c2;
+					i += 2;
+					continue;
+				}
+			}
+			*out++ = REPLACEMENT_CHAR;
+		}
+		else if( c>=0xdc00 && c<=0xdfff )
+		{
+			*out++ = REPLACEMENT_CHAR;
+		}
+		else
+		{
+			*out++ = (unsigned short)c;
+		}
+	}
+
+	// 奇数バイトの端数
+	if( i<len )
+	{
+		*out++ = REPLACEMENT_CHAR;
+	}
+
+	dst->resize( out - dst->data() );
+}
+
+// コードページ → UTF-16
+static void _decodeCodePage( UINT codepage, const unsigned char * src, size_t len, std::vector<unsigned short> * dst )
+{
+	if(len==0)
+	{
+		dst->clear();
+		return;
+	}
+
+	int size = ::MultiByteToWideChar( codepage, 0, (const char*)src, (int)len, NULL, 0 );
+	dst->resize(size);
+	if(size>0)
+	{
+		size = ::MultiByteToWideChar( codepage, 0, (const char*)src, (int)len, (wchar_t*)dst->data(), size );
+		dst->resize( std::max(size,0) );
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+// デコード済みのテキストを行に分割する
+//
+// 行情報の計算と同じ走査の中で、波ダッシュの置き換えも行う。
+static void _splitLines( DecodedChunk * chunk, bool wave_dash, bool last_chunk )
+{
+	unsigned short * text = chunk->text.data();
+	size_t len = chunk->text.size();
+
+	size_t line_top = 0;
+	unsigned int char_bits = 0;
+	size_t num_surrogates = 0;
+
+	auto push_line = [&]( size_t line_end, int lineend )
+	{
+		DecodedLine line;
+		line.offset = line_top;
+		line.length = line_end - line_top;
+		line.num_chars = line.length - num_surrogates;
+		// 文字コードの論理和は、文字列の種類(1/2/4バイト)の判定において最大値と同じ結果になる
+		line.max_char = num_surrogates ? 0x10ffff : char_bits;
+		line.lineend = lineend;
+		chunk->lines.push_back(line);
+
+		char_bits = 0;
+		num_surrogates = 0;
+	};
+
+	size_t i = 0;
+	while( i<len )
+	{
+		unsigned int c = text[i];
+
+		if( c=='\n' )
+		{
+			push_line( i, LineEnd_LF );
+			i += 1;
+			line_top = i;
+		}
+		else if( c=='\r' )
+		{
+			if( i+1<len && text[i+1]=='\n' )
+			{
+				push_line( i, LineEnd_CRLF );
+				i += 2;
+			}
+			else
+			{
+				push_line( i, LineEnd_CR );
+				i += 1;
+			}
+			line_top = i;
+		}
+		else
+		{
+			if( c>=0xd800 && c<=0xdbff )
+			{
+				num_surrogates++;
+			}
+			else if( wave_dash && c==0x301c )
+			{
+				// 波ダッシュ → 全角チルダ
+				c = 0xff5e;
+				text[i] = (unsigned short)c;
+			}
+			char_bits |= c;
+			i += 1;
+		}
+	}
+
+	if( last_chunk || line_top<len )
+	{
+		push_line( len, 0 );
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+void TextCodec::DecodeLines( Encoding encoding, const char * _data, size_t len, std::vector<DecodedChunk> * chunks )
+{
+	const unsigned char * data = (const unsigned char*)_data;
+
+	bool utf16 = ( encoding==Encoding_Utf16LE || encoding==Encoding_Utf16BE );
+	bool big_endian = ( encoding==Encoding_Utf16BE );
+
+	// 改行位置でチャンクに分割する
+	size_t chunk_size = len / ( ThreadUtil::GetNumWorkers() * 4 );
+	chunk_size = std::max( chunk_size, CHUNK_SIZE_MIN );
+	chunk_size = std::min( chunk_size, CHUNK_SIZE_MAX );
+
+	std::vector<size_t> boundaries;
+	boundaries.push_back(0);
+	while( boundaries.back()<len )
+	{
+		size_t pos = boundaries.back() + chunk_size;
+		if( pos>=len )
+		{
+			boundaries.push_back(len);
+			break;
+		}
+
+		if(utf16)
+		{
+			boundaries.push_back( _findBoundary16( data, len, pos, big_endian ) );
+		}
+		else
+		{
+			boundaries.push_back( _findBoundary8( data, len, pos ) );
+		}
+	}
+
+	int num_chunks = std::max( (int)boundaries.size()-1, 1 );
+	boundaries.resize( num_chunks+1, len );
+
+	chunks->clear();
+	chunks->resize(num_chunks);
+
+	ThreadUtil::ParallelFor( num_chunks, [&]( int index )
+	{
+		const unsigned char * src = data + boundaries[index];
+		size_t src_len = boundaries[index+1] - boundaries[index];
+		DecodedChunk & chunk = (*chunks)[index];
+
+		switch(encoding)
+		{
+		case Encoding_Utf8:
+			_decodeUtf8( src, src_len, &chunk.text );
+			break;
+
+		case Encoding_Utf16LE:
+		case Encoding_Utf16BE:
+			_decodeUtf16( src, src_len, big_endian, &chunk.text );
+			break;
+
+		case Encoding_Cp932:
+			_decodeCodePage( 932, src, src_len, &chunk.text );
+			break;
+
+		case Encoding_EucJp:
+			_decodeCodePage( 20932, src, src_len, &chunk.text );
+			break;
+
+		default:
+			break;
+		}
+
+		_splitLines( &chunk, encoding==Encoding_Cp932, index==num_chunks-1 );
+	});
+}
+
+//-----------------------------------------------------------------------------
+
+// 出力バッファの大きさ
+static const size_t OUTPUT_BUFFER_SIZE = 1024 * 1024;
+
+// 一度にエンコードする最大の文字数 (長い行を分割して処理する)
+static const size_t ENCODE_SEGMENT_SIZE = 32 * 1024;
+
+struct _OutputBuffer
+{
+	_OutputBuffer( const WriteFunc & _write_func )
+		:
+		write_func(_write_func),
+		buf(OUTPUT_BUFFER_SIZE),
+		pos(0),
+		ok(true)
+	{
+	}
+
+	// n バイト書き込める領域を確保する
+	char * Reserve( size_t n )
+	{
+		if( pos+n > buf.size() )
+		{
+			Flush();
+			if( n > buf.size() )
+			{
+				buf.resize(n);
+			}
+		}
+		return &buf[pos];
+	}
+
+	void Commit( size_t n )
+	{
+		pos += n;
+	}
+
+	bool Flush()
+	{
+		if( pos>0 && ok )
+		{
+			ok = write_func( buf.data(), pos );
+		}
+		pos = 0;
+		return ok;
+	}
+
+	const WriteFunc & write_func;
+	std::vector<char> buf;
+	size_t pos;
+	bool ok;
+};
+
+template<typename CHAR>
+static void _encodeUtf8( _OutputBuffer & out, const CHAR * src, size_t len )
+{
+	char * dst = out.Reserve( len*4 );
+	char * p = dst;
+
+	for( size_t i=0 ; i<len ; ++i )
+	{
+		unsigned int c = src[i];
+
+		if( c<0x80 )
+		{
+			*p++ = (char)c;
+		}
+		else if( c<0x800 )
+		{
+			*p++ = (char)( 0xc0 | (c>>6) );
+			*p++ = (char)( 0x80 | (c&0x3f) );
+		}
+		else if( c>=0xd800 && c<=0xdfff )
+		{
+			// 単独のサロゲート
+			*p++ = '?';
+		}
+		else if( c<0x10000 )
+		{
+			*p++ = (char)( 0xe0 | (c>>12) );
+			*p++ = (char)( 0x80 | ((c>>6)&0x3f) );
+			*p++ = (char)( 0x80 | (c&0x3f) );
+		}
+		else
+		{
+			*p++ = (char)( 0xf0 | (c>>18) );
+			*p++ = (char)( 0x80 | ((c>>12)&0x3f) );
+			*p++ = (char)( 0x80 | ((c>>6)&0x3f) );
+			*p++ = (char)( 0x80 | (c&0x3f) );
+		}
+	}
+
+	out.Commit( p-dst );
+}
+
+static inline char * _writeUtf16( char * p, unsigned int c, bool big_endian )
+{
+	if(big_endian)
+	{
+		*p++ = (char)(c>>8);
+		*p++ = (char)(c);
+	}
+	else
+	{
+		*p++ = (char)(c);
+		*p++ = (char)(c>>8);
+	}
+	return p;
+}
+
+template<typename CHAR>
+static void _encodeUtf16( _OutputBuffer & out, const CHAR * src, size_t len, bool big_endian )
+{
+	char * dst = out.Reserve( len*4 );
+	char * p = dst;
+
+	for( size_t i=0 ; i<len ; ++i )
+	{
+		unsigned int c = src[i];
+
+		if( c>=0xd800 && c<=0xdfff )
+		{
+			// 単独のサロゲート
+			p = _writeUtf16( p, '?', big_endian );
+		}
+		else if( c<0x10000 )
+		{
+			p = _writeUtf16( p, c, big_endian );
+		}
+		else
+		{
+			c -= 0x10000;
+			p = _writeUtf16( p, 0xd800 | (c>>10), big_endian );
+			p = _writeUtf16( p, 0xdc00 | (c&0x3ff), big_endian );
+		}
+	}
+
+	out.Commit( p-dst );
+}
+
+// WideCharToMultiByte で変換できなかった範囲を、1文字 (サロゲートペアは2単位) ずつ変換し直す
+//
+// 変換できない文字は '?' にする。
+// コードページが使えないなど、文字によらない理由で失敗した場合は false を返す。
+static bool _encodeCodePageEachChar( _OutputBuffer & out, UINT codepage, const unsigned short * w, int wlen )
+{
+	for( int i=0 ; i<wlen ; )
+	{
+		int n = 1;
+		if( w[i]>=0xd800 && w[i]<=0xdbff && i+1<wlen )
+		{
+			n = 2;
+		}
+
+		char * dst = out.Reserve(4);
+		int written = ::WideCharToMultiByte( codepage, WC_NO_BEST_FIT_CHARS, (const wchar_t*)(w+i), n, dst, 4, "?", NULL );
+		if( written<=0 )
+		{
+			if( ::GetLastError()!=ERROR_NO_UNICODE_TRANSLATION )
+			{
+				return false;
+			}
+			*dst = '?';
+			written = 1;
+		}
+		out.Commit(written);
+
+		i += n;
+	}
+
+	return true;
+}
+
+template<typename CHAR>
+static bool _encodeCodePage( _OutputBuffer & out, UINT codepage, const CHAR * src, size_t len, bool wave_dash, std::vector<unsigned short> * wbuf )
+{
+	// UTF-16 に変換してから WideCharToMultiByte に渡す
+	wbuf->resize( len*2 );
+	unsigned short * w = wbuf->data();
+
+	for( size_t i=0 ; i<len ; ++i )
+	{
+		unsigned int c = src[i];
+
+		if( wave_dash && c==0x301c )
+		{
+			// 波ダッシュ と 全角チルダ は、どちらも 0x8160 に変換する
+			// (Python の cp932 と同じ結果。WideCharToMultiByte は最適マッピングを使わないので、
+			//  全角チルダ側に寄せる)
+			*w++ = 0xff5e;
+		}
+		else if( c>=0xd800 && c<=0xdfff )
+		{
+			// 単独のサロゲート (WideCharToMultiByte に渡すと、その範囲全体の変換が失敗する)
+			*w++ = '?';
+		}
+		else if( c<0x10000 )
+		{
+			*w++ = (unsigned short)c;
+		}
+		else
+		{
+			c -= 0x10000;
+			*w++ = (unsigned short)( 0xd800 | (c>>10) );
+			*w++ = (unsigned short)( 0xdc00 | (c&0x3ff) );
+		}
+	}
+
+	int wlen = (int)( w - wbuf->data() );
+	if(wlen==0) return true;
+
+	// 1単位あたり最大 3バイト (euc-jp の補助漢字)
+	// 変換できない文字は、Python の errors='replace' と同じく '?' にする
+	int size = wlen*3;
+	char * dst = out.Reserve(size);
+	int written = ::WideCharToMultiByte( codepage, WC_NO_BEST_FIT_CHARS, (const wchar_t*)wbuf->data(), wlen, dst, size, "?", NULL );
+	if( written<=0 )
+	{
+		// 範囲全体の変換に失敗した場合は、その範囲を落とさずに1文字ずつ変換する
+		return _encodeCodePageEachChar( out, codepage, wbuf->data(), wlen );
+	}
+	out.Commit(written);
+
+	return true;
+}
+
+// コードページへの変換に失敗した場合は false を返す
+template<typename CHAR>
+static bool _encodeLine( _OutputBuffer & out, Encoding encoding, const CHAR * src, size_t len, std::vector<unsigned short> * wbuf )
+{
+	for( size_t pos=0 ; pos<len ; pos+=ENCODE_SEGMENT_SIZE )
+	{
+		size_t n = std::min( len-pos, ENCODE_SEGMENT_SIZE );
+
+		switch(encoding)
+		{
+		case Encoding_Utf8:
+			_encodeUtf8( out, src+pos, n );
+			break;
+
+		case Encoding_Utf16LE:
+		case Encoding_Utf16BE:
+			_encodeUtf16( out, src+pos, n, encoding==Encoding_Utf16BE );
+			break;
+
+		case Encoding_Cp932:
+			if( !_encodeCodePage( out, 932, src+pos, n, true, wbuf ) ) return false;
+			break;
+
+		case Encoding_EucJp:
+			if( !_encodeCodePage( out, 20932, src+pos, n, false, wbuf ) ) return false;
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	return true;
+}
+
+static void _encodeLineEnd( _OutputBuffer & out, Encoding encoding, int lineend )
+{
+	static const unsigned char cr_lf[] = { '\r', '\n' };
+
+	const unsigned char * s;
+	size_t len;
+
+	switch(lineend)
+	{
+	case LineEnd_CR:
+		s = cr_lf;
+		len = 1;
+		break;
+
+	case LineEnd_LF:
+		s = cr_lf+1;
+		len = 1;
+		break;
+
+	case LineEnd_CRLF:
+		s = cr_lf;
+		len = 2;
+		break;
+
+	default:
+		return;
+	}
+
+	if( encoding==Encoding_Utf16LE || encoding==Encoding_Utf16BE )
+	{
+		_encodeUtf16( out, s, len, encoding==Encoding_Utf16BE );
+	}
+	else
+	{
+		memcpy( out.Reserve(len), s, len );
+		out.Commit(len);
+	}
+}
+
+bool TextCodec::EncodeLines( Encoding encoding, const std::vector<SourceLine> & lines, const WriteFunc & write_func )
+{
+	_OutputBuffer out(write_func);
+	std::vector<unsigned short> wbuf;
+
+	for( size_t i=0 ; i<lines.size() ; ++i )
+	{
+		const SourceLine & line = lines[i];
+
+		bool encoded = true;
+
+		switch(line.kind)
+		{
+		case 1:
+			encoded = _encodeLine( out, encoding, (const unsigned char*)line.data, line.length, &wbuf );
+			break;
+
+		case 2:
+			encoded = _encodeLine( out, encoding, (const unsigned short*)line.data, line.length, &wbuf );
+			break;
+
+		case 4:
+			encoded = _encodeLine( out, encoding, (const unsigned int*)line.data, line.length, &wbuf );
+			break;
+		}
+
+		// 変換の失敗は GetLastError で取得できるように、ここでは何も呼ばずに返る
+		if(!encoded) return false;
+
+		_encodeLineEnd( out, encoding, line.lineend );
+
+		if(!out.ok) return false;
+	}
+
+	return out.Flush();
+}
+
+//-----------------------------------------------------------------------------
+
+static bool _writeAll( HANDLE handle, const char * data, size_t len )
+{
+	while( len>0 )
+	{
+		DWORD size = (DWORD)std::min( len, (size_t)0x40000000 );
+		DWORD written = 0;
+		if( !::WriteFile( handle, data, size, &written, NULL ) )
+		{
+			return false;
+		}
+		data += written;
+		len -= written;
+	}
+	return true;
+}
+
+bool TextCodec::SaveFile( const wchar_t * filename, Encoding encoding, const char * bom, size_t bom_len, const std::vector<SourceLine> & lines, unsigned long * error )
+{
+	// 保存先と同じディレクトリに一時ファイルを作る (同じボリューム内でないと置き換えがアトミックにならない)
+	std::wstring dirname = filename;
+	size_t sep = dirname.find_last_of(L"\\/");
+	if( sep==std::wstring::npos )
+	{
+		dirname = L".";
+	}
+	else
+	{
+		dirname = dirname.substr( 0, sep+1 );
+	}
+
+	wchar_t tmp_filename[MAX_PATH];
+	if( !::GetTempFileNameW( dirname.c_str(), L"ckt", 0, tmp_filename ) )
+	{
+		*error = ::GetLastError();
+		return false;
+	}
+
+	HANDLE handle = ::CreateFileW( tmp_filename, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL );
+	if( handle==INVALID_HANDLE_VALUE )
+	{
+		*error = ::GetLastError();
+		::DeleteFileW(tmp_filename);
+		return false;
+	}
+
+	bool result = _writeAll( handle, bom, bom_len );
+
+	if(result)
+	{
+		result = EncodeLines( encoding, lines, [handle]( const char * data, size_t len )
+		{
+			return _writeAll( handle, data, len );
+		});
+	}
+
+	if(result)
+	{
+		result = ::FlushFileBuffers(handle)!=FALSE;
+	}
+
+	if(!result)
+	{
+		*error = ::GetLastError();
+	}
+
+	::CloseHandle(handle);
+
+	if(result)
+	{
+		// 既存のファイルがある場合は、属性などを引き継ぐために ReplaceFile を使う
+		if( ::GetFileAttributesW(filename)!=INVALID_FILE_ATTRIBUTES )
+		{
+			result = ::ReplaceFileW( filename, tmp_filename, NULL, REPLACEFILE_IGNORE_MERGE_ERRORS, NULL, NULL )!=FALSE;
+		}
+		else
+		{
+			result = false;
+		}
+
+		if(!result)
+		{
+			result = ::MoveFileExW( tmp_filename, filename, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH )!=FALSE;
+		}
+
+		if(!result)
+		{
+			*error = ::GetLastError();
+		}
+	}
+
+	if(!result)
+	{
+		::DeleteFileW(tmp_filename);
+	}
+
+	return result;
+}
@@ -0,0 +1,86 @@
+﻿#ifndef _TEXTCODEC_H_
+#define _TEXTCODEC_H_
+
+#include <vector>
+#include <string>
+#include <functional>
+
+namespace TextCodec
+{
+	enum Encoding
+	{
+		Encoding_Unknown,
+		Encoding_Utf8,
+		Encoding_Utf16LE,
+		Encoding_Utf16BE,
+		Encoding_Cp932,
+		Encoding_EucJp,
+	};
+
+	// 改行コードの種類 (Line オブジェクトの flags と同じ値)
+	enum
+	{
+		LineEnd_CR   = 1<<0,
+		LineEnd_LF   = 1<<1,
+		LineEnd_CRLF = LineEnd_CR | LineEnd_LF,
+	};
+
+	// Python のエンコーディング名から Encoding を得る
+	// ネイティブで扱えないエンコーディングの場合は Encoding_Unknown
+	Encoding GetEncoding( const char * name );
+
+	struct DecodedLine
+	{
+		size_t offset;			// DecodedChunk::text 中の位置 (UTF-16単位)
+		size_t length;			// UTF-16単位の長さ (改行を含まない)
+		size_t num_chars;		// 文字数 (サロゲートペアは1文字)
+		unsigned int max_char;	// 含まれる文字の最大値 (PyUnicode_New に渡す値)
+		int lineend;
+	};
+
+	struct DecodedChunk
+	{
+		std::vector<unsigned short> text;
+		std::vector<DecodedLine> lines;
+	};
+
+	// バイト列を行単位にデコードする
+	//
+	// 入力を改行位置で分割し、ワーカースレッドで並列にデコードする。
+	// 改行は CR / LF / CRLF のみを扱い、最後の行は改行を持たない(空の場合もある)。
+	// 不正なバイト列は U+FFFD に置き換える。
+	// cp932 の場合は、波ダッシュ(U+301C)を全角チルダ(U+FF5E)に置き換える。
+	// Python の GIL を保持せずに呼び出すことができる。
+	void DecodeLines( Encoding encoding, const char * data, size_t len, std::vector<DecodedChunk> * chunks );
+
+	// エンコードする1行 (Python の文字列のデータを直接参照する)
+	struct SourceLine
+	{
+		const void * data;
+		size_t length;			// 文字数
+		int kind;				// 1文字のバイト数 (1,2,4)
+		int lineend;
+	};
+
+	// 書き出し関数 (false を返すと中断する)
+	typedef std::function<bool(const char*,size_t)> WriteFunc;
+
+	// 行をエンコードして、大きな単位で write_func に渡す
+	//
+	// 行ごとの改行コードも同じエンコーディングで出力する。
+	// エンコードできない文字は '?' に置き換える。
+	// cp932 の場合は、波ダッシュ(U+301C)も全角チルダ(U+FF5E)と同じく 0x8160 にエンコードする。
+	// Python の GIL を保持せずに呼び出すことができる。
+	// コードページが使えないなどで変換できなかった場合や、write_func が false を返した場合は false を返す。
+	// 変換の失敗は GetLastError でエラーコードを取得できる。
+	bool EncodeLines( Encoding encoding, const std::vector<SourceLine> & lines, const WriteFunc & write_func );
+
+	// 行をエンコードしてファイルに保存する
+	//
+	// 同じディレクトリの一時ファイルに書き出してから既存のファイルと置き換えるので、
+	// 途中で失敗しても元のファイルは壊れない。
+	// 失敗した場合は false を返し、error に Windows のエラーコードを格納する。
+	bool SaveFile( const wchar_t * filename, Encoding encoding, const char * bom, size_t bom_len, const std::vector<SourceLine> & lines, unsigned long * error );
+};
+
+#endif // _TEXTCODEC_H_
@@ -0,0 +1,700 @@
+﻿#include <algorithm>
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define TEXTSEARCH_USE_SSE2
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#include "threadutil.h"
+#include "unicodefuncs.h"
+#include "casefold.h"
+#include "textsearch.h"
+
+using namespace ckit;
+
+//-----------------------------------------------------------------------------
+
+// FindAll で並列に検索する1チャンクの文字数
+static const size_t FIND_CHUNK_CHARS = 1024 * 1024;
+
+// SearchHitIndex のギャップを広げるときに余分に確保する要素数の最小値
+static const size_t HIT_GAP_MIN = 64;
+
+//-----------------------------------------------------------------------------
+
+static TextSearch::UnicodeFuncs unicode_funcs =
+{
+	UnicodeFuncsDefault::IsNone,
+	UnicodeFuncsDefault::Identity,
+};
+
+static CaseFold case_fold( UnicodeFuncsDefault::Identity );
+
+void TextSearch::SetUnicodeFuncs( const UnicodeFuncs & funcs )
+{
+	unicode_funcs = funcs;
+	case_fold.SetToLower( funcs.to_lower );
+}
+
+static inline bool _isWord( unsigned int c )
+{
+	if( c<128 ) return ( c>='a' && c<='z' ) || ( c>='A' && c<='Z' ) || ( c>='0' && c<='9' ) || c=='_';
+	return unicode_funcs.is_word(c);
+}
+
+//-----------------------------------------------------------------------------
+
+static inline int _countTrailingZeros( unsigned int x )
+{
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward( &index, x );
+	return (int)index;
+#else
+	return __builtin_ctz(x);
+#endif
+}
+
+static inline int _findHighestBit( unsigned int x )
+{
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanReverse( &index, x );
+	return (int)index;
+#else
+	return 31 - __builtin_clz(x);
+#endif
+}
+
+// CHAR で表せる文字だけの候補
+struct _CharFilter
+{
+	bool valid;
+	int num;
+	unsigned int chars[TextSearch::Filter::MAX_CHARS];
+};
+
+template<typename CHAR>
+static void _restrictFilter( const TextSearch::Filter & filter, _CharFilter * result )
+{
+	const unsigned int max_char = (unsigned int)(CHAR)~0;
+
+	result->valid = filter.valid;
+	result->num = 0;
+
+	for( int i=0 ; i<filter.num ; ++i )
+	{
+		if( filter.chars[i]<=max_char )
+		{
+			result->chars[result->num++] = filter.chars[i];
+		}
+	}
+}
+
+#if defined(TEXTSEARCH_USE_SSE2)
+
+// 文字の大きさごとの SSE2 の命令
+// BITS は _mm_movemask_epi8 の結果のうち、各文字の最初のバイトに対応するビット
+template<typename CHAR> struct _Sse2;
+
+template<> struct _Sse2<unsigned char>
+{
+	enum { LANES = 16, SHIFT = 0, BITS = 0xffff };
+	static __m128i Set( unsigned int c ) { return _mm_set1_epi8( (char)c ); }
+	static __m128i CmpEq( __m128i a, __m128i b ) { return _mm_cmpeq_epi8( a, b ); }
+};
+
+template<> struct _Sse2<unsigned short>
+{
+	enum { LANES = 8, SHIFT = 1, BITS = 0x5555 };
+	static __m128i Set( unsigned int c ) { return _mm_set1_epi16( (short)c ); }
+	static __m128i CmpEq( __m128i a, __m128i b ) { return _mm_cmpeq_epi16( a, b ); }
+};
+
+template<> struct _Sse2<unsigned int>
+{
+	enum { LANES = 4, SHIFT = 2, BITS = 0x1111 };
+	static __m128i Set( unsigned int c ) { return _mm_set1_epi32( (int)c ); }
+	static __m128i CmpEq( __m128i a, __m128i b ) { return _mm_cmpeq_epi32( a, b ); }
+};
+
+// 候補の文字のどれかに一致するレーンを求める
+template<typename CHAR>
+struct _VecFilter
+{
+	_VecFilter( const _CharFilter & filter )
+		:
+		valid(filter.valid),
+		num(filter.num)
+	{
+		for( int i=0 ; i<num ; ++i )
+		{
+			chars[i] = _Sse2<CHAR>::Set( filter.chars[i] );
+		}
+	}
+
+	__m128i Match( __m128i v ) const
+	{
+		if( !valid ) return _mm_set1_epi8( -1 );
+
+		__m128i result = _Sse2<CHAR>::CmpEq( v, chars[0] );
+		for( int i=1 ; i<num ; ++i )
+		{
+			result = _mm_or_si128( result, _Sse2<CHAR>::CmpEq( v, chars[i] ) );
+		}
+		return result;
+	}
+
+	bool valid;
+	int num;
+	__m128i chars[TextSearch::Filter::MAX_CHARS];
+};
+
+#endif
+
+//-----------------------------------------------------------------------------
+
+TextSearch::TextSearch( const unsigned int * _pattern, size_t len, bool _ignore_case, bool _word )
+	:
+	pattern( _pattern, _pattern+len ),
+	ignore_case(_ignore_case),
+	word(_word)
+{
+	if(ignore_case)
+	{
+		for( size_t i=0 ; i<pattern.size() ; ++i )
+		{
+			pattern[i] = case_fold.Fold(pattern[i]);
+		}
+	}
+
+	first.valid = false;
+	first.num = 0;
+	last.valid = false;
+	last.num = 0;
+
+	if( !pattern.empty() )
+	{
+		_makeFilter( pattern.front(), &first );
+		_makeFilter( pattern.back(), &last );
+	}
+}
+
+void TextSearch::_makeFilter( unsigned int c, Filter * filter ) const
+{
+	filter->valid = true;
+	filter->num = 0;
+
+	if( !ignore_case )
+	{
+		filter->chars[filter->num++] = c;
+		return;
+	}
+
+	unsigned int chars[CaseFold::MAX_CHARS];
+	int num = case_fold.GetChars( c, chars );
+
+	if( num>Filter::MAX_CHARS )
+	{
+		filter->valid = false;
+		return;
+	}
+
+	for( int i=0 ; i<num ; ++i )
+	{
+		filter->chars[filter->num++] = chars[i];
+	}
+}
+
+// text[pos,...) がパターンに一致するか
+// 単語の区切りは text[0,end) をテキスト全体として判定する
+template<typename CHAR>
+bool TextSearch::_matchAt( const CHAR * text, size_t end, size_t pos ) const
+{
+	size_t len = pattern.size();
+
+	if(ignore_case)
+	{
+		for( size_t i=0 ; i<len ; ++i )
+		{
+			if( case_fold.Fold(text[pos+i])!=pattern[i] ) return false;
+		}
+	}
+	else
+	{
+		for( size_t i=0 ; i<len ; ++i )
+		{
+			if( text[pos+i]!=pattern[i] ) return false;
+		}
+	}
+
+	if( word && len>0 )
+	{
+		// パターンの前後が \b に一致するか
+		bool before = pos>0 && _isWord(text[pos-1]);
+		if( before==_isWord(text[pos]) ) return false;
+
+		bool after = pos+len<end && _isWord(text[pos+len]);
+		if( after==_isWord(text[pos+len-1]) ) return false;
+	}
+
+	return true;
+}
+
+template<typename CHAR>
+bool TextSearch::Search( const CHAR * text, size_t len, size_t pos, size_t end, size_t * match_start ) const
+{
+	end = std::min( end, len );
+	if( pos>end ) return false;
+
+	size_t m = pattern.size();
+	if( m==0 )
+	{
+		*match_start = pos;
+		return true;
+	}
+
+	if( end-pos<m ) return false;
+
+	_CharFilter first_chars, last_chars;
+	_restrictFilter<CHAR>( first, &first_chars );
+	_restrictFilter<CHAR>( last, &last_chars );
+
+	// このテキストに現れない文字を含むパターン
+	if( ( first_chars.valid && first_chars.num==0 ) || ( last_chars.valid && last_chars.num==0 ) ) return false;
+
+	const size_t last_start = end-m;
+	size_t i = pos;
+
+#if defined(TEXTSEARCH_USE_SSE2)
+	if( first_chars.valid || last_chars.valid )
+	{
+		typedef _Sse2<CHAR> Sse2;
+		const _VecFilter<CHAR> first_vec(first_chars);
+		const _VecFilter<CHAR> last_vec(last_chars);
+
+		// 先頭の文字と末尾の文字が両方候補に一致する位置だけを比較する
+		for( ; i+Sse2::LANES-1<=last_start ; i+=Sse2::LANES )
+		{
+			__m128i a = _mm_loadu_si128( (const __m128i*)(text+i) );
+			__m128i b = _mm_loadu_si128( (const __m128i*)(text+i+m-1) );
+			unsigned int mask = _mm_movemask_epi8( _mm_and_si128( first_vec.Match(a), last_vec.Match(b) ) ) & Sse2::BITS;
+
+			while(mask)
+			{
+				size_t p = i + ( _countTrailingZeros(mask) >> Sse2::SHIFT );
+				mask &= mask-1;
+
+				if( _matchAt( text, end, p ) )
+				{
+					*match_start = p;
+					return true;
+				}
+			}
+		}
+	}
+#endif
+
+	for( ; i<=last_start ; ++i )
+	{
+		if( _matchAt( text, end, i ) )
+		{
+			*match_start = i;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+template<typename CHAR>
+bool TextSearch::ReverseSearch( const CHAR * text, size_t len, size_t end, size_t * match_start ) const
+{
+	end = std::min( end, len );
+
+	size_t m = pattern.size();
+	if( m==0 )
+	{
+		*match_start = end;
+		return true;
+	}
+
+	if( end<m ) return false;
+
+	_CharFilter first_chars, last_chars;
+	_restrictFilter<CHAR>( first, &first_chars );
+	_restrictFilter<CHAR>( last, &last_chars );
+
+	if( ( first_chars.valid && first_chars.num==0 ) || ( last_chars.valid && last_chars.num==0 ) ) return false;
+
+	// 候補の開始位置は [0,top)
+	size_t top = end-m+1;
+
+#if defined(TEXTSEARCH_USE_SSE2)
+	if( first_chars.valid || last_chars.valid )
+	{
+		typedef _Sse2<CHAR> Sse2;
+		const _VecFilter<CHAR> first_vec(first_chars);
+		const _VecFilter<CHAR> last_vec(last_chars);
+
+		while( top>=Sse2::LANES )
+		{
+			size_t i = top-Sse2::LANES;
+
+			__m128i a = _mm_loadu_si128( (const __m128i*)(text+i) );
+			__m128i b = _mm_loadu_si128( (const __m128i*)(text+i+m-1) );
+			unsigned int mask = _mm_movemask_epi8( _mm_and_si128( first_vec.Match(a), last_vec.Match(b) ) ) & Sse2::BITS;
+
+			// 後ろの候補から順に比較する
+			while(mask)
+			{
+				int bit = _findHighestBit(mask);
+				size_t p = i + ( bit >> Sse2::SHIFT );
+				mask &= ~( 1u << bit );
+
+				if( _matchAt( text, end, p ) )
+				{
+					*match_start = p;
+					return true;
+				}
+			}
+
+			top = i;
+		}
+	}
+#endif
+
+	while( top>0 )
+	{
+		--top;
+		if( _matchAt( text, end, top ) )
+		{
+			*match_start = top;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+template bool TextSearch::Search<unsigned char>( const unsigned char * text, size_t len, size_t pos, size_t end, size_t * match_start ) const;
+template bool TextSearch::Search<unsigned short>( const unsigned short * text, size_t len, size_t pos, size_t end, size_t * match_start ) const;
+template bool TextSearch::Search<unsigned int>( const unsigned int * text, size_t len, size_t pos, size_t end, size_t * match_start ) const;
+template bool TextSearch::ReverseSearch<unsigned char>( const unsigned char * text, size_t len, size_t end, size_t * match_start ) const;
+template bool TextSearch::ReverseSearch<unsigned short>( const unsigned short * text, size_t len, size_t end, size_t * match_start ) const;
+template bool TextSearch::ReverseSearch<unsigned int>( const unsigned int * text, size_t len, size_t end, size_t * match_start ) const;
+
+//-----------------------------------------------------------------------------
+
+void SearchHitIndex::FindAll( const TextSearch::LineText * lines, size_t num_lines, size_t first_line, const FindFunc & find, std::vector<SearchHit> * hits )
+{
+	// 文字数がおよそ FIND_CHUNK_CHARS ずつになるように、行をチャンクに分ける
+	std::vector<size_t> chunk_starts;
+	chunk_starts.push_back(0);
+
+	size_t num_chars = 0;
+	for( size_t i=0 ; i<num_lines ; ++i )
+	{
+		num_chars += lines[i].len + 1;
+		if( num_chars>=FIND_CHUNK_CHARS && i+1<num_lines )
+		{
+			chunk_starts.push_back(i+1);
+			num_chars = 0;
+		}
+	}
+
+	int num_chunks = (int)chunk_starts.size();
+	chunk_starts.push_back(num_lines);
+
+	std::vector< std::vector<SearchHit> > chunk_hits(num_chunks);
+
+	auto find_chunk = [&]( int index )
+	{
+		for( size_t i=chunk_starts[index] ; i<chunk_starts[index+1] ; ++i )
+		{
+			// 空文字列に一致した位置で、その行の検索を終える (TextWidget の描画と同じ規則)
+			size_t pos = 0;
+			size_t match_start;
+			size_t match_end;
+
+			while( find( lines[i], pos, &match_start, &match_end ) && match_end!=pos )
+			{
+				SearchHit hit;
+				hit.line = first_line+i;
+				hit.start = (unsigned int)match_start;
+				hit.end = (unsigned int)match_end;
+				chunk_hits[index].push_back(hit);
+
+				pos = match_end;
+			}
+		}
+	};
+
+	if( num_chunks==1 )
+	{
+		find_chunk(0);
+	}
+	else
+	{
+		ThreadUtil::ParallelFor( num_chunks, find_chunk );
+	}
+
+	for( int i=0 ; i<num_chunks ; ++i )
+	{
+		hits->insert( hits->end(), chunk_hits[i].begin(), chunk_hits[i].end() );
+	}
+}
+
+SearchHitIndex::SearchHitIndex()
+	:
+	gap_begin(0),
+	gap_end(0),
+	after_delta(0)
+{
+}
+
+void SearchHitIndex::Clear()
+{
+	buf.clear();
+	gap_begin = 0;
+	gap_end = 0;
+	after_delta = 0;
+}
+
+SearchHit SearchHitIndex::Get( size_t index ) const
+{
+	if( index<gap_begin ) return buf[index];
+
+	SearchHit hit = buf[ index - gap_begin + gap_end ];
+	hit.line += after_delta;
+	return hit;
+}
+
+size_t SearchHitIndex::LowerBound( size_t line, size_t start ) const
+{
+	size_t lo = 0;
+	size_t hi = Size();
+
+	while( lo<hi )
+	{
+		size_t mid = lo + (hi-lo)/2;
+		SearchHit hit = Get(mid);
+
+		if( hit.line<line || ( hit.line==line && hit.start<start ) )
+		{
+			lo = mid+1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+
+	return lo;
+}
+
+bool SearchHitIndex::FindNext( size_t line, size_t index, size_t * number ) const
+{
+	size_t found = LowerBound( line, index );
+	if( found>=Size() ) return false;
+
+	*number = found;
+	return true;
+}
+
+bool SearchHitIndex::FindPrev( size_t line, size_t index, size_t * number ) const
+{
+	size_t lo = LowerBound( line, 0 );
+	size_t hi = LowerBound( line+1, 0 );
+
+	// 同じ行のヒットは重ならないので、終了位置も昇順に並んでいる
+	size_t a = lo;
+	size_t b = hi;
+	while( a<b )
+	{
+		size_t mid = a + (b-a)/2;
+		if( Get(mid).end<=index )
+		{
+			a = mid+1;
+		}
+		else
+		{
+			b = mid;
+		}
+	}
+
+	if( a>lo )
+	{
+		*number = a-1;
+		return true;
+	}
+
+	if( lo>0 )
+	{
+		*number = lo-1;
+		return true;
+	}
+
+	return false;
+}
+
+// ギャップを論理的な位置 pos に移動する
+void SearchHitIndex::_moveGap( size_t pos )
+{
+	while( pos<gap_begin )
+	{
+		--gap_begin;
+		--gap_end;
+		buf[gap_end] = buf[gap_begin];
+		buf[gap_end].line -= after_delta;
+	}
+
+	while( pos>gap_begin )
+	{
+		buf[gap_begin] = buf[gap_end];
+		buf[gap_begin].line += after_delta;
+		++gap_begin;
+		++gap_end;
+	}
+}
+
+void SearchHitIndex::ReplaceLines( size_t line, size_t old_count, size_t new_count, const std::vector<SearchHit> & hits )
+{
+	size_t begin = LowerBound( line, 0 );
+	size_t end = LowerBound( line+old_count, 0 );
+
+	// 置き換える範囲をギャップの直前に移動して、ギャップに含める
+	_moveGap(end);
+	gap_begin = begin;
+
+	// 後ろの行の行番号をずらす
+	after_delta += new_count - old_count;
+
+	// ギャップが足りない場合は広げる
+	if( gap_end-gap_begin < hits.size() )
+	{
+		size_t num_after = buf.size() - gap_end;
+		size_t gap_size = hits.size() + std::max( ( Size() + hits.size() ) / 8, HIT_GAP_MIN );
+
+		std::vector<SearchHit> new_buf( gap_begin + gap_size + num_after );
+		std::copy( buf.begin(), buf.begin()+gap_begin, new_buf.begin() );
+		std::copy( buf.begin()+gap_end, buf.end(), new_buf.begin()+gap_begin+gap_size );
+
+		buf.swap(new_buf);
+		gap_end = gap_begin + gap_size;
+	}
+
+	std::copy( hits.begin(), hits.end(), buf.begin()+gap_begin );
+	gap_begin += hits.size();
+}
+
+size_t SearchHitIndex::GetMemorySize() const
+{
+	return buf.capacity() * sizeof(SearchHit);
+}
+
+//-----------------------------------------------------------------------------
+
+MultiLineText::MultiLineText()
+	:
+	char_size(1),
+	len(0)
+{
+}
+
+template<typename CHAR>
+void MultiLineText::_assign( const Line * lines, size_t num_lines )
+{
+	buf.resize( len * sizeof(CHAR) );
+	CHAR * dst = (CHAR*)buf.data();
+
+	for( size_t i=0 ; i<num_lines ; ++i )
+	{
+		const TextSearch::LineText & text = lines[i].text;
+
+		switch(text.char_size)
+		{
+		case 1:
+			std::copy( (const unsigned char*)text.data, (const unsigned char*)text.data + text.len, dst + offsets[i] );
+			break;
+		case 2:
+			std::copy( (const unsigned short*)text.data, (const unsigned short*)text.data + text.len, dst + offsets[i] );
+			break;
+		case 4:
+			std::copy( (const unsigned int*)text.data, (const unsigned int*)text.data + text.len, dst + offsets[i] );
+			break;
+		}
+
+		if( lines[i].lineend )
+		{
+			dst[ offsets[i] + text.len ] = '\n';
+		}
+	}
+}
+
+void MultiLineText::Assign( const Line * lines, size_t num_lines )
+{
+	offsets.resize(num_lines);
+	lengths.resize(num_lines);
+
+	char_size = 1;
+	len = 0;
+	for( size_t i=0 ; i<num_lines ; ++i )
+	{
+		offsets[i] = len;
+		lengths[i] = lines[i].text.len;
+		len += lines[i].text.len + ( lines[i].lineend ? 1 : 0 );
+		char_size = std::max( char_size, lines[i].text.char_size );
+	}
+
+	switch(char_size)
+	{
+	case 1:
+		_assign<unsigned char>( lines, num_lines );
+		break;
+	case 2:
+		_assign<unsigned short>( lines, num_lines );
+		break;
+	case 4:
+		_assign<unsigned int>( lines, num_lines );
+		break;
+	}
+}
+
+TextSearch::LineText MultiLineText::GetText() const
+{
+	TextSearch::LineText text;
+	text.data = buf.data();
+	text.char_size = char_size;
+	text.len = len;
+	return text;
+}
+
+size_t MultiLineText::GetOffset( size_t line, size_t index ) const
+{
+	if( line>=offsets.size() ) return len;
+	return offsets[line] + std::min( index, lengths[line] );
+}
+
+void MultiLineText::GetPosition( size_t offset, size_t * line, size_t * index ) const
+{
+	// offset 以下で始まる最後の行
+	std::vector<size_t>::const_iterator it = std::upper_bound( offsets.begin(), offsets.end(), offset );
+	size_t i = ( it==offsets.begin() ) ? 0 : (size_t)( it - offsets.begin() ) - 1;
+
+	if( offset - offsets[i] > lengths[i] )
+	{
+		// 最後の行の改行の後ろ
+		*line = i+1;
+		*index = 0;
+	}
+	else
+	{
+		*line = i;
+		*index = offset - offsets[i];
+	}
+}
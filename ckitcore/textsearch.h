@@ -0,0 +1,181 @@
+﻿#ifndef _TEXTSEARCH_H_
+#define _TEXTSEARCH_H_
+
+#include <stddef.h>
+#include <vector>
+#include <functional>
+
+namespace ckit
+{
+	// 検索で一致した範囲
+	struct SearchHit
+	{
+		size_t line;
+		unsigned int start;
+		unsigned int end;
+	};
+
+	// 文字列の検索
+	//
+	// 正規表現を使わない検索 (固定文字列の検索) を行う。
+	// 先頭と末尾の文字の候補を SIMD でまとめて比較し、両方が一致した位置だけを詳しく比較する。
+	// 大文字小文字を区別しない場合も、テキストを変換した文字列を作らずに1文字ずつ変換して比較する。
+	//
+	// 大文字小文字を区別しない検索は re の IGNORECASE と同じ規則 (CaseFold) で文字を同一視する。
+	// 単語単位の検索は、パターンの前後を re の \b で囲んだ場合と同じ判定を行う。
+	// Python の GIL を保持せずに呼び出すことができる。
+	class TextSearch
+	{
+	public:
+		// ASCII 以外の文字の分類と小文字への変換
+		// 設定しない場合は ASCII の範囲だけで判定する
+		struct UnicodeFuncs
+		{
+			bool (*is_word)( unsigned int c );
+			unsigned int (*to_lower)( unsigned int c );
+		};
+
+		static void SetUnicodeFuncs( const UnicodeFuncs & funcs );
+
+		// 検索する1行分の文字列
+		struct LineText
+		{
+			const void * data;
+			int char_size;		// 1, 2, 4
+			size_t len;
+		};
+
+		TextSearch( const unsigned int * pattern, size_t len, bool ignore_case, bool word );
+
+		size_t GetLength() const { return pattern.size(); }
+
+		// text[pos,end) の中で、最も左で始まるマッチを探す
+		// 単語の区切りの判定には pos より前の文字も参照し、end をテキストの終端として扱う (re の search(string,pos,endpos) と同じ)
+		template<typename CHAR>
+		bool Search( const CHAR * text, size_t len, size_t pos, size_t end, size_t * match_start ) const;
+
+		// text[0,end) の中で、最も右で始まるマッチを探す
+		template<typename CHAR>
+		bool ReverseSearch( const CHAR * text, size_t len, size_t end, size_t * match_start ) const;
+
+	public:
+		// 以下は実装で使用する型
+
+		// 絞り込みに使う位置の文字の候補
+		struct Filter
+		{
+			enum
+			{
+				MAX_CHARS = 4,
+			};
+
+			bool valid;							// false の場合は候補が多すぎて絞り込みに使えない
+			int num;
+			unsigned int chars[MAX_CHARS];
+		};
+
+	private:
+		template<typename CHAR>
+		bool _matchAt( const CHAR * text, size_t end, size_t pos ) const;
+
+		void _makeFilter( unsigned int c, Filter * filter ) const;
+
+		std::vector<unsigned int> pattern;		// 大文字小文字を区別しない場合は大文字に変換したもの
+		bool ignore_case;
+		bool word;
+
+		Filter first;							// パターンの先頭の文字の候補
+		Filter last;							// パターンの末尾の文字の候補
+	};
+
+	// 検索で一致した範囲の一覧
+	//
+	// 行番号と開始位置の順に並べて保持し、任意の位置の前後のヒットを O(log n) で求める。
+	// 編集された行の範囲を ReplaceLines で置き換えると、それより後ろのヒットの行番号がずれる。
+	// 配列の途中にギャップを持ち、ギャップより後ろの要素は行番号の差分 after_delta を共有するので、
+	// 同じ付近を続けて編集する場合は、置き換える範囲とギャップの移動距離に比例する時間で更新できる。
+	class SearchHitIndex
+	{
+	public:
+		// text の pos 以降で最初に始まるマッチを探す関数
+		// 複数のスレッドから同時に呼ばれる
+		typedef std::function<bool( const TextSearch::LineText & text, size_t pos, size_t * match_start, size_t * match_end )> FindFunc;
+
+		// lines の全ての行から、重ならないマッチを全て探して hits に追加する
+		// 行番号は first_line からの通し番号になる
+		// 行をいくつかのチャンクに分けて並列に検索する
+		static void FindAll( const TextSearch::LineText * lines, size_t num_lines, size_t first_line, const FindFunc & find, std::vector<SearchHit> * hits );
+
+		SearchHitIndex();
+
+		void Clear();
+
+		size_t Size() const { return gap_begin + ( buf.size() - gap_end ); }
+		SearchHit Get( size_t index ) const;
+
+		// ( line, start ) 以降で最初のヒットの番号 (無い場合は Size())
+		size_t LowerBound( size_t line, size_t start ) const;
+
+		// ( line, index ) 以降で始まる最初のヒットを探す
+		bool FindNext( size_t line, size_t index, size_t * number ) const;
+
+		// line の index までで終わる最後のヒット、無ければ line より前の行の最後のヒットを探す
+		bool FindPrev( size_t line, size_t index, size_t * number ) const;
+
+		// 行 [line,line+old_count) を new_count 行に置き換え、その範囲のヒットを hits にする
+		// hits は行番号と開始位置の順に並んでいる必要がある
+		void ReplaceLines( size_t line, size_t old_count, size_t new_count, const std::vector<SearchHit> & hits );
+
+		size_t GetMemorySize() const;
+
+	private:
+		void _moveGap( size_t pos );
+
+		std::vector<SearchHit> buf;
+		size_t gap_begin;
+		size_t gap_end;
+		size_t after_delta;		// ギャップより後ろの要素の行番号に加える値 (2^N を法とする)
+	};
+
+	// 複数の行を改行でつないだテキスト
+	//
+	// 行をまたぐ検索のために、ドキュメントの一部の行を1つの文字列に連結する。
+	// 行末の改行コードの種類 (CR, LF, CR+LF) に関わらず、改行のある行の後ろには '\n' を1文字置く。
+	// 文字のサイズは、連結する行の中で最も大きいものにそろえる。
+	class MultiLineText
+	{
+	public:
+		// 連結する1行分の文字列
+		struct Line
+		{
+			TextSearch::LineText text;
+			bool lineend;				// 後ろに改行があるか
+		};
+
+		MultiLineText();
+
+		void Assign( const Line * lines, size_t num_lines );
+
+		TextSearch::LineText GetText() const;
+		size_t GetNumLines() const { return offsets.size(); }
+
+		// line 行目の index 文字目の、連結したテキストの中での位置
+		size_t GetOffset( size_t line, size_t index ) const;
+
+		// 連結したテキストの中の位置を、行番号と行の中の位置に変換する
+		// 改行の後ろの位置は、次の行の先頭になる (最後の行の改行の後ろは GetNumLines() 行目の先頭)
+		void GetPosition( size_t offset, size_t * line, size_t * index ) const;
+
+	private:
+		template<typename CHAR>
+		void _assign( const Line * lines, size_t num_lines );
+
+		std::vector<unsigned char> buf;
+		int char_size;
+		size_t len;
+		std::vector<size_t> offsets;	// 各行の先頭の位置
+		std::vector<size_t> lengths;	// 各行の長さ (改行を含まない)
+	};
+};
+
+#endif // _TEXTSEARCH_H_
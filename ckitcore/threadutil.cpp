@@ -0,0 +1,257 @@
+﻿#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <vector>
+
+#include "threadutil.h"
+
+// ParallelFor の手伝いのタスクの優先度
+// 呼び出し元が終わるのを待っているので、ほかのタスクより先に実行する
+static const int PARALLEL_FOR_PRIORITY = 0x10000;
+
+// 現在のスレッドがワーカーの場合の、ThreadPool とワーカーの番号
+static thread_local ThreadUtil::ThreadPool * tls_pool = NULL;
+static thread_local int tls_worker_index = -1;
+
+int ThreadUtil::GetNumWorkers()
+{
+	static int num_workers = 0;
+
+	if(num_workers==0)
+	{
+		int n = (int)std::thread::hardware_concurrency();
+		num_workers = n>0 ? n : 1;
+	}
+
+	return num_workers;
+}
+
+void ThreadUtil::ParallelFor( int num, const std::function<void(int)> & func )
+{
+	if(num<=0) return;
+
+	int num_helpers = std::min( num, GetNumWorkers() ) - 1;
+
+	if(num_helpers<=0)
+	{
+		for( int i=0 ; i<num ; ++i )
+		{
+			func(i);
+		}
+		return;
+	}
+
+	// 手伝いのタスクが ParallelFor から戻った後に開始しても良いように、状態は共有する
+	struct State
+	{
+		std::atomic<int> next;
+		int num;
+		const std::function<void(int)> * func;
+
+		std::mutex mutex;
+		std::condition_variable cv;
+		int running;		// 実行中の手伝いのタスクの数
+		bool closed;		// これ以降に開始した手伝いのタスクは何もしない
+
+		void Run()
+		{
+			for(;;)
+			{
+				int i = next++;
+				if(i>=num) break;
+				(*func)(i);
+			}
+		}
+	};
+
+	std::shared_ptr<State> state = std::make_shared<State>();
+	state->next = 0;
+	state->num = num;
+	state->func = &func;
+	state->running = 0;
+	state->closed = false;
+
+	ThreadPool & pool = GetThreadPool();
+	for( int i=0 ; i<num_helpers ; ++i )
+	{
+		pool.Submit( [state]()
+		{
+			{
+				std::lock_guard<std::mutex> lock(state->mutex);
+				if(state->closed) return;
+				state->running++;
+			}
+
+			state->Run();
+
+			{
+				std::lock_guard<std::mutex> lock(state->mutex);
+				state->running--;
+				if(state->running==0) state->cv.notify_all();
+			}
+		}, PARALLEL_FOR_PRIORITY );
+	}
+
+	state->Run();
+
+	// 開始済みの手伝いのタスクが終わるのを待つ
+	std::unique_lock<std::mutex> lock(state->mutex);
+	state->closed = true;
+	state->cv.wait( lock, [&]{ return state->running==0; } );
+}
+
+ThreadUtil::ThreadPool & ThreadUtil::GetThreadPool()
+{
+	// ワーカーは終了しないので、プールはプロセスの終了時にも破棄しない
+	static ThreadPool * pool = new ThreadPool( GetNumWorkers() );
+	return *pool;
+}
+
+ThreadUtil::ThreadPool::ThreadPool( int _num_workers )
+	:
+	num_pending(0),
+	num_idle(0),
+	seq(0),
+	num_workers(0)
+{
+	_num_workers = std::max( 1, std::min( _num_workers, (int)MAX_WORKERS ) );
+	max_workers = std::min( _num_workers + MAX_EXTRA_WORKERS, (int)MAX_WORKERS );
+
+	std::lock_guard<std::mutex> lock(mutex);
+
+	for( int i=0 ; i<_num_workers ; ++i )
+	{
+		_addWorker();
+	}
+}
+
+bool ThreadUtil::ThreadPool::_TaskLess( const Task & a, const Task & b )
+{
+	if( a.priority != b.priority ) return a.priority < b.priority;
+	return (int)(a.seq - b.seq) > 0;
+}
+
+// mutex を保持して呼ぶ
+void ThreadUtil::ThreadPool::_addWorker()
+{
+	int index = num_workers;
+
+	workers[index].reset( new Worker() );
+	num_workers = index + 1;
+
+	std::thread( [this,index](){ _workerMain(index); } ).detach();
+}
+
+void ThreadUtil::ThreadPool::Submit( const std::function<void()> & func, int priority, const CancelToken & token, bool blocking )
+{
+	Task task;
+	task.func = func;
+	task.token = token;
+	task.priority = priority;
+	task.seq = 0;
+
+	// ワーカーの中から投入されたタスクは、そのワーカーのキューに積む
+	if( tls_pool==this && !blocking )
+	{
+		Worker & worker = *workers[tls_worker_index];
+		{
+			std::lock_guard<std::mutex> lock(worker.mutex);
+			worker.tasks.push_back( std::move(task) );
+		}
+
+		num_pending++;
+
+		std::lock_guard<std::mutex> lock(mutex);
+		if(num_idle>0) cv.notify_one();
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+
+	task.seq = seq++;
+	shared_tasks.push_back( std::move(task) );
+	std::push_heap( shared_tasks.begin(), shared_tasks.end(), _TaskLess );
+
+	num_pending++;
+
+	if(num_idle>0)
+	{
+		cv.notify_one();
+	}
+	else if( blocking && num_workers<max_workers )
+	{
+		// 全てのワーカーが実行中なので、待たされないようにワーカーを追加する
+		_addWorker();
+	}
+}
+
+bool ThreadUtil::ThreadPool::_popLocal( int index, Task * task )
+{
+	Worker & worker = *workers[index];
+	std::lock_guard<std::mutex> lock(worker.mutex);
+
+	if( worker.tasks.empty() ) return false;
+
+	*task = std::move( worker.tasks.back() );
+	worker.tasks.pop_back();
+	return true;
+}
+
+bool ThreadUtil::ThreadPool::_popShared( Task * task )
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	if( shared_tasks.empty() ) return false;
+
+	std::pop_heap( shared_tasks.begin(), shared_tasks.end(), _TaskLess );
+	*task = std::move( shared_tasks.back() );
+	shared_tasks.pop_back();
+	return true;
+}
+
+bool ThreadUtil::ThreadPool::_steal( int index, Task * task )
+{
+	int n = num_workers;
+
+	for( int i=1 ; i<n ; ++i )
+	{
+		Worker & worker = *workers[ (index+i) % n ];
+		std::lock_guard<std::mutex> lock(worker.mutex);
+
+		if( worker.tasks.empty() ) continue;
+
+		*task = std::move( worker.tasks.front() );
+		worker.tasks.pop_front();
+		return true;
+	}
+
+	return false;
+}
+
+void ThreadUtil::ThreadPool::_workerMain( int index )
+{
+	tls_pool = this;
+	tls_worker_index = index;
+
+	for(;;)
+	{
+		{
+			Task task;
+			if( _popLocal(index,&task) || _popShared(&task) || _steal(index,&task) )
+			{
+				num_pending--;
+
+				if( ! task.token.IsCanceled() )
+				{
+					task.func();
+				}
+				continue;
+			}
+		}
+
+		std::unique_lock<std::mutex> lock(mutex);
+		num_idle++;
+		cv.wait( lock, [this](){ return num_pending>0; } );
+		num_idle--;
+	}
+}
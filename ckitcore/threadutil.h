@@ -0,0 +1,99 @@
+﻿#ifndef _THREADUTIL_H_
+#define _THREADUTIL_H_
+
+#include <functional>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include <thread>
+
+namespace ThreadUtil
+{
+	// 並列処理に使うワーカーの数 (論理コア数)
+	int GetNumWorkers();
+
+	// 0 ～ num-1 の index で func を並列に呼び出し、すべて終わるまで待つ
+	// 呼び出し元のスレッドも処理に参加し、残りは ThreadPool のワーカーが分担する
+	void ParallelFor( int num, const std::function<void(int)> & func );
+
+	// タスクのキャンセル要求
+	//
+	// コピーしたトークンは同じ状態を共有する。
+	// 実行前にキャンセルされたタスクは実行されない。実行中のタスクは自分で IsCanceled を調べる。
+	class CancelToken
+	{
+	public:
+		CancelToken() : canceled( std::make_shared< std::atomic<bool> >(false) ) {}
+
+		void Cancel() { *canceled = true; }
+		bool IsCanceled() const { return *canceled; }
+
+	private:
+		std::shared_ptr< std::atomic<bool> > canceled;
+	};
+
+	// ワークスティーリングのスレッドプール
+	//
+	// 各ワーカーは自分のタスクの両端キューを持ち、ワーカーの中から投入されたタスクはそこに積まれる。
+	// ワーカーは、自分のキューの末尾 → 共有のキュー (優先度の高い順) → ほかのワーカーのキューの先頭 の順にタスクを取り出す。
+	// ワーカーの外から投入されたタスクは、共有のキューに優先度順に入る。
+	//
+	// blocking に true を指定したタスク (I/O や GIL を待つ可能性があるもの) を投入したときに
+	// 空いているワーカーがいない場合は、ワーカーを追加して、ほかのタスクが実行されなくなるのを防ぐ。
+	class ThreadPool
+	{
+	public:
+		ThreadPool( int num_workers );
+
+		void Submit( const std::function<void()> & func, int priority=0, const CancelToken & token=CancelToken(), bool blocking=false );
+
+	private:
+		enum
+		{
+			MAX_WORKERS = 256,
+			MAX_EXTRA_WORKERS = 64,		// blocking なタスクのために追加するワーカーの最大数
+		};
+
+		struct Task
+		{
+			std::function<void()> func;
+			CancelToken token;
+			int priority;
+			unsigned int seq;		// 同じ優先度のタスクは投入された順に実行する
+		};
+
+		struct Worker
+		{
+			std::mutex mutex;
+			std::deque<Task> tasks;
+		};
+
+		static bool _TaskLess( const Task & a, const Task & b );
+
+		void _addWorker();
+		void _workerMain( int index );
+		bool _popLocal( int index, Task * task );
+		bool _popShared( Task * task );
+		bool _steal( int index, Task * task );
+
+		std::mutex mutex;						// shared_tasks, workers の追加, 待機の保護
+		std::condition_variable cv;
+		std::vector<Task> shared_tasks;			// 共有のキュー (優先度のヒープ)
+		std::atomic<int> num_pending;			// 実行待ちのタスクの数
+		int num_idle;							// 待機中のワーカーの数
+		unsigned int seq;
+
+		// ワーカーは削除しないので、ほかのワーカーから参照しても良い
+		std::unique_ptr<Worker> workers[MAX_WORKERS];
+		std::atomic<int> num_workers;
+		int max_workers;
+	};
+
+	// プロセス全体で共有するスレッドプール (最初に呼ばれたときに作る)
+	ThreadPool & GetThreadPool();
+};
+
+#endif // _THREADUTIL_H_
@@ -0,0 +1,723 @@
+﻿#include <string.h>
+#include <algorithm>
+
+#if defined(_MSC_VER)
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "undojournal.h"
+
+using namespace ckit;
+
+#if defined(_MSC_VER)
+#define UNDOJOURNAL_FSEEK _fseeki64
+#define UNDOJOURNAL_FTRUNCATE(file,size) _chsize_s( _fileno(file), (long long)(size) )
+#else
+#define UNDOJOURNAL_FSEEK fseeko
+#define UNDOJOURNAL_FTRUNCATE(file,size) ftruncate( fileno(file), (off_t)(size) )
+#endif
+
+//-----------------------------------------------------------------------------
+
+// このバイト数以上の文字列は圧縮する
+static const size_t COMPRESS_MIN_BYTES = 16 * 1024;
+
+// 1つにまとめる入力の最大の文字数
+static const size_t COALESCE_MAX_CHARS = 1024;
+
+// アリーナの未使用部分を詰める最小のサイズ
+static const size_t ARENA_COMPACT_MIN = 64 * 1024;
+
+// ファイルの未使用部分を詰める最小のサイズ
+static const unsigned long long SPILL_COMPACT_MIN = 1024 * 1024;
+
+// ファイルの中の文字列を移動するときのバッファのサイズ
+static const size_t SPILL_COPY_BYTES = 64 * 1024;
+
+//-----------------------------------------------------------------------------
+
+static inline unsigned int _getChar( const unsigned char * data, int char_size, size_t i )
+{
+	switch(char_size)
+	{
+	case 1:
+		return data[i];
+	case 2:
+		return ((const unsigned short*)data)[i];
+	default:
+		return ((const unsigned int*)data)[i];
+	}
+}
+
+// src の文字を dst_size バイトの文字に広げて dst に追加する
+static void _appendChars( std::vector<unsigned char> * dst, const void * src, int src_size, size_t len, int dst_size )
+{
+	size_t pos = dst->size();
+	dst->resize( pos + len * dst_size );
+
+	if( src_size==dst_size )
+	{
+		if(len) memcpy( &(*dst)[pos], src, len * dst_size );
+		return;
+	}
+
+	for( size_t i=0 ; i<len ; ++i )
+	{
+		unsigned int c = _getChar( (const unsigned char*)src, src_size, i );
+		switch(dst_size)
+		{
+		case 2:
+			((unsigned short*)&(*dst)[pos])[i] = (unsigned short)c;
+			break;
+		case 4:
+			((unsigned int*)&(*dst)[pos])[i] = c;
+			break;
+		}
+	}
+}
+
+static inline bool _isSpace( unsigned int c )
+{
+	return c==' ' || c=='\t' || c==0x3000;
+}
+
+//-----------------------------------------------------------------------------
+
+// LZ 方式の圧縮
+//
+// [リテラルの長さ] [リテラル] [一致の長さ-4] [一致の距離] の繰り返しで、最後はリテラルだけになる。
+// 数値は 7bit ずつの可変長で格納する。
+
+static void _putVarint( std::vector<unsigned char> * dst, size_t value )
+{
+	while( value>=0x80 )
+	{
+		dst->push_back( (unsigned char)( value | 0x80 ) );
+		value >>= 7;
+	}
+	dst->push_back( (unsigned char)value );
+}
+
+static size_t _getVarint( const unsigned char * src, size_t * pos )
+{
+	size_t value = 0;
+	int shift = 0;
+	while(true)
+	{
+		unsigned char b = src[(*pos)++];
+		value |= (size_t)( b & 0x7f ) << shift;
+		if( (b & 0x80)==0 ) break;
+		shift += 7;
+	}
+	return value;
+}
+
+static void _lzCompress( const unsigned char * src, size_t size, std::vector<unsigned char> * dst )
+{
+	const int HASH_BITS = 14;
+	const size_t NONE = (size_t)-1;
+
+	std::vector<size_t> table( (size_t)1<<HASH_BITS, NONE );
+
+	size_t literal_begin = 0;
+	size_t i = 0;
+
+	while( i+4<=size )
+	{
+		unsigned int v;
+		memcpy( &v, src+i, 4 );
+		unsigned int hash = ( v * 2654435761u ) >> ( 32 - HASH_BITS );
+
+		size_t candidate = table[hash];
+		table[hash] = i;
+
+		if( candidate!=NONE && memcmp( src+candidate, src+i, 4 )==0 )
+		{
+			size_t len = 4;
+			while( i+len<size && src[candidate+len]==src[i+len] ) ++len;
+
+			_putVarint( dst, i-literal_begin );
+			dst->insert( dst->end(), src+literal_begin, src+i );
+			_putVarint( dst, len-4 );
+			_putVarint( dst, i-candidate );
+
+			i += len;
+			literal_begin = i;
+		}
+		else
+		{
+			++i;
+		}
+	}
+
+	_putVarint( dst, size-literal_begin );
+	dst->insert( dst->end(), src+literal_begin, src+size );
+}
+
+static void _lzDecompress( const unsigned char * src, size_t size, std::vector<unsigned char> * dst, size_t dst_size )
+{
+	size_t begin = dst->size();
+	dst->reserve( begin + dst_size );
+
+	size_t pos = 0;
+	while( pos<size )
+	{
+		size_t literal_len = _getVarint( src, &pos );
+		dst->insert( dst->end(), src+pos, src+pos+literal_len );
+		pos += literal_len;
+
+		if( pos>=size || dst->size()-begin>=dst_size ) break;
+
+		size_t len = _getVarint( src, &pos ) + 4;
+		size_t distance = _getVarint( src, &pos );
+
+		// 一致する範囲が重なる場合があるので1バイトずつコピーする
+		size_t from = dst->size() - distance;
+		for( size_t i=0 ; i<len ; ++i )
+		{
+			dst->push_back( (*dst)[from+i] );
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+UndoJournal::UndoJournal( size_t _memory_limit, const std::string & _spill_filename )
+	:
+	item_base(0),
+	current(0),
+	in_group(false),
+	arena_live(0),
+	spill_item(0),
+	memory_limit(_memory_limit),
+	spill_filename(_spill_filename),
+	spill_file(NULL),
+	spill_failed(false),
+	spill_size(0),
+	spill_live(0)
+{
+}
+
+UndoJournal::~UndoJournal()
+{
+	Clear();
+}
+
+void UndoJournal::Clear()
+{
+	units.clear();
+	items.clear();
+	item_base = 0;
+	current = 0;
+	in_group = false;
+
+	std::vector<unsigned char>().swap(arena);
+	arena_live = 0;
+	spill_item = 0;
+
+	if(spill_file)
+	{
+		fclose(spill_file);
+		spill_file = NULL;
+		remove( spill_filename.c_str() );
+	}
+	spill_failed = false;
+	spill_size = 0;
+	spill_live = 0;
+}
+
+UndoJournal::TextRef UndoJournal::_storeText( const Text & text )
+{
+	return _storeText( (const unsigned char*)text.data, text.char_size, text.len );
+}
+
+UndoJournal::TextRef UndoJournal::_storeText( const unsigned char * data, int char_size, size_t len )
+{
+	TextRef ref;
+	ref.pos = arena.size();
+	ref.size = len * char_size;
+	ref.len = len;
+	ref.char_size = (unsigned char)char_size;
+	ref.flags = 0;
+
+	if( ref.size>=COMPRESS_MIN_BYTES )
+	{
+		std::vector<unsigned char> compressed;
+		_lzCompress( data, ref.size, &compressed );
+
+		if( compressed.size() < ref.size - ref.size/8 )
+		{
+			ref.size = compressed.size();
+			ref.flags |= TextFlag_Compressed;
+			arena.insert( arena.end(), compressed.begin(), compressed.end() );
+			arena_live += ref.size;
+			return ref;
+		}
+	}
+
+	arena.insert( arena.end(), data, data+ref.size );
+	arena_live += ref.size;
+	return ref;
+}
+
+void UndoJournal::_loadText( const TextRef & ref, std::vector<unsigned char> * data ) const
+{
+	data->clear();
+
+	if( ref.size==0 ) return;
+
+	std::vector<unsigned char> spilled;
+	const unsigned char * src;
+
+	if( ref.flags & TextFlag_Spilled )
+	{
+		spilled.resize(ref.size);
+		if( !spill_file
+			|| UNDOJOURNAL_FSEEK( spill_file, ref.pos, SEEK_SET )!=0
+			|| fread( spilled.data(), 1, ref.size, spill_file )!=ref.size )
+		{
+			// 読めない場合は同じ長さの空白にする
+			data->assign( ref.len * ref.char_size, 0 );
+			for( size_t i=0 ; i<ref.len ; ++i ) (*data)[ i * ref.char_size ] = ' ';
+			return;
+		}
+		src = spilled.data();
+	}
+	else
+	{
+		src = &arena[(size_t)ref.pos];
+	}
+
+	if( ref.flags & TextFlag_Compressed )
+	{
+		_lzDecompress( src, ref.size, data, ref.len * ref.char_size );
+	}
+	else
+	{
+		data->assign( src, src+ref.size );
+	}
+}
+
+void UndoJournal::_releaseText( const TextRef & ref )
+{
+	if( ref.flags & TextFlag_Spilled )
+	{
+		spill_live -= ref.size;
+	}
+	else
+	{
+		arena_live -= ref.size;
+	}
+}
+
+UndoJournal::Position UndoJournal::_getTextEnd( const Position & left, const TextRef & ref, const std::vector<unsigned char> & data ) const
+{
+	Position pos = left;
+
+	for( size_t i=0 ; i<ref.len ; ++i )
+	{
+		unsigned int c = _getChar( data.data(), ref.char_size, i );
+
+		if( c=='\r' || c=='\n' )
+		{
+			if( c=='\r' && i+1<ref.len && _getChar( data.data(), ref.char_size, i+1 )=='\n' ) ++i;
+			++pos.line;
+			pos.index = 0;
+		}
+		else
+		{
+			++pos.index;
+		}
+	}
+
+	return pos;
+}
+
+bool UndoJournal::_coalesce( const Position & left, const Text & new_text, const Selection & selection )
+{
+	if( current==0 || current!=units.size() ) return false;
+
+	Unit & unit = units.back();
+	if( unit.selection.atomic || unit.num_items!=1 ) return false;
+
+	Item & item = _getItem(unit.first_item);
+	TextRef & ref = item.new_text;
+
+	if( item.old_text.len!=0 || ref.len==0 || ( ref.flags & (TextFlag_Spilled|TextFlag_Compressed) ) ) return false;
+	if( ref.len + new_text.len > COALESCE_MAX_CHARS ) return false;
+
+	// 直前の入力の直後に続く入力か
+	if( unit.selection.new_cursor.line!=left.line || unit.selection.new_cursor.index!=left.index ) return false;
+
+	for( size_t i=0 ; i<new_text.len ; ++i )
+	{
+		unsigned int c = _getChar( (const unsigned char*)new_text.data, new_text.char_size, i );
+		if( c=='\r' || c=='\n' ) return false;
+	}
+
+	// 単語の後ろの空白から、次の Unit にする
+	unsigned int last = _getChar( &arena[(size_t)ref.pos], ref.char_size, ref.len-1 );
+	unsigned int first = _getChar( (const unsigned char*)new_text.data, new_text.char_size, 0 );
+	if( _isSpace(first) && !_isSpace(last) ) return false;
+
+	int char_size = std::max<int>( ref.char_size, new_text.char_size );
+
+	if( ref.char_size==char_size && ref.pos + ref.size == arena.size() )
+	{
+		// アリーナの最後にあるので、そのまま後ろに追加する
+		size_t old_size = arena.size();
+		_appendChars( &arena, new_text.data, new_text.char_size, new_text.len, char_size );
+		ref.size += arena.size() - old_size;
+		arena_live += arena.size() - old_size;
+		ref.len += new_text.len;
+	}
+	else
+	{
+		std::vector<unsigned char> data;
+		_appendChars( &data, &arena[(size_t)ref.pos], ref.char_size, ref.len, char_size );
+		_appendChars( &data, new_text.data, new_text.char_size, new_text.len, char_size );
+
+		_releaseText(ref);
+		ref = _storeText( data.data(), char_size, ref.len + new_text.len );
+	}
+
+	++item.count;
+	unit.selection.new_anchor = selection.new_anchor;
+	unit.selection.new_cursor = selection.new_cursor;
+
+	return true;
+}
+
+void UndoJournal::_truncateRedo()
+{
+	while( units.size()>current )
+	{
+		const Unit & unit = units.back();
+		for( size_t i=0 ; i<unit.num_items ; ++i )
+		{
+			_releaseText( items.back().old_text );
+			_releaseText( items.back().new_text );
+			items.pop_back();
+		}
+		units.pop_back();
+	}
+
+	spill_item = std::min( spill_item, item_base + items.size() );
+
+	_compactSpillFile();
+}
+
+bool UndoJournal::Append( const Position & left, const Text & old_text, const Text & new_text, const Selection & selection, bool coalesce )
+{
+	if( !in_group )
+	{
+		if( coalesce && old_text.len==0 && new_text.len>0 && _coalesce( left, new_text, selection ) )
+		{
+			return _enforceLimit();
+		}
+
+		_truncateRedo();
+
+		Unit unit;
+		unit.first_item = item_base + items.size();
+		unit.num_items = 0;
+		unit.selection = selection;
+		unit.selection.atomic = false;
+		units.push_back(unit);
+
+		current = units.size();
+	}
+
+	Item item;
+	item.left = left;
+	item.old_text = _storeText(old_text);
+	item.new_text = _storeText(new_text);
+	item.count = 1;
+	items.push_back(item);
+
+	++units.back().num_items;
+
+	return _enforceLimit();
+}
+
+void UndoJournal::BeginGroup( const Position & old_anchor, const Position & old_cursor )
+{
+	_truncateRedo();
+
+	Unit unit;
+	unit.first_item = item_base + items.size();
+	unit.num_items = 0;
+	unit.selection.old_anchor = old_anchor;
+	unit.selection.old_cursor = old_cursor;
+	unit.selection.new_anchor = old_anchor;
+	unit.selection.new_cursor = old_cursor;
+	unit.selection.atomic = true;
+	units.push_back(unit);
+
+	current = units.size();
+	in_group = true;
+}
+
+bool UndoJournal::EndGroup( const Position & new_anchor, const Position & new_cursor )
+{
+	if( !in_group ) return false;
+
+	units.back().selection.new_anchor = new_anchor;
+	units.back().selection.new_cursor = new_cursor;
+	in_group = false;
+
+	return _enforceLimit();
+}
+
+bool UndoJournal::Undo( Selection * selection, std::vector<Edit> * edits )
+{
+	if( in_group || current==0 ) return false;
+
+	const Unit & unit = units[--current];
+	*selection = unit.selection;
+
+	// 後の編集から順に、置き換えた後の範囲を置き換える前の文字列に戻す
+	edits->resize(unit.num_items);
+
+	std::vector<unsigned char> data;
+	for( size_t i=0 ; i<unit.num_items ; ++i )
+	{
+		const Item & item = _getItem( unit.first_item + unit.num_items - 1 - i );
+		Edit & edit = (*edits)[i];
+
+		_loadText( item.new_text, &data );
+		edit.left = item.left;
+		edit.right = _getTextEnd( item.left, item.new_text, data );
+
+		_loadText( item.old_text, &edit.text );
+		edit.char_size = item.old_text.char_size;
+		edit.len = item.old_text.len;
+		edit.count = item.count;
+	}
+
+	return true;
+}
+
+bool UndoJournal::Redo( Selection * selection, std::vector<Edit> * edits )
+{
+	if( in_group || current>=units.size() ) return false;
+
+	const Unit & unit = units[current++];
+	*selection = unit.selection;
+
+	// 前の編集から順に、置き換える前の範囲を置き換えた後の文字列にする
+	edits->resize(unit.num_items);
+
+	std::vector<unsigned char> data;
+	for( size_t i=0 ; i<unit.num_items ; ++i )
+	{
+		const Item & item = _getItem( unit.first_item + i );
+		Edit & edit = (*edits)[i];
+
+		_loadText( item.old_text, &data );
+		edit.left = item.left;
+		edit.right = _getTextEnd( item.left, item.old_text, data );
+
+		_loadText( item.new_text, &edit.text );
+		edit.char_size = item.new_text.char_size;
+		edit.len = item.new_text.len;
+		edit.count = item.count;
+	}
+
+	return true;
+}
+
+size_t UndoJournal::GetUndoCount() const
+{
+	size_t count = 0;
+	for( size_t i=0 ; i<current ; ++i )
+	{
+		const Unit & unit = units[i];
+		for( size_t j=0 ; j<unit.num_items ; ++j )
+		{
+			count += _getItem( unit.first_item + j ).count;
+		}
+	}
+	return count;
+}
+
+size_t UndoJournal::GetMemorySize() const
+{
+	// アリーナの未使用部分は _compactArena で使用中の部分以下に抑えるので含めない
+	return arena_live + items.size() * sizeof(Item) + units.size() * sizeof(Unit);
+}
+
+bool UndoJournal::_spillText( TextRef * ref )
+{
+	if( ( ref->flags & TextFlag_Spilled ) || ref->size==0 ) return true;
+
+	if( !spill_file )
+	{
+		spill_file = fopen( spill_filename.c_str(), "w+b" );
+		if( !spill_file )
+		{
+			spill_failed = true;
+			return false;
+		}
+	}
+
+	if( UNDOJOURNAL_FSEEK( spill_file, spill_size, SEEK_SET )!=0
+		|| fwrite( &arena[(size_t)ref->pos], 1, ref->size, spill_file )!=ref->size )
+	{
+		spill_failed = true;
+		return false;
+	}
+
+	arena_live -= ref->size;
+	ref->pos = spill_size;
+	ref->flags |= TextFlag_Spilled;
+	spill_size += ref->size;
+	spill_live += ref->size;
+
+	return true;
+}
+
+// force が true の場合は、未使用部分が半分より少なくても、ARENA_COMPACT_MIN 以上あれば詰めて余分な領域を解放する
+void UndoJournal::_compactArena( bool force )
+{
+	if( force ? arena.capacity() - arena_live < ARENA_COMPACT_MIN : ( arena.size()<ARENA_COMPACT_MIN || arena_live*2 > arena.size() ) ) return;
+
+	std::vector<unsigned char> new_arena;
+	new_arena.reserve(arena_live);
+
+	for( size_t i=0 ; i<items.size() ; ++i )
+	{
+		TextRef * refs[] = { &items[i].old_text, &items[i].new_text };
+		for( int j=0 ; j<2 ; ++j )
+		{
+			TextRef * ref = refs[j];
+			if( ref->flags & TextFlag_Spilled ) continue;
+
+			size_t pos = new_arena.size();
+			new_arena.insert( new_arena.end(), arena.begin()+(size_t)ref->pos, arena.begin()+(size_t)ref->pos+ref->size );
+			ref->pos = pos;
+		}
+	}
+
+	arena.swap(new_arena);
+	arena_live = arena.size();
+}
+
+// ファイルの中で捨てた文字列の部分が半分以上になったら、書き出してある文字列を前に詰めてファイルを切り詰める
+void UndoJournal::_compactSpillFile()
+{
+	if( !spill_file || spill_failed ) return;
+
+	if( spill_live==0 )
+	{
+		// 全部捨てた場合は最初から使い直す
+		if( spill_size>0 ) (void)UNDOJOURNAL_FTRUNCATE( spill_file, 0 );
+		spill_size = 0;
+		return;
+	}
+
+	if( spill_size<SPILL_COMPACT_MIN || spill_live*2 > spill_size ) return;
+
+	// ファイルの中の位置の順に前に詰めていくので、移動先が移動元を追い越すことはない
+	std::vector<TextRef*> refs;
+	for( size_t i=0 ; i<items.size() ; ++i )
+	{
+		TextRef * item_refs[] = { &items[i].old_text, &items[i].new_text };
+		for( int j=0 ; j<2 ; ++j )
+		{
+			if( item_refs[j]->flags & TextFlag_Spilled ) refs.push_back( item_refs[j] );
+		}
+	}
+	std::sort( refs.begin(), refs.end(), []( const TextRef * a, const TextRef * b ){ return a->pos < b->pos; } );
+
+	std::vector<unsigned char> buf( SPILL_COPY_BYTES );
+	unsigned long long new_size = 0;
+
+	for( size_t i=0 ; i<refs.size() ; ++i )
+	{
+		TextRef * ref = refs[i];
+
+		if( ref->pos!=new_size )
+		{
+			for( size_t done=0 ; done<ref->size ; )
+			{
+				size_t n = std::min( ref->size - done, buf.size() );
+				if( UNDOJOURNAL_FSEEK( spill_file, ref->pos + done, SEEK_SET )!=0
+					|| fread( buf.data(), 1, n, spill_file )!=n
+					|| UNDOJOURNAL_FSEEK( spill_file, new_size + done, SEEK_SET )!=0
+					|| fwrite( buf.data(), 1, n, spill_file )!=n )
+				{
+					// 詰められなかった場合は、これ以上ファイルに書き出さない
+					spill_failed = true;
+					return;
+				}
+				done += n;
+			}
+			ref->pos = new_size;
+		}
+
+		new_size += ref->size;
+	}
+
+	// 切り詰められなくても、後ろの部分は次に書き出すときに上書きする
+	fflush(spill_file);
+	(void)UNDOJOURNAL_FTRUNCATE( spill_file, new_size );
+	spill_size = new_size;
+}
+
+bool UndoJournal::_enforceLimit()
+{
+	_compactArena(false);
+
+	if( memory_limit==0 || GetMemorySize()<=memory_limit ) return false;
+
+	// 古い編集の文字列から順に、上限の半分になるまでファイルに書き出す
+	if( !spill_filename.empty() && !spill_failed )
+	{
+		size_t target = memory_limit / 2;
+		size_t meta_size = items.size() * sizeof(Item) + units.size() * sizeof(Unit);
+
+		size_t old_live = arena_live;
+
+		spill_item = std::max( spill_item, item_base );
+		while( spill_item < item_base + items.size() && arena_live + meta_size > target )
+		{
+			Item & item = _getItem(spill_item);
+			if( !_spillText(&item.old_text) || !_spillText(&item.new_text) ) break;
+			++spill_item;
+		}
+
+		if(spill_file) fflush(spill_file);
+
+		// 書き出した部分を詰めて、アリーナの大きさを使用中の部分に合わせる
+		if( arena_live<old_live ) _compactArena(true);
+	}
+
+	// 書き出せなかった場合や、Unit の情報だけで超える場合は、古い Unit から順に捨てる
+	// 記録中のグループは捨てない
+	bool dropped = false;
+	while( GetMemorySize()>memory_limit && current>0 && !( in_group && units.size()==1 ) )
+	{
+		const Unit & unit = units.front();
+		for( size_t i=0 ; i<unit.num_items ; ++i )
+		{
+			_releaseText( items.front().old_text );
+			_releaseText( items.front().new_text );
+			items.pop_front();
+			++item_base;
+		}
+		units.pop_front();
+		--current;
+		dropped = true;
+
+		_compactArena(false);
+	}
+
+	spill_item = std::max( spill_item, item_base );
+
+	if(dropped) _compactSpillFile();
+
+	return dropped;
+}
@@ -0,0 +1,163 @@
+﻿#ifndef _UNDOJOURNAL_H_
+#define _UNDOJOURNAL_H_
+
+#include <stddef.h>
+#include <stdio.h>
+#include <vector>
+#include <deque>
+#include <string>
+
+namespace ckit
+{
+	// テキスト編集の Undo/Redo の記録
+	//
+	// 1回の編集は、置き換えた範囲の開始位置と、置き換える前後の文字列で記録する。
+	// 範囲の終了位置は文字列の改行 (CR / LF / CRLF) の数と最後の行の長さから求めるので保持しない。
+	// 文字列は追記専用のバッファ (アリーナ) に保持し、大きい文字列は LZ 方式で圧縮する。
+	//
+	// Undo/Redo の単位 (Unit) は、1回の編集か、グループにまとめた複数の編集 (アトミックな編集) になる。
+	// 同じ位置に続けて1文字ずつ入力した編集は、単語の区切りまで1つの編集にまとめる。
+	//
+	// 使用するメモリが memory_limit を超えると、古い編集の文字列から順にファイルに書き出す。
+	// ファイルが使えない場合や、書き出した後も Unit の情報だけで超える場合は、古い Unit から順に捨てる (Undo できなくなる)。
+	// 捨てた編集の文字列が書き出してあった部分は、ファイルを詰めて再利用する。
+	class UndoJournal
+	{
+	public:
+		struct Position
+		{
+			size_t line;
+			size_t index;
+		};
+
+		// 記録する文字列 (1文字 char_size バイトの配列)
+		struct Text
+		{
+			const void * data;
+			int char_size;			// 1, 2, 4
+			size_t len;
+		};
+
+		// Undo/Redo で行う編集
+		// 範囲 [left,right) を text で置き換え、変更回数を count 回分戻す (進める)
+		struct Edit
+		{
+			Position left;
+			Position right;
+			std::vector<unsigned char> text;
+			int char_size;
+			size_t len;
+			unsigned int count;
+		};
+
+		// Undo/Redo の前後の選択範囲
+		struct Selection
+		{
+			Position old_anchor;
+			Position old_cursor;
+			Position new_anchor;
+			Position new_cursor;
+			bool atomic;
+		};
+
+		// memory_limit : 使用するメモリの上限 (0 の場合は制限しない)
+		// spill_filename : 古い編集の文字列を書き出すファイル (空の場合は書き出さずに捨てる)
+		UndoJournal( size_t memory_limit, const std::string & spill_filename );
+		~UndoJournal();
+
+		void Clear();
+
+		// 編集を記録する (Redo の記録は消える)
+		// coalesce が true の場合は、直前の編集に続く入力であれば1つにまとめる
+		// 古い編集を捨てた場合は true を返す
+		bool Append( const Position & left, const Text & old_text, const Text & new_text, const Selection & selection, bool coalesce );
+
+		// これ以降の Append をまとめて1つの Unit にする
+		void BeginGroup( const Position & old_anchor, const Position & old_cursor );
+		bool EndGroup( const Position & new_anchor, const Position & new_cursor );
+
+		bool CanUndo() const { return current>0; }
+		bool CanRedo() const { return current<units.size(); }
+
+		// 最後の Unit を取り消すための編集を、実行する順に edits に格納する
+		bool Undo( Selection * selection, std::vector<Edit> * edits );
+		bool Redo( Selection * selection, std::vector<Edit> * edits );
+
+		// Undo できる変更回数の合計
+		size_t GetUndoCount() const;
+
+		// 記録している文字列と Unit の情報のバイト数
+		size_t GetMemorySize() const;
+		unsigned long long GetSpilledSize() const { return spill_size; }
+
+	public:
+		// 以下は実装で使用する型
+
+		// アリーナかファイルに格納した文字列
+		struct TextRef
+		{
+			unsigned long long pos;		// アリーナかファイルの中の位置
+			size_t size;				// 格納したバイト数
+			size_t len;					// 文字数
+			unsigned char char_size;
+			unsigned char flags;		// TextFlag_xxx
+		};
+
+		enum TextFlag
+		{
+			TextFlag_Compressed = 1<<0,
+			TextFlag_Spilled = 1<<1,
+		};
+
+		struct Item
+		{
+			Position left;
+			TextRef old_text;
+			TextRef new_text;
+			unsigned int count;			// まとめた編集の数
+		};
+
+		struct Unit
+		{
+			size_t first_item;			// 最初の Item の通し番号
+			size_t num_items;
+			Selection selection;
+		};
+
+	private:
+		TextRef _storeText( const Text & text );
+		TextRef _storeText( const unsigned char * data, int char_size, size_t len );
+		void _loadText( const TextRef & ref, std::vector<unsigned char> * data ) const;
+		void _releaseText( const TextRef & ref );
+		Position _getTextEnd( const Position & left, const TextRef & ref, const std::vector<unsigned char> & data ) const;
+
+		bool _coalesce( const Position & left, const Text & new_text, const Selection & selection );
+		void _truncateRedo();
+		bool _enforceLimit();
+		bool _spillText( TextRef * ref );
+		void _compactArena( bool force );
+		void _compactSpillFile();
+
+		Item & _getItem( size_t number ) { return items[ number - item_base ]; }
+		const Item & _getItem( size_t number ) const { return items[ number - item_base ]; }
+
+		std::deque<Unit> units;
+		std::deque<Item> items;
+		size_t item_base;				// items[0] の通し番号
+		size_t current;					// Undo できる Unit の数 (units[current] 以降は Redo できる)
+		bool in_group;
+
+		std::vector<unsigned char> arena;
+		size_t arena_live;				// アリーナの中で使われているバイト数
+		size_t spill_item;				// これより前の Item の文字列はファイルに書き出し済み
+
+		size_t memory_limit;
+		std::string spill_filename;
+		FILE * spill_file;
+		bool spill_failed;
+		unsigned long long spill_size;	// ファイルの中で使っている範囲の大きさ
+		unsigned long long spill_live;	// ファイルの中で Item から参照されているバイト数
+	};
+};
+
+#endif // _UNDOJOURNAL_H_
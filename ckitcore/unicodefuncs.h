@@ -0,0 +1,15 @@
+﻿#ifndef _UNICODEFUNCS_H_
+#define _UNICODEFUNCS_H_
+
+namespace ckit
+{
+	// Regex / TextSearch / WordIndex の UnicodeFuncs が設定されていない場合の関数
+	// ASCII 以外の文字をどの種類にも分類せず、大文字小文字も変換しない
+	namespace UnicodeFuncsDefault
+	{
+		inline bool IsNone( unsigned int ) { return false; }
+		inline unsigned int Identity( unsigned int c ) { return c; }
+	};
+};
+
+#endif // _UNICODEFUNCS_H_
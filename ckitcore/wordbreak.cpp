@@ -0,0 +1,185 @@
+﻿#include <algorithm>
+#include <set>
+
+#include "wordbreak.h"
+
+using namespace ckit;
+
+//-----------------------------------------------------------------------------
+
+WordBreak::WordBreak( const std::vector< std::vector<Range> > & char_types, const std::vector< std::pair<int,int> > & type_bounds )
+	:
+	num_types( (int)char_types.size() )
+{
+	// 範囲の端で区切った区間ごとに、その区間を含む最も先の種類を求める
+	struct Event
+	{
+		unsigned int pos;
+		int type;
+		bool begin;
+
+		bool operator<( const Event & other ) const { return pos < other.pos; }
+	};
+
+	std::vector<Event> events;
+	for( int type=0 ; type<num_types ; ++type )
+	{
+		for( size_t i=0 ; i<char_types[type].size() ; ++i )
+		{
+			const Range & range = char_types[type][i];
+			if( range.first>range.last ) continue;
+
+			Event begin = { range.first, type, true };
+			Event end = { range.last+1, type, false };
+			events.push_back(begin);
+			if( range.last<0xffffffff ) events.push_back(end);
+		}
+	}
+	std::stable_sort( events.begin(), events.end() );
+
+	std::vector<TypeRange> ranges;
+	std::multiset<int> active;
+	for( size_t i=0 ; i<events.size() ; )
+	{
+		unsigned int pos = events[i].pos;
+		for( ; i<events.size() && events[i].pos==pos ; ++i )
+		{
+			if( events[i].begin ) active.insert( events[i].type );
+			else active.erase( active.find( events[i].type ) );
+		}
+
+		if( active.empty() ) continue;
+
+		unsigned int last = i<events.size() ? events[i].pos-1 : 0xffffffff;
+		int type = *active.begin();
+
+		if( !ranges.empty() && ranges.back().type==type && ranges.back().last+1==pos )
+		{
+			ranges.back().last = last;
+		}
+		else
+		{
+			TypeRange range = { pos, last, type };
+			ranges.push_back(range);
+		}
+	}
+
+	// 0x100 未満の文字は配列で引く
+	for( unsigned int c=0 ; c<LOW_TABLE_SIZE ; ++c ) low_table[c] = -1;
+	for( size_t i=0 ; i<ranges.size() ; ++i )
+	{
+		for( unsigned int c=ranges[i].first ; c<LOW_TABLE_SIZE && c<=ranges[i].last ; ++c )
+		{
+			low_table[c] = (signed char)ranges[i].type;
+		}
+
+		if( ranges[i].last>=LOW_TABLE_SIZE )
+		{
+			TypeRange range = ranges[i];
+			range.first = std::max( range.first, (unsigned int)LOW_TABLE_SIZE );
+			high_ranges.push_back(range);
+		}
+	}
+
+	bounds.assign( (num_types+1) * (num_types+1), 0 );
+	for( size_t i=0 ; i<type_bounds.size() ; ++i )
+	{
+		int left = type_bounds[i].first;
+		int right = type_bounds[i].second;
+		if( left<-1 || left>=num_types || right<-1 || right>=num_types ) continue;
+		bounds[ (left+1) * (num_types+1) + (right+1) ] = 1;
+	}
+}
+
+int WordBreak::_getCharTypeHigh( unsigned int c ) const
+{
+	size_t lo = 0;
+	size_t hi = high_ranges.size();
+
+	while( lo<hi )
+	{
+		size_t mid = (lo+hi)/2;
+		if( high_ranges[mid].last<c )
+		{
+			lo = mid+1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+
+	if( lo<high_ranges.size() && high_ranges[lo].first<=c ) return high_ranges[lo].type;
+	return -1;
+}
+
+template<typename CHAR>
+size_t WordBreak::Find( const CHAR * s, size_t len, size_t pos, int step, bool use_type_bounds ) const
+{
+	if( pos>len ) pos = len;
+
+	if( step>0 )
+	{
+		pos += 1;
+		if( pos>=len ) return len;
+	}
+	else
+	{
+		if( pos<=1 ) return 0;
+		pos -= 1;
+	}
+
+	int left_char_type = GetCharType(s[pos-1]);
+	int right_char_type = GetCharType(s[pos]);
+
+	while(true)
+	{
+		if( _isBreak( left_char_type, right_char_type, use_type_bounds ) )
+		{
+			return pos;
+		}
+
+		if( step>0 )
+		{
+			pos += 1;
+			if( pos>=len ) return len;
+			left_char_type = right_char_type;
+			right_char_type = GetCharType(s[pos]);
+		}
+		else
+		{
+			pos -= 1;
+			if( pos<=0 ) return 0;
+			right_char_type = left_char_type;
+			left_char_type = GetCharType(s[pos-1]);
+		}
+	}
+}
+
+template<typename CHAR>
+void WordBreak::FindAll( const CHAR * s, size_t len, bool use_type_bounds, std::vector<size_t> * positions ) const
+{
+	if( len==0 ) return;
+
+	int left_char_type = GetCharType(s[0]);
+
+	for( size_t pos=1 ; pos<len ; ++pos )
+	{
+		int right_char_type = GetCharType(s[pos]);
+
+		if( _isBreak( left_char_type, right_char_type, use_type_bounds ) )
+		{
+			positions->push_back(pos);
+		}
+
+		left_char_type = right_char_type;
+	}
+}
+
+template size_t WordBreak::Find<unsigned char>( const unsigned char * s, size_t len, size_t pos, int step, bool use_type_bounds ) const;
+template size_t WordBreak::Find<unsigned short>( const unsigned short * s, size_t len, size_t pos, int step, bool use_type_bounds ) const;
+template size_t WordBreak::Find<unsigned int>( const unsigned int * s, size_t len, size_t pos, int step, bool use_type_bounds ) const;
+
+template void WordBreak::FindAll<unsigned char>( const unsigned char * s, size_t len, bool use_type_bounds, std::vector<size_t> * positions ) const;
+template void WordBreak::FindAll<unsigned short>( const unsigned short * s, size_t len, bool use_type_bounds, std::vector<size_t> * positions ) const;
+template void WordBreak::FindAll<unsigned int>( const unsigned int * s, size_t len, bool use_type_bounds, std::vector<size_t> * positions ) const;
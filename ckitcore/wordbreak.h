@@ -0,0 +1,79 @@
+﻿#ifndef _WORDBREAK_H_
+#define _WORDBREAK_H_
+
+#include <stddef.h>
+#include <vector>
+
+namespace ckit
+{
+	// 単語区切り
+	//
+	// ckit_misc.WordBreak と同じ結果を返す。
+	// 文字の種類の定義 (文字の集合と範囲) を、コードポイントの範囲から種類への表にコンパイルし、
+	// 0x100 未満の文字は配列、それ以外の文字は範囲の二分探索で種類を求める。
+	// どの種類にも含まれない文字の種類は -1 になる。
+	//
+	// 種類の境界で単語を区切るかどうか (type_bounds) も、種類の組み合わせの表にコンパイルする。
+	class WordBreak
+	{
+	public:
+		// 文字の範囲 [first,last]
+		struct Range
+		{
+			unsigned int first;
+			unsigned int last;
+		};
+
+		// char_types : 種類ごとの文字の範囲のリスト (同じ文字を含む場合は、先の種類が優先される)
+		// type_bounds : 単語を区切る ( 左の種類, 右の種類 ) の組み合わせ
+		WordBreak( const std::vector< std::vector<Range> > & char_types, const std::vector< std::pair<int,int> > & type_bounds );
+
+		int GetCharType( unsigned int c ) const
+		{
+			if( c<LOW_TABLE_SIZE ) return low_table[c];
+			return _getCharTypeHigh(c);
+		}
+
+		bool IsBound( int left, int right ) const
+		{
+			return bounds[ (left+1) * (num_types+1) + (right+1) ] != 0;
+		}
+
+		// s の pos から step の方向 (+1 / -1) に、次の単語区切りの位置を探す
+		// 見つからない場合は、文字列の端の位置を返す
+		template<typename CHAR>
+		size_t Find( const CHAR * s, size_t len, size_t pos, int step, bool use_type_bounds ) const;
+
+		// s の中の全ての単語区切りの位置 (文字列の端を除く) を、位置の順に positions に追加する
+		template<typename CHAR>
+		void FindAll( const CHAR * s, size_t len, bool use_type_bounds, std::vector<size_t> * positions ) const;
+
+	private:
+		enum
+		{
+			LOW_TABLE_SIZE = 0x100,
+		};
+
+		// 種類が同じ文字の範囲
+		struct TypeRange
+		{
+			unsigned int first;
+			unsigned int last;
+			int type;
+		};
+
+		int _getCharTypeHigh( unsigned int c ) const;
+
+		bool _isBreak( int left, int right, bool use_type_bounds ) const
+		{
+			return left!=right && ( !use_type_bounds || IsBound(left,right) );
+		}
+
+		int num_types;
+		signed char low_table[LOW_TABLE_SIZE];		// 0x100 未満の文字の種類
+		std::vector<TypeRange> high_ranges;			// 0x100 以上の文字の範囲 (first の順)
+		std::vector<unsigned char> bounds;			// [ (left+1) * (num_types+1) + (right+1) ]
+	};
+};
+
+#endif // _WORDBREAK_H_
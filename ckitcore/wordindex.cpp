@@ -0,0 +1,182 @@
+﻿#include <algorithm>
+#include <unordered_map>
+
+#include "threadutil.h"
+#include "unicodefuncs.h"
+#include "wordindex.h"
+
+using namespace ckit;
+
+//-----------------------------------------------------------------------------
+
+// 並列に数える1チャンクの文字数
+static const size_t COUNT_CHUNK_CHARS = 1024 * 1024;
+
+// これより長い単語は補完の候補にならないので数えない
+static const size_t WORD_MAX_CHARS = 256;
+
+//-----------------------------------------------------------------------------
+
+static WordIndex::UnicodeFuncs unicode_funcs =
+{
+	UnicodeFuncsDefault::IsNone,
+};
+
+void WordIndex::SetUnicodeFuncs( const UnicodeFuncs & funcs )
+{
+	unicode_funcs = funcs;
+}
+
+static inline bool _isAsciiWord( unsigned int c )
+{
+	return ( c>='a' && c<='z' ) || ( c>='A' && c<='Z' ) || ( c>='0' && c<='9' ) || c=='_';
+}
+
+typedef std::unordered_map<std::string,size_t> WordCounts;
+
+// 1行の単語を数える
+template<typename CHAR>
+static void _countWords( const CHAR * s, size_t len, std::string * word, WordCounts * counts )
+{
+	size_t i = 0;
+	while( i<len )
+	{
+		if( !_isAsciiWord(s[i]) )
+		{
+			++i;
+			continue;
+		}
+
+		size_t start = i;
+		while( i<len && _isAsciiWord(s[i]) ) ++i;
+
+		// 直前が ASCII 以外の単語の文字の場合は、単語の途中
+		if( start>0 && s[start-1]>=0x80 && unicode_funcs.is_word(s[start-1]) ) continue;
+
+		if( i-start > WORD_MAX_CHARS ) continue;
+
+		word->assign( s+start, s+i );
+		++(*counts)[*word];
+	}
+}
+
+static void _countWords( const TextSearch::LineText & text, std::string * word, WordCounts * counts )
+{
+	switch(text.char_size)
+	{
+	case 1:
+		_countWords( (const unsigned char*)text.data, text.len, word, counts );
+		break;
+
+	case 2:
+		_countWords( (const unsigned short*)text.data, text.len, word, counts );
+		break;
+
+	case 4:
+		_countWords( (const unsigned int*)text.data, text.len, word, counts );
+		break;
+	}
+}
+
+//-----------------------------------------------------------------------------
+
+WordIndex::WordIndex()
+{
+}
+
+void WordIndex::Clear()
+{
+	words.clear();
+}
+
+void WordIndex::AddLines( const TextSearch::LineText * lines, size_t num_lines )
+{
+	_update( lines, num_lines, true );
+}
+
+void WordIndex::RemoveLines( const TextSearch::LineText * lines, size_t num_lines )
+{
+	_update( lines, num_lines, false );
+}
+
+void WordIndex::_update( const TextSearch::LineText * lines, size_t num_lines, bool add )
+{
+	// 文字数でチャンクに分ける
+	std::vector<size_t> chunk_starts;
+	chunk_starts.push_back(0);
+
+	size_t num_chars = 0;
+	for( size_t i=0 ; i<num_lines ; ++i )
+	{
+		num_chars += lines[i].len + 1;
+		if( num_chars>=COUNT_CHUNK_CHARS && i+1<num_lines )
+		{
+			chunk_starts.push_back(i+1);
+			num_chars = 0;
+		}
+	}
+
+	int num_chunks = (int)chunk_starts.size();
+	chunk_starts.push_back(num_lines);
+
+	std::vector<WordCounts> chunk_counts(num_chunks);
+
+	auto count_chunk = [&]( int index )
+	{
+		std::string word;
+		for( size_t i=chunk_starts[index] ; i<chunk_starts[index+1] ; ++i )
+		{
+			_countWords( lines[i], &word, &chunk_counts[index] );
+		}
+	};
+
+	if( num_chunks==1 )
+	{
+		count_chunk(0);
+	}
+	else
+	{
+		ThreadUtil::ParallelFor( num_chunks, count_chunk );
+	}
+
+	// 異なる単語の数は出現回数よりずっと少ないので、まとめてから反映する
+	for( int i=0 ; i<num_chunks ; ++i )
+	{
+		for( auto it=chunk_counts[i].begin() ; it!=chunk_counts[i].end() ; ++it )
+		{
+			if(add)
+			{
+				words[it->first] += it->second;
+			}
+			else
+			{
+				auto found = words.find(it->first);
+				if( found==words.end() ) continue;
+
+				if( found->second > it->second )
+				{
+					found->second -= it->second;
+				}
+				else
+				{
+					words.erase(found);
+				}
+			}
+		}
+	}
+}
+
+void WordIndex::Find( const std::string & prefix, std::vector<std::string> * result ) const
+{
+	for( auto it=words.lower_bound(prefix) ; it!=words.end() ; ++it )
+	{
+		const std::string & word = it->first;
+
+		if( word.compare( 0, prefix.size(), prefix )!=0 ) break;
+
+		if( word.size() > prefix.size() )
+		{
+			result->push_back(word);
+		}
+	}
+}
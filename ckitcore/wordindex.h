@@ -0,0 +1,55 @@
+﻿#ifndef _WORDINDEX_H_
+#define _WORDINDEX_H_
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <map>
+
+#include "textsearch.h"
+
+namespace ckit
+{
+	// 単語補完のための、文書に含まれる単語の一覧
+	//
+	// 単語は ASCII の英数字とアンダースコアの連続で、直前の文字が単語の文字 (ASCII 以外の英数字を含む) でないもの
+	// (正規表現の \b[a-zA-Z0-9_]+ に一致する範囲)。
+	// 単語ごとに文書の中での出現回数を数えて辞書順に保持するので、前方一致する単語を O(log n + 結果の数) で列挙できる。
+	//
+	// 編集の前に変更する行の単語を RemoveLines で取り除き、編集の後に変更した行の単語を AddLines で加えることで、
+	// 文書全体を数え直さずに更新する。
+	class WordIndex
+	{
+	public:
+		// ASCII 以外の文字の分類
+		// 設定しない場合は ASCII 以外の文字を単語の文字とみなさない
+		struct UnicodeFuncs
+		{
+			bool (*is_word)( unsigned int c );
+		};
+
+		static void SetUnicodeFuncs( const UnicodeFuncs & funcs );
+
+		WordIndex();
+
+		void Clear();
+
+		// lines の単語を加える / 取り除く
+		// 行が多い場合は、いくつかのチャンクに分けて並列に数える
+		void AddLines( const TextSearch::LineText * lines, size_t num_lines );
+		void RemoveLines( const TextSearch::LineText * lines, size_t num_lines );
+
+		// prefix で始まり prefix より長い単語を、辞書順に words に追加する
+		void Find( const std::string & prefix, std::vector<std::string> * words ) const;
+
+		// 異なる単語の数
+		size_t Size() const { return words.size(); }
+
+	private:
+		void _update( const TextSearch::LineText * lines, size_t num_lines, bool add );
+
+		std::map<std::string,size_t> words;		// 単語と出現回数
+	};
+};
+
+#endif // _WORDINDEX_H_
@@ -0,0 +1,108 @@
+﻿import os
+import sys
+import re
+import time
+
+sys.path[0:0] = [
+    os.path.abspath( os.path.join( os.path.split(sys.argv[0])[0], '../..' ) ),
+    ]
+
+from ckit import ckitcore
+
+# 正規表現検索のベンチマーク
+#
+# ckitcore.Regex ( 後戻りしないエンジン ) と re モジュールで、同じパターンを同じテキストに対して検索し、
+# 所要時間を比較する。
+# 指数的な後戻りを起こすパターンでは、re は打ち切り時間を超えた時点で計測を止める。
+
+TIMEOUT = 1.0
+
+# 典型的なパターン
+typical_patterns = [
+    ( r"def\s+\w+", "    def foo( self, x ):\n" * 20000 ),
+    ( r"[0-9]+\.[0-9]+", "value = 123.456, other = 7\n" * 20000 ),
+    ( r"(?i)hello", "abcdefghijklmnopqrstuvwxyz " * 40000 + "HeLLo" ),
+    ( r"\bclass\b", "subclass classes class_ " * 40000 + "class" ),
+]
+
+# 後戻りが指数的になるパターン
+pathological_patterns = [
+    ( r"(a+)+b", 28 ),
+    ( r"(a|aa)*c", 32 ),
+    ( r"(a*)*b", 28 ),
+    ( r"(\w+\s?)+$", 28 ),
+]
+
+# 先読みを含むパターン
+# 読む文字数に上限がない先読みは、位置ごとに部分プログラムを実行すると O(n^2) になるので、
+# ckitcore.Regex は対応せずに ValueError を送出する (呼び出し側は re を使う)
+lookahead_patterns = [
+    ( r"(?=a*b)a", "a" * 40000, False ),
+    ( r"(?=a{0,8}b)a", "a" * 40000, True ),
+    ( r"\w+(?=\()", "call_function_name " * 20000 + "f(", True ),
+]
+
+def measure( func ):
+    t = time.perf_counter()
+    result = func()
+    return time.perf_counter() - t, result
+
+def benchRe( re_object, text ):
+    re_result = re_object.search(text)
+    if re_result:
+        return ( re_result.start(), re_result.end() )
+    return None
+
+def runTypical():
+    print( "--- typical patterns ---" )
+    for pattern, text in typical_patterns:
+        re_object = re.compile(pattern)
+        native_object = ckitcore.Regex(re_object)
+        t_native, r_native = measure( lambda: native_object.search(text) )
+        t_re, r_re = measure( lambda: benchRe(re_object, text) )
+        assert r_native==r_re
+        print( "%-20s len=%8d  Regex: %8.3f ms  re: %8.3f ms" % ( pattern, len(text), t_native*1000, t_re*1000 ) )
+
+def runPathological():
+    print( "--- pathological patterns ---" )
+    for pattern, max_n in pathological_patterns:
+        re_object = re.compile(pattern)
+        native_object = ckitcore.Regex(re_object)
+        re_timeout = False
+        for n in range( 16, max_n+1, 2 ):
+            text = "a" * n + "!"
+            t_native, r_native = measure( lambda: native_object.search(text) )
+            if re_timeout:
+                print( "%-20s n=%3d  Regex: %8.3f ms  re: (skipped)" % ( pattern, n, t_native*1000 ) )
+                continue
+            t_re, r_re = measure( lambda: benchRe(re_object, text) )
+            assert r_native==r_re
+            print( "%-20s n=%3d  Regex: %8.3f ms  re: %8.3f ms" % ( pattern, n, t_native*1000, t_re*1000 ) )
+            if t_re > TIMEOUT:
+                re_timeout = True
+
+        # 後戻りしないエンジンは長いテキストでも線形時間で終わる
+        text = "a" * 1000000 + "!"
+        t_native, r_native = measure( lambda: native_object.search(text) )
+        print( "%-20s n=%d  Regex: %8.3f ms" % ( pattern, len(text)-1, t_native*1000 ) )
+
+def runLookahead():
+    print( "--- lookahead patterns ---" )
+    for pattern, text, supported in lookahead_patterns:
+        re_object = re.compile(pattern)
+        try:
+            native_object = ckitcore.Regex(re_object)
+        except ValueError:
+            native_object = None
+        assert (native_object!=None)==supported
+        t_re, r_re = measure( lambda: benchRe(re_object, text) )
+        if native_object:
+            t_native, r_native = measure( lambda: native_object.search(text) )
+            assert r_native==r_re
+            print( "%-20s len=%8d  Regex: %8.3f ms  re: %8.3f ms" % ( pattern, len(text), t_native*1000, t_re*1000 ) )
+        else:
+            print( "%-20s len=%8d  Regex: (unsupported)  re: %8.3f ms" % ( pattern, len(text), t_re*1000 ) )
+
+runTypical()
+runPathological()
+runLookahead()
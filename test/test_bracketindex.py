@@ -0,0 +1,143 @@
+﻿import os
+import sys
+import random
+
+sys.path[0:0] = [
+    os.path.abspath( os.path.join( os.path.split(sys.argv[0])[0], '../..' ) ),
+    ]
+
+from ckit import ckitcore
+
+# ckitcore.BracketIndex のテスト
+#
+# 行の挿入、削除、置き換えを繰り返しながら updateLines でインデックスを更新し、
+# findPair の結果が、文書全体の括弧を先頭から数えて求めた対応と一致することを確かめる。
+# 文字列とコメントのトークンの中の括弧は、括弧として扱わない。
+
+pairs = ( '{}', '()', '[]' )
+
+Token_Text = 0
+Token_String = 4
+Token_Comment = 6
+
+ignore_token_types = ( Token_String, Token_Comment )
+
+def randomText( bracket_rate ):
+    s = ""
+    for i in range( random.randint(0,20) ):
+        if random.random()<bracket_rate:
+            s += random.choice( "{}()[]" )
+        else:
+            s += random.choice( "ab é漢\U0001F600" )
+    return s
+
+# 行の一部を文字列やコメントのトークンにした Line オブジェクト
+def randomLine( s ):
+    line = ckitcore.Line( s + "\n" )
+    if random.random()<0.5:
+        positions = sorted( set( [ random.randint( 0, len(s) ) for i in range( random.randint(1,4) ) ] ) )
+        line.tokens = ckitcore.TokenArray( [ ( pos, random.choice( ( Token_Text, Token_String, Token_Comment ) ) ) for pos in positions ] )
+    return line
+
+# 括弧として扱う ( 行番号, 位置, 括弧の種類, 開き括弧か ) を文書の順に列挙する
+def listBrackets( lines ):
+    brackets = []
+    for lineno, line in enumerate(lines):
+        if isinstance( line, str ):
+            s = line
+            ignore = set()
+        else:
+            s = line.s
+            ignore = set()
+            if line.tokens:
+                tokens = list(line.tokens)
+                for i, ( pos, token_type ) in enumerate(tokens):
+                    end = tokens[i+1][0] if i+1<len(tokens) else len(s)
+                    if token_type in ignore_token_types:
+                        ignore.update( range( pos, end ) )
+
+        for index, c in enumerate(s):
+            if index in ignore : continue
+            for pair_index, pair in enumerate(pairs):
+                if c==pair[0]:
+                    brackets.append( ( lineno, index, pair_index, True ) )
+                elif c==pair[1]:
+                    brackets.append( ( lineno, index, pair_index, False ) )
+    return brackets
+
+# 括弧の種類ごとに深さを数えて、全ての括弧の対応を求める
+def bruteForcePairs( lines ):
+    brackets = listBrackets(lines)
+    result = {}
+    for pair_index in range(len(pairs)):
+        stack = []
+        for lineno, index, bracket_pair, is_open in brackets:
+            if bracket_pair!=pair_index : continue
+            if is_open:
+                stack.append( ( lineno, index ) )
+            else:
+                if stack:
+                    open_pos = stack.pop()
+                    result[ open_pos ] = ( lineno, index )
+                    result[ ( lineno, index ) ] = open_pos
+                else:
+                    result[ ( lineno, index ) ] = None
+        for open_pos in stack:
+            result[ open_pos ] = None
+    return result
+
+def checkIndex( index, lines, num_samples=None ):
+    expected = bruteForcePairs(lines)
+
+    positions = list(expected)
+    if num_samples!=None:
+        positions = random.sample( positions, min( num_samples, len(positions) ) )
+
+    for pos in positions:
+        assert index.findPair( *pos )==expected[pos], pos
+
+    # 括弧でない位置
+    for i in range(10):
+        lineno = random.randint( 0, len(lines)-1 )
+        pos = ( lineno, random.randint( 0, 25 ) )
+        if pos not in expected:
+            assert index.findPair( *pos )==None, pos
+
+def testEdit( bracket_rate, num_lines, num_edits ):
+    lines = [ randomLine( randomText(bracket_rate) ) for i in range(num_lines) ]
+
+    index = ckitcore.BracketIndex( pairs, ignore_token_types )
+    index.updateLines( lines, 0, 0, len(lines) )
+    checkIndex( index, lines )
+
+    for i in range(num_edits):
+        line = random.randint( 0, len(lines) )
+        old_count = random.randint( 0, min( 3, len(lines)-line ) )
+
+        # 文字列の行と Line オブジェクトの行を混ぜる
+        new_lines = []
+        for j in range( random.randint(0,3) ):
+            s = randomText(bracket_rate)
+            new_lines.append( randomLine(s) if random.random()<0.7 else s )
+
+        lines[ line : line+old_count ] = new_lines
+        index.updateLines( lines, line, old_count, len(new_lines) )
+
+        checkIndex( index, lines, 20 )
+
+    checkIndex( index, lines )
+
+# 括弧が多く、近くで対応する文書
+def testDense():
+    testEdit( 0.5, 50, 1000 )
+    print( "dense : ok" )
+
+# 括弧が少なく、多くの葉を隔てて対応する文書
+def testSparse():
+    testEdit( 0.01, 3000, 200 )
+    print( "sparse : ok" )
+
+random.seed(1)
+
+testDense()
+testSparse()
@@ -0,0 +1,183 @@
+﻿import os
+import sys
+import re
+import shutil
+import tempfile
+
+sys.path[0:0] = [
+    os.path.abspath( os.path.join( os.path.split(sys.argv[0])[0], '..' ) ),
+    ]
+
+# ckit パッケージは Windows でしか import できないので、ckit_migemo を単独で import する
+import ckit_migemo
+from ckit_migemo import PortableMigemo, MigemoPattern, _makeTrieRegex
+
+# ckit_migemo.PortableMigemo のテスト
+#
+# ローマ字からひらがなへの変換 (促音、撥音、入力の途中のローマ字を含む) が期待するかなになること、
+# 展開した正規表現が、かな、カタカナ、全角文字、辞書の単語にマッチすることを確かめる。
+# ckitcore を import できない環境で、MigemoPattern が re で検索することも確かめる。
+
+def testRomaToHira():
+    migemo = PortableMigemo()
+
+    cases = [
+        ( "aiueo",          ( "あいうえお", "" ) ),
+        ( "kanji",          ( "かんじ", "" ) ),
+        ( "KaNa",           ( "かな", "" ) ),
+        ( "shachou",        ( "しゃちょう", "" ) ),
+        ( "tsukue",         ( "つくえ", "" ) ),
+        ( "fairu",          ( "ふぁいる", "" ) ),
+        ( "tokyo",          ( "ときょ", "" ) ),
+        ( "xtuxya",         ( "っゃ", "" ) ),
+        ( "ra-menn",        ( "らーめん", "" ) ),
+
+        # 促音
+        ( "sakka",          ( "さっか", "" ) ),
+        ( "kitte",          ( "きって", "" ) ),
+        ( "zasshi",         ( "ざっし", "" ) ),
+
+        # 撥音
+        ( "shinbun",        ( "しんぶ", "n" ) ),
+        ( "shinbunn",       ( "しんぶん", "" ) ),
+        ( "konnichiha",     ( "こんにちは", "" ) ),
+        ( "konnnichiha",    ( "こんにちは", "" ) ),
+        ( "hon'ya",         ( "ほんや", "" ) ),
+        ( "honya",          ( "ほにゃ", "" ) ),
+        ( "sanpo",          ( "さんぽ", "" ) ),
+
+        # 入力の途中のローマ字
+        ( "k",              ( "", "k" ) ),
+        ( "ky",             ( "", "ky" ) ),
+        ( "kans",           ( "かん", "s" ) ),
+        ( "kansh",          ( "かん", "sh" ) ),
+        ( "xts",            ( "", "xts" ) ),
+    ]
+
+    for q, expected in cases:
+        assert migemo.romaToHira(q)==expected, ( q, migemo.romaToHira(q) )
+
+    print( "romaToHira : ok" )
+
+def fullmatch( pattern, s ):
+    return re.fullmatch( pattern, s, re.IGNORECASE )!=None
+
+def testQuery():
+    migemo = PortableMigemo()
+
+    pattern = migemo.query("kana")
+    for s in ( "kana", "KANA", "ｋａｎａ", "かな", "カナ" ):
+        assert fullmatch( pattern, s ), ( pattern, s )
+    for s in ( "か", "かに", "kan" ):
+        assert not fullmatch( pattern, s ), ( pattern, s )
+
+    # 入力の途中のローマ字は、それで始まる全てのかなの候補にする
+    pattern = migemo.query("shinbun")
+    for s in ( "しんぶん", "シンブン", "しんぶな", "しんぶにゃ", "shinbun" ):
+        assert fullmatch( pattern, s ), ( pattern, s )
+    assert not fullmatch( pattern, "しんぶ" )
+
+    pattern = migemo.query("ky")
+    for s in ( "きゃ", "きゅ", "きょ", "キョ" ):
+        assert fullmatch( pattern, s ), ( pattern, s )
+    assert not fullmatch( pattern, "き" )
+
+    # ASCII 以外を含む場合は展開しない
+    pattern = migemo.query("かa")
+    assert fullmatch( pattern, "かa" )
+    assert not fullmatch( pattern, "かあ" )
+
+    assert migemo.query("")==""
+
+    # キャッシュ
+    assert migemo.query("kana") is migemo.query("kana")
+    assert migemo.compile("kana") is migemo.compile("kana")
+    assert migemo.compile("kana") is not migemo.compile( "kana", False )
+
+    print( "query : ok" )
+
+def testDictionary():
+    dirname = tempfile.mkdtemp()
+    try:
+        fd = open( os.path.join( dirname, "migemo-dict" ), "w", encoding="utf-8" )
+        fd.write( ";; コメント\n" )
+        fd.write( "かんじ\t漢字\t感じ\n" )
+        fd.write( "かんじゃ\t患者\n" )
+        fd.write( "しんぶん\t新聞\t新聞紙\n" )
+        fd.write( "き\t木\n" )
+        fd.write( "ckit\tシーキット\n" )
+        fd.close()
+
+        migemo = PortableMigemo(dirname)
+
+        # 読みが "かんじ" で始まる単語
+        pattern = migemo.query("kanji")
+        for s in ( "漢字", "感じ", "患者", "かんじ", "カンジ" ):
+            assert fullmatch( pattern, s ), ( pattern, s )
+        for s in ( "新聞", "木", ";; コメント" ):
+            assert not fullmatch( pattern, s ), ( pattern, s )
+
+        # 入力が1文字ずつ増えていく場合
+        for q in ( "k", "ka", "kan", "kanj" ):
+            pattern = migemo.query(q)
+            for s in ( "漢字", "感じ", "患者" ):
+                assert fullmatch( pattern, s ), ( q, pattern, s )
+            assert fullmatch( pattern, "木" )==( q=="k" ), ( q, pattern )
+
+        # 同じ位置から始まる候補の中では、長い単語を優先する
+        pattern = migemo.query("shinbunn")
+        assert re.match( pattern, "新聞紙を" ).group(0)=="新聞紙"
+
+        # ローマ字の読みでも辞書を引く
+        assert fullmatch( migemo.query("ckit"), "シーキット" )
+    finally:
+        shutil.rmtree(dirname)
+
+    print( "dictionary : ok" )
+
+def testMakeTrieRegex():
+    assert _makeTrieRegex( [] )==""
+    assert _makeTrieRegex( [ "" ] )==""
+    assert _makeTrieRegex( [ "abc" ] )=="abc"
+    assert _makeTrieRegex( [ "a", "b", "c" ] )=="[abc]"
+    assert _makeTrieRegex( [ "ab", "abc", "b" ] )=="(?:ab(?:c)?|b)"
+
+    words = [ "a.b", "a*", "a", "(x)", "[", "\\", "ab", "abcd", "漢字", "漢", "\U0001F600" ]
+    pattern = _makeTrieRegex(words)
+    for word in words:
+        assert re.fullmatch( pattern, word ), ( pattern, word )
+    for s in ( "axb", "aa*", "x", "abc", "", "字" ):
+        assert not re.fullmatch( pattern, s ), ( pattern, s )
+
+    # 長い単語を優先する
+    assert re.match( pattern, "abcde" ).group(0)=="abcd"
+    assert re.match( pattern, "a*b" ).group(0)=="a*"
+
+    print( "makeTrieRegex : ok" )
+
+# ckitcore を import できないので、re で検索する
+def testPatternWithoutNative():
+    pattern = MigemoPattern( _makeTrieRegex( [ "かな", "カナ" ] ) )
+    assert pattern.native_object==None
+
+    assert pattern.search( "あかなとカタカナ" )==( 1, 3 )
+    assert pattern.search( "あかなとカタカナ", 2 )==( 6, 8 )
+    assert pattern.search( "あかな", 2 )==None
+
+    lines = [ "かな", "なし", "あかな カナ" ]
+    assert pattern.searchLines( lines, 0, 1, 1 )==( 2, 1, 3 )
+    assert pattern.searchLines( lines, 2, 6, -1 )==( 2, 4, 6 )
+    assert pattern.searchLines( lines, 2, 5, -1 )==( 2, 1, 3 )
+    assert pattern.searchLines( lines, 1, 2, -1 )==( 0, 0, 2 )
+    assert pattern.searchLines( lines, 1, 0, 1, True )==None
+
+    assert MigemoPattern( "KANA" ).search( "kana" )==( 0, 4 )
+    assert MigemoPattern( "KANA", False ).search( "kana" )==None
+
+    print( "pattern without native : ok" )
+
+testRomaToHira()
+testQuery()
+testDictionary()
+testMakeTrieRegex()
+testPatternWithoutNative()
@@ -0,0 +1,167 @@
+﻿import os
+import sys
+import random
+
+sys.path[0:0] = [
+    os.path.abspath( os.path.join( os.path.split(sys.argv[0])[0], '../..' ) ),
+    ]
+
+import ckit
+from ckit.ckit_const import *
+
+# TextWidget.modifyLines のテスト
+#
+# 行をまたぐコメント ( /* と */ ) で開始コンテキストが変わるシンタックス分析を使い、
+# 先頭の行の削除を含むランダムな modifyLines の後で、全ての行の開始コンテキストが
+# 最初から分析し直した結果と一致することを確かめる。
+# 最後に全て Undo して、元のテキストに戻ることを確かめる。
+
+NUM_EDITS = 500
+
+# /* から */ までをコメントとして、コメントの中で始まる行のコンテキストを 'comment' にする
+class CommentLexer( ckit.Lexer ):
+
+    def __init__(self):
+        ckit.Lexer.__init__(self)
+
+    def lex( self, ctx, line, detail ):
+        pos = 0
+        while True:
+            if ctx=='comment':
+                pos = line.find( "*/", pos )
+                if pos<0 : break
+                ctx = ckit.rootContext()
+            else:
+                pos = line.find( "/*", pos )
+                if pos<0 : break
+                ctx = 'comment'
+            pos += 2
+
+        if detail:
+            return [ ( 0, ckit.Token_Comment if ctx=='comment' else ckit.Token_Text ) ], ctx
+        else:
+            return ctx
+
+class CommentMode( ckit.Mode ):
+
+    name = "comment"
+
+    def __init__(self):
+        ckit.Mode.__init__(self)
+        self.lexer = CommentLexer()
+
+class TestWindow( ckit.TextWindow ):
+
+    def __init__(self):
+
+        ckit.TextWindow.__init__(
+            self,
+            x=20,
+            y=10,
+            width=80,
+            height=24,
+            title = "modifyLines Test",
+            show = False,
+            )
+
+        self.command = ckit.CommandMap(self)
+
+        self.edit = ckit.TextWidget( self, 0, 0, 80, 24 )
+
+    def executeCommand( self, name, info ):
+        return False
+
+def randomText():
+    return "".join( [ random.choice( [ "a", "b", " ", "/*", "*/" ] ) for i in range( random.randint(0,4) ) ] )
+
+def expectedContexts( lexer, texts ):
+    ctxs = []
+    ctx = ckit.rootContext()
+    for s in texts:
+        ctxs.append(ctx)
+        ctx = lexer.lex( ctx, s, False )
+    return ctxs
+
+def checkContexts( doc ):
+    doc.updateSyntaxContext()
+    texts = [ line.s for line in doc.lines ]
+    assert [ line.ctx for line in doc.lines ]==expectedContexts( doc.lexer, texts ), texts
+
+# 先頭の行を削除する編集を多めに含む、ランダムな modifyLines の編集のリスト
+def randomEdits( num_lines ):
+    first = random.randint( 0, num_lines-1 )
+    edits = []
+    for lineno in range( first, min( first+random.randint(1,4), num_lines ) ):
+        if lineno==first and random.random()<0.5:
+            edits.append( ( lineno, None ) )
+        elif random.random()<0.5:
+            r = random.random()
+            if r<0.3:
+                edits.append( ( lineno, None ) )
+            elif r<0.5:
+                edits.append( ( lineno, randomText() + "\n" + randomText() ) )
+            else:
+                edits.append( ( lineno, randomText() ) )
+    return edits
+
+def testModifyLines( window ):
+    edit = window.edit
+    doc = ckit.Document( filename=None, mode=CommentMode() )
+
+    texts = [ randomText() for i in range(30) ]
+    doc.lines = [ ckit.Line( s + "\n" ) for s in texts ] + [ ckit.Line("") ]
+    doc.setMode(doc.mode)
+    edit.setDocument(doc)
+    original_texts = [ line.s for line in doc.lines ]
+
+    checkContexts(doc)
+
+    for i in range(NUM_EDITS):
+        edits = randomEdits( len(doc.lines) )
+        edit.modifyLines( edits, paint=False )
+        checkContexts(doc)
+
+    while edit.undo():
+        pass
+
+    assert [ line.s for line in doc.lines ]==original_texts
+    checkContexts(doc)
+
+    print( "modifyLines : ok" )
+
+# 先頭の行にあるコメントの開始を、その行ごと削除する
+def testDeleteFirstLine( window ):
+    edit = window.edit
+    doc = ckit.Document( filename=None, mode=CommentMode() )
+
+    doc.lines = [ ckit.Line( "a\n" ), ckit.Line( "/* b\n" ), ckit.Line( "c\n" ), ckit.Line( "d */\n" ), ckit.Line( "e" ) ]
+    doc.setMode(doc.mode)
+    edit.setDocument(doc)
+
+    checkContexts(doc)
+    assert doc.lines[2].ctx=='comment'
+
+    edit.modifyLines( [ ( 1, None ) ], paint=False )
+    checkContexts(doc)
+    assert doc.lines[1].ctx==ckit.rootContext()
+
+    assert edit.undo()
+    assert [ line.s for line in doc.lines ]==[ "a", "/* b", "c", "d */", "e" ]
+    checkContexts(doc)
+    assert doc.lines[2].ctx=='comment'
+
+    print( "delete first line : ok" )
+
+ckit.registerWindowClass( "CkitTest" )
+
+ckit.setTheme( "black", {} )
+
+random.seed(1)
+
+window = TestWindow()
+
+testDeleteFirstLine(window)
+testModifyLines(window)
+
+window.edit.destroy()
+window.destroy()
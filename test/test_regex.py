@@ -0,0 +1,146 @@
+﻿import os
+import sys
+import re
+import random
+
+sys.path[0:0] = [
+    os.path.abspath( os.path.join( os.path.split(sys.argv[0])[0], '../..' ) ),
+    ]
+
+from ckit import ckitcore
+
+# ckitcore.Regex のテスト
+#
+# コンパイル済みの re のパターンから作った Regex の検索結果を、re の検索と比較する。
+# 空文字列にマッチできる繰り返しの優先順位や、大文字小文字を区別しない比較の規則が re と同じであることを確かめる。
+# Regex が対応していないパターン (ValueError になる) は比較しない。
+
+NUM_PATTERNS = 10000
+
+atoms = [ 'a', 'b', 'c', 'A', 'B', '1', ' ', '.', '[a-c]', '[^a]', '[ab]', r'\w', r'\s', r'\d', r'\b', '^', '$', '(?=a)', '(?!b)', '(?<=a)', '(?<!b)' ]
+
+def randomPattern( depth=0 ):
+    r = random.random()
+    if depth>3 or r<0.3:
+        return random.choice(atoms)
+    if r<0.5:
+        return "".join( [ randomPattern(depth+1) for i in range( random.randint(1,3) ) ] )
+    if r<0.65:
+        return "|".join( [ randomPattern(depth+1) for i in range( random.randint(2,3) ) ] )
+    if r<0.8:
+        return "(" + randomPattern(depth+1) + ")"
+    if r<0.88:
+        return "(?:" + randomPattern(depth+1) + ")"
+    quantifier = random.choice( [ '*', '+', '?', '{0,2}', '{1,3}', '{2}' ] )
+    if random.random()<0.4:
+        quantifier += '?'
+    return "(?:" + randomPattern(depth+1) + ")" + quantifier
+
+def randomText():
+    return "".join( [ random.choice("abcAB1 \n") for i in range( random.randint(0,10) ) ] )
+
+def reSearch( re_object, s, pos ):
+    re_result = re_object.search( s, pos )
+    if re_result:
+        return ( re_result.start(), re_result.end() )
+    return None
+
+# TextWidget の Search.rsearch と同じ規則で、開始位置を1文字ずつ進めながら search を繰り返し、最も右で始まるマッチを探す
+def reReverseSearch( re_object, s, end ):
+    pos = 0
+    result = None
+    while pos<len(s):
+        re_result = re_object.search( s, pos, end )
+        if not re_result:
+            break
+        if result==None or result[0] < re_result.start():
+            result = ( re_result.start(), re_result.end() )
+        pos = re_result.start() + 1
+    return result
+
+# 対応していないパターンの場合は False を返す
+def compareSearch( re_object, texts ):
+    try:
+        native_object = ckitcore.Regex(re_object)
+    except ValueError:
+        return False
+
+    for s in texts:
+        for pos in range( len(s)+1 ):
+            assert native_object.search(s,pos)==reSearch( re_object, s, pos ), ( re_object, s, pos )
+        assert native_object.rsearch(s)==reReverseSearch( re_object, s, len(s) ), ( re_object, s )
+
+    return True
+
+# 空文字列にマッチできる繰り返しで、空の繰り返しの後に抜ける経路の優先順位
+def testNullableLoop():
+    patterns = [
+        r"(?:a*)*b",
+        r"(?:a|)*b",
+        r"(?:a?)+?b",
+        r"(?:(?:a*)*)*c",
+        r"(?:a*|b)*",
+        r"(?:a*?|b)*",
+        r"(?:\b|a)*a",
+        r"(?:$|a)*",
+        r"(?:(?=a)|b)*a",
+        r"(a*)*?b",
+        r"(?:a??b?)*",
+        r"(?:|a)+",
+        r"(?:a*)+?",
+    ]
+    texts = [ "", "a", "aab", "bab", "abcab", "ccc", "aaaa", "ba\nab" ]
+
+    for pattern in patterns:
+        assert compareSearch( re.compile(pattern), texts ), pattern
+
+    print( "nullable loop : ok" )
+
+# 先読みで読む文字数に制限がないパターンは、検索が O(n^2) になるので対応しない
+def testUnboundedLookahead():
+    for pattern in ( r"(?=a*b)a", r"(?!.*x)", r"(?=(?:ab)+)" ):
+        try:
+            ckitcore.Regex( re.compile(pattern) )
+            assert False, pattern
+        except ValueError:
+            pass
+
+    assert compareSearch( re.compile(r"(?=a{0,3}b)a"), [ "aab", "aaaab", "b" ] )
+
+    print( "unbounded lookahead : ok" )
+
+# re._casefix の組 (i と ı、s と ſ、σ と ς など) を含む、大文字小文字を区別しない比較
+def testIgnoreCase():
+    text = "iIİısSſkKKσςΣßẞµμΜ"
+    patterns = [ re.escape(c) for c in text ] + [ "[" + re.escape(c) + "]" for c in text ] + [ "[a-z]", "[^a-z]", "[ς-σ]" ]
+
+    for pattern in patterns:
+        for flags in ( re.IGNORECASE, re.IGNORECASE|re.ASCII ):
+            re_object = re.compile( pattern, flags )
+            native_object = ckitcore.Regex(re_object)
+            for i in range( len(text) ):
+                assert native_object.search(text,i)==reSearch( re_object, text, i ), ( pattern, flags, i )
+
+    print( "ignore case : ok" )
+
+def testRandom():
+    num_supported = 0
+
+    for i in range(NUM_PATTERNS):
+        pattern = randomPattern()
+        flags = random.choice( [ 0, re.IGNORECASE, re.MULTILINE, re.DOTALL, re.ASCII|re.IGNORECASE ] )
+        texts = [ randomText() for j in range(4) ]
+        if compareSearch( re.compile( pattern, flags ), texts ):
+            num_supported += 1
+
+    # ほとんどのパターンは Regex で検索できる
+    assert num_supported > NUM_PATTERNS*9//10, num_supported
+
+    print( "random : ok" )
+
+random.seed(1)
+
+testNullableLoop()
+testUnboundedLookahead()
+testIgnoreCase()
+testRandom()
@@ -0,0 +1,144 @@
+﻿import os
+import sys
+import re
+import random
+
+sys.path[0:0] = [
+    os.path.abspath( os.path.join( os.path.split(sys.argv[0])[0], '../..' ) ),
+    ]
+
+from ckit import ckitcore
+
+# ckitcore.SearchHitIndex のテスト
+#
+# 行の挿入、削除、置き換えを繰り返しながら findLines / replaceLines でヒットを更新し、
+# 毎回ドキュメント全体を re で検索し直した結果と比較する。
+# getLineHits / findNext / findPrev も、ヒットのリストから求めた結果と比較する。
+
+NUM_EDITS = 2000
+
+alphabet = "ab ab.c\t"
+
+def randomText( length ):
+    return "".join( [ random.choice(alphabet) for i in range(length) ] )
+
+# TextWidget の描画と同じ規則で、1行の重ならないヒットを全て探す (空文字列に一致した位置で、その行の検索を終える)
+def reFindLine( re_object, s, line ):
+    hits = []
+    pos = 0
+    while True:
+        re_result = re_object.search( s, pos )
+        if not re_result or re_result.end()==pos:
+            break
+        hits.append( ( line, re_result.start(), re_result.end() ) )
+        pos = re_result.end()
+    return hits
+
+def reFindAll( re_object, texts, line=0, count=None ):
+    if count==None:
+        count = len(texts)
+    hits = []
+    for i in range( line, line+count ):
+        hits += reFindLine( re_object, texts[i], i )
+    return hits
+
+# ( line, pos ) 以降で始まる最初のヒット
+def findNext( hits, line, pos ):
+    for i, hit in enumerate(hits):
+        if ( hit[0], hit[1] ) >= ( line, pos ):
+            return i
+    return None
+
+# line の pos までで終わる最後のヒット、無ければ line より前の行の最後のヒット
+def findPrev( hits, line, pos ):
+    result = None
+    for i, hit in enumerate(hits):
+        if hit[0]==line and hit[2]<=pos:
+            result = i
+    if result==None:
+        for i, hit in enumerate(hits):
+            if hit[0]<line:
+                result = i
+    return result
+
+def checkIndex( index, hits, texts ):
+    assert list(index)==hits
+    assert len(index)==len(hits)
+
+    for i in range(10):
+        line = random.randint( 0, max(len(texts)-1,0) )
+        assert index.getLineHits(line)==[ ( hit[1], hit[2] ) for hit in hits if hit[0]==line ], line
+        pos = random.randint( 0, len(texts[line])+1 if texts else 1 )
+        assert index.findNext(line,pos)==findNext( hits, line, pos ), ( line, pos )
+        assert index.findPrev(line,pos)==findPrev( hits, line, pos ), ( line, pos )
+
+def randomEdit( texts ):
+    line = random.randint( 0, len(texts) )
+    old_count = random.randint( 0, min( 3, len(texts)-line ) )
+    new_count = random.randint( 0, 3 )
+    if len(texts)-old_count+new_count==0:
+        new_count = 1
+    new_texts = [ randomText( random.randint(0,30) ) for i in range(new_count) ]
+    texts[ line : line+old_count ] = new_texts
+    return line, old_count, new_count
+
+def testEdit( search_object, re_object, use_line_object ):
+
+    def toLines( texts ):
+        if use_line_object:
+            return [ ckitcore.Line( s + "\n" ) for s in texts ]
+        return list(texts)
+
+    texts = [ randomText( random.randint(0,30) ) for i in range(50) ]
+    lines = toLines(texts)
+
+    index = ckitcore.SearchHitIndex()
+    index.findLines( search_object, lines, 0, 0, len(lines) )
+    checkIndex( index, reFindAll( re_object, texts ), texts )
+
+    for i in range(NUM_EDITS):
+        line, old_count, new_count = randomEdit(texts)
+        lines[ line : line+old_count ] = toLines( texts[ line : line+new_count ] )
+
+        # findLines と、ヒットを直接指定する replaceLines を交互に使う
+        if i%2==0:
+            index.findLines( search_object, lines, line, old_count, new_count )
+        else:
+            index.replaceLines( line, old_count, new_count, reFindAll( re_object, texts, line, new_count ) )
+
+        checkIndex( index, reFindAll( re_object, texts ), texts )
+
+def testEditTextSearch():
+    for case in ( 0, 1 ):
+        for use_line_object in ( 0, 1 ):
+            testEdit( ckitcore.TextSearch( "ab", 0, case ), re.compile( "ab", 0 if case else re.IGNORECASE ), use_line_object )
+    print( "edit (TextSearch) : ok" )
+
+def testEditRegex():
+    for pattern in ( "ab+", "b*", r"\bab\b", "a|b " ):
+        re_object = re.compile(pattern)
+        testEdit( ckitcore.Regex(re_object), re_object, 0 )
+    print( "edit (Regex) : ok" )
+
+# 複数のチャンクに分けて並列に検索される大きさのドキュメント
+def testLargeDocument():
+    texts = [ randomText(60) for i in range(40000) ]
+    re_object = re.compile("ab")
+    search_object = ckitcore.TextSearch( "ab", 0, 1 )
+
+    index = ckitcore.SearchHitIndex()
+    index.findLines( search_object, texts, 0, 0, len(texts) )
+    assert list(index)==reFindAll( re_object, texts )
+
+    for i in range(20):
+        line, old_count, new_count = randomEdit(texts)
+        index.findLines( search_object, texts, line, old_count, new_count )
+    assert list(index)==reFindAll( re_object, texts )
+
+    print( "large document : ok" )
+
+random.seed(1)
+
+testEditTextSearch()
+testEditRegex()
+testLargeDocument()
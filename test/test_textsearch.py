@@ -0,0 +1,122 @@
+﻿import os
+import sys
+import re
+import random
+
+sys.path[0:0] = [
+    os.path.abspath( os.path.join( os.path.split(sys.argv[0])[0], '../..' ) ),
+    ]
+
+from ckit import ckitcore
+
+# ckitcore.TextSearch のテスト
+#
+# 固定文字列の検索の結果を、同じ条件の re の検索と比較する。
+# 単語単位の検索はパターンの前後を \b で囲んだ re と、大文字小文字を区別しない検索は re.IGNORECASE と同じ結果になる。
+# テキストには 1 / 2 / 4 バイトの文字と、大文字小文字の変換が特殊な文字を混ぜる。
+
+NUM_CASES = 3000
+
+alphabet = "aAbBzZ_09 .(\t-éÉßΣσς漢字\U0001F600"
+
+def randomText( length ):
+    return "".join( [ random.choice(alphabet) for i in range(length) ] )
+
+# パターンの大文字小文字を入れ替えた文字列を、テキストのところどころに埋め込む
+def randomTextWithPattern( pattern, length ):
+    parts = []
+    while sum( [ len(part) for part in parts ] ) < length:
+        if random.random()<0.3:
+            parts.append( "".join( [ c.swapcase() if random.random()<0.3 else c for c in pattern ] ) )
+        else:
+            parts.append( randomText( random.randint(0,40) ) )
+    return "".join(parts)
+
+def compileRe( pattern, word, case ):
+    re_pattern = re.escape(pattern)
+    if word:
+        re_pattern = r"\b" + re_pattern + r"\b"
+    re_option = re.UNICODE
+    if not case:
+        re_option |= re.IGNORECASE
+    return re.compile( re_pattern, re_option )
+
+def reSearch( re_object, s, pos, end ):
+    re_result = re_object.search( s, pos, end )
+    if re_result:
+        return ( re_result.start(), re_result.end() )
+    return None
+
+# s[0,end) の中で最も右で始まるマッチ
+def reReverseSearch( re_object, s, end ):
+    for pos in range( min(end,len(s)), -1, -1 ):
+        re_result = re_object.match( s, pos, end )
+        if re_result:
+            return ( re_result.start(), re_result.end() )
+    return None
+
+# TextWidget.Search.searchLines と同じ規則で、行のリストを検索する
+def reSearchLines( re_object, texts, line, index, direction, oneline ):
+    while 0<=line<len(texts):
+        s = texts[line]
+        if direction>0:
+            result = reSearch( re_object, s, index if index!=None else 0, len(s) )
+        else:
+            result = reReverseSearch( re_object, s, index if index!=None else len(s) )
+        if result:
+            return ( line, result[0], result[1] )
+        if oneline:
+            break
+        index = None
+        line += direction
+    return None
+
+def testSearch():
+    for i in range(NUM_CASES):
+        pattern = randomText( random.randint(1,6) )
+        word = random.randint(0,1)
+        case = random.randint(0,1)
+        s = randomTextWithPattern( pattern, random.randint(0,200) )
+
+        re_object = compileRe( pattern, word, case )
+        native_object = ckitcore.TextSearch( pattern, word, case )
+
+        pos = random.randint( 0, len(s) )
+        end = random.randint( pos, len(s) )
+
+        assert native_object.search(s)==reSearch( re_object, s, 0, len(s) ), ( pattern, word, case, s )
+        assert native_object.search(s,pos,end)==reSearch( re_object, s, pos, end ), ( pattern, word, case, s, pos, end )
+        assert native_object.rsearch(s)==reReverseSearch( re_object, s, len(s) ), ( pattern, word, case, s )
+        assert native_object.rsearch(s,end)==reReverseSearch( re_object, s, end ), ( pattern, word, case, s, end )
+
+    print( "search / rsearch : ok" )
+
+def testSearchLines():
+    for i in range(NUM_CASES//10):
+        pattern = randomText( random.randint(1,4) )
+        word = random.randint(0,1)
+        case = random.randint(0,1)
+        texts = [ randomTextWithPattern( pattern, random.randint(0,60) ) if random.random()<0.1 else randomText( random.randint(0,60) ) for j in range( random.randint(1,50) ) ]
+
+        # Line オブジェクトのリストと文字列のリストのどちらも検索できる
+        if random.randint(0,1):
+            lines = [ ckitcore.Line( s + "\n" ) for s in texts ]
+        else:
+            lines = list(texts)
+
+        re_object = compileRe( pattern, word, case )
+        native_object = ckitcore.TextSearch( pattern, word, case )
+
+        for j in range(10):
+            line = random.randint( 0, len(texts)-1 )
+            index = random.randint( 0, len(texts[line]) )
+            direction = random.choice( ( 1, -1 ) )
+            oneline = random.randint(0,1)
+            assert native_object.searchLines( lines, line, index, direction, oneline )==reSearchLines( re_object, texts, line, index, direction, oneline ), ( pattern, word, case, texts, line, index, direction, oneline )
+
+    print( "searchLines : ok" )
+
+random.seed(1)
+
+testSearch()
+testSearchLines()
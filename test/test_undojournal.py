@@ -0,0 +1,207 @@
+﻿import os
+import sys
+import random
+import tempfile
+
+sys.path[0:0] = [
+    os.path.abspath( os.path.join( os.path.split(sys.argv[0])[0], '../..' ) ),
+    ]
+
+from ckit import ckitcore
+
+# ckitcore.UndoJournal のテスト
+#
+# 文字列のドキュメントにランダムな編集を行いながら UndoJournal に記録し、
+# Undo / Redo で返される編集を適用した結果が、記録しておいた各時点のドキュメントと一致することを確かめる。
+# メモリの上限を超えた場合に、古い編集の文字列をファイルに書き出して全ての編集を残すこと、
+# ファイルを指定しない場合は古い編集を捨てること、Redo の記録を消したときにファイルが伸び続けないことも確かめる。
+
+alphabet = "abcdefghijklmnopqrstuvwxyz \n漢字\U0001F600"
+
+def randomText( length ):
+    return "".join( [ random.choice(alphabet) for i in range(length) ] )
+
+def offsetToPosition( s, offset ):
+    line = s.count( "\n", 0, offset )
+    return ( line, offset - ( s.rfind( "\n", 0, offset ) + 1 ) )
+
+def positionToOffset( s, pos ):
+    offset = 0
+    for i in range(pos[0]):
+        offset = s.index( "\n", offset ) + 1
+    return offset + pos[1]
+
+# Undo / Redo の結果の編集を、実行する順に適用する
+def applyEdits( s, edits ):
+    for line1, index1, line2, index2, text, count in edits:
+        left = positionToOffset( s, (line1,index1) )
+        right = positionToOffset( s, (line2,index2) )
+        s = s[:left] + text + s[right:]
+    return s
+
+# ランダムな範囲を置き換えて journal に記録し、( 編集後のドキュメント, 古い編集を捨てたか ) を返す
+def randomEdit( journal, s, max_length ):
+    left = random.randint( 0, len(s) )
+    right = random.randint( left, min( left+max_length, len(s) ) )
+    old_text = s[left:right]
+    new_text = randomText( random.randint( 0, max_length ) )
+    if not old_text and not new_text:
+        new_text = "x"
+
+    left_pos = offsetToPosition( s, left )
+    old_cursor = offsetToPosition( s, right )
+    s = s[:left] + new_text + s[right:]
+    new_cursor = offsetToPosition( s, left+len(new_text) )
+
+    dropped = journal.append( left_pos, old_text, new_text, left_pos, old_cursor, new_cursor, new_cursor )
+    return s, dropped
+
+def spillFilename():
+    return os.path.join( tempfile.gettempdir(), "ckit_test_undojournal_%d.tmp" % os.getpid() )
+
+# Undo / Redo をランダムに繰り返し、途中で新しい編集をして Redo の記録を消す
+def testUndoRedo():
+    journal = ckitcore.UndoJournal()
+
+    s = randomText(200)
+    history = [s]
+    current = 0
+
+    for i in range(3000):
+        r = random.random()
+        if r<0.3 and journal.canUndo():
+            result = journal.undo()
+            s = applyEdits( s, result[5] )
+            current -= 1
+            assert s==history[current]
+        elif r<0.5 and journal.canRedo():
+            result = journal.redo()
+            s = applyEdits( s, result[5] )
+            current += 1
+            assert s==history[current]
+        elif r<0.6:
+            # 複数の編集を1回の Undo で取り消せるようにまとめる
+            journal.beginGroup( (0,0), (0,0) )
+            for j in range( random.randint(1,4) ):
+                s, dropped = randomEdit( journal, s, 10 )
+            journal.endGroup( (0,0), (0,0) )
+            current += 1
+            history[current:] = [s]
+        else:
+            s, dropped = randomEdit( journal, s, 10 )
+            assert not dropped
+            current += 1
+            history[current:] = [s]
+
+        assert journal.canUndo()==( current>0 )
+        assert journal.canRedo()==( current<len(history)-1 )
+
+    print( "undo / redo : ok" )
+
+# 上限を超えた古い編集の文字列をファイルに書き出し、全ての編集を Undo できる
+def testSpill():
+    memory_limit = 256 * 1024
+    filename = spillFilename()
+    journal = ckitcore.UndoJournal( memory_limit, filename )
+
+    s = randomText(1000)
+    history = [s]
+
+    for i in range(500):
+        s, dropped = randomEdit( journal, s, 4000 )
+        assert not dropped
+        assert journal.getMemorySize() <= memory_limit
+        history.append(s)
+
+    assert journal.getSpilledSize() > 0
+    assert journal.getUndoCount()==len(history)-1
+
+    for i in range( len(history)-2, -1, -1 ):
+        s = applyEdits( s, journal.undo()[5] )
+        assert s==history[i], i
+    assert not journal.canUndo()
+
+    for i in range( 1, len(history) ):
+        s = applyEdits( s, journal.redo()[5] )
+        assert s==history[i], i
+
+    del journal
+    assert not os.path.exists(filename)
+
+    print( "spill : ok" )
+
+# ファイルを指定しない場合は、上限を超えた古い編集を捨てる
+def testDrop():
+    memory_limit = 256 * 1024
+    journal = ckitcore.UndoJournal( memory_limit, None )
+
+    s = randomText(1000)
+    history = [s]
+    num_dropped = 0
+
+    for i in range(500):
+        s, dropped = randomEdit( journal, s, 4000 )
+        if dropped:
+            num_dropped += 1
+        assert journal.getMemorySize() <= memory_limit
+        history.append(s)
+
+    assert num_dropped > 0
+    assert journal.getSpilledSize()==0
+
+    # 残っている編集は、最後の状態から順に Undo できる
+    num_undo = journal.getUndoCount()
+    assert 0 < num_undo < len(history)-1
+    for i in range( num_undo ):
+        s = applyEdits( s, journal.undo()[5] )
+        assert s==history[-2-i], i
+    assert not journal.canUndo()
+
+    print( "drop : ok" )
+
+# Undo して新しい編集をする (Redo の記録を消す) ことを繰り返しても、ファイルが伸び続けない
+def testSpillReclaim():
+    memory_limit = 256 * 1024
+    filename = spillFilename()
+    journal = ckitcore.UndoJournal( memory_limit, filename )
+
+    s = randomText(1000)
+    history = [s]
+
+    max_spilled_size = 0
+    for round in range(20):
+        for i in range(100):
+            s, dropped = randomEdit( journal, s, 4000 )
+            assert not dropped
+            history.append(s)
+
+        for i in range(90):
+            s = applyEdits( s, journal.undo()[5] )
+            history.pop()
+            assert s==history[-1]
+
+        if round==0:
+            first_spilled_size = journal.getSpilledSize()
+        max_spilled_size = max( max_spilled_size, journal.getSpilledSize() )
+
+    # 残っている編集は 100 編集から 290 編集までしか増えず、ファイルは半分以上が使われるように詰められるので、1 回目の 6 倍程度に収まる
+    # (消した Redo の分を再利用しない場合は、書き出した 2000 編集分で 1 回目の 20 倍近くになる)
+    assert max_spilled_size < first_spilled_size * 8, ( first_spilled_size, max_spilled_size )
+    assert os.path.getsize(filename) <= max_spilled_size
+
+    for i in range( len(history)-2, -1, -1 ):
+        s = applyEdits( s, journal.undo()[5] )
+        assert s==history[i], i
+
+    journal.clear()
+    assert journal.getSpilledSize()==0
+    del journal
+
+    print( "spill reclaim : ok" )
+
+random.seed(1)
+
+testUndoRedo()
+testSpill()
+testDrop()
+testSpillReclaim()
@@ -0,0 +1,106 @@
+﻿import os
+import sys
+import re
+import random
+import collections
+
+sys.path[0:0] = [
+    os.path.abspath( os.path.join( os.path.split(sys.argv[0])[0], '../..' ) ),
+    ]
+
+from ckit import ckitcore
+
+# ckitcore.WordIndex のテスト
+#
+# Document と同じように、行を変更する前に removeLines、変更した後に addLines を呼びながらランダムな編集を繰り返し、
+# find の結果と単語の数が、文書全体の単語を re で数え直した結果と一致することを確かめる。
+
+NUM_EDITS = 2000
+
+# 単語の長さの上限 (これより長い単語は数えない)
+WORD_MAX_CHARS = 256
+
+word_re = re.compile( r"\b[a-zA-Z0-9_]+" )
+
+words = [ "a", "ab", "abc", "abd", "b", "b_1", "Ab", "9", "_" ]
+separators = [ " ", ".", "-", "\t", "é", "漢", "。", "\U0001F600" ]
+
+def randomText():
+    parts = []
+    for i in range( random.randint(0,8) ):
+        parts.append( random.choice(words) )
+        parts.append( random.choice(separators) )
+    return "".join(parts)
+
+def countWords( texts ):
+    counts = collections.Counter()
+    for s in texts:
+        for word in word_re.findall(s):
+            if len(word)<=WORD_MAX_CHARS:
+                counts[word] += 1
+    return counts
+
+def checkIndex( index, texts ):
+    counts = countWords(texts)
+    assert len(index)==len(counts)
+    assert index.find("")==sorted(counts)
+    for prefix in ( "a", "ab", "b", "Ab", "z", "é" ):
+        assert index.find(prefix)==sorted( [ word for word in counts if word.startswith(prefix) and len(word)>len(prefix) ] ), prefix
+
+def testEdit( use_line_object ):
+
+    def toLines( texts ):
+        if use_line_object:
+            return [ ckitcore.Line( s + "\n" ) for s in texts ]
+        return list(texts)
+
+    texts = [ randomText() for i in range(50) ]
+    lines = toLines(texts)
+
+    index = ckitcore.WordIndex()
+    index.addLines( lines, 0, len(lines) )
+    checkIndex( index, texts )
+
+    for i in range(NUM_EDITS):
+        line = random.randint( 0, len(texts) )
+        old_count = random.randint( 0, min( 3, len(texts)-line ) )
+        new_texts = [ randomText() for j in range( random.randint(0,3) ) ]
+
+        index.removeLines( lines, line, old_count )
+        texts[ line : line+old_count ] = new_texts
+        lines[ line : line+old_count ] = toLines(new_texts)
+        index.addLines( lines, line, len(new_texts) )
+
+        checkIndex( index, texts )
+
+    index.clear()
+    assert len(index)==0
+    assert index.find("")==[]
+
+def testEditLine():
+    testEdit(True)
+    print( "edit (Line) : ok" )
+
+def testEditString():
+    testEdit(False)
+    print( "edit (str) : ok" )
+
+# 長すぎる単語と、複数のチャンクに分けて並列に数える大きさの文書
+def testLargeDocument():
+    texts = [ randomText() for i in range(100000) ]
+    texts[10] = "x" * WORD_MAX_CHARS + " " + "y" * (WORD_MAX_CHARS+1)
+
+    index = ckitcore.WordIndex()
+    index.addLines( texts, 0, len(texts) )
+    checkIndex( index, texts )
+
+    index.removeLines( texts, 0, len(texts)//2 )
+    checkIndex( index, texts[ len(texts)//2 : ] )
+
+    print( "large document : ok" )
+
+random.seed(1)
+
+testEditLine()
+testEditString()
+testLargeDocument()